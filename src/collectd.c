@@ -40,7 +40,7 @@
  * Global variables
  */
 char hostname_g[DATA_MAX_NAME_LEN];
-int  interval_g;
+cdtime_t interval_g;
 #if HAVE_LIBKSTAT
 kstat_ctl_t *kc;
 #endif /* HAVE_LIBKSTAT */
@@ -137,18 +137,26 @@ static int init_hostname (void)
 static int init_global_variables (void)
 {
 	const char *str;
+	char *endptr;
+	double tmp;
 
 	str = global_option_get ("Interval");
 	if (str == NULL)
 		str = "10";
-	interval_g = atoi (str);
-	if (interval_g <= 0)
+	errno = 0;
+	endptr = NULL;
+	tmp = strtod (str, &endptr);
+	if ((errno != 0) || (endptr == str) || !(tmp > 0.0))
+		interval_g = 0;
+	else
+		interval_g = DOUBLE_TO_CDTIME_T (tmp);
+	if (interval_g == 0)
 	{
 		fprintf (stderr, "Cannot set the interval to a correct value.\n"
 				"Please check your settings.\n");
 		return (-1);
 	}
-	DEBUG ("interval_g = %i;", interval_g);
+	DEBUG ("interval_g = %.3f;", CDTIME_T_TO_DOUBLE (interval_g));
 
 	if (init_hostname () != 0)
 		return (-1);
@@ -299,22 +307,13 @@ static int do_init (void)
 
 static int do_loop (void)
 {
-	struct timeval tv_now;
-	struct timeval tv_next;
-	struct timeval tv_wait;
+	cdtime_t now;
+	cdtime_t next;
 	struct timespec ts_wait;
 
 	while (loop == 0)
 	{
-		if (gettimeofday (&tv_next, NULL) < 0)
-		{
-			char errbuf[1024];
-			ERROR ("gettimeofday failed: %s",
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-			return (-1);
-		}
-		tv_next.tv_sec += interval_g;
+		next = cdtime () + interval_g;
 
 #if HAVE_LIBKSTAT
 		update_kstat ();
@@ -323,25 +322,16 @@ static int do_loop (void)
 		/* Issue all plugins */
 		plugin_read_all ();
 
-		if (gettimeofday (&tv_now, NULL) < 0)
-		{
-			char errbuf[1024];
-			ERROR ("gettimeofday failed: %s",
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-			return (-1);
-		}
-
-		if (timeval_cmp (tv_next, tv_now, &tv_wait) <= 0)
+		now = cdtime ();
+		if (now >= next)
 		{
 			WARNING ("Not sleeping because the next interval is "
-					"%i.%06i seconds in the past!",
-					(int) tv_wait.tv_sec, (int) tv_wait.tv_usec);
+					"%.3f seconds in the past!",
+					CDTIME_T_TO_DOUBLE (now - next));
 			continue;
 		}
 
-		ts_wait.tv_sec  = tv_wait.tv_sec;
-		ts_wait.tv_nsec = (long) (1000 * tv_wait.tv_usec);
+		cdtime_to_timespec (next - now, &ts_wait);
 
 		while ((loop == 0) && (nanosleep (&ts_wait, &ts_wait) == -1))
 		{
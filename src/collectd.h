@@ -280,7 +280,9 @@
 # endif
 #endif
 
-extern char hostname_g[];
-extern int  interval_g;
+#include "utils_time.h"
+
+extern char     hostname_g[];
+extern cdtime_t interval_g;
 
 #endif /* COLLECTD_H */
@@ -880,10 +880,11 @@ int parse_values (char *buffer, value_list_t *vl, const data_set_t *ds)
 
 		if (i == -1)
 		{
+			/* The time may have a fractional part. */
 			if (strcmp ("N", ptr) == 0)
-				vl->time = time (NULL);
+				vl->time = cdtime ();
 			else
-				vl->time = (time_t) atoi (ptr);
+				vl->time = DOUBLE_TO_CDTIME_T (atof (ptr));
 		}
 		else
 		{
@@ -99,6 +99,10 @@ static cf_global_option_t cf_global_options[] =
 	{"FQDNLookup",  NULL, "false"},
 	{"Interval",    NULL, "10"},
 	{"ReadThreads", NULL, "5"},
+	{"WriteThreads", NULL, "5"},
+	{"WriteQueueLimit", NULL, "10000"},
+	{"WriteQueuePolicy", NULL, "Block"},
+	{"WriteQueueStats", NULL, "false"},
 	{"PreCacheChain",  NULL, "PreCache"},
 	{"PostCacheChain", NULL, "PostCache"}
 };
@@ -22,22 +22,77 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "utils_avltree.h"
 #include "utils_cache.h"
 #include "utils_parse_option.h"
 
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* Maximum size of the write buffer of each file. Every line has to fit into
+ * CSV_LINE_SIZE bytes. */
+#define CSV_BUFFER_SIZE 4096
+#define CSV_LINE_SIZE 512
+
+/*
+ * Private types
+ */
+/* An output file. The name does not include the date, so the file can be
+ * rotated without looking it up again. Entries exist as long as the file is
+ * open or has buffered lines. */
+struct csv_file_s
+{
+	char *name;  /* also the key in `files' */
+	char  date[16];
+	int   fd;
+	const data_set_t *ds; /* for the header of new files */
+
+	char  *buffer;
+	size_t buffer_len;
+	size_t buffer_size;
+	time_t buffer_time; /* when the first buffered line was added */
+
+	/* Files with an open descriptor, most recently used first. */
+	struct csv_file_s *lru_prev;
+	struct csv_file_s *lru_next;
+	/* Files with buffered lines, oldest first. */
+	struct csv_file_s *dirty_prev;
+	struct csv_file_s *dirty_next;
+};
+typedef struct csv_file_s csv_file_t;
+
 /*
  * Private variables
  */
 static const char *config_keys[] =
 {
 	"DataDir",
-	"StoreRates"
+	"StoreRates",
+	"MaxOpenFiles",
+	"FlushInterval"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 static char *datadir   = NULL;
 static int store_rates = 0;
 static int use_stdio   = 0;
+static int max_open_files = 64;
+static int flush_interval = 0;
+
+/* XXX: `files_lock' protects all of the following. */
+static c_avl_tree_t *files = NULL;
+static csv_file_t *lru_head = NULL;
+static csv_file_t *lru_tail = NULL;
+static int open_files = 0;
+static csv_file_t *dirty_head = NULL;
+static csv_file_t *dirty_tail = NULL;
+static time_t last_flush = 0;
+/* The date suffix is only updated once per second, since `localtime_r' is
+ * pretty expensive. */
+static char   date_suffix[16];
+static time_t date_time = 0;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int value_list_to_string (char *buffer, int buffer_len,
 		const data_set_t *ds, const value_list_t *vl)
@@ -49,9 +104,8 @@ static int value_list_to_string (char *buffer, int buffer_len,
 
 	assert (0 == strcmp (ds->type, vl->type));
 
-	memset (buffer, '\0', buffer_len);
-
-	status = ssnprintf (buffer, buffer_len, "%u", (unsigned int) vl->time);
+	status = ssnprintf (buffer, buffer_len, "%.3f",
+			CDTIME_T_TO_DOUBLE (vl->time));
 	if ((status < 1) || (status >= buffer_len))
 		return (-1);
 	offset = status;
@@ -148,26 +202,28 @@ static int value_list_to_filename (char *buffer, int buffer_len,
 		return (-1);
 	offset += status;
 
-	if (!use_stdio)
-	{
-		time_t now;
-		struct tm stm;
+	return (0);
+} /* int value_list_to_filename */
 
-		/* TODO: Find a way to minimize the calls to `localtime_r',
-		 * since they are pretty expensive.. */
-		now = time (NULL);
-		if (localtime_r (&now, &stm) == NULL)
-		{
-			ERROR ("csv plugin: localtime_r failed");
-			return (1);
-		}
+/* Updates `date_suffix' if the second has changed. The caller has to hold
+ * `files_lock'. */
+static int csv_date_update (time_t now)
+{
+	struct tm stm;
+
+	if (now == date_time)
+		return (0);
 
-		strftime (buffer + offset, buffer_len - offset,
-				"-%Y-%m-%d", &stm);
+	if (localtime_r (&now, &stm) == NULL)
+	{
+		ERROR ("csv plugin: localtime_r failed");
+		return (-1);
 	}
 
+	strftime (date_suffix, sizeof (date_suffix), "-%Y-%m-%d", &stm);
+	date_time = now;
 	return (0);
-} /* int value_list_to_filename */
+} /* int csv_date_update */
 
 static int csv_create_file (const char *filename, const data_set_t *ds)
 {
@@ -197,6 +253,303 @@ static int csv_create_file (const char *filename, const data_set_t *ds)
 	return 0;
 } /* int csv_create_file */
 
+static void csv_lru_remove (csv_file_t *f)
+{
+	if (f->lru_prev == NULL)
+		lru_head = f->lru_next;
+	else
+		f->lru_prev->lru_next = f->lru_next;
+
+	if (f->lru_next == NULL)
+		lru_tail = f->lru_prev;
+	else
+		f->lru_next->lru_prev = f->lru_prev;
+
+	f->lru_prev = NULL;
+	f->lru_next = NULL;
+} /* void csv_lru_remove */
+
+static void csv_lru_prepend (csv_file_t *f)
+{
+	f->lru_prev = NULL;
+	f->lru_next = lru_head;
+	if (lru_head == NULL)
+		lru_tail = f;
+	else
+		lru_head->lru_prev = f;
+	lru_head = f;
+} /* void csv_lru_prepend */
+
+static void csv_dirty_remove (csv_file_t *f)
+{
+	if (f->dirty_prev == NULL)
+		dirty_head = f->dirty_next;
+	else
+		f->dirty_prev->dirty_next = f->dirty_next;
+
+	if (f->dirty_next == NULL)
+		dirty_tail = f->dirty_prev;
+	else
+		f->dirty_next->dirty_prev = f->dirty_prev;
+
+	f->dirty_prev = NULL;
+	f->dirty_next = NULL;
+} /* void csv_dirty_remove */
+
+static void csv_dirty_append (csv_file_t *f)
+{
+	f->dirty_next = NULL;
+	f->dirty_prev = dirty_tail;
+	if (dirty_tail == NULL)
+		dirty_head = f;
+	else
+		dirty_tail->dirty_next = f;
+	dirty_tail = f;
+} /* void csv_dirty_append */
+
+/* Frees the file if it has neither an open descriptor nor buffered lines. */
+static void csv_file_release (csv_file_t *f)
+{
+	if ((f->fd >= 0) || (f->buffer_len > 0))
+		return;
+
+	c_avl_remove (files, f->name, NULL, NULL);
+	sfree (f->name);
+	sfree (f->buffer);
+	sfree (f);
+} /* void csv_file_release */
+
+static void csv_file_close (csv_file_t *f)
+{
+	if (f->fd < 0)
+		return;
+
+	close (f->fd);
+	f->fd = -1;
+	csv_lru_remove (f);
+	open_files--;
+} /* void csv_file_close */
+
+static int csv_file_flush (csv_file_t *f);
+
+/* Opens the file for the current date, creating it if necessary. Closes the
+ * least recently used file if too many files are open. */
+static int csv_file_open (csv_file_t *f)
+{
+	char filename[512];
+	struct stat statbuf;
+
+	ssnprintf (filename, sizeof (filename), "%s%s", f->name, f->date);
+
+	if (stat (filename, &statbuf) == -1)
+	{
+		if (errno == ENOENT)
+		{
+			if (csv_create_file (filename, f->ds))
+				return (-1);
+		}
+		else
+		{
+			char errbuf[1024];
+			ERROR ("stat(%s) failed: %s", filename,
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			return (-1);
+		}
+	}
+	else if (!S_ISREG (statbuf.st_mode))
+	{
+		ERROR ("stat(%s): Not a regular file!",
+				filename);
+		return (-1);
+	}
+
+	f->fd = open (filename, O_WRONLY | O_APPEND);
+	if (f->fd < 0)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: open (%s) failed: %s", filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	csv_lru_prepend (f);
+	open_files++;
+
+	while ((open_files > max_open_files) && (lru_tail != f))
+	{
+		csv_file_t *lru = lru_tail;
+
+		csv_file_flush (lru);
+		csv_file_close (lru);
+		csv_file_release (lru);
+	}
+
+	return (0);
+} /* int csv_file_open */
+
+/* Writes the buffered lines to the file. The lines are dropped if that
+ * fails. */
+static int csv_file_flush (csv_file_t *f)
+{
+	struct flock fl;
+	size_t offset = 0;
+	int status;
+
+	if (f->buffer_len == 0)
+		return (0);
+
+	csv_dirty_remove (f);
+
+	if (f->fd < 0)
+	{
+		status = csv_file_open (f);
+		if (status != 0)
+		{
+			f->buffer_len = 0;
+			return (-1);
+		}
+	}
+	else if (lru_head != f)
+	{
+		csv_lru_remove (f);
+		csv_lru_prepend (f);
+	}
+
+	memset (&fl, '\0', sizeof (fl));
+	fl.l_start  = 0;
+	fl.l_len    = 0; /* till end of file */
+	fl.l_pid    = getpid ();
+	fl.l_type   = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	status = fcntl (f->fd, F_SETLK, &fl);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: flock (%s%s) failed: %s", f->name, f->date,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		f->buffer_len = 0;
+		return (-1);
+	}
+
+	while (offset < f->buffer_len)
+	{
+		ssize_t bytes = write (f->fd, f->buffer + offset,
+				f->buffer_len - offset);
+		if (bytes < 0)
+		{
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+
+			ERROR ("csv plugin: write (%s%s) failed: %s",
+					f->name, f->date,
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			break;
+		}
+		offset += (size_t) bytes;
+	}
+
+	fl.l_type = F_UNLCK;
+	fcntl (f->fd, F_SETLK, &fl);
+
+	status = (offset < f->buffer_len) ? -1 : 0;
+	f->buffer_len = 0;
+	return (status);
+} /* int csv_file_flush */
+
+/* Flushes all files whose oldest buffered line is at least `timeout' seconds
+ * old. The caller has to hold `files_lock'. */
+static void csv_flush_dirty (int timeout, time_t now)
+{
+	while (dirty_head != NULL)
+	{
+		csv_file_t *f = dirty_head;
+
+		if ((timeout > 0) && ((now - f->buffer_time) < timeout))
+			break;
+
+		csv_file_flush (f);
+		csv_file_release (f);
+	}
+
+	last_flush = now;
+} /* void csv_flush_dirty */
+
+/* Returns the file called `name', creating it if necessary. The caller has to
+ * hold `files_lock'. */
+static csv_file_t *csv_file_get (const char *name, const data_set_t *ds)
+{
+	csv_file_t *f = NULL;
+
+	if (c_avl_get (files, name, (void *) &f) == 0)
+		return (f);
+
+	f = calloc (1, sizeof (*f));
+	if (f == NULL)
+		return (NULL);
+
+	f->name = strdup (name);
+	if (f->name == NULL)
+	{
+		sfree (f);
+		return (NULL);
+	}
+	f->ds = ds;
+	f->fd = -1;
+	sstrncpy (f->date, date_suffix, sizeof (f->date));
+
+	if (c_avl_insert (files, f->name, f) != 0)
+	{
+		sfree (f->name);
+		sfree (f);
+		return (NULL);
+	}
+
+	return (f);
+} /* csv_file_t *csv_file_get */
+
+/* Appends a line to the file's buffer. */
+static int csv_file_append (csv_file_t *f, const char *line, time_t now)
+{
+	size_t len = strlen (line);
+
+	if ((f->buffer_len + len + 1) > CSV_BUFFER_SIZE)
+		csv_file_flush (f);
+
+	if ((f->buffer_len + len + 1) > f->buffer_size)
+	{
+		size_t new_size = (f->buffer_size > 0) ? f->buffer_size : 128;
+		char *tmp;
+
+		while ((f->buffer_len + len + 1) > new_size)
+			new_size *= 2;
+
+		tmp = realloc (f->buffer, new_size);
+		if (tmp == NULL)
+		{
+			ERROR ("csv plugin: realloc failed.");
+			return (-1);
+		}
+		f->buffer = tmp;
+		f->buffer_size = new_size;
+	}
+
+	if (f->buffer_len == 0)
+	{
+		f->buffer_time = now;
+		csv_dirty_append (f);
+	}
+
+	memcpy (f->buffer + f->buffer_len, line, len);
+	f->buffer[f->buffer_len + len] = '\n';
+	f->buffer_len += len + 1;
+
+	return (0);
+} /* int csv_file_append */
+
 static int csv_config (const char *key, const char *value)
 {
 	if (strcasecmp ("DataDir", key) == 0)
@@ -242,6 +595,28 @@ static int csv_config (const char *key, const char *value)
 			store_rates = 0;
 		}
 	}
+	else if (strcasecmp ("MaxOpenFiles", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			ERROR ("csv plugin: `MaxOpenFiles' must be "
+					"greater than 0.");
+			return (1);
+		}
+		max_open_files = tmp;
+	}
+	else if (strcasecmp ("FlushInterval", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 0)
+		{
+			ERROR ("csv plugin: `FlushInterval' must not be "
+					"negative.");
+			return (1);
+		}
+		flush_interval = tmp;
+	}
 	else
 	{
 		return (-1);
@@ -252,12 +627,10 @@ static int csv_config (const char *key, const char *value)
 static int csv_write (const data_set_t *ds, const value_list_t *vl,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	struct stat  statbuf;
 	char         filename[512];
-	char         values[512];
-	FILE        *csv;
-	int          csv_fd;
-	struct flock fl;
+	char         values[CSV_LINE_SIZE];
+	csv_file_t  *f;
+	time_t       now;
 	int          status;
 
 	if (0 != strcmp (ds->type, vl->type)) {
@@ -289,73 +662,111 @@ static int csv_write (const data_set_t *ds, const value_list_t *vl,
 		}
 
 		fprintf (use_stdio == 1 ? stdout : stderr,
-			 "PUTVAL %s interval=%i %s\n",
-			 filename, interval_g, values);
+			 "PUTVAL %s interval=%.3f %s\n",
+			 filename, CDTIME_T_TO_DOUBLE (vl->interval), values);
 		return (0);
 	}
 
-	if (stat (filename, &statbuf) == -1)
+	now = time (NULL);
+
+	pthread_mutex_lock (&files_lock);
+
+	if ((files == NULL) || (csv_date_update (now) != 0))
 	{
-		if (errno == ENOENT)
-		{
-			if (csv_create_file (filename, ds))
-				return (-1);
-		}
-		else
-		{
-			char errbuf[1024];
-			ERROR ("stat(%s) failed: %s", filename,
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-			return (-1);
-		}
+		pthread_mutex_unlock (&files_lock);
+		return (-1);
 	}
-	else if (!S_ISREG (statbuf.st_mode))
+
+	f = csv_file_get (filename, ds);
+	if (f == NULL)
 	{
-		ERROR ("stat(%s): Not a regular file!",
-				filename);
+		pthread_mutex_unlock (&files_lock);
+		ERROR ("csv plugin: csv_file_get (%s) failed.", filename);
 		return (-1);
 	}
 
-	csv = fopen (filename, "a");
-	if (csv == NULL)
+	/* The date changed: Write the buffered lines to the old file and
+	 * continue with a new one. */
+	if (strcmp (f->date, date_suffix) != 0)
 	{
-		char errbuf[1024];
-		ERROR ("csv plugin: fopen (%s) failed: %s", filename,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		return (-1);
+		csv_file_flush (f);
+		csv_file_close (f);
+		sstrncpy (f->date, date_suffix, sizeof (f->date));
 	}
-	csv_fd = fileno (csv);
 
-	memset (&fl, '\0', sizeof (fl));
-	fl.l_start  = 0;
-	fl.l_len    = 0; /* till end of file */
-	fl.l_pid    = getpid ();
-	fl.l_type   = F_WRLCK;
-	fl.l_whence = SEEK_SET;
+	status = csv_file_append (f, values, now);
 
-	status = fcntl (csv_fd, F_SETLK, &fl);
-	if (status != 0)
+	if (flush_interval == 0)
+		csv_file_flush (f);
+
+	/* Flushing other files may close and free `f', so release it
+	 * first. */
+	csv_file_release (f);
+
+	if ((flush_interval > 0) && ((now - last_flush) >= flush_interval))
+		csv_flush_dirty (flush_interval, now);
+
+	pthread_mutex_unlock (&files_lock);
+
+	return (status);
+} /* int csv_write */
+
+static int csv_flush (int timeout,
+		const char __attribute__((unused)) *identifier,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	pthread_mutex_lock (&files_lock);
+	if (files != NULL)
+		csv_flush_dirty (timeout, time (NULL));
+	pthread_mutex_unlock (&files_lock);
+
+	return (0);
+} /* int csv_flush */
+
+static int csv_init (void)
+{
+	pthread_mutex_lock (&files_lock);
+	if (files == NULL)
+		files = c_avl_create ((int (*) (const void *, const void *))
+				strcmp);
+	pthread_mutex_unlock (&files_lock);
+
+	if (files == NULL)
 	{
-		char errbuf[1024];
-		ERROR ("csv plugin: flock (%s) failed: %s", filename,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (csv);
+		ERROR ("csv plugin: c_avl_create failed.");
 		return (-1);
 	}
 
-	fprintf (csv, "%s\n", values);
+	return (0);
+} /* int csv_init */
 
-	/* The lock is implicitely released. I we don't release it explicitely
-	 * because the `FILE *' may need to flush a cache first */
-	fclose (csv);
+static int csv_shutdown (void)
+{
+	pthread_mutex_lock (&files_lock);
+	if (files != NULL)
+	{
+		csv_flush_dirty (/* timeout = */ 0, time (NULL));
+		while (lru_head != NULL)
+		{
+			csv_file_t *f = lru_head;
+
+			csv_file_close (f);
+			csv_file_release (f);
+		}
+		c_avl_destroy (files);
+		files = NULL;
+	}
+	pthread_mutex_unlock (&files_lock);
 
 	return (0);
-} /* int csv_write */
+} /* int csv_shutdown */
 
 void module_register (void)
 {
 	plugin_register_config ("csv", csv_config,
 			config_keys, config_keys_num);
+	plugin_register_init ("csv", csv_init);
 	plugin_register_write ("csv", csv_write, /* user_data = */ NULL);
+	plugin_register_flush ("csv", csv_flush, /* user_data = */ NULL);
+	plugin_register_shutdown ("csv", csv_shutdown);
 } /* void module_register */
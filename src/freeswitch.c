@@ -24,19 +24,57 @@
 #include "common.h"
 #include "plugin.h"
 #include "utils_match.h"
+#include "utils_avltree.h"
+#include "utils_complain.h"
 #include "esl.h"
 
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
 #define FS_DEF_HOST "127.0.0.1"
 #define FS_DEF_PORT "8021"
 #define FS_DEF_PASS "ClueCon"
 
+/* Events the event thread subscribes to. Everything else is filtered by
+ * FreeSWITCH itself, so the event connection stays cheap even at high call
+ * rates. */
+#define FS_EVENT_SUBSCRIPTION "CHANNEL_CREATE CHANNEL_HANGUP_COMPLETE " \
+	"CUSTOM sofia::register sofia::unregister sofia::expire"
+
+/* Limits, in seconds, of the exponential backoff used when (re-)connecting to
+ * a server fails. */
+#define FS_RECONNECT_MIN 1
+#define FS_RECONNECT_MAX 300
+
+/* Milliseconds to wait for the result of a background job by default. */
+#define FS_DEF_TIMEOUT 2000
+
+/* Milliseconds to wait for the late replies of timed out jobs before running
+ * synchronous commands. */
+#define FS_DRAIN_TIMEOUT 2000
+
 /*
  *	<Plugin freeswitch>
+ *		<Server "media1">
+ *			Host "10.0.0.1"
+ *			Port "8021"
+ *			Pass "ClueCon"
+ *			Interval 0.5		# seconds; default: global Interval
+ *			EventStats true
+ *			<Command "api show calls count">
+ *				...
+ *			</Command>
+ *		</Server>
+ *
+ *		# Legacy configuration of a single, unnamed server:
  *		Host "127.0.0.1"
  *		Port "8021"
  *		Pass "ClueCon"
+ *		EventStats true
  *		<Command "api sofia status profile res-public">
  *			Instance "profile-sofia-res-public"
+ *			Timeout 2000
  *			<Match>
  *				Instance "calls-in"
  *				Regex "CALLS-IN\\s+([0-9]+)"
@@ -44,12 +82,65 @@
  *				Type "gauge"
  *			</Match>
  *		</Command>
+ *		<Command "api show channels as json">
+ *			Instance "channels"
+ *			Format "JSON"		# JSON, XML, Delimited or Regex (default)
+ *			Rows "rows"
+ *			<Match>
+ *				Aggregate "Count"	# Count, Sum, Min, Max, Average or Last
+ *				GroupBy "callstate"
+ *				DSType "GaugeLast"
+ *				Type "gauge"
+ *			</Match>
+ *		</Command>
  *	</Plugin>
+ *
+ * With a structured `Format', matches select a `Field' of each row instead of
+ * using a `Regex' and aggregate its values over all rows. `Delimiter' sets the
+ * column separator of delimited output (default ","). Only the data source
+ * type of `DSType' is used in this case.
+ */
+
+/*
+ * Commands starting with "api " are sent as "bgapi" jobs, all at once. Their
+ * results arrive as BACKGROUND_JOB events and are matched to the command by
+ * the Job-UUID from the command's reply, so the time spent in `fs_read' is
+ * that of the slowest command rather than the sum of all of them. Other
+ * commands are executed synchronously before the jobs are started.
+ *
+ * Every server is read by its own read callback, so servers are read in
+ * parallel by the daemon's read threads and one unreachable server doesn't
+ * delay the others. Values of a named server use the server name as (prefix
+ * of) the plugin instance. Lost connections are re-established on the next
+ * read, backing off exponentially while the server is unreachable.
  */
 
 /*
  * Data types
  */
+#define FS_FORMAT_REGEX     0
+#define FS_FORMAT_JSON      1
+#define FS_FORMAT_XML       2
+#define FS_FORMAT_DELIMITED 3
+
+#define FS_AGGREGATE_LAST    0
+#define FS_AGGREGATE_COUNT   1
+#define FS_AGGREGATE_SUM     2
+#define FS_AGGREGATE_MIN     3
+#define FS_AGGREGATE_MAX     4
+#define FS_AGGREGATE_AVERAGE 5
+
+struct fs_aggregate_s
+{
+	char *name;		// group name, NULL if not grouped
+	uint64_t count;
+	gauge_t sum;
+	gauge_t min;
+	gauge_t max;
+	gauge_t last;
+};
+typedef struct fs_aggregate_s fs_aggregate_t;
+
 struct fs_match_s;
 typedef struct fs_match_s fs_match_t;
 struct fs_match_s
@@ -59,9 +150,20 @@ struct fs_match_s
 	char *type;
 	char *instance;
 	cu_match_t *match;
+
+	/* Structured formats only */
+	char *field;		// name or path of the field within a row
+	char *group_by;		// field whose value is appended to the instance
+	int aggregate;		// FS_AGGREGATE_*
+	size_t field_hint;	// position of `field' in the previous row
+	size_t group_hint;	// position of `group_by' in the previous row
+	c_avl_tree_t *groups;	// group name -> fs_aggregate_t, while parsing
+	fs_aggregate_t total;	// used if `group_by' is not set
+
 	fs_match_t *next;
 };
 
+
 struct fs_command_s;
 typedef struct fs_command_s fs_command_t;
 struct fs_command_s
@@ -71,18 +173,94 @@ struct fs_command_s
 	char *buffer;		// <output from esl command as a char*>
 	size_t buffer_size;	// strlen(*buffer)+3
 	size_t buffer_fill;	// 0 or 1
+	int timeout;		// milliseconds to wait for a background job
+	int job_state;		// FS_JOB_*
+	unsigned int job_seq;	// identifies the reply we are waiting for
+	uint64_t job_deadline;	// milliseconds since the epoch
+	char job_uuid[64];
+	int format;		// FS_FORMAT_*
+	char *rows;		// path of the rows in JSON and XML output
+	char delimiter;		// column separator of delimited output
 	fs_match_t *matches;
 	fs_command_t *next;
 };
 
-static fs_command_t *fs_commands_g = NULL;
+#define FS_JOB_IDLE    0
+#define FS_JOB_QUEUED  1 /* bgapi sent, waiting for the command reply */
+#define FS_JOB_RUNNING 2 /* Job-UUID known, waiting for BACKGROUND_JOB */
+
+/* Replies to "bgapi" are received in the order the commands were sent. This
+ * FIFO remembers which command each outstanding reply belongs to. Replies of
+ * commands which timed out are recognized by their sequence number. */
+struct fs_reply_s;
+typedef struct fs_reply_s fs_reply_t;
+struct fs_reply_s
+{
+	fs_command_t *command;
+	unsigned int seq;
+	fs_reply_t *next;
+};
+
+/*
+ * Call statistics per endpoint profile (the second component of the
+ * `Channel-Name' header, e.g. "internal" for "sofia/internal/1000@host").
+ * These are maintained by the event thread and only copied by `fs_read'.
+ */
+struct fs_profile_stats_s
+{
+	char name[DATA_MAX_NAME_LEN];
+	gauge_t   calls_active;
+	counter_t calls_created;
+	counter_t calls_completed;
+	counter_t registrations;
+	counter_t unregistrations;
+};
+typedef struct fs_profile_stats_s fs_profile_stats_t;
 
-static char *fs_host = NULL;
-static char *fs_port = NULL;
-static char *fs_pass = NULL;
+struct fs_cause_stats_s
+{
+	char name[DATA_MAX_NAME_LEN];
+	counter_t count;
+};
+typedef struct fs_cause_stats_s fs_cause_stats_t;
 
-static esl_handle_t esl_handle = {{0}};
-// static int thread_running = 0; // for when subscribing to esl events
+struct fs_server_s;
+typedef struct fs_server_s fs_server_t;
+struct fs_server_s
+{
+	char *name;		// NULL for the legacy configuration
+	char *host;
+	char *port;
+	char *pass;
+	cdtime_t interval;	// 0 to use the global interval
+	fs_command_t *commands;
+
+	esl_handle_t handle;
+	time_t next_connect;
+	int reconnect_interval;
+	c_complain_t complaint;
+
+	fs_reply_t *replies_head;
+	fs_reply_t *replies_tail;
+	unsigned int job_seq;
+
+	/* The event thread owns its own ESL connection, so that subscribed
+	 * events never end up in the reply queue of the command connection. */
+	int event_stats;
+	esl_handle_t event_handle;
+	pthread_t event_thread_id;
+	int event_thread_running;
+	int event_loop;
+
+	/* Both trees map a name (char *) to its statistics and are protected by
+	 * `stats_lock'. */
+	c_avl_tree_t *profiles;
+	c_avl_tree_t *causes;
+	counter_t calls_created;
+	counter_t calls_completed;
+	gauge_t calls_active;
+	pthread_mutex_t stats_lock;
+};
 
 /*
  * Private functions
@@ -104,6 +282,20 @@ static int fs_config_add_string (const char *name, char **dest, oconfig_item_t *
 	return (0);
 } /* int fs_config_add_string */
 
+static int fs_config_add_timeout (int *dest, oconfig_item_t *ci)
+{
+	if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_NUMBER)
+			|| (ci->values[0].value.number <= 0))
+	{
+		WARNING ("freeswitch plugin: `Timeout' needs exactly one positive "
+				"numeric argument (milliseconds).");
+		return (-1);
+	}
+
+	*dest = (int) ci->values[0].value.number;
+	return (0);
+} /* int fs_config_add_timeout */
+
 static void fs_match_free (fs_match_t *fm)
 {
 	if (fm == NULL)
@@ -112,7 +304,12 @@ static void fs_match_free (fs_match_t *fm)
 	sfree (fm->regex);
 	sfree (fm->type);
 	sfree (fm->instance);
-	match_destroy (fm->match);
+	sfree (fm->field);
+	sfree (fm->group_by);
+	if (fm->match != NULL)
+		match_destroy (fm->match);
+	if (fm->groups != NULL)
+		c_avl_destroy (fm->groups);
 	fs_match_free (fm->next);
 	sfree (fm);
 } /* void fs_match_free */
@@ -124,6 +321,7 @@ static void fs_command_free (fs_command_t *fc)
 
 	sfree (fc->line);
 	sfree (fc->instance);
+	sfree (fc->rows);
 	sfree (fc->buffer);
 	fs_match_free (fc->matches);
 	fs_command_free (fc->next);
@@ -182,6 +380,42 @@ static int fs_config_add_match_dstype (int *dstype_ret, oconfig_item_t *ci)
 	return (0);
 } /* int fs_config_add_match_dstype */
 
+static int fs_config_add_match_aggregate (int *ret, oconfig_item_t *ci)
+{
+	const char *value;
+
+	if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_STRING))
+	{
+		WARNING ("freeswitch plugin: `Aggregate' needs exactly one string argument.");
+		return (-1);
+	}
+	value = ci->values[0].value.string;
+
+	if (strcasecmp ("Last", value) == 0)
+		*ret = FS_AGGREGATE_LAST;
+	else if (strcasecmp ("Count", value) == 0)
+		*ret = FS_AGGREGATE_COUNT;
+	else if (strcasecmp ("Sum", value) == 0)
+		*ret = FS_AGGREGATE_SUM;
+	else if (strcasecmp ("Min", value) == 0)
+		*ret = FS_AGGREGATE_MIN;
+	else if (strcasecmp ("Max", value) == 0)
+		*ret = FS_AGGREGATE_MAX;
+	else if (strcasecmp ("Average", value) == 0)
+		*ret = FS_AGGREGATE_AVERAGE;
+	else
+	{
+		WARNING ("freeswitch plugin: `%s' is not a valid argument to `Aggregate'.",
+				value);
+		return (-1);
+	}
+
+	return (0);
+} /* int fs_config_add_match_aggregate */
+
+/* Only parses the `Match' block. Whether it is complete depends on the
+ * command's `Format', which may come after it, so the match is checked by
+ * `fs_config_check_match' once the whole command has been read. */
 static int fs_config_add_match (fs_command_t *fs_command, oconfig_item_t *ci)
 {
 	fs_match_t *fs_match;
@@ -200,6 +434,7 @@ static int fs_config_add_match (fs_command_t *fs_command, oconfig_item_t *ci)
 		return (-1);
 	}
 	memset (fs_match, 0, sizeof (*fs_match));
+	fs_match->aggregate = FS_AGGREGATE_LAST;
 
 	status = 0;
 	for (i = 0; i < ci->children_num; i++)
@@ -214,6 +449,12 @@ static int fs_config_add_match (fs_command_t *fs_command, oconfig_item_t *ci)
 			status = fs_config_add_string ("Type", &fs_match->type, child);
 		else if (strcasecmp ("Instance", child->key) == 0)
 			status = fs_config_add_string ("Instance", &fs_match->instance, child);
+		else if (strcasecmp ("Field", child->key) == 0)
+			status = fs_config_add_string ("Field", &fs_match->field, child);
+		else if (strcasecmp ("GroupBy", child->key) == 0)
+			status = fs_config_add_string ("GroupBy", &fs_match->group_by, child);
+		else if (strcasecmp ("Aggregate", child->key) == 0)
+			status = fs_config_add_match_aggregate (&fs_match->aggregate, child);
 		else
 		{
 			WARNING ("freeswitch plugin: Option `%s' not allowed here.", child->key);
@@ -224,57 +465,179 @@ static int fs_config_add_match (fs_command_t *fs_command, oconfig_item_t *ci)
 			break;
 	} /* for (i = 0; i < ci->children_num; i++) */
 
-	while (status == 0)
+	if (status != 0)
+	{
+		fs_match_free (fs_match);
+		return (status);
+	}
+
+	/* Add the new match to the end of the list */
+	{
+		fs_match_t *prev;
+
+		prev = fs_command->matches;
+		while ((prev != NULL) && (prev->next != NULL))
+			prev = prev->next;
+
+		if (prev == NULL)
+			fs_command->matches = fs_match;
+		else
+			prev->next = fs_match;
+	}
+
+	return (0);
+} /* int fs_config_add_match */
+
+static int fs_config_check_match (const fs_command_t *fc, fs_match_t *fm)
+{
+	int status = 0;
+
+	if (fm->type == NULL)
+	{
+		WARNING ("freeswitch plugin: `Type' missing in `Match' block.");
+		status = -1;
+	}
+
+	if (fm->dstype == 0)
+	{
+		WARNING ("freeswitch plugin: `DSType' missing in `Match' block.");
+		status = -1;
+	}
+
+	if (fc->format == FS_FORMAT_REGEX)
 	{
-		if (fs_match->regex == NULL)
+		if (fm->regex == NULL)
 		{
 			WARNING ("freeswitch plugin: `Regex' missing in `Match' block.");
 			status = -1;
 		}
 
-		if (fs_match->type == NULL)
+		if ((fm->field != NULL) || (fm->group_by != NULL))
 		{
-			WARNING ("freeswitch plugin: `Type' missing in `Match' block.");
+			WARNING ("freeswitch plugin: `Field' and `GroupBy' require a "
+					"structured `Format' of the command.");
 			status = -1;
 		}
 
-		if (fs_match->dstype == 0)
+		if (status != 0)
+			return (status);
+
+		fm->match = match_create_simple (fm->regex, fm->dstype);
+		if (fm->match == NULL)
 		{
-			WARNING ("freeswitch plugin: `DSType' missing in `Match' block.");
-			status = -1;
+			ERROR ("freeswitch plugin: match_create_simple failed.");
+			return (-1);
 		}
 
-		break;
-	} /* while (status == 0) */
+		return (0);
+	}
+
+	/* Structured formats */
+	if (fm->regex != NULL)
+	{
+		WARNING ("freeswitch plugin: `Regex' can't be used with the `Format' "
+				"of command `%s'.", fc->line);
+		status = -1;
+	}
+
+	if ((fm->field == NULL) && (fm->aggregate != FS_AGGREGATE_COUNT))
+	{
+		WARNING ("freeswitch plugin: `Field' missing in `Match' block.");
+		status = -1;
+	}
+
+	if ((fm->instance == NULL) && (fm->group_by == NULL))
+	{
+		WARNING ("freeswitch plugin: `Instance' or `GroupBy' missing in "
+				"`Match' block.");
+		status = -1;
+	}
+
+	if ((status == 0) && (fm->group_by != NULL))
+	{
+		fm->groups = c_avl_create ((void *) strcmp);
+		if (fm->groups == NULL)
+		{
+			ERROR ("freeswitch plugin: c_avl_create failed.");
+			status = -1;
+		}
+	}
 
-	if (status != 0)
 	return (status);
+} /* int fs_config_check_match */
+
+/* Removes all matches which are incomplete or don't fit the command's
+ * format. These have always been ignored rather than failing the command. */
+static void fs_config_check_matches (fs_command_t *fc)
+{
+	fs_match_t *fm;
+	fs_match_t *prev;
+	fs_match_t *next;
 
-	fs_match->match = match_create_simple (fs_match->regex, fs_match->dstype);
-	if (fs_match->match == NULL)
+	prev = NULL;
+	for (fm = fc->matches; fm != NULL; fm = next)
 	{
-		ERROR ("freeswitch plugin: tail_match_add_match_simple failed.");
-		fs_match_free (fs_match);
+		next = fm->next;
+
+		if (fs_config_check_match (fc, fm) == 0)
+		{
+			prev = fm;
+			continue;
+		}
+
+		if (prev == NULL)
+			fc->matches = next;
+		else
+			prev->next = next;
+		fm->next = NULL;
+		fs_match_free (fm);
+	}
+} /* void fs_config_check_matches */
+
+static int fs_config_add_format (fs_command_t *fc, oconfig_item_t *ci)
+{
+	const char *value;
+
+	if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_STRING))
+	{
+		WARNING ("freeswitch plugin: `Format' needs exactly one string argument.");
 		return (-1);
 	}
+	value = ci->values[0].value.string;
+
+	if (strcasecmp ("Regex", value) == 0)
+		fc->format = FS_FORMAT_REGEX;
+	else if (strcasecmp ("JSON", value) == 0)
+		fc->format = FS_FORMAT_JSON;
+	else if (strcasecmp ("XML", value) == 0)
+		fc->format = FS_FORMAT_XML;
+	else if (strcasecmp ("Delimited", value) == 0)
+		fc->format = FS_FORMAT_DELIMITED;
 	else
 	{
-		fs_match_t *prev;
+		WARNING ("freeswitch plugin: `%s' is not a valid argument to `Format'.",
+				value);
+		return (-1);
+	}
 
-		prev = fs_command->matches;
-		while ((prev != NULL) && (prev->next != NULL))
-			prev = prev->next;
+	return (0);
+} /* int fs_config_add_format */
 
-		if (prev == NULL)
-			fs_command->matches = fs_match;
-		else
-			prev->next = fs_match;
+static int fs_config_add_delimiter (fs_command_t *fc, oconfig_item_t *ci)
+{
+	if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_STRING)
+			|| (strlen (ci->values[0].value.string) != 1))
+	{
+		WARNING ("freeswitch plugin: `Delimiter' needs exactly one string "
+				"argument of exactly one character.");
+		return (-1);
 	}
 
+	fc->delimiter = ci->values[0].value.string[0];
 	return (0);
-} /* int fs_config_add_match */
+} /* int fs_config_add_delimiter */
 
-static int fs_config_add_command (oconfig_item_t *ci)
+static int fs_config_add_command (fs_server_t *srv, oconfig_item_t *ci)
 {
 	fs_command_t *command;
 	int status;
@@ -294,6 +657,9 @@ static int fs_config_add_command (oconfig_item_t *ci)
 	}
 	memset (command, 0, sizeof (*command));
 
+	command->timeout = FS_DEF_TIMEOUT;
+	command->format = FS_FORMAT_REGEX;
+	command->delimiter = ',';
 	command->line = NULL;
 	command->line = strdup (ci->values[0].value.string);
 
@@ -312,6 +678,14 @@ static int fs_config_add_command (oconfig_item_t *ci)
 
 		if (strcasecmp ("Instance", child->key) == 0)
 			status = fs_config_add_string ("Instance", &command->instance, child);
+		else if (strcasecmp ("Timeout", child->key) == 0)
+			status = fs_config_add_timeout (&command->timeout, child);
+		else if (strcasecmp ("Format", child->key) == 0)
+			status = fs_config_add_format (command, child);
+		else if (strcasecmp ("Rows", child->key) == 0)
+			status = fs_config_add_string ("Rows", &command->rows, child);
+		else if (strcasecmp ("Delimiter", child->key) == 0)
+			status = fs_config_add_delimiter (command, child);
 		else if (strcasecmp ("Match", child->key) == 0)
 			fs_config_add_match (command, child);
 		else
@@ -330,14 +704,16 @@ static int fs_config_add_command (oconfig_item_t *ci)
 		return (status);
 	}
 
+	fs_config_check_matches (command);
+
 	/* Add the new command to the linked list */
-	if (fs_commands_g == NULL)
-		fs_commands_g = command;
+	if (srv->commands == NULL)
+		srv->commands = command;
 	else
 	{
 		fs_command_t *prev;
 
-		prev = fs_commands_g;
+		prev = srv->commands;
 		while ((prev != NULL) && (prev->next != NULL))
 			prev = prev->next;
 		prev->next = command;
@@ -346,8 +722,154 @@ static int fs_config_add_command (oconfig_item_t *ci)
 	return (0);
 } /* int fs_config_add_command */
 
+static void fs_server_free (void *arg);
+static int fs_read (user_data_t *ud);
+
+static fs_server_t *fs_server_create (void)
+{
+	fs_server_t *srv;
+
+	srv = (fs_server_t *) malloc (sizeof (*srv));
+	if (srv == NULL)
+	{
+		ERROR ("freeswitch plugin: malloc failed.");
+		return (NULL);
+	}
+	memset (srv, 0, sizeof (*srv));
+
+	srv->handle.sock = ESL_SOCK_INVALID;
+	srv->event_handle.sock = ESL_SOCK_INVALID;
+	C_COMPLAIN_INIT (&srv->complaint);
+	pthread_mutex_init (&srv->stats_lock, /* attr = */ NULL);
+
+	return (srv);
+} /* fs_server_t *fs_server_create */
+
+/* Handles the options shared by `Server' blocks and the legacy configuration.
+ * Returns one if `child' is not one of them. */
+static int fs_config_server_option (fs_server_t *srv, oconfig_item_t *child,
+		int *status)
+{
+	if (strcasecmp ("Host", child->key) == 0)
+		*status = fs_config_add_string ("Host", &srv->host, child);
+	else if (strcasecmp ("Port", child->key) == 0)
+		*status = fs_config_add_string ("Port", &srv->port, child);
+	else if (strcasecmp ("Pass", child->key) == 0)
+		*status = fs_config_add_string ("Pass", &srv->pass, child);
+	else if (strcasecmp ("Interval", child->key) == 0)
+	{
+		if ((child->values_num != 1)
+				|| (child->values[0].type != OCONFIG_TYPE_NUMBER)
+				|| (child->values[0].value.number <= 0.0))
+		{
+			WARNING ("freeswitch plugin: `Interval' needs exactly "
+					"one positive numeric argument.");
+			*status = -1;
+		}
+		else
+		{
+			srv->interval = DOUBLE_TO_CDTIME_T (child->values[0].value.number);
+			*status = 0;
+		}
+	}
+	else if (strcasecmp ("EventStats", child->key) == 0)
+	{
+		if ((child->values_num != 1)
+				|| (child->values[0].type != OCONFIG_TYPE_BOOLEAN))
+		{
+			WARNING ("freeswitch plugin: `EventStats' needs exactly "
+					"one boolean argument.");
+			*status = -1;
+		}
+		else
+		{
+			srv->event_stats = child->values[0].value.boolean ? 1 : 0;
+			*status = 0;
+		}
+	}
+	else if (strcasecmp ("Command", child->key) == 0)
+		*status = fs_config_add_command (srv, child);
+	else
+		return (1);
+
+	return (0);
+} /* int fs_config_server_option */
+
+static int fs_server_register (fs_server_t *srv)
+{
+	user_data_t ud;
+	struct timespec interval;
+	char cb_name[DATA_MAX_NAME_LEN];
+
+	if (srv->host == NULL) srv->host = strdup (FS_DEF_HOST);
+	if (srv->port == NULL) srv->port = strdup (FS_DEF_PORT);
+	if (srv->pass == NULL) srv->pass = strdup (FS_DEF_PASS);
+	if ((srv->host == NULL) || (srv->port == NULL) || (srv->pass == NULL))
+	{
+		ERROR ("freeswitch plugin: strdup failed.");
+		fs_server_free (srv);
+		return (-1);
+	}
+
+	if (srv->name != NULL)
+		ssnprintf (cb_name, sizeof (cb_name), "freeswitch-%s", srv->name);
+	else
+		sstrncpy (cb_name, "freeswitch", sizeof (cb_name));
+
+	memset (&ud, 0, sizeof (ud));
+	ud.data = (void *) srv;
+	ud.free_func = fs_server_free;
+
+	/* Values dispatched by `fs_read' inherit this interval. */
+	memset (&interval, 0, sizeof (interval));
+	if (srv->interval != 0)
+		cdtime_to_timespec (srv->interval, &interval);
+
+	return (plugin_register_complex_read (cb_name, fs_read,
+				(srv->interval != 0) ? &interval : NULL, &ud));
+} /* int fs_server_register */
+
+static int fs_config_add_server (oconfig_item_t *ci)
+{
+	fs_server_t *srv;
+	int status;
+	int i;
+
+	if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_STRING))
+	{
+		WARNING ("freeswitch plugin: 'Server' blocks need exactly one string argument.");
+		return (-1);
+	}
+
+	srv = fs_server_create ();
+	if (srv == NULL)
+		return (-1);
+
+	status = fs_config_add_string ("Server", &srv->name, ci);
+
+	for (i = 0; (status == 0) && (i < ci->children_num); i++)
+	{
+		oconfig_item_t *child = ci->children + i;
+
+		if (fs_config_server_option (srv, child, &status) != 0)
+		{
+			WARNING ("freeswitch plugin: Option '%s' not allowed here.", child->key);
+			status = -1;
+		}
+	}
+
+	if (status != 0)
+	{
+		fs_server_free (srv);
+		return (status);
+	}
+
+	return (fs_server_register (srv));
+} /* int fs_config_add_server */
+
 static int fs_complex_config (oconfig_item_t *ci)
 {
+	fs_server_t *legacy;
 	int success;
 	int errors;
 	int status;
@@ -356,38 +878,37 @@ static int fs_complex_config (oconfig_item_t *ci)
 	success = 0;
 	errors = 0;
 
+	legacy = fs_server_create ();
+	if (legacy == NULL)
+		return (-1);
+
 	for (i = 0; i < ci->children_num; i++)
 	{
 		oconfig_item_t *child = ci->children + i;
 
-		if (strcasecmp ("Host", child->key) == 0)
-		{
-			if (fs_host != NULL) free (fs_host);
-			fs_host = strdup(child->values[0].value.string);
-		}
-		else if (strcasecmp ("Port", child->key) == 0)
-		{
-			if (fs_port != NULL) free (fs_port);
-			fs_port = strdup(child->values[0].value.string);
-		}
-		else if (strcasecmp ("Pass", child->key) == 0)
-		{
-			if (fs_pass != NULL) free (fs_pass);
-			fs_pass = strdup(child->values[0].value.string);
-		}
-		else if (strcasecmp ("Command", child->key) == 0)
+		if (strcasecmp ("Server", child->key) == 0)
+			status = fs_config_add_server (child);
+		else if (fs_config_server_option (legacy, child, &status) != 0)
 		{
-			status = fs_config_add_command(child);
-			if (status == 0)
-				success++;
-			else
-				errors++;
+			WARNING ("freeswitch plugin: Option '%s' not allowed here.", child->key);
+			status = -1;
 		}
+
+		if (status == 0)
+			success++;
 		else
-		{
-			WARNING ("freeswitch plugin: Option '%s' not allowed here.", child->key);
 			errors++;
-		}
+	}
+
+	/* Only read the legacy server if it has been configured to do anything. */
+	if ((legacy->commands != NULL) || (legacy->event_stats != 0))
+	{
+		if (fs_server_register (legacy) != 0)
+			errors++;
+	}
+	else
+	{
+		fs_server_free (legacy);
 	}
 
 	if ((success == 0) && (errors > 0))
@@ -399,56 +920,1449 @@ static int fs_complex_config (oconfig_item_t *ci)
 	return (0);
 } /* int fs_complex_config */
 
-static void fs_submit (const fs_command_t *fc,
-	const fs_match_t *fm, const cu_match_value_t *mv)
+/* Builds the plugin instance of a value: Values of named servers are prefixed
+ * with the server name, the legacy server's values are left untouched. */
+static void fs_plugin_instance (const fs_server_t *srv, const char *instance,
+		char *buffer, size_t buffer_size)
+{
+	if ((instance == NULL) || (instance[0] == 0))
+		sstrncpy (buffer, (srv->name != NULL) ? srv->name : "", buffer_size);
+	else if (srv->name == NULL)
+		sstrncpy (buffer, instance, buffer_size);
+	else
+		ssnprintf (buffer, buffer_size, "%s-%s", srv->name, instance);
+} /* void fs_plugin_instance */
+
+static void fs_submit (const fs_server_t *srv, const fs_command_t *fc,
+	const char *type, const char *type_instance, value_t value)
 {
 	value_t values[1];
 	value_list_t vl = VALUE_LIST_INIT;
 
-	values[0] = mv->value;
+	values[0] = value;
 
 	vl.values = values;
 	vl.values_len = 1;
-	vl.time = time (NULL);
+	vl.time = cdtime ();
 
 	strncpy (vl.host, hostname_g, sizeof (vl.host));
 	strncpy (vl.plugin, "freeswitch", sizeof (vl.plugin));
-	strncpy (vl.plugin_instance, fc->instance, sizeof (vl.plugin_instance));
-	strncpy (vl.type, fm->type, sizeof (vl.type));
-	strncpy (vl.type_instance, fm->instance, sizeof (vl.type_instance));
+	fs_plugin_instance (srv, fc->instance, vl.plugin_instance,
+			sizeof (vl.plugin_instance));
+	strncpy (vl.type, type, sizeof (vl.type));
+	strncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
 
 	plugin_dispatch_values (&vl);
 } /* void fs_submit */
 
-static int fs_read_command (fs_command_t *fc)
+static void fs_submit_stat (const fs_server_t *srv,
+		const char *plugin_instance, const char *type,
+		const char *type_instance, value_t value)
 {
-	fs_match_t *fm;
-	int status;
+	value_list_t vl = VALUE_LIST_INIT;
 
-	/* can't the following be done nicer ? */
-	char *line;
-	line = (char *) malloc (strlen(fc->line)+3);
-	snprintf(line, strlen(fc->line)+3, "%s\n\n", fc->line);
-	esl_send_recv(&esl_handle, line);
+	vl.values = &value;
+	vl.values_len = 1;
+	vl.time = cdtime ();
 
-	fc->buffer_fill = 0;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "freeswitch", sizeof (vl.plugin));
+	fs_plugin_instance (srv, plugin_instance, vl.plugin_instance,
+			sizeof (vl.plugin_instance));
+	sstrncpy (vl.type, type, sizeof (vl.type));
+	sstrncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
+
+	plugin_dispatch_values (&vl);
+} /* void fs_submit_stat */
+
+static void fs_submit_counter (const fs_server_t *srv,
+		const char *plugin_instance,
+		const char *type_instance, counter_t counter)
+{
+	value_t value;
+
+	value.counter = counter;
+	fs_submit_stat (srv, plugin_instance, "counter", type_instance, value);
+} /* void fs_submit_counter */
+
+static void fs_submit_gauge (const fs_server_t *srv,
+		const char *plugin_instance,
+		const char *type_instance, gauge_t gauge)
+{
+	value_t value;
+
+	value.gauge = gauge;
+	fs_submit_stat (srv, plugin_instance, "gauge", type_instance, value);
+} /* void fs_submit_gauge */
+
+/* Returns the statistics of the profile `name', creating them if necessary.
+ * Must be called with `srv->stats_lock' held. */
+static fs_profile_stats_t *fs_profile_get (fs_server_t *srv, const char *name)
+{
+	fs_profile_stats_t *ps = NULL;
+
+	if (c_avl_get (srv->profiles, name, (void *) &ps) == 0)
+		return (ps);
 
-	if (esl_handle.last_sr_event && esl_handle.last_sr_event->body)
+	ps = (fs_profile_stats_t *) malloc (sizeof (*ps));
+	if (ps == NULL)
 	{
-		sfree(fc->buffer);
-		fc->buffer = strdup(esl_handle.last_sr_event->body);
-		fc->buffer_size = strlen(fc->buffer);
-		fc->buffer_fill = 1;
+		ERROR ("freeswitch plugin: malloc failed.");
+		return (NULL);
 	}
+	memset (ps, 0, sizeof (*ps));
+	sstrncpy (ps->name, name, sizeof (ps->name));
 
-	for (fm = fc->matches; fm != NULL; fm = fm->next)
+	if (c_avl_insert (srv->profiles, ps->name, ps) != 0)
 	{
-		cu_match_value_t *mv;
+		ERROR ("freeswitch plugin: c_avl_insert failed.");
+		sfree (ps);
+		return (NULL);
+	}
 
-		status = match_apply (fm->match, fc->buffer);
-		if (status != 0)
-		{
-			WARNING ("freeswitch plugin: match_apply failed.");
+	return (ps);
+} /* fs_profile_stats_t *fs_profile_get */
+
+/* Same as `fs_profile_get' for the hangup cause histogram. */
+static fs_cause_stats_t *fs_cause_get (fs_server_t *srv, const char *name)
+{
+	fs_cause_stats_t *cs = NULL;
+
+	if (c_avl_get (srv->causes, name, (void *) &cs) == 0)
+		return (cs);
+
+	cs = (fs_cause_stats_t *) malloc (sizeof (*cs));
+	if (cs == NULL)
+	{
+		ERROR ("freeswitch plugin: malloc failed.");
+		return (NULL);
+	}
+	memset (cs, 0, sizeof (*cs));
+	sstrncpy (cs->name, name, sizeof (cs->name));
+
+	if (c_avl_insert (srv->causes, cs->name, cs) != 0)
+	{
+		ERROR ("freeswitch plugin: c_avl_insert failed.");
+		sfree (cs);
+		return (NULL);
+	}
+
+	return (cs);
+} /* fs_cause_stats_t *fs_cause_get */
+
+/* Extracts the profile from a channel name such as
+ * "sofia/internal/1000@example.com". For endpoints without a profile the
+ * endpoint name itself ("loopback", "portaudio", ...) is used. */
+static void fs_channel_profile (const char *channel, char *buffer,
+		size_t buffer_size)
+{
+	const char *start;
+	const char *end;
+	size_t len;
+
+	start = strchr (channel, '/');
+	if ((start == NULL) || (strncasecmp ("sofia/", channel, 6) != 0))
+	{
+		start = channel;
+		end = strchr (channel, '/');
+	}
+	else
+	{
+		start++;
+		end = strchr (start, '/');
+	}
+
+	len = (end == NULL) ? strlen (start) : (size_t) (end - start);
+	if (len >= buffer_size)
+		len = buffer_size - 1;
+
+	memcpy (buffer, start, len);
+	buffer[len] = 0;
+} /* void fs_channel_profile */
+
+static void fs_handle_event (fs_server_t *srv, esl_event_t *event)
+{
+	const char *event_name;
+	const char *value;
+	char profile[DATA_MAX_NAME_LEN];
+	fs_profile_stats_t *ps;
+	fs_cause_stats_t *cs;
+
+	event_name = esl_event_get_header (event, "Event-Name");
+	if (event_name == NULL)
+		return;
+
+	if (strcasecmp ("CHANNEL_CREATE", event_name) == 0)
+	{
+		value = esl_event_get_header (event, "Channel-Name");
+		fs_channel_profile ((value != NULL) ? value : "unknown",
+				profile, sizeof (profile));
+
+		pthread_mutex_lock (&srv->stats_lock);
+		srv->calls_created++;
+		srv->calls_active++;
+		ps = fs_profile_get (srv, profile);
+		if (ps != NULL)
+		{
+			ps->calls_created++;
+			ps->calls_active++;
+		}
+		pthread_mutex_unlock (&srv->stats_lock);
+	}
+	else if (strcasecmp ("CHANNEL_HANGUP_COMPLETE", event_name) == 0)
+	{
+		value = esl_event_get_header (event, "Channel-Name");
+		fs_channel_profile ((value != NULL) ? value : "unknown",
+				profile, sizeof (profile));
+
+		value = esl_event_get_header (event, "Hangup-Cause");
+		if (value == NULL)
+			value = "UNKNOWN";
+
+		pthread_mutex_lock (&srv->stats_lock);
+		srv->calls_completed++;
+		/* Channels created before we subscribed are never counted as active,
+		 * so don't let their hangups push the gauges below zero. */
+		if (srv->calls_active > 0.0)
+			srv->calls_active--;
+		ps = fs_profile_get (srv, profile);
+		if (ps != NULL)
+		{
+			ps->calls_completed++;
+			if (ps->calls_active > 0.0)
+				ps->calls_active--;
+		}
+		cs = fs_cause_get (srv, value);
+		if (cs != NULL)
+			cs->count++;
+		pthread_mutex_unlock (&srv->stats_lock);
+	}
+	else if (strcasecmp ("CUSTOM", event_name) == 0)
+	{
+		const char *subclass;
+
+		subclass = esl_event_get_header (event, "Event-Subclass");
+		if ((subclass == NULL) || (strncasecmp ("sofia::", subclass, 7) != 0))
+			return;
+
+		value = esl_event_get_header (event, "profile-name");
+		if (value == NULL)
+			return;
+		sstrncpy (profile, value, sizeof (profile));
+
+		pthread_mutex_lock (&srv->stats_lock);
+		ps = fs_profile_get (srv, profile);
+		if (ps != NULL)
+		{
+			if (strcasecmp ("sofia::register", subclass) == 0)
+				ps->registrations++;
+			else if ((strcasecmp ("sofia::unregister", subclass) == 0)
+					|| (strcasecmp ("sofia::expire", subclass) == 0))
+				ps->unregistrations++;
+		}
+		pthread_mutex_unlock (&srv->stats_lock);
+	}
+} /* void fs_handle_event */
+
+static int fs_event_connect (fs_server_t *srv)
+{
+	if (esl_connect (&srv->event_handle, srv->host, atoi (srv->port),
+				srv->pass) != ESL_SUCCESS)
+	{
+		ERROR ("freeswitch plugin: Event connection to %s:%s failed: %s",
+				srv->host, srv->port, srv->event_handle.err);
+		return (-1);
+	}
+
+	if ((esl_events (&srv->event_handle, ESL_EVENT_TYPE_PLAIN,
+					FS_EVENT_SUBSCRIPTION) != ESL_SUCCESS)
+			|| (strncmp ("+OK", srv->event_handle.last_sr_reply, 3) != 0))
+	{
+		ERROR ("freeswitch plugin: Subscribing to events failed: %s",
+				srv->event_handle.last_sr_reply);
+		esl_disconnect (&srv->event_handle);
+		return (-1);
+	}
+
+	INFO ("freeswitch plugin: Subscribed to events on %s:%s.",
+			srv->host, srv->port);
+	return (0);
+} /* int fs_event_connect */
+
+static void *fs_event_thread (void *arg)
+{
+	fs_server_t *srv = arg;
+	time_t next_connect = 0;
+	int reconnect_interval = FS_RECONNECT_MIN;
+
+	while (srv->event_loop == 0)
+	{
+		esl_status_t status;
+		const char *content_type;
+
+		if (!srv->event_handle.connected)
+		{
+			time_t now = time (NULL);
+
+			if (now < next_connect)
+			{
+				sleep (1);
+				continue;
+			}
+
+			if (fs_event_connect (srv) != 0)
+			{
+				next_connect = now + reconnect_interval;
+				reconnect_interval *= 2;
+				if (reconnect_interval > FS_RECONNECT_MAX)
+					reconnect_interval = FS_RECONNECT_MAX;
+				continue;
+			}
+			reconnect_interval = FS_RECONNECT_MIN;
+		}
+
+		/* Use a timeout well below one second so shutdown isn't delayed. */
+		status = esl_recv_event_timed (&srv->event_handle, 500,
+				/* check_q = */ 1, /* save_event = */ NULL);
+		if (status == ESL_BREAK)
+			continue;
+		else if (status != ESL_SUCCESS)
+		{
+			WARNING ("freeswitch plugin: Lost event connection to %s:%s.",
+					srv->host, srv->port);
+			if (srv->event_handle.connected)
+				esl_disconnect (&srv->event_handle);
+			next_connect = time (NULL) + reconnect_interval;
+			continue;
+		}
+
+		if ((srv->event_handle.last_event == NULL)
+				|| (srv->event_handle.last_ievent == NULL))
+			continue;
+
+		content_type = esl_event_get_header (srv->event_handle.last_event,
+				"Content-Type");
+		if ((content_type == NULL)
+				|| (strcasecmp ("text/event-plain", content_type) != 0))
+			continue;
+
+		fs_handle_event (srv, srv->event_handle.last_ievent);
+		esl_event_safe_destroy (&srv->event_handle.last_ievent);
+	} /* while (srv->event_loop == 0) */
+
+	if (srv->event_handle.connected)
+		esl_disconnect (&srv->event_handle);
+
+	return ((void *) 0);
+} /* void *fs_event_thread */
+
+/* Dispatches a copy of the event statistics. The copies are taken with the
+ * lock held, the values are dispatched without it so a slow write plugin can
+ * not stall the event thread. */
+static int fs_read_events (fs_server_t *srv)
+{
+	fs_profile_stats_t *profiles = NULL;
+	fs_cause_stats_t *causes = NULL;
+	int profiles_num = 0;
+	int profiles_size = 0;
+	int causes_num = 0;
+	int causes_size = 0;
+	counter_t calls_created;
+	counter_t calls_completed;
+	gauge_t calls_active;
+	c_avl_iterator_t *iter;
+	void *key;
+	void *value;
+	int i;
+
+	pthread_mutex_lock (&srv->stats_lock);
+
+	calls_created = srv->calls_created;
+	calls_completed = srv->calls_completed;
+	calls_active = srv->calls_active;
+
+	iter = c_avl_get_iterator (srv->profiles);
+	while (c_avl_iterator_next (iter, &key, &value) == 0)
+	{
+		if (profiles_num >= profiles_size)
+		{
+			fs_profile_stats_t *tmp;
+			int new_size;
+
+			new_size = (profiles_size == 0) ? 16 : (2 * profiles_size);
+			tmp = (fs_profile_stats_t *) realloc (profiles,
+					sizeof (*profiles) * new_size);
+			if (tmp == NULL)
+				break;
+			profiles = tmp;
+			profiles_size = new_size;
+		}
+
+		memcpy (profiles + profiles_num, value, sizeof (*profiles));
+		profiles_num++;
+	}
+	c_avl_iterator_destroy (iter);
+
+	iter = c_avl_get_iterator (srv->causes);
+	while (c_avl_iterator_next (iter, &key, &value) == 0)
+	{
+		if (causes_num >= causes_size)
+		{
+			fs_cause_stats_t *tmp;
+			int new_size;
+
+			new_size = (causes_size == 0) ? 16 : (2 * causes_size);
+			tmp = (fs_cause_stats_t *) realloc (causes,
+					sizeof (*causes) * new_size);
+			if (tmp == NULL)
+				break;
+			causes = tmp;
+			causes_size = new_size;
+		}
+
+		memcpy (causes + causes_num, value, sizeof (*causes));
+		causes_num++;
+	}
+	c_avl_iterator_destroy (iter);
+
+	pthread_mutex_unlock (&srv->stats_lock);
+
+	fs_submit_counter (srv, NULL, "calls-created", calls_created);
+	fs_submit_counter (srv, NULL, "calls-completed", calls_completed);
+	fs_submit_gauge (srv, NULL, "calls-active", calls_active);
+
+	for (i = 0; i < profiles_num; i++)
+	{
+		char plugin_instance[DATA_MAX_NAME_LEN];
+
+		ssnprintf (plugin_instance, sizeof (plugin_instance), "profile-%s",
+				profiles[i].name);
+
+		fs_submit_counter (srv, plugin_instance, "calls-created",
+				profiles[i].calls_created);
+		fs_submit_counter (srv, plugin_instance, "calls-completed",
+				profiles[i].calls_completed);
+		fs_submit_gauge (srv, plugin_instance, "calls-active",
+				profiles[i].calls_active);
+		fs_submit_counter (srv, plugin_instance, "registrations",
+				profiles[i].registrations);
+		fs_submit_counter (srv, plugin_instance, "unregistrations",
+				profiles[i].unregistrations);
+	}
+
+	for (i = 0; i < causes_num; i++)
+	{
+		char type_instance[DATA_MAX_NAME_LEN];
+
+		ssnprintf (type_instance, sizeof (type_instance), "hangup-%s",
+				causes[i].name);
+		fs_submit_counter (srv, NULL, type_instance, causes[i].count);
+	}
+
+	sfree (profiles);
+	sfree (causes);
+
+	return (0);
+} /* int fs_read_events */
+
+/*
+ * Structured output
+ *
+ * JSON, XML and delimited output is parsed once into a list of rows, each of
+ * which is a list of (name, value) fields. Values point into the command's
+ * buffer, which is unescaped and null-terminated in place; only the field
+ * names are copied. All matches of the command are then evaluated in a single
+ * pass over the rows.
+ *
+ * A field's name is its path relative to the row, e.g. "name" or "data/url"
+ * for JSON and XML, with attributes of XML elements named "@attribute". The
+ * rows of JSON and XML output are the objects (elements) at the path given
+ * by the command's `Rows' option; without it the whole document is the only
+ * row. Delimited output has one row per line and takes the field names from
+ * the first line. It ends with the first empty line.
+ */
+struct fs_field_s
+{
+	size_t name;		// offset into fs_doc_t.names
+	char *value;
+	size_t value_len;	// the value is null-terminated after parsing
+};
+typedef struct fs_field_s fs_field_t;
+
+#define FS_DOC_MAX_DEPTH 64
+
+struct fs_doc_s
+{
+	fs_field_t *fields;
+	size_t fields_num;
+	size_t fields_size;
+
+	size_t *rows;		// index of the first field of every row
+	size_t rows_num;
+	size_t rows_size;
+
+	char *names;
+	size_t names_fill;
+	size_t names_size;
+
+	/* Parser state */
+	const char *rows_path;
+	char path[512];
+	size_t path_len;
+	int depth;
+	int row_depth;		// depth of the current row, -1 if not in a row
+	size_t row_base;	// length of the path of the current row
+};
+typedef struct fs_doc_s fs_doc_t;
+
+/* Makes room for one more element in an array of `*size' elements, `num' of
+ * which are used. Returns the (possibly moved) array or NULL. */
+static void *fs_doc_grow (void *array, size_t *size, size_t num,
+		size_t elem_size)
+{
+	size_t new_size;
+	void *tmp;
+
+	if (num < *size)
+		return (array);
+
+	new_size = (*size == 0) ? 64 : (2 * *size);
+	tmp = realloc (array, new_size * elem_size);
+	if (tmp == NULL)
+	{
+		ERROR ("freeswitch plugin: realloc failed.");
+		return (NULL);
+	}
+
+	*size = new_size;
+	return (tmp);
+} /* void *fs_doc_grow */
+
+static void fs_doc_free (fs_doc_t *doc)
+{
+	sfree (doc->fields);
+	sfree (doc->rows);
+	sfree (doc->names);
+} /* void fs_doc_free */
+
+/* Copies `name' into the name buffer and returns its offset there, or
+ * (size_t) -1 on failure. */
+static size_t fs_doc_add_name (fs_doc_t *doc, const char *name, size_t len)
+{
+	size_t offset;
+
+	while (doc->names_fill + len + 1 > doc->names_size)
+	{
+		char *tmp;
+
+		tmp = fs_doc_grow (doc->names, &doc->names_size, doc->names_size,
+				sizeof (*doc->names));
+		if (tmp == NULL)
+			return ((size_t) -1);
+		doc->names = tmp;
+	}
+
+	offset = doc->names_fill;
+	memcpy (doc->names + offset, name, len);
+	doc->names[offset + len] = 0;
+	doc->names_fill += len + 1;
+
+	return (offset);
+} /* size_t fs_doc_add_name */
+
+static int fs_doc_begin_row (fs_doc_t *doc)
+{
+	size_t *tmp;
+
+	tmp = fs_doc_grow (doc->rows, &doc->rows_size, doc->rows_num,
+			sizeof (*doc->rows));
+	if (tmp == NULL)
+		return (-1);
+	doc->rows = tmp;
+
+	doc->rows[doc->rows_num] = doc->fields_num;
+	doc->rows_num++;
+	return (0);
+} /* int fs_doc_begin_row */
+
+static int fs_doc_add_named_field (fs_doc_t *doc, size_t name,
+		char *value, size_t value_len)
+{
+	fs_field_t *tmp;
+
+	tmp = fs_doc_grow (doc->fields, &doc->fields_size, doc->fields_num,
+			sizeof (*doc->fields));
+	if (tmp == NULL)
+		return (-1);
+	doc->fields = tmp;
+
+	doc->fields[doc->fields_num].name = name;
+	doc->fields[doc->fields_num].value = value;
+	doc->fields[doc->fields_num].value_len = value_len;
+	doc->fields_num++;
+	return (0);
+} /* int fs_doc_add_named_field */
+
+/* Adds a field named after the current path. Values outside of rows are
+ * ignored. */
+static int fs_doc_add_field (fs_doc_t *doc, char *value, size_t value_len)
+{
+	const char *name;
+	size_t name_off;
+
+	if (doc->row_depth < 0)
+		return (0);
+
+	name = doc->path + doc->row_base;
+	if (*name == '/')
+		name++;
+
+	name_off = fs_doc_add_name (doc, name,
+			doc->path_len - (size_t) (name - doc->path));
+	if (name_off == ((size_t) -1))
+		return (-1);
+
+	return (fs_doc_add_named_field (doc, name_off, value, value_len));
+} /* int fs_doc_add_field */
+
+static int fs_doc_path_push (fs_doc_t *doc, const char *name, size_t len,
+		size_t *old_len)
+{
+	size_t sep = (doc->path_len > 0) ? 1 : 0;
+
+	if (doc->path_len + sep + len >= sizeof (doc->path))
+	{
+		WARNING ("freeswitch plugin: Path of a field is too long.");
+		return (-1);
+	}
+
+	*old_len = doc->path_len;
+	if (sep)
+		doc->path[doc->path_len] = '/';
+	memcpy (doc->path + doc->path_len + sep, name, len);
+	doc->path_len += sep + len;
+	doc->path[doc->path_len] = 0;
+
+	return (0);
+} /* int fs_doc_path_push */
+
+static void fs_doc_path_pop (fs_doc_t *doc, size_t old_len)
+{
+	doc->path_len = old_len;
+	doc->path[old_len] = 0;
+} /* void fs_doc_path_pop */
+
+/* Called when entering an object or element. If it is at the rows path it
+ * starts a new row. */
+static int fs_doc_enter (fs_doc_t *doc, int may_be_row)
+{
+	if (doc->depth >= FS_DOC_MAX_DEPTH)
+	{
+		WARNING ("freeswitch plugin: Output is nested too deeply.");
+		return (-1);
+	}
+	doc->depth++;
+
+	if (may_be_row && (doc->row_depth < 0) && (doc->rows_path != NULL)
+			&& (strcmp (doc->path, doc->rows_path) == 0))
+	{
+		if (fs_doc_begin_row (doc) != 0)
+			return (-1);
+		doc->row_depth = doc->depth;
+		doc->row_base = doc->path_len;
+	}
+
+	return (0);
+} /* int fs_doc_enter */
+
+static void fs_doc_leave (fs_doc_t *doc)
+{
+	if (doc->row_depth == doc->depth)
+		doc->row_depth = -1;
+	doc->depth--;
+} /* void fs_doc_leave */
+
+/* Stores `cp' UTF-8 encoded in `buffer', which must have room for four
+ * bytes, and returns the number of bytes used. */
+static size_t fs_utf8_encode (unsigned long cp, char *buffer)
+{
+	if (cp < 0x80)
+	{
+		buffer[0] = (char) cp;
+		return (1);
+	}
+	else if (cp < 0x800)
+	{
+		buffer[0] = (char) (0xC0 | (cp >> 6));
+		buffer[1] = (char) (0x80 | (cp & 0x3F));
+		return (2);
+	}
+	else if (cp < 0x10000)
+	{
+		buffer[0] = (char) (0xE0 | (cp >> 12));
+		buffer[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+		buffer[2] = (char) (0x80 | (cp & 0x3F));
+		return (3);
+	}
+
+	buffer[0] = (char) (0xF0 | ((cp >> 18) & 0x07));
+	buffer[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+	buffer[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+	buffer[3] = (char) (0x80 | (cp & 0x3F));
+	return (4);
+} /* size_t fs_utf8_encode */
+
+static void fs_json_skip_ws (char **pp)
+{
+	while (isspace ((int) **pp))
+		(*pp)++;
+} /* void fs_json_skip_ws */
+
+/* Unescapes the string at `*pp' in place. The result is not null-terminated,
+ * as the closing quote may be needed by the caller. */
+static int fs_json_string (char **pp, char **ret, size_t *ret_len)
+{
+	char *r = *pp + 1;
+	char *w = r;
+
+	*ret = r;
+	while (*r != '"')
+	{
+		if (*r == 0)
+			return (-1);
+
+		if (*r != '\\')
+		{
+			*w++ = *r++;
+			continue;
+		}
+
+		r++;
+		switch (*r)
+		{
+			case '"':
+			case '\\':
+			case '/': *w++ = *r; break;
+			case 'b': *w++ = '\b'; break;
+			case 'f': *w++ = '\f'; break;
+			case 'n': *w++ = '\n'; break;
+			case 'r': *w++ = '\r'; break;
+			case 't': *w++ = '\t'; break;
+			case 'u':
+			{
+				char hex[5];
+				int i;
+
+				for (i = 0; i < 4; i++)
+					if (!isxdigit ((int) r[i + 1]))
+						return (-1);
+				memcpy (hex, r + 1, 4);
+				hex[4] = 0;
+				/* Six bytes of input are at least three bytes of output. */
+				w += fs_utf8_encode (strtoul (hex, NULL, 16), w);
+				r += 4;
+				break;
+			}
+			default:
+				return (-1);
+		}
+		r++;
+	} /* while (*r != '"') */
+
+	*ret_len = (size_t) (w - *ret);
+	*pp = r + 1;
+	return (0);
+} /* int fs_json_string */
+
+static int fs_json_value (fs_doc_t *doc, char **pp);
+
+static int fs_json_object (fs_doc_t *doc, char **pp)
+{
+	char *p = *pp + 1;
+
+	if (fs_doc_enter (doc, /* may_be_row = */ 1) != 0)
+		return (-1);
+
+	fs_json_skip_ws (&p);
+	if (*p == '}')
+		p++;
+	else while (42)
+	{
+		char *key;
+		size_t key_len;
+		size_t old_len;
+		int status;
+
+		fs_json_skip_ws (&p);
+		if ((*p != '"') || (fs_json_string (&p, &key, &key_len) != 0))
+			return (-1);
+
+		fs_json_skip_ws (&p);
+		if (*p != ':')
+			return (-1);
+		p++;
+
+		if (fs_doc_path_push (doc, key, key_len, &old_len) != 0)
+			return (-1);
+		status = fs_json_value (doc, &p);
+		fs_doc_path_pop (doc, old_len);
+		if (status != 0)
+			return (status);
+
+		fs_json_skip_ws (&p);
+		if (*p == ',')
+			p++;
+		else if (*p == '}')
+		{
+			p++;
+			break;
+		}
+		else
+			return (-1);
+	} /* while (42) */
+
+	fs_doc_leave (doc);
+	*pp = p;
+	return (0);
+} /* int fs_json_object */
+
+/* Elements of arrays share the path of the array, so an array at the rows
+ * path is a list of rows. */
+static int fs_json_array (fs_doc_t *doc, char **pp)
+{
+	char *p = *pp + 1;
+
+	if (fs_doc_enter (doc, /* may_be_row = */ 0) != 0)
+		return (-1);
+
+	fs_json_skip_ws (&p);
+	if (*p == ']')
+		p++;
+	else while (42)
+	{
+		if (fs_json_value (doc, &p) != 0)
+			return (-1);
+
+		fs_json_skip_ws (&p);
+		if (*p == ',')
+			p++;
+		else if (*p == ']')
+		{
+			p++;
+			break;
+		}
+		else
+			return (-1);
+	} /* while (42) */
+
+	fs_doc_leave (doc);
+	*pp = p;
+	return (0);
+} /* int fs_json_array */
+
+static int fs_json_value (fs_doc_t *doc, char **pp)
+{
+	char *value;
+	size_t value_len;
+
+	fs_json_skip_ws (pp);
+
+	if (**pp == '{')
+		return (fs_json_object (doc, pp));
+	else if (**pp == '[')
+		return (fs_json_array (doc, pp));
+	else if (**pp == '"')
+	{
+		if (fs_json_string (pp, &value, &value_len) != 0)
+			return (-1);
+		return (fs_doc_add_field (doc, value, value_len));
+	}
+
+	/* Numbers, true, false and null */
+	value = *pp;
+	while ((**pp != 0) && (strchr (",}] \t\r\n", **pp) == NULL))
+		(*pp)++;
+	if (*pp == value)
+		return (-1);
+
+	return (fs_doc_add_field (doc, value, (size_t) (*pp - value)));
+} /* int fs_json_value */
+
+static int fs_json_parse (fs_doc_t *doc, char *buffer)
+{
+	return (fs_json_value (doc, &buffer));
+} /* int fs_json_parse */
+
+/* Replaces entities and CDATA sections of the text from `begin' to `end' in
+ * place and strips leading and trailing white space. */
+static char *fs_xml_text (char *begin, char *end, size_t *ret_len)
+{
+	char *r = begin;
+	char *w = begin;
+
+	while (r < end)
+	{
+		if ((*r == '<') && ((end - r) >= 12) && (memcmp (r, "<![CDATA[", 9) == 0))
+		{
+			r += 9;
+			while ((r < end) && !(((end - r) >= 3) && (memcmp (r, "]]>", 3) == 0)))
+				*w++ = *r++;
+			r += 3;
+			continue;
+		}
+		else if (*r == '&')
+		{
+			char *semicolon = memchr (r, ';', (size_t) (end - r));
+			size_t len = (semicolon != NULL) ? (size_t) (semicolon - r) + 1 : 0;
+
+			/* Entities are longer than what they stand for. */
+			if ((len == 4) && (memcmp (r, "&lt;", 4) == 0))
+				*w++ = '<';
+			else if ((len == 4) && (memcmp (r, "&gt;", 4) == 0))
+				*w++ = '>';
+			else if ((len == 5) && (memcmp (r, "&amp;", 5) == 0))
+				*w++ = '&';
+			else if ((len == 6) && (memcmp (r, "&quot;", 6) == 0))
+				*w++ = '"';
+			else if ((len == 6) && (memcmp (r, "&apos;", 6) == 0))
+				*w++ = '\'';
+			else if ((len >= 4) && (len <= 12) && (r[1] == '#'))
+			{
+				unsigned long cp;
+
+				if ((r[2] == 'x') || (r[2] == 'X'))
+					cp = strtoul (r + 3, NULL, 16);
+				else
+					cp = strtoul (r + 2, NULL, 10);
+				if ((cp == 0) || (cp > 0x10FFFF))
+					len = 0;
+				else
+					w += fs_utf8_encode (cp, w);
+			}
+			else
+				len = 0;
+
+			if (len == 0)
+				*w++ = *r++;
+			else
+				r += len;
+			continue;
+		}
+
+		*w++ = *r++;
+	} /* while (r < end) */
+
+	while ((begin < w) && isspace ((int) *begin))
+		begin++;
+	while ((w > begin) && isspace ((int) w[-1]))
+		w--;
+
+	*ret_len = (size_t) (w - begin);
+	return (begin);
+} /* char *fs_xml_text */
+
+/* A minimal, non-validating XML parser: Text of elements without child
+ * elements and attributes are fields, mixed content is ignored. */
+static int fs_xml_parse (fs_doc_t *doc, char *p)
+{
+	struct
+	{
+		size_t path_len;	// length of the path before the element
+		int children;
+		char *text;
+	} stack[FS_DOC_MAX_DEPTH];
+	char *value;
+	size_t value_len;
+
+	while (*p != 0)
+	{
+		char *name;
+		int e;
+
+		if (*p != '<')
+		{
+			p++;
+			continue;
+		}
+
+		if (strncmp ("<![CDATA[", p, 9) == 0)
+		{
+			p = strstr (p + 9, "]]>");
+			if (p == NULL)
+				return (-1);
+			p += 3;
+			continue;
+		}
+		else if (strncmp ("<!--", p, 4) == 0)
+		{
+			p = strstr (p + 4, "-->");
+			if (p == NULL)
+				return (-1);
+			p += 3;
+			continue;
+		}
+		else if ((p[1] == '?') || (p[1] == '!'))
+		{
+			p = strchr (p, '>');
+			if (p == NULL)
+				return (-1);
+			p++;
+			continue;
+		}
+		else if (p[1] == '/')
+		{
+			char *text_end = p;
+
+			p = strchr (p, '>');
+			if ((p == NULL) || (doc->depth <= 0))
+				return (-1);
+			p++;
+
+			e = doc->depth - 1;
+			if (!stack[e].children)
+			{
+				value = fs_xml_text (stack[e].text, text_end, &value_len);
+				if (fs_doc_add_field (doc, value, value_len) != 0)
+					return (-1);
+			}
+			fs_doc_leave (doc);
+			fs_doc_path_pop (doc, stack[e].path_len);
+			continue;
+		}
+
+		/* Start tag */
+		name = ++p;
+		while ((*p != 0) && !isspace ((int) *p) && (*p != '>') && (*p != '/'))
+			p++;
+		if ((p == name) || (doc->depth >= FS_DOC_MAX_DEPTH))
+			return (-1);
+
+		if (doc->depth > 0)
+			stack[doc->depth - 1].children = 1;
+		e = doc->depth;
+		stack[e].children = 0;
+		if ((fs_doc_path_push (doc, name, (size_t) (p - name),
+						&stack[e].path_len) != 0)
+				|| (fs_doc_enter (doc, /* may_be_row = */ 1) != 0))
+			return (-1);
+
+		/* Attributes */
+		while (42)
+		{
+			char attr[DATA_MAX_NAME_LEN];
+			char *attr_name;
+			char *attr_end;
+			size_t old_len;
+			char quote;
+
+			while (isspace ((int) *p))
+				p++;
+
+			if (*p == '>')
+			{
+				stack[e].text = ++p;
+				break;
+			}
+			else if ((p[0] == '/') && (p[1] == '>'))
+			{
+				/* Empty element: The slash is overwritten by the value's
+				 * terminating null byte. */
+				if (fs_doc_add_field (doc, p, 0) != 0)
+					return (-1);
+				p += 2;
+				fs_doc_leave (doc);
+				fs_doc_path_pop (doc, stack[e].path_len);
+				break;
+			}
+
+			attr_name = p;
+			while ((*p != 0) && (*p != '=') && !isspace ((int) *p)
+					&& (*p != '>') && (*p != '/'))
+				p++;
+			if (p == attr_name)
+				return (-1);
+			ssnprintf (attr, sizeof (attr), "@%.*s",
+					(int) (p - attr_name), attr_name);
+
+			while (isspace ((int) *p))
+				p++;
+			if (*p != '=')
+				return (-1);
+			p++;
+			while (isspace ((int) *p))
+				p++;
+
+			quote = *p;
+			if ((quote != '"') && (quote != '\''))
+				return (-1);
+			attr_end = strchr (p + 1, quote);
+			if (attr_end == NULL)
+				return (-1);
+
+			value = fs_xml_text (p + 1, attr_end, &value_len);
+			if ((fs_doc_path_push (doc, attr, strlen (attr), &old_len) != 0)
+					|| (fs_doc_add_field (doc, value, value_len) != 0))
+				return (-1);
+			fs_doc_path_pop (doc, old_len);
+
+			p = attr_end + 1;
+		} /* while (42) */
+	} /* while (*p != 0) */
+
+	return (0);
+} /* int fs_xml_parse */
+
+static int fs_delimited_parse (fs_doc_t *doc, char *p, char delimiter)
+{
+	size_t *columns = NULL;
+	size_t columns_num = 0;
+	size_t columns_size = 0;
+	int header = 1;
+	int status = 0;
+
+	while ((*p != 0) && (status == 0))
+	{
+		char *line = p;
+		char *line_end;
+		char *field;
+		size_t i;
+
+		line_end = strchr (line, '\n');
+		if (line_end == NULL)
+			line_end = line + strlen (line);
+		p = (*line_end != 0) ? (line_end + 1) : line_end;
+
+		if ((line_end > line) && (line_end[-1] == '\r'))
+			line_end--;
+		*line_end = 0;
+
+		if (line == line_end)
+		{
+			/* Skip empty lines before the header, stop at the first one
+			 * after it. */
+			if (header)
+				continue;
+			break;
+		}
+
+		if (!header && (fs_doc_begin_row (doc) != 0))
+		{
+			status = -1;
+			break;
+		}
+
+		field = line;
+		for (i = 0; field != NULL; i++)
+		{
+			char *field_end;
+			size_t field_len;
+
+			field_end = strchr (field, delimiter);
+			field_len = (field_end != NULL)
+				? (size_t) (field_end - field) : (size_t) (line_end - field);
+
+			if (header)
+			{
+				size_t *tmp;
+
+				tmp = fs_doc_grow (columns, &columns_size, columns_num,
+						sizeof (*columns));
+				if (tmp == NULL)
+				{
+					status = -1;
+					break;
+				}
+				columns = tmp;
+
+				columns[columns_num] = fs_doc_add_name (doc, field, field_len);
+				if (columns[columns_num] == ((size_t) -1))
+				{
+					status = -1;
+					break;
+				}
+				columns_num++;
+			}
+			else if (i < columns_num)
+			{
+				if (fs_doc_add_named_field (doc, columns[i], field,
+							field_len) != 0)
+				{
+					status = -1;
+					break;
+				}
+			}
+
+			field = (field_end != NULL) ? (field_end + 1) : NULL;
+		} /* for (i = 0; field != NULL; i++) */
+
+		header = 0;
+	} /* while (*p != 0) */
+
+	sfree (columns);
+	return (status);
+} /* int fs_delimited_parse */
+
+/* Returns the value of the field `name' in row `row'. Rows of one output
+ * usually have the same layout, so the position of the field in the previous
+ * row (`*hint') is tried first. */
+static const char *fs_doc_row_get (const fs_doc_t *doc, size_t row,
+		const char *name, size_t *hint)
+{
+	size_t first;
+	size_t last;
+	size_t i;
+
+	first = doc->rows[row];
+	last = ((row + 1) < doc->rows_num) ? doc->rows[row + 1] : doc->fields_num;
+
+	if (((first + *hint) < last)
+			&& (strcmp (doc->names + doc->fields[first + *hint].name, name) == 0))
+		return (doc->fields[first + *hint].value);
+
+	for (i = first; i < last; i++)
+	{
+		if (strcmp (doc->names + doc->fields[i].name, name) != 0)
+			continue;
+
+		*hint = i - first;
+		return (doc->fields[i].value);
+	}
+
+	return (NULL);
+} /* const char *fs_doc_row_get */
+
+static void fs_aggregate_add (fs_aggregate_t *agg, gauge_t value)
+{
+	if ((agg->count == 0) || (value < agg->min))
+		agg->min = value;
+	if ((agg->count == 0) || (value > agg->max))
+		agg->max = value;
+	agg->sum += value;
+	agg->last = value;
+	agg->count++;
+} /* void fs_aggregate_add */
+
+static fs_aggregate_t *fs_aggregate_group (fs_match_t *fm, const char *name)
+{
+	fs_aggregate_t *agg;
+
+	if (c_avl_get (fm->groups, name, (void *) &agg) == 0)
+		return (agg);
+
+	agg = (fs_aggregate_t *) malloc (sizeof (*agg));
+	if (agg == NULL)
+	{
+		ERROR ("freeswitch plugin: malloc failed.");
+		return (NULL);
+	}
+	memset (agg, 0, sizeof (*agg));
+
+	agg->name = strdup (name);
+	if (agg->name == NULL)
+	{
+		ERROR ("freeswitch plugin: strdup failed.");
+		sfree (agg);
+		return (NULL);
+	}
+
+	if (c_avl_insert (fm->groups, agg->name, agg) != 0)
+	{
+		ERROR ("freeswitch plugin: c_avl_insert failed.");
+		sfree (agg->name);
+		sfree (agg);
+		return (NULL);
+	}
+
+	return (agg);
+} /* fs_aggregate_t *fs_aggregate_group */
+
+static void fs_submit_aggregate (const fs_server_t *srv,
+		const fs_command_t *fc, const fs_match_t *fm,
+		const fs_aggregate_t *agg)
+{
+	char type_instance[DATA_MAX_NAME_LEN];
+	value_t value;
+	gauge_t g;
+
+	if ((agg->count == 0) && (fm->aggregate != FS_AGGREGATE_COUNT)
+			&& (fm->aggregate != FS_AGGREGATE_SUM))
+		return;
+
+	switch (fm->aggregate)
+	{
+		case FS_AGGREGATE_COUNT:   g = (gauge_t) agg->count; break;
+		case FS_AGGREGATE_SUM:     g = agg->sum; break;
+		case FS_AGGREGATE_MIN:     g = agg->min; break;
+		case FS_AGGREGATE_MAX:     g = agg->max; break;
+		case FS_AGGREGATE_AVERAGE: g = agg->sum / (gauge_t) agg->count; break;
+		default:                   g = agg->last; break;
+	}
+
+	if (fm->dstype & UTILS_MATCH_DS_TYPE_COUNTER)
+		value.counter = (counter_t) g;
+	else
+		value.gauge = g;
+
+	if (agg->name == NULL)
+		sstrncpy (type_instance, fm->instance, sizeof (type_instance));
+	else if (fm->instance == NULL)
+		sstrncpy (type_instance, agg->name, sizeof (type_instance));
+	else
+		ssnprintf (type_instance, sizeof (type_instance), "%s-%s",
+				fm->instance, agg->name);
+	escape_slashes (type_instance, sizeof (type_instance));
+
+	fs_submit (srv, fc, fm->type, type_instance, value);
+} /* void fs_submit_aggregate */
+
+static void fs_command_apply_structured (fs_server_t *srv, fs_command_t *fc)
+{
+	fs_doc_t doc;
+	fs_match_t *fm;
+	size_t i;
+	int status;
+
+	memset (&doc, 0, sizeof (doc));
+	doc.row_depth = -1;
+	doc.rows_path = fc->rows;
+
+	if ((fc->format != FS_FORMAT_DELIMITED)
+			&& ((fc->rows == NULL) || (fc->rows[0] == 0)))
+	{
+		/* The whole document is one row. */
+		doc.rows_path = NULL;
+		doc.row_depth = 0;
+		status = fs_doc_begin_row (&doc);
+		if (status != 0)
+		{
+			fs_doc_free (&doc);
+			return;
+		}
+	}
+
+	if (fc->format == FS_FORMAT_JSON)
+		status = fs_json_parse (&doc, fc->buffer);
+	else if (fc->format == FS_FORMAT_XML)
+		status = fs_xml_parse (&doc, fc->buffer);
+	else
+		status = fs_delimited_parse (&doc, fc->buffer, fc->delimiter);
+
+	if (status != 0)
+	{
+		WARNING ("freeswitch plugin: Parsing the output of `%s' failed.",
+				fc->line);
+		fs_doc_free (&doc);
+		return;
+	}
+
+	for (i = 0; i < doc.fields_num; i++)
+		doc.fields[i].value[doc.fields[i].value_len] = 0;
+
+	for (fm = fc->matches; fm != NULL; fm = fm->next)
+		memset (&fm->total, 0, sizeof (fm->total));
+
+	for (i = 0; i < doc.rows_num; i++)
+	{
+		for (fm = fc->matches; fm != NULL; fm = fm->next)
+		{
+			const char *value = NULL;
+			fs_aggregate_t *agg = &fm->total;
+			gauge_t g = 0.0;
+
+			if (fm->field != NULL)
+			{
+				value = fs_doc_row_get (&doc, i, fm->field, &fm->field_hint);
+				if (value == NULL)
+					continue;
+			}
+
+			if (fm->group_by != NULL)
+			{
+				const char *group;
+
+				group = fs_doc_row_get (&doc, i, fm->group_by, &fm->group_hint);
+				if ((group == NULL) || (group[0] == 0))
+					continue;
+
+				agg = fs_aggregate_group (fm, group);
+				if (agg == NULL)
+					continue;
+			}
+
+			if ((value != NULL) && (fm->aggregate != FS_AGGREGATE_COUNT))
+			{
+				char *endptr = NULL;
+
+				g = strtod (value, &endptr);
+				if (endptr == value)
+					continue;
+			}
+
+			fs_aggregate_add (agg, g);
+		} /* for (fm = fc->matches; fm != NULL; fm = fm->next) */
+	} /* for (i = 0; i < doc.rows_num; i++) */
+
+	fs_doc_free (&doc);
+
+	for (fm = fc->matches; fm != NULL; fm = fm->next)
+	{
+		void *key;
+		void *value;
+
+		if (fm->group_by == NULL)
+		{
+			fs_submit_aggregate (srv, fc, fm, &fm->total);
+			continue;
+		}
+
+		/* The key is part of the value, so only the value is freed. */
+		while (c_avl_pick (fm->groups, &key, &value) == 0)
+		{
+			fs_aggregate_t *agg = value;
+
+			fs_submit_aggregate (srv, fc, fm, agg);
+			sfree (agg->name);
+			sfree (agg);
+		}
+	}
+} /* void fs_command_apply_structured */
+
+/* Runs all matches of `fc' over `body', the output of the command. */
+static void fs_command_apply (fs_server_t *srv, fs_command_t *fc,
+		const char *body)
+{
+	fs_match_t *fm;
+	int status;
+
+	fc->buffer_fill = 0;
+
+	if (body == NULL)
+		return;
+
+	sfree (fc->buffer);
+	fc->buffer = strdup (body);
+	if (fc->buffer == NULL)
+	{
+		ERROR ("freeswitch plugin: strdup failed.");
+		return;
+	}
+	fc->buffer_size = strlen (fc->buffer);
+	fc->buffer_fill = 1;
+
+	if (fc->format != FS_FORMAT_REGEX)
+	{
+		fs_command_apply_structured (srv, fc);
+		return;
+	}
+
+	for (fm = fc->matches; fm != NULL; fm = fm->next)
+	{
+		cu_match_value_t *mv;
+
+		status = match_apply (fm->match, fc->buffer);
+		if (status != 0)
+		{
+			WARNING ("freeswitch plugin: match_apply failed.");
 			continue;
 		}
 
@@ -459,81 +2373,508 @@ static int fs_read_command (fs_command_t *fc)
 			continue;
 		}
 
-		fs_submit (fc, fm, mv);
+		fs_submit (srv, fc, fm->type, fm->instance, mv->value);
 	} /* for (fm = fc->matches; fm != NULL; fm = fm->next) */
+} /* void fs_command_apply */
+
+static int fs_read_command (fs_server_t *srv, fs_command_t *fc)
+{
+	char *line;
+	size_t line_len;
+	esl_status_t status;
+
+	line_len = strlen (fc->line) + 3;
+	line = (char *) malloc (line_len);
+	if (line == NULL)
+	{
+		ERROR ("freeswitch plugin: malloc failed.");
+		return (-1);
+	}
+	ssnprintf (line, line_len, "%s\n\n", fc->line);
+	status = esl_send_recv (&srv->handle, line);
+	sfree (line);
+
+	if (status != ESL_SUCCESS)
+	{
+		WARNING ("freeswitch plugin: Command `%s' failed on %s:%s.",
+				fc->line, srv->host, srv->port);
+		fc->buffer_fill = 0;
+		return (-1);
+	}
+
+	if (srv->handle.last_sr_event != NULL)
+		fs_command_apply (srv, fc, srv->handle.last_sr_event->body);
+	else
+		fc->buffer_fill = 0;
 
 	return (0);
 } /* int fs_read_command */
 
-static int fs_read (void)
+static int fs_command_is_api (const fs_command_t *fc)
+{
+	return (strncasecmp ("api ", fc->line, 4) == 0);
+} /* int fs_command_is_api */
+
+static uint64_t fs_time_ms (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, /* timezone = */ NULL);
+	return (((uint64_t) tv.tv_sec) * 1000 + (uint64_t) (tv.tv_usec / 1000));
+} /* uint64_t fs_time_ms */
+
+static int fs_reply_push (fs_server_t *srv, fs_command_t *fc)
+{
+	fs_reply_t *r;
+
+	r = (fs_reply_t *) malloc (sizeof (*r));
+	if (r == NULL)
+	{
+		ERROR ("freeswitch plugin: malloc failed.");
+		return (-1);
+	}
+	r->command = fc;
+	r->seq = fc->job_seq;
+	r->next = NULL;
+
+	if (srv->replies_tail == NULL)
+		srv->replies_head = r;
+	else
+		srv->replies_tail->next = r;
+	srv->replies_tail = r;
+
+	return (0);
+} /* int fs_reply_push */
+
+/* Returns the command the next reply belongs to, or NULL if the command has
+ * given up on the reply already. */
+static fs_command_t *fs_reply_pop (fs_server_t *srv)
+{
+	fs_reply_t *r;
+	fs_command_t *fc;
+
+	r = srv->replies_head;
+	if (r == NULL)
+		return (NULL);
+
+	srv->replies_head = r->next;
+	if (srv->replies_head == NULL)
+		srv->replies_tail = NULL;
+
+	fc = r->command;
+	if ((fc->job_state != FS_JOB_QUEUED) || (fc->job_seq != r->seq))
+		fc = NULL;
+
+	sfree (r);
+	return (fc);
+} /* fs_command_t *fs_reply_pop */
+
+static void fs_reply_clear (fs_server_t *srv)
+{
+	while (srv->replies_head != NULL)
+		fs_reply_pop (srv);
+} /* void fs_reply_clear */
+
+/* Handles one message received on the command connection. Returns the number
+ * of jobs which are finished because of it (zero or one). */
+static int fs_handle_job_message (fs_server_t *srv)
 {
+	const char *content_type;
 	fs_command_t *fc;
 
-	for (fc = fs_commands_g; fc != NULL; fc = fc->next)
-		fs_read_command (fc);
+	if (srv->handle.last_event == NULL)
+		return (0);
+
+	content_type = esl_event_get_header (srv->handle.last_event, "Content-Type");
+	if (content_type == NULL)
+		return (0);
+
+	if (strcasecmp ("command/reply", content_type) == 0)
+	{
+		const char *reply;
+		const char *uuid;
+
+		fc = fs_reply_pop (srv);
+		if (fc == NULL)
+			return (0);
+
+		reply = esl_event_get_header (srv->handle.last_event, "Reply-Text");
+		uuid = esl_event_get_header (srv->handle.last_event, "Job-UUID");
+		if ((uuid == NULL) && (reply != NULL)
+				&& (strncmp ("+OK Job-UUID: ", reply, 14) == 0))
+			uuid = reply + 14;
+
+		if ((reply == NULL) || (strncmp ("+OK", reply, 3) != 0) || (uuid == NULL))
+		{
+			WARNING ("freeswitch plugin: Command `%s' failed: %s",
+					fc->line, (reply != NULL) ? reply : "no reply text");
+			fc->job_state = FS_JOB_IDLE;
+			return (1);
+		}
+
+		sstrncpy (fc->job_uuid, uuid, sizeof (fc->job_uuid));
+		fc->job_state = FS_JOB_RUNNING;
+		return (0);
+	}
+	else if ((strcasecmp ("text/event-plain", content_type) == 0)
+			&& (srv->handle.last_ievent != NULL))
+	{
+		esl_event_t *event = srv->handle.last_ievent;
+		const char *uuid;
+		int finished = 0;
+
+		uuid = esl_event_get_header (event, "Job-UUID");
+		if (uuid != NULL)
+		{
+			for (fc = srv->commands; fc != NULL; fc = fc->next)
+			{
+				if ((fc->job_state != FS_JOB_RUNNING)
+						|| (strcmp (fc->job_uuid, uuid) != 0))
+					continue;
+
+				fs_command_apply (srv, fc, event->body);
+				fc->job_state = FS_JOB_IDLE;
+				finished = 1;
+				break;
+			}
+		}
+
+		esl_event_safe_destroy (&srv->handle.last_ievent);
+		return (finished);
+	}
 
 	return (0);
-} /* int fs_read */
+} /* int fs_handle_job_message */
 
-/*
-static void *msg_thread_run(esl_thread_t *me, void *obj)
+static int fs_read_jobs (fs_server_t *srv)
+{
+	fs_command_t *fc;
+	uint64_t now;
+	int pending = 0;
+
+	/* Events queued while synchronous commands were running are results of
+	 * jobs we have given up on. */
+	esl_event_safe_destroy (&srv->handle.race_event);
+
+	now = fs_time_ms ();
+	for (fc = srv->commands; fc != NULL; fc = fc->next)
+	{
+		char *line;
+		size_t line_len;
+		esl_status_t status;
+
+		if (!fs_command_is_api (fc))
+			continue;
+
+		/* "api foo" -> "bgapi foo" */
+		line_len = strlen (fc->line) + 5;
+		line = (char *) malloc (line_len);
+		if (line == NULL)
+		{
+			ERROR ("freeswitch plugin: malloc failed.");
+			continue;
+		}
+		ssnprintf (line, line_len, "bg%s\n\n", fc->line);
+
+		fc->job_seq = ++srv->job_seq;
+		if (fs_reply_push (srv, fc) != 0)
+		{
+			sfree (line);
+			continue;
+		}
+
+		status = esl_send (&srv->handle, line);
+		sfree (line);
+		if (status != ESL_SUCCESS)
+		{
+			WARNING ("freeswitch plugin: Sending `%s' to %s:%s failed.",
+					fc->line, srv->host, srv->port);
+			for (fc = srv->commands; fc != NULL; fc = fc->next)
+				fc->job_state = FS_JOB_IDLE;
+			fs_reply_clear (srv);
+			return (-1);
+		}
+
+		fc->job_state = FS_JOB_QUEUED;
+		fc->job_deadline = now + fc->timeout;
+		fc->job_uuid[0] = 0;
+		pending++;
+	} /* for (fc = srv->commands; fc != NULL; fc = fc->next) */
+
+	while (pending > 0)
+	{
+		uint64_t next_deadline = 0;
+		esl_status_t status;
+
+		now = fs_time_ms ();
+		for (fc = srv->commands; fc != NULL; fc = fc->next)
+		{
+			if (fc->job_state == FS_JOB_IDLE)
+				continue;
+
+			if (now >= fc->job_deadline)
+			{
+				WARNING ("freeswitch plugin: Command `%s' timed out after %i ms.",
+						fc->line, fc->timeout);
+				fc->job_state = FS_JOB_IDLE;
+				fc->buffer_fill = 0;
+				pending--;
+				continue;
+			}
+
+			if ((next_deadline == 0) || (fc->job_deadline < next_deadline))
+				next_deadline = fc->job_deadline;
+		}
+
+		if (pending <= 0)
+			break;
+
+		status = esl_recv_event_timed (&srv->handle,
+				(uint32_t) (next_deadline - now), /* check_q = */ 0,
+				/* save_event = */ NULL);
+		if (status == ESL_BREAK)
+			continue;
+		else if (status != ESL_SUCCESS)
+		{
+			ERROR ("freeswitch plugin: Receiving job results from %s:%s "
+					"failed: %s", srv->host, srv->port, srv->handle.err);
+			for (fc = srv->commands; fc != NULL; fc = fc->next)
+				fc->job_state = FS_JOB_IDLE;
+			fs_reply_clear (srv);
+			return (-1);
+		}
+
+		pending -= fs_handle_job_message (srv);
+	} /* while (pending > 0) */
+
+	return (0);
+} /* int fs_read_jobs */
+
+/* Receives the outstanding replies to "bgapi" commands which timed out.
+ * Synchronous commands take the next reply on the connection as theirs, so
+ * they must not run before these have arrived. If they don't arrive in time,
+ * the connection can't be used anymore. */
+static int fs_reply_drain (fs_server_t *srv)
 {
-	esl_handle_t *esl_handle = (esl_handle_t *) obj;
-	thread_running = 1;
+	uint64_t deadline;
 
-	// Maybe do some more in this loop later, like receive subscribed events,
-	// and create statistics of them
-	// see fs_cli.c function static void *msg_thread_run(), around line 198
-	while (thread_running && esl_handle->connected)
+	deadline = fs_time_ms () + FS_DRAIN_TIMEOUT;
+	while (srv->replies_head != NULL)
 	{
-		esl_status_t status = esl_recv_event_timed(esl_handle, 10, 1, NULL);
-		if (status == ESL_FAIL)
+		uint64_t now;
+		esl_status_t status;
+
+		now = fs_time_ms ();
+		if (now >= deadline)
+		{
+			WARNING ("freeswitch plugin: Replies of timed out commands "
+					"did not arrive from %s:%s.", srv->host, srv->port);
+			fs_reply_clear (srv);
+			return (-1);
+		}
+
+		status = esl_recv_event_timed (&srv->handle,
+				(uint32_t) (deadline - now), /* check_q = */ 0,
+				/* save_event = */ NULL);
+		if (status == ESL_BREAK)
+			continue;
+		else if (status != ESL_SUCCESS)
 		{
-			//DEBUG ("Disconnected [%s]\n", ESL_LOG_WARNING); // todo fixit
-			DEBUG ("Disconnected [%s]\n", "ESL_LOG_WARNING");
-			thread_running = 0;
+			fs_reply_clear (srv);
+			return (-1);
 		}
-		usleep(1000);
+
+		/* Results of jobs which timed out are discarded. */
+		fs_handle_job_message (srv);
 	}
 
-	thread_running = 0;
-	return (NULL);
-} */ /* void *msg_thread_run */
+	return (0);
+} /* int fs_reply_drain */
+
+/* Connects the command connection of `srv'. Failing servers are retried with
+ * an exponential backoff, so an unreachable server is neither hammered with
+ * connection attempts nor logged about in every interval. */
+static int fs_server_connect (fs_server_t *srv)
+{
+	time_t now;
+
+	now = time (NULL);
+	if (now < srv->next_connect)
+		return (-1);
+
+	if (esl_connect (&srv->handle, srv->host, atoi (srv->port), srv->pass)
+			!= ESL_SUCCESS)
+	{
+		c_complain (LOG_ERR, &srv->complaint, "freeswitch plugin: "
+				"Connecting to %s:%s failed: %s",
+				srv->host, srv->port, srv->handle.err);
+	}
+	/* Results of "bgapi" jobs are delivered as events. */
+	else if ((esl_events (&srv->handle, ESL_EVENT_TYPE_PLAIN, "BACKGROUND_JOB")
+				!= ESL_SUCCESS)
+			|| (strncmp ("+OK", srv->handle.last_sr_reply, 3) != 0))
+	{
+		c_complain (LOG_ERR, &srv->complaint, "freeswitch plugin: "
+				"Subscribing to BACKGROUND_JOB events on %s:%s failed: %s",
+				srv->host, srv->port, srv->handle.last_sr_reply);
+		esl_disconnect (&srv->handle);
+	}
+	else
+	{
+		c_release (LOG_INFO, &srv->complaint, "freeswitch plugin: "
+				"Connected to %s:%s.", srv->host, srv->port);
+		srv->reconnect_interval = 0;
+		srv->next_connect = 0;
+		return (0);
+	}
+
+	if (srv->reconnect_interval <= 0)
+		srv->reconnect_interval = FS_RECONNECT_MIN;
+	else if (srv->reconnect_interval < FS_RECONNECT_MAX)
+		srv->reconnect_interval *= 2;
+	if (srv->reconnect_interval > FS_RECONNECT_MAX)
+		srv->reconnect_interval = FS_RECONNECT_MAX;
+	srv->next_connect = now + srv->reconnect_interval;
 
-static int fs_init (void)
+	return (-1);
+} /* int fs_server_connect */
+
+static int fs_server_start_events (fs_server_t *srv)
 {
-	/* Set some default configuration variables */
-	if (fs_host == NULL) fs_host = FS_DEF_HOST;
-	if (fs_port == NULL) fs_port = FS_DEF_PORT;
-	if (fs_pass == NULL) fs_pass = FS_DEF_PASS;
+	int status;
 
-	/* Connect to FreeSWITCH over ESL */
-	DEBUG ("freeswitch plugin: making ESL connection to %s %s %s\n", fs_host, fs_port, fs_pass);
-	if (esl_connect(&esl_handle, fs_host, atoi(fs_port), fs_pass))
+	if (srv->profiles == NULL)
+		srv->profiles = c_avl_create ((void *) strcmp);
+	if (srv->causes == NULL)
+		srv->causes = c_avl_create ((void *) strcmp);
+	if ((srv->profiles == NULL) || (srv->causes == NULL))
 	{
-		ERROR ("freeswitch plugin: connection failed [%s]", esl_handle.err);
+		ERROR ("freeswitch plugin: c_avl_create failed.");
 		return (-1);
 	}
 
-	/* Start a seperate thread for incoming events here */
-	//esl_thread_create_detached(msg_thread_run, &esl_handle);
+	srv->event_loop = 0;
+	status = pthread_create (&srv->event_thread_id, /* attr = */ NULL,
+			fs_event_thread, /* arg = */ srv);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("freeswitch plugin: pthread_create failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+	srv->event_thread_running = 1;
 
-	return(0);
-} /* int fs_init */
+	return (0);
+} /* int fs_server_start_events */
 
-static int fs_shutdown (void)
+static int fs_read (user_data_t *ud)
 {
-	DEBUG ("freeswitch plugin: disconnecting");
-	if (esl_handle.connected) esl_disconnect(&esl_handle);
-	fs_command_free (fs_commands_g);
-	fs_commands_g = NULL;
+	fs_server_t *srv;
+	fs_command_t *fc;
+	int status = 0;
+
+	if ((ud == NULL) || (ud->data == NULL))
+	{
+		ERROR ("freeswitch plugin: fs_read: Invalid user data.");
+		return (-1);
+	}
+	srv = (fs_server_t *) ud->data;
+
+	if (srv->event_stats && (srv->event_thread_running == 0))
+		if (fs_server_start_events (srv) != 0)
+			return (-1);
+
+	if (srv->commands != NULL)
+	{
+		if (!srv->handle.connected)
+			fs_server_connect (srv);
+
+		/* Don't fail the read callback while the server is unreachable:
+		 * The daemon would back off on its own and the event statistics
+		 * would be skipped, too. */
+		if (srv->handle.connected)
+		{
+			status = fs_reply_drain (srv);
+
+			for (fc = srv->commands; (fc != NULL) && (status == 0);
+					fc = fc->next)
+			{
+				if (fs_command_is_api (fc))
+					continue;
+				status = fs_read_command (srv, fc);
+				if (status != 0)
+					break;
+			}
+
+			if (status == 0)
+				status = fs_read_jobs (srv);
+
+			if (status != 0)
+			{
+				WARNING ("freeswitch plugin: Lost connection to %s:%s, "
+						"reconnecting.", srv->host, srv->port);
+				esl_disconnect (&srv->handle);
+				/* Replies don't survive the connection. */
+				fs_reply_clear (srv);
+			}
+		}
+	}
+
+	if (srv->event_stats)
+		fs_read_events (srv);
+
 	return (0);
-} /* int fs_shutdown */
+} /* int fs_read */
+
+static void fs_stats_tree_free (c_avl_tree_t **tree)
+{
+	void *key;
+	void *value;
+
+	if (*tree == NULL)
+		return;
+
+	/* The key is part of the value, so only the value is freed. */
+	while (c_avl_pick (*tree, &key, &value) == 0)
+		sfree (value);
+
+	c_avl_destroy (*tree);
+	*tree = NULL;
+} /* void fs_stats_tree_free */
+
+static void fs_server_free (void *arg)
+{
+	fs_server_t *srv = arg;
+
+	if (srv == NULL)
+		return;
+
+	if (srv->event_thread_running != 0)
+	{
+		srv->event_loop++;
+		pthread_join (srv->event_thread_id, /* return = */ NULL);
+		srv->event_thread_running = 0;
+	}
+
+	DEBUG ("freeswitch plugin: disconnecting");
+	if (srv->handle.connected)
+		esl_disconnect (&srv->handle);
+	fs_reply_clear (srv);
+	fs_command_free (srv->commands);
+
+	fs_stats_tree_free (&srv->profiles);
+	fs_stats_tree_free (&srv->causes);
+	pthread_mutex_destroy (&srv->stats_lock);
+
+	sfree (srv->name);
+	sfree (srv->host);
+	sfree (srv->port);
+	sfree (srv->pass);
+	sfree (srv);
+} /* void fs_server_free */
 
 void module_register (void)
 {
 	plugin_register_complex_config ("freeswitch", fs_complex_config);
-	plugin_register_init ("freeswitch", fs_init);
-	plugin_register_read ("freeswitch", fs_read);
-	plugin_register_shutdown ("freeswitch", fs_shutdown);
 } /* void module_register */
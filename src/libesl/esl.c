@@ -390,6 +390,80 @@ static void sock_setup(esl_handle_t *handle)
 #endif
 }
 
+#define ESL_SOCK_BUF_INITIAL_SIZE 8192
+#define ESL_SOCK_BUF_READ_SIZE 4096
+
+static void sock_buf_reset(esl_handle_t *handle)
+{
+	handle->sock_buf_start = 0;
+	handle->sock_buf_end = 0;
+}
+
+static void sock_buf_free(esl_handle_t *handle)
+{
+	esl_safe_free(handle->sock_buf);
+	handle->sock_buf_size = 0;
+	sock_buf_reset(handle);
+}
+
+/* Reads at least one more byte from the socket into the read buffer, making
+ * room by compacting or growing the buffer first. Returns the number of bytes
+ * read, zero when the peer closed the connection or -1 on error. */
+static esl_ssize_t sock_buf_fill(esl_handle_t *handle)
+{
+	esl_ssize_t rrval;
+
+	if (handle->sock_buf_start > 0 && handle->sock_buf_size - handle->sock_buf_end < ESL_SOCK_BUF_READ_SIZE) {
+		memmove(handle->sock_buf, handle->sock_buf + handle->sock_buf_start, handle->sock_buf_end - handle->sock_buf_start);
+		handle->sock_buf_end -= handle->sock_buf_start;
+		handle->sock_buf_start = 0;
+	}
+
+	if (handle->sock_buf_size - handle->sock_buf_end < ESL_SOCK_BUF_READ_SIZE) {
+		size_t new_size = handle->sock_buf_size ? handle->sock_buf_size * 2 : ESL_SOCK_BUF_INITIAL_SIZE;
+		char *tmp;
+
+		if (!(tmp = realloc(handle->sock_buf, new_size))) {
+			snprintf(handle->err, sizeof(handle->err), "Memory Error");
+			return -1;
+		}
+
+		handle->sock_buf = tmp;
+		handle->sock_buf_size = new_size;
+	}
+
+	rrval = recv(handle->sock, handle->sock_buf + handle->sock_buf_end, handle->sock_buf_size - handle->sock_buf_end, 0);
+
+	if (rrval > 0) {
+		handle->sock_buf_end += rrval;
+	}
+
+	return rrval;
+}
+
+/* Returns a pointer to the blank line terminating the header block if the read
+ * buffer holds a complete one, NULL otherwise. */
+static char *sock_buf_header_end(esl_handle_t *handle, size_t offset)
+{
+	char *p, *e;
+
+	if (!handle->sock_buf || handle->sock_buf_end - handle->sock_buf_start < 2) {
+		return NULL;
+	}
+
+	p = handle->sock_buf + handle->sock_buf_start + offset;
+	e = handle->sock_buf + handle->sock_buf_end;
+
+	while (p < e && (p = memchr(p, '\n', e - p))) {
+		if (p + 1 < e && *(p + 1) == '\n') {
+			return p;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
 ESL_DECLARE(esl_status_t) esl_attach_handle(esl_handle_t *handle, esl_socket_t socket, struct sockaddr_in *addr)
 {
 	handle->sock = socket;
@@ -406,6 +480,7 @@ ESL_DECLARE(esl_status_t) esl_attach_handle(esl_handle_t *handle, esl_socket_t s
 		esl_mutex_create(&handle->mutex);
 	}
 
+	sock_buf_reset(handle);
 	handle->connected = 1;
 
 	sock_setup(handle);
@@ -637,6 +712,7 @@ ESL_DECLARE(esl_status_t) esl_connect(esl_handle_t *handle, const char *host, es
 
 	sock_setup(handle);
 
+	sock_buf_reset(handle);
 	handle->connected = 1;
 
 	if (esl_recv(handle)) {
@@ -697,12 +773,18 @@ ESL_DECLARE(esl_status_t) esl_disconnect(esl_handle_t *handle)
 		handle->sock = ESL_SOCK_INVALID;
 		status = ESL_SUCCESS;
 	}
-	
+
+	sock_buf_free(handle);
 	handle->connected = 0;
 
 	if (mutex) {
 		esl_mutex_unlock(mutex);
-		esl_mutex_destroy(&mutex);
+		/* Destroying fails while the mutex is still held further up the stack
+		 * (e.g. when called from esl_recv_event), keep it around in that case
+		 * so a later esl_connect() doesn't use a stale pointer. */
+		if (esl_mutex_destroy(&mutex) == ESL_SUCCESS) {
+			handle->mutex = NULL;
+		}
 	}
 
 
@@ -729,7 +811,24 @@ ESL_DECLARE(esl_status_t) esl_recv_event_timed(esl_handle_t *handle, uint32_t ms
 		return ESL_FAIL;
 	}
 
-	tv.tv_usec = ms * 1000;
+	/* A previous read may already have buffered a complete event, in which
+	 * case the socket might not become readable again. */
+	if (sock_buf_header_end(handle, 0)) {
+		if (esl_mutex_trylock(handle->mutex) != ESL_SUCCESS) {
+			return ESL_BREAK;
+		}
+
+		if (esl_recv_event(handle, check_q, save_event)) {
+			status = ESL_FAIL;
+		}
+
+		if (handle->mutex) esl_mutex_unlock(handle->mutex);
+
+		return status;
+	}
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
 
 
 	FD_ZERO(&rfds);
@@ -775,14 +874,14 @@ ESL_DECLARE(esl_status_t) esl_recv_event(esl_handle_t *handle, int check_q, esl_
 {
 	char *c;
 	esl_ssize_t rrval;
-	int crc = 0;
 	esl_event_t *revent = NULL, *qevent = NULL;
 	char *beg;
+	char *hend;
 	char *hname, *hval;
 	char *col;
 	char *cl;
 	esl_ssize_t len;
-	int zc = 0;
+	size_t scanned;
 
 	if (!handle->connected) {
 		return ESL_FAIL;
@@ -807,87 +906,97 @@ ESL_DECLARE(esl_status_t) esl_recv_event(esl_handle_t *handle, int check_q, esl_
 	}
 
 	esl_event_safe_destroy(&handle->last_event);
-	memset(handle->header_buf, 0, sizeof(handle->header_buf));
 
-	c = handle->header_buf;
-	beg = c;
+	/* Read until the buffer holds a complete header block. Most of the time a
+	 * single recv() returns the whole event (or several of them). */
+	scanned = 0;
+	while(!(hend = sock_buf_header_end(handle, scanned))) {
+		if (!handle->connected) {
+			goto fail;
+		}
+
+		if (handle->sock_buf_end - handle->sock_buf_start > 1) {
+			scanned = handle->sock_buf_end - handle->sock_buf_start - 1;
+		}
+
+		rrval = sock_buf_fill(handle);
 
-	while(handle->connected) {
-		rrval = recv(handle->sock, c, 1, 0);
 		if (rrval == 0) {
-			if (++zc >= 100) {
-				esl_disconnect(handle);
-				esl_mutex_unlock(handle->mutex);
-				return ESL_DISCONNECTED;
-			}
+			esl_disconnect(handle);
+			esl_mutex_unlock(handle->mutex);
+			return ESL_DISCONNECTED;
 		} else if (rrval < 0) {
 			strerror_r(handle->errnum, handle->err, sizeof(handle->err));
 			goto fail;
-		} else {
-			zc = 0;
-			
-			if (*c == '\n') {
-				if (++crc == 2) {
-					break;
-				}
-				
-				if (!revent) {
-					esl_event_create(&revent, ESL_EVENT_COMMAND);
-				}
-				
-				hname = beg;
-				hval = col = NULL;
-				
-				if (hname && (col = strchr(hname, ':'))) {
-					hval = col + 1;
-					*col = '\0';
-					while(*hval == ' ') hval++;
-				}
-			
-				*c = '\0';
-				
-				if (hname && hval) {
-					esl_url_decode(hval);
-					esl_log(ESL_LOG_DEBUG, "RECV HEADER [%s] = [%s]\n", hname, hval);
-					esl_event_add_header_string(revent, ESL_STACK_BOTTOM, hname, hval);
-				}
+		}
+	}
 
-				beg = c+1;
-				
-				
-			} else {
-				crc = 0;
-			}
+	/* Terminate the header block and consume it, including the blank line. */
+	*hend = '\0';
+	beg = handle->sock_buf + handle->sock_buf_start;
+	handle->sock_buf_start = (hend - handle->sock_buf) + 2;
 
-			c++;
+	esl_event_create(&revent, ESL_EVENT_COMMAND);
+
+	while(beg) {
+		if ((c = strchr(beg, '\n'))) {
+			*c = '\0';
 		}
-	}
-	
-	if (!revent) {
-		goto fail;
+
+		hname = beg;
+		hval = col = NULL;
+
+		if ((col = strchr(hname, ':'))) {
+			hval = col + 1;
+			*col = '\0';
+			while(*hval == ' ') hval++;
+		}
+
+		if (hval) {
+			esl_url_decode(hval);
+			esl_log(ESL_LOG_DEBUG, "RECV HEADER [%s] = [%s]\n", hname, hval);
+			esl_event_add_header_string(revent, ESL_STACK_BOTTOM, hname, hval);
+		}
+
+		beg = c ? c + 1 : NULL;
 	}
 
 	if ((cl = esl_event_get_header(revent, "content-length"))) {
 		char *body;
-		esl_ssize_t sofar = 0;
-		
+		esl_ssize_t sofar;
+
 		len = atol(cl);
 		body = malloc(len+1);
 		esl_assert(body);
 		*(body + len) = '\0';
-		
-		do {
+
+		/* Take whatever part of the body has already been read, then receive the
+		 * rest straight into the body so large replies don't grow the buffer. */
+		sofar = handle->sock_buf_end - handle->sock_buf_start;
+		if (sofar > len) {
+			sofar = len;
+		}
+		memcpy(body, handle->sock_buf + handle->sock_buf_start, sofar);
+		handle->sock_buf_start += sofar;
+
+		while (sofar < len) {
 			esl_ssize_t r;
-			if ((r = recv(handle->sock, body + sofar, len - sofar, 0)) < 0) {
-				strerror_r(handle->errnum, handle->err, sizeof(handle->err));	
+			if ((r = recv(handle->sock, body + sofar, len - sofar, 0)) <= 0) {
+				strerror_r(handle->errnum, handle->err, sizeof(handle->err));
+				free(body);
+				esl_event_destroy(&revent);
 				goto fail;
 			}
 			sofar += r;
-		} while (sofar < len);
-		
+		}
+
 		revent->body = body;
 	}
 
+	if (handle->sock_buf_start == handle->sock_buf_end) {
+		sock_buf_reset(handle);
+	}
+
 	if (save_event) {
 		*save_event = revent;
 		revent = NULL;
@@ -939,9 +1048,9 @@ ESL_DECLARE(esl_status_t) esl_recv_event(esl_handle_t *handle, int check_q, esl_
 					esl_log(ESL_LOG_DEBUG, "RECV INNER HEADER [%s] = [%s]\n", hname, hval);
 					if (!strcasecmp(hname, "event-name")) {
 						esl_event_del_header(handle->last_ievent, "event-name");
+						esl_name_event(hval, &handle->last_ievent->event_id);
 					}
 					esl_event_add_header_string(handle->last_ievent, ESL_STACK_BOTTOM, hname, hval);
-					esl_name_event(hval, &handle->last_ievent->event_id);
 				}
 				
 				beg = c + 1;
@@ -958,7 +1067,7 @@ ESL_DECLARE(esl_status_t) esl_recv_event(esl_handle_t *handle, int check_q, esl_
 			
 			free(body);			
 
-			if (esl_log_level >= 7) {
+			if (esl_log != null_logger && esl_log_level >= 7) {
 				char *foo;
 				esl_event_serialize(handle->last_ievent, &foo, ESL_FALSE);
 				esl_log(ESL_LOG_DEBUG, "RECV EVENT\n%s\n", foo);
@@ -966,7 +1075,7 @@ ESL_DECLARE(esl_status_t) esl_recv_event(esl_handle_t *handle, int check_q, esl_
 			}
 		}
 		
-		if (esl_log_level >= 7) {
+		if (esl_log != null_logger && esl_log_level >= 7) {
 			char *foo;
 			esl_event_serialize(revent, &foo, ESL_FALSE);
 			esl_log(ESL_LOG_DEBUG, "RECV MESSAGE\n%s\n", foo);
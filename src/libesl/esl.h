@@ -263,7 +263,12 @@ typedef struct {
 	esl_socket_t sock;
 	char err[256];
 	int errnum;
-	char header_buf[4196];
+	/* Read buffer for the socket. Valid data lives in
+	 * sock_buf[sock_buf_start .. sock_buf_end). */
+	char *sock_buf;
+	size_t sock_buf_size;
+	size_t sock_buf_start;
+	size_t sock_buf_end;
 	char last_reply[1024];
 	char last_sr_reply[1024];
 	esl_event_t *last_event;
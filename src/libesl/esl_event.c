@@ -221,20 +221,125 @@ static unsigned int esl_ci_hashfunc_default(const char *char_key, esl_ssize_t *k
 }
 
 
+/* Headers, their names and values are carved out of a chain of blocks owned
+ * by the event, so adding a header doesn't need any malloc() in the common
+ * case and destroying an event frees everything at once. */
+struct esl_event_arena {
+	struct esl_event_arena *next;
+	size_t size;
+	size_t used;
+};
+
+#define ESL_EVENT_ARENA_ALIGN 16
+#define ESL_EVENT_ARENA_HDR_SIZE ((sizeof(esl_event_arena_t) + ESL_EVENT_ARENA_ALIGN - 1) & ~(ESL_EVENT_ARENA_ALIGN - 1))
+#define ESL_EVENT_ARENA_BLOCK_SIZE 8192
+#define ESL_EVENT_INDEX_MIN_SIZE 64
+
+static void *esl_event_arena_alloc(esl_event_t *event, size_t size)
+{
+	esl_event_arena_t *block = event->arena;
+	char *ptr;
+
+	size = (size + ESL_EVENT_ARENA_ALIGN - 1) & ~(ESL_EVENT_ARENA_ALIGN - 1);
+
+	if (!block || block->size - block->used < size) {
+		size_t bsize = ESL_EVENT_ARENA_BLOCK_SIZE;
+
+		if (block && block->size * 2 > bsize) {
+			bsize = block->size * 2;
+		}
+
+		if (bsize < size) {
+			bsize = size;
+		}
+
+		block = ALLOC(ESL_EVENT_ARENA_HDR_SIZE + bsize);
+		esl_assert(block);
+
+		block->size = bsize;
+		block->used = 0;
+		block->next = event->arena;
+		event->arena = block;
+	}
+
+	ptr = (char *) block + ESL_EVENT_ARENA_HDR_SIZE + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+static char *esl_event_arena_dup(esl_event_t *event, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return (char *) memcpy(esl_event_arena_alloc(event, len), s, len);
+}
+
+static void esl_event_arena_free(esl_event_t *event)
+{
+	esl_event_arena_t *block, *next;
+
+	for (block = event->arena; block; block = next) {
+		next = block->next;
+		FREE(block);
+	}
+
+	event->arena = NULL;
+}
+
+/* The index only references the header a linear walk of the list would find
+ * first, so lookups keep returning the same header as before. */
+static void esl_event_index_insert(esl_event_t *event, esl_event_header_t *header, int replace)
+{
+	size_t mask = event->index_size - 1;
+	size_t i;
+
+	for (i = header->hash & mask; event->index[i]; i = (i + 1) & mask) {
+		esl_event_header_t *hp = event->index[i];
+
+		if (hp->hash == header->hash && !strcasecmp(hp->name, header->name)) {
+			if (replace) {
+				event->index[i] = header;
+			}
+			return;
+		}
+	}
+
+	event->index[i] = header;
+	event->index_used++;
+}
+
+static void esl_event_index_rebuild(esl_event_t *event, size_t size)
+{
+	esl_event_header_t *hp;
+
+	FREE(event->index);
+	event->index_used = 0;
+	event->index_size = size;
+	event->index = calloc(size, sizeof(*event->index));
+	esl_assert(event->index);
+
+	for (hp = event->headers; hp; hp = hp->next) {
+		esl_event_index_insert(event, hp, 0);
+	}
+}
+
 ESL_DECLARE(char *)esl_event_get_header(esl_event_t *event, const char *header_name)
 {
 	esl_event_header_t *hp;
 	esl_ssize_t hlen = -1;
 	unsigned long hash = 0;
+	size_t mask, i;
 
 	esl_assert(event);
 
-	if (!header_name) return NULL;
+	if (!header_name || !event->index) return NULL;
 	
 	hash = esl_ci_hashfunc_default(header_name, &hlen);
-	
-	for (hp = event->headers; hp; hp = hp->next) {
-		if ((!hp->hash || hash == hp->hash) && !strcasecmp(hp->name, header_name) ) {
+	mask = event->index_size - 1;
+
+	for (i = hash & mask; (hp = event->index[i]); i = (i + 1) & mask) {
+		if (hash == hp->hash && !strcasecmp(hp->name, header_name)) {
 			return hp->value;
 		}
 	}
@@ -250,20 +355,21 @@ ESL_DECLARE(esl_status_t) esl_event_del_header(esl_event_t *event, const char *h
 {
 	esl_event_header_t *hp, *lp = NULL, *tp;
 	esl_status_t status = ESL_FAIL;
-	int x = 0;
 	esl_ssize_t hlen = -1;
 	unsigned long hash = 0;
 
+	if (!esl_event_get_header(event, header_name)) {
+		return ESL_FAIL;
+	}
+
+	hash = esl_ci_hashfunc_default(header_name, &hlen);
+
 	tp = event->headers;
 	while (tp) {
 		hp = tp;
 		tp = tp->next;
-		
-		x++;
-		esl_assert(x < 1000);
-		hash = esl_ci_hashfunc_default(header_name, &hlen);
 
-		if (hp->name && (!hp->hash || hash == hp->hash) && !strcasecmp(header_name, hp->name)) {
+		if (hash == hp->hash && !strcasecmp(header_name, hp->name)) {
 			if (lp) {
 				lp->next = hp->next;
 			} else {
@@ -272,33 +378,30 @@ ESL_DECLARE(esl_status_t) esl_event_del_header(esl_event_t *event, const char *h
 			if (hp == event->last_header || !hp->next) {
 				event->last_header = lp;
 			}
-			FREE(hp->name);
-			FREE(hp->value);
-			memset(hp, 0, sizeof(*hp));
-			FREE(hp);
-
+			/* The memory itself belongs to the arena. */
 			status = ESL_SUCCESS;
 		} else {
 			lp = hp;
 		}
 	}
 
+	/* Deleting is rare, so rather than keeping tombstones the index is rebuilt. */
+	esl_event_index_rebuild(event, event->index_size);
+
 	return status;
 }
 
-static esl_status_t esl_event_base_add_header(esl_event_t *event, esl_stack_t stack, const char *header_name, char *data)
+static esl_status_t esl_event_base_add_header(esl_event_t *event, esl_stack_t stack, const char *header_name, const char *data)
 {
 	esl_event_header_t *header;
 	esl_ssize_t hlen = -1;
 	
-	header = ALLOC(sizeof(*header));
-	esl_assert(header);
-
+	header = esl_event_arena_alloc(event, sizeof(*header));
 	memset(header, 0, sizeof(*header));
 
-	header->name = DUP(header_name);
-	header->value = data;
-	header->hash = esl_ci_hashfunc_default(header->name, &hlen);
+	header->hash = esl_ci_hashfunc_default(header_name, &hlen);
+	header->name = memcpy(esl_event_arena_alloc(event, hlen + 1), header_name, hlen + 1);
+	header->value = esl_event_arena_dup(event, data);
 	
 	if (stack == ESL_STACK_TOP) {
 		header->next = event->headers;
@@ -316,6 +419,13 @@ static esl_status_t esl_event_base_add_header(esl_event_t *event, esl_stack_t st
 		event->last_header = header;
 	}
 
+	/* Keep the load factor of the index below one half. */
+	if ((event->index_used + 1) * 2 > event->index_size) {
+		esl_event_index_rebuild(event, event->index_size ? event->index_size * 2 : ESL_EVENT_INDEX_MIN_SIZE);
+	} else {
+		esl_event_index_insert(event, header, stack == ESL_STACK_TOP);
+	}
+
 	return ESL_SUCCESS;
 }
 
@@ -333,13 +443,16 @@ ESL_DECLARE(esl_status_t) esl_event_add_header(esl_event_t *event, esl_stack_t s
 		return ESL_FAIL;
 	}
 
-	return esl_event_base_add_header(event, stack, header_name, data);
+	esl_event_base_add_header(event, stack, header_name, data);
+	free(data);
+
+	return ESL_SUCCESS;
 }
 
 ESL_DECLARE(esl_status_t) esl_event_add_header_string(esl_event_t *event, esl_stack_t stack, const char *header_name, const char *data)
 {
 	if (data) {
-		return esl_event_base_add_header(event, stack, header_name, DUP(data));
+		return esl_event_base_add_header(event, stack, header_name, data);
 	}
 	return ESL_FAIL;
 }
@@ -370,20 +483,13 @@ ESL_DECLARE(esl_status_t) esl_event_add_body(esl_event_t *event, const char *fmt
 ESL_DECLARE(void) esl_event_destroy(esl_event_t **event)
 {
 	esl_event_t *ep = *event, *this_event;
-	esl_event_header_t *hp, *this_header;
 
 	for (ep = *event ; ep ;) {
 		this_event = ep;
 		ep = ep->next;
 		
-		for (hp = this_event->headers; hp;) {
-			this_header = hp;
-			hp = hp->next;
-			FREE(this_header->name);
-			FREE(this_header->value);
-			memset(this_header, 0, sizeof(*this_header));
-			FREE(this_header);
-		}
+		esl_event_arena_free(this_event);
+		FREE(this_event->index);
 		FREE(this_event->body);
 		FREE(this_event->subclass_name);
 		memset(this_event, 0, sizeof(*this_event));
@@ -132,6 +132,8 @@ typedef enum {
 };
 
 
+typedef struct esl_event_arena esl_event_arena_t;
+
 /*! \brief Representation of an event */
 struct esl_event {
 	/*! the event id (descriptor) */
@@ -155,6 +157,14 @@ struct esl_event {
 	/*! unique key */
 	unsigned long key;
 	struct esl_event *next;
+	/*! memory backing the headers, their names and values; freed in one go */
+	esl_event_arena_t *arena;
+	/*! open addressing index of the headers, keyed by their hash */
+	esl_event_header_t **index;
+	/*! number of slots in the index (a power of two) */
+	size_t index_size;
+	/*! number of used slots in the index */
+	size_t index_used;
 };
 
 
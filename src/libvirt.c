@@ -649,7 +649,7 @@ init_value_list (value_list_t *vl, time_t t, virDomainPtr dom)
     char  *host_ptr;
     size_t host_len;
 
-    vl->time = t;
+    vl->time = TIME_T_TO_CDTIME_T (t);
     vl->interval = interval_g;
 
     sstrncpy (vl->plugin, "libvirt", sizeof (vl->plugin));
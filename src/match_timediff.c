@@ -34,14 +34,14 @@ struct mt_match_s;
 typedef struct mt_match_s mt_match_t;
 struct mt_match_s
 {
-  time_t future;
-  time_t past;
+  cdtime_t future;
+  cdtime_t past;
 };
 
 /*
  * internal helper functions
  */
-static int mt_config_add_time_t (time_t *ret_value, /* {{{ */
+static int mt_config_add_time_t (cdtime_t *ret_value, /* {{{ */
     oconfig_item_t *ci)
 {
 
@@ -52,7 +52,13 @@ static int mt_config_add_time_t (time_t *ret_value, /* {{{ */
     return (-1);
   }
 
-  *ret_value = (time_t) ci->values[0].value.number;
+  if (ci->values[0].value.number < 0.0)
+  {
+    ERROR ("timediff match: `%s' must not be negative.", ci->key);
+    return (-1);
+  }
+
+  *ret_value = DOUBLE_TO_CDTIME_T (ci->values[0].value.number);
 
   return (0);
 } /* }}} int mt_config_add_time_t */
@@ -132,13 +138,13 @@ static int mt_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
     notification_meta_t __attribute__((unused)) **meta, void **user_data)
 {
   mt_match_t *m;
-  time_t now;
+  cdtime_t now;
 
   if ((user_data == NULL) || (*user_data == NULL))
     return (-1);
 
   m = *user_data;
-  now = time (NULL);
+  now = cdtime ();
 
   if (m->future != 0)
   {
@@ -148,7 +154,7 @@ static int mt_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
 
   if (m->past != 0)
   {
-    if (vl->time <= (now - m->past))
+    if ((vl->time + m->past) <= now)
       return (FC_MATCH_MATCHES);
   }
 
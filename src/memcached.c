@@ -169,12 +169,14 @@ static int memcached_query_daemon (char *buffer, int buffer_size) /* {{{ */
 		p.events = POLLIN | POLLERR | POLLHUP;
 		p.revents = 0;
 
-		status = poll (&p, /* nfds = */ 1, /* timeout = */ 1000 * interval_g);
+		status = poll (&p, /* nfds = */ 1,
+				/* timeout = */ (int) CDTIME_T_TO_MS (interval_g));
 		if (status <= 0)
 		{
 			if (status == 0)
 			{
-				ERROR ("memcached: poll(2) timed out after %i seconds.", interval_g);
+				ERROR ("memcached: poll(2) timed out after %.3f seconds.",
+						CDTIME_T_TO_DOUBLE (interval_g));
 			}
 			else
 			{
@@ -295,7 +297,7 @@ static void submit_counter2 (const char *type, const char *type_inst,
 
 	vl.values = values;
 	vl.values_len = 2;
-	vl.time = time (NULL);
+	vl.time = cdtime ();
 	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
 	sstrncpy (vl.plugin, "memcached", sizeof (vl.plugin));
 	sstrncpy (vl.type, type, sizeof (vl.type));
@@ -316,7 +318,7 @@ static void submit_gauge (const char *type, const char *type_inst,
 
 	vl.values = values;
 	vl.values_len = 1;
-	vl.time = time (NULL);
+	vl.time = cdtime ();
 	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
 	sstrncpy (vl.plugin, "memcached", sizeof (vl.plugin));
 	sstrncpy (vl.type, type, sizeof (vl.type));
@@ -338,7 +340,7 @@ static void submit_gauge2 (const char *type, const char *type_inst,
 
 	vl.values = values;
 	vl.values_len = 2;
-	vl.time = time (NULL);
+	vl.time = cdtime ();
 	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
 	sstrncpy (vl.plugin, "memcached", sizeof (vl.plugin));
 	sstrncpy (vl.type, type, sizeof (vl.type));
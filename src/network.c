@@ -19,11 +19,17 @@
  *   Florian octo Forster <octo at verplant.org>
  **/
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE /* recvmmsg(2), sendmmsg(2) */
+#endif
+
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
 #include "configfile.h"
-#include "utils_avltree.h"
+#include "utils_complain.h"
+#include "utils_ident.h"
+#include "utils_spool.h"
 
 #include "network.h"
 
@@ -42,12 +48,20 @@
 #if HAVE_ARPA_INET_H
 # include <arpa/inet.h>
 #endif
+#if HAVE_NETINET_TCP_H
+# include <netinet/tcp.h>
+#endif
 #if HAVE_POLL_H
 # include <poll.h>
 #endif
 
 #if HAVE_GCRYPT_H
 # include <gcrypt.h>
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+#endif
+
+#if HAVE_ZLIB_H
+# include <zlib.h>
 #endif
 
 /* 1500 - 40 - 8  =  Ethernet packet - IPv6 header - UDP header */
@@ -61,8 +75,23 @@
 # endif
 #endif /* !IP_ADD_MEMBERSHIP */
 
-/* Buffer size to allocate. */
+/* Default and minimum packet size, see the `MaxPacketSize' option. */
 #define BUFF_SIZE 1024
+/* Largest UDP payload possible with IPv4. */
+#define BUFF_SIZE_MAX 65507
+
+/* Maximum number of packets read from a socket with one system call. */
+#define RECEIVE_BATCH_SIZE 32
+
+/* Maximum number of value lists and values collected by a dispatch thread
+ * before dispatching them, see `parse_batch_t'. */
+#define PARSE_BATCH_SIZE 64
+#define PARSE_BATCH_VALUES 512
+
+/* Maximum number of full packets collected before sending them with one
+ * system call per socket, and the maximum time the first of them waits. */
+#define SEND_BATCH_SIZE 8
+#define SEND_BATCH_DELAY TIME_T_TO_CDTIME_T (1)
 
 /*
  * Maximum size required for encryption / signing:
@@ -75,15 +104,102 @@
  */
 #define BUFF_SIG_SIZE 57
 
+/* Default size of the spool of a stream server, see the `SpoolSize' option. */
+#define STREAM_SPOOL_SIZE (8 * 1024 * 1024)
+/* Default size of the disk spool, see the `SpoolDiskSize' option. */
+#define STREAM_SPOOL_DISK_SIZE (256 * 1024 * 1024)
+/* Maximum number of frames written with one system call. */
+#define STREAM_IOV_MAX 64
+/* Reconnecting to a stream server is tried after this delay, which is doubled
+ * after each failure up to STREAM_RECONNECT_MAX. */
+#define STREAM_RECONNECT_MIN TIME_T_TO_CDTIME_T (1)
+#define STREAM_RECONNECT_MAX TIME_T_TO_CDTIME_T (60)
+
 /*
  * Private data types
  */
+
+/* On stream (TCP) sockets, each packet is preceded by its length as a 32 bit
+ * unsigned integer in network byte order. */
+#define STREAM_FRAME_HEADER_SIZE 4
+
+/* A packet waiting to be sent to a stream server, including its length. */
+struct stream_frame_s
+{
+	char   *data;
+	size_t  size;
+	struct stream_frame_s *next;
+};
+typedef struct stream_frame_s stream_frame_t;
+
+/* Connection state of a stream server. Packets which cannot be written right
+ * away, because the server is not connected or doesn't read fast enough, are
+ * kept in the spool, up to `spool_max' bytes. Only complete frames are
+ * spooled: If the connection breaks, the frame at the head of the spool is
+ * sent again, from the beginning, on the next connection.
+ *
+ * If a spool directory is configured, packets which don't fit into the spool
+ * go to the disk spool instead. Once it holds any packets, all new packets are
+ * appended to it, so they are sent in order: The (memory) spool is sent first,
+ * then the disk spool, at up to `replay_rate' packets per second. */
+struct sockent_stream_s
+{
+	pthread_mutex_t  lock;
+	int              family;
+
+	cdtime_t         reconnect_next;
+	cdtime_t         reconnect_delay;
+
+	stream_frame_t  *spool_head;
+	stream_frame_t  *spool_tail;
+	size_t           spool_size;
+	size_t           spool_max;
+	/* Bytes of `spool_head' written to the current connection. */
+	size_t           spool_head_sent;
+
+	spool_t         *disk;
+	/* Bytes of the oldest record of `disk' written to the current
+	 * connection, including the frame header. */
+	size_t           disk_head_sent;
+	/* Packets per second, zero means unlimited. */
+	double           replay_rate;
+	double           replay_tokens;
+	cdtime_t         replay_last;
+
+	/* "node:service", for log messages. */
+	char             name[256];
+	c_complain_t     complaint;
+	c_complain_t     spool_complaint;
+	c_complain_t     disk_complaint;
+};
+typedef struct sockent_stream_s sockent_stream_t;
+
+/* Options of a stream server, set in its `Server' block. */
+struct stream_options_s
+{
+	size_t  spool_size;
+	char   *spool_dir;
+	size_t  spool_disk_size;
+	double  replay_rate;
+};
+typedef struct stream_options_s stream_options_t;
+
 typedef struct sockent
 {
 	int                      fd;
 	struct sockaddr_storage *addr;
 	socklen_t                addrlen;
 
+	/* SOCK_DGRAM or SOCK_STREAM. */
+	int                      type;
+	/* Connection and spool of a server using a stream socket. NULL for
+	 * datagram sockets and listening sockets. */
+	sockent_stream_t        *stream;
+
+	/* Number of packets dropped by the kernel on this (listening) socket,
+	 * as last reported via the `SO_RXQ_OVFL' socket option. */
+	uint32_t                 rx_dropped;
+
 #define SECURITY_LEVEL_NONE     0
 #if HAVE_GCRYPT_H
 # define SECURITY_LEVEL_SIGN    1
@@ -91,7 +207,6 @@ typedef struct sockent
 	int security_level;
 	char *shared_secret;
 	unsigned char shared_secret_hash[32];
-	gcry_cipher_hd_t cypher;
 #endif /* HAVE_GCRYPT_H */
 
 	struct sockent          *next;
@@ -206,218 +321,705 @@ struct part_encryption_aes256_s
 };
 typedef struct part_encryption_aes256_s part_encryption_aes256_t;
 
+/*                      1 1 1 1 1 1 1 1 1 1 2 2 2 2 2 2 2 2 2 2 3 3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-------------------------------+-------------------------------+
+ * ! Type                          ! Length                        !
+ * +-------------------------------+-------------------------------+
+ * ! Original length               ! Raw deflate data ...          !
+ * +-------------------------------+                               !
+ * : :                                                             :
+ * +---------------------------------------------------------------+
+ *
+ * The deflate data is a sequence of blocks, each ended with a sync flush,
+ * which decompress to a sequence of parts with a total size of `Original
+ * length' bytes.
+ */
+#define PART_COMPRESS_ZLIB_SIZE 6
+#define PART_COMPRESS_ZLIB_ORIG_MAX 65535
+struct part_compress_zlib_s
+{
+  part_header_t head;
+  uint16_t orig_length;
+};
+typedef struct part_compress_zlib_s part_compress_zlib_t;
+
 struct receive_list_entry_s
 {
-  char data[BUFF_SIZE];
+  char *data;
   int  data_len;
-  int  fd;
+  sockent_t *se;
   struct receive_list_entry_s *next;
 };
 typedef struct receive_list_entry_s receive_list_entry_t;
 
+/* Received packets are distributed to the dispatch threads by the sender's
+ * address, so values from one host are always handled, in order, by the same
+ * thread. Each dispatch thread has its own queue. */
+struct receive_queue_s
+{
+  receive_list_entry_t *head;
+  receive_list_entry_t *tail;
+  int length;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  pthread_t thread;
+  int thread_running;
+
+  /* Packets received for this queue which have not been appended to it yet.
+   * Only used by the receive thread. */
+  receive_list_entry_t *private_head;
+  receive_list_entry_t *private_tail;
+  int private_num;
+};
+typedef struct receive_queue_s receive_queue_t;
+
+/* Value lists parsed by a dispatch thread and not dispatched yet. They are
+ * handed to `plugin_dispatch_values_batch' together, once the batch is full
+ * or the thread has parsed a batch of packets. The values of all lists are
+ * decoded into `values', so parsing doesn't allocate memory. */
+struct parse_batch_s
+{
+  value_list_t vls[PARSE_BATCH_SIZE];
+  int vls_num;
+  value_t values[PARSE_BATCH_VALUES];
+  int values_num;
+};
+typedef struct parse_batch_s parse_batch_t;
+
+/* A connection accepted on a listening stream socket. Data is read into
+ * `buffer' until a complete frame is available, which is then copied into a
+ * receive list entry. */
+struct stream_conn_s
+{
+  int fd;
+  sockent_t *se;
+  struct sockaddr_storage addr;
+
+  char *buffer;
+  size_t buffer_fill;
+
+  struct stream_conn_s *next;
+};
+typedef struct stream_conn_s stream_conn_t;
+
 /*
  * Private variables
  */
 static int network_config_ttl = 0;
 static int network_config_forward = 0;
+static int network_config_stats = 0;
+static int network_config_compress = 0;
+static size_t network_config_packet_size = BUFF_SIZE;
 
 static sockent_t *sending_sockets = NULL;
 
-static receive_list_entry_t *receive_list_head = NULL;
-static receive_list_entry_t *receive_list_tail = NULL;
-static pthread_mutex_t       receive_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t        receive_list_cond = PTHREAD_COND_INITIALIZER;
+static receive_queue_t *receive_queues = NULL;
+static int              receive_queues_num = 0;
+static int              dispatch_threads_num = 1;
+
+/* Receive list entries are allocated once, when the receive thread is
+ * started, and recycled afterwards: The receive thread takes free entries from
+ * the pool, receives packets directly into them and passes them on to the
+ * dispatch threads, which put them back into the pool after parsing. */
+static receive_list_entry_t *receive_pool = NULL;
+static char                 *receive_pool_data = NULL;
+static int                   receive_pool_size = 4096;
+static receive_list_entry_t *receive_pool_free = NULL;
+static pthread_mutex_t       receive_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        receive_pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* Receive statistics, protected by `receive_pool_lock'. */
+static counter_t stats_packets_received = 0;
+static counter_t stats_packets_dropped = 0;
+static counter_t stats_pool_exhausted = 0;
 
 static sockent_t     *listen_sockets = NULL;
 static struct pollfd *listen_sockets_pollfd = NULL;
 static int            listen_sockets_num = 0;
 
+/* Connections accepted on stream sockets. Only used by the receive thread,
+ * which polls them after the listening sockets, see `network_receive'. */
+static stream_conn_t *stream_conns = NULL;
+static int            stream_conns_num = 0;
+
 /* The receive and dispatch threads will run as long as `listen_loop' is set to
  * zero. */
 static int       listen_loop = 0;
 static int       receive_thread_running = 0;
 static pthread_t receive_thread_id;
-static int       dispatch_thread_running = 0;
-static pthread_t dispatch_thread_id;
 
-/* Buffer in which to-be-sent network packets are constructed. */
-static char             send_buffer[BUFF_SIZE];
-static char            *send_buffer_ptr;
-static int              send_buffer_fill;
-static value_list_t     send_buffer_vl = VALUE_LIST_STATIC;
-static pthread_mutex_t  send_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Each thread writing values builds packets in its own buffers, so threads
+ * don't wait for each other. Full buffers are not sent right away but
+ * collected, see SEND_BATCH_SIZE.
+ *
+ * Values are queued in these buffers for at most half their interval. The
+ * next value of the same identifier may be written by another thread and
+ * must not overtake the previous one: Receivers drop values older than what
+ * they've already seen. */
+struct send_state_s
+{
+  pthread_mutex_t lock;
+
+  /* The buffer currently being filled, `buffer', is always
+   * `buffers[buffers_num]'. */
+  char    *buffers[SEND_BATCH_SIZE + 1];
+  size_t   buffers_fill[SEND_BATCH_SIZE + 1];
+  int      buffers_num;
+  cdtime_t buffers_first;
+  /* Time by which everything queued must have been sent. */
+  cdtime_t deadline;
+
+  char        *buffer;
+  char        *buffer_ptr;
+  int          buffer_fill;
+  cdtime_t     buffer_first;
+  /* The parts last written to `buffer', for omitting repeated parts. */
+  value_list_t buffer_vl;
+
+#if HAVE_GCRYPT_H
+  /* Signed or encrypted copies of the packets being sent. */
+  char *scratch[SEND_BATCH_SIZE];
+#endif
+
+#if HAVE_ZLIB_H
+  /* With `Compress' enabled, values are written to `segment', which is
+   * compressed into the packet `buffers[buffers_num]' when it is full.
+   * `packet_fill' is the size of the compressed data up to the end of the
+   * last segment, `packet_orig' the size of the segments. */
+  char     *segment;
+  z_stream  zstream;
+  size_t    packet_fill;
+  size_t    packet_orig;
+  size_t    segment_last;
+#endif
+
+  struct send_state_s *next;
+};
+typedef struct send_state_s send_state_t;
+
+static send_state_t    *send_states = NULL;
+static int              send_states_closed = 0;
+static pthread_mutex_t  send_states_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t    send_state_key;
+static pthread_once_t   send_state_key_once = PTHREAD_ONCE_INIT;
+/* The earliest deadline of all send states. It's read without holding the
+ * lock, so checking it doesn't cost writers a shared lock for each value.
+ * `send_states_deadline_new' collects the deadlines set while
+ * `network_send_stale' is walking the list. */
+static cdtime_t         send_states_deadline = 0;
+static cdtime_t         send_states_deadline_new = 0;
+static pthread_mutex_t  send_states_deadline_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* In this cache we store all the values we received, so we can send out only
  * those values which were *not* received via the network plugin, too. This is
- * used for the `Forward false' option. */
-static c_avl_tree_t    *cache_tree = NULL;
+ * used for the `Forward false' option. The hash table is keyed by the interned
+ * identifier, each entry holding a reference to it.
+ *
+ * To expire entries without searching the whole table, each entry is also
+ * linked into the list of the generation it was last updated in. A generation
+ * spans 1/(CACHE_GENERATIONS-1) of the flush interval; when a list is reused
+ * for a new generation, the entries still in it have not been updated for at
+ * least `cache_flush_interval' seconds and are removed. */
+#define CACHE_GENERATIONS 16
+#define CACHE_TABLE_SIZE_MIN 1024
+
+struct cache_entry_s
+{
+  const identifier_t *key;
+  cdtime_t time;
+  uint64_t generation;
+
+  /* Next entry in the same hash bucket. */
+  struct cache_entry_s *next;
+  /* Neighbours in the generation list. */
+  struct cache_entry_s *gen_prev;
+  struct cache_entry_s *gen_next;
+};
+typedef struct cache_entry_s cache_entry_t;
+
+static cache_entry_t  **cache_table = NULL;
+static size_t           cache_table_size = 0;
+static size_t           cache_entries_num = 0;
+static cache_entry_t   *cache_generations[CACHE_GENERATIONS];
+static uint64_t         cache_generation = 0;
+static cdtime_t         cache_generation_end = 0;
 static pthread_mutex_t  cache_lock = PTHREAD_MUTEX_INITIALIZER;
-static time_t           cache_flush_last = 0;
 static int              cache_flush_interval = 1800;
 
+#if HAVE_GCRYPT_H
+/* Cipher and HMAC handles of one thread. Packets are encrypted, decrypted,
+ * signed and verified by several threads at once, so the handles can't be
+ * shared. Each handle remembers the key it was last set up with (identified
+ * by the hash of the shared secret), so only the IV or the HMAC state has to
+ * be reset as long as packets of the same socket are handled. */
+struct network_crypto_s
+{
+  gcry_cipher_hd_t cypher;
+  unsigned char    cypher_key[32];
+  int              cypher_key_set;
+
+  gcry_md_hd_t     hmac;
+  unsigned char    hmac_key[32];
+  int              hmac_key_set;
+};
+typedef struct network_crypto_s network_crypto_t;
+
+/* Thread-specific crypto handles, see `network_get_crypto'. */
+static pthread_key_t  crypto_key;
+static pthread_once_t crypto_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+#if HAVE_ZLIB_H
+/* Thread-specific decompression streams, see `network_get_inflate_stream'. */
+static pthread_key_t  inflate_key;
+static pthread_once_t inflate_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* The batch of the dispatch thread, see `dispatch_thread'. */
+static pthread_key_t  parse_batch_key;
+static pthread_once_t parse_batch_key_once = PTHREAD_ONCE_INIT;
+
 /*
  * Private functions
  */
-static int cache_flush (void)
+/* Hashes the address of the interned identifier, so looking up an entry
+ * doesn't need to read the identifier itself. Identifiers are allocated one
+ * after another and values usually arrive in the same order every interval,
+ * so keeping neighbouring addresses in neighbouring buckets keeps the table
+ * accesses mostly sequential. */
+static size_t cache_hash (const identifier_t *key) /* {{{ */
+{
+	return ((size_t) (((uintptr_t) key) / sizeof (identifier_t)));
+} /* }}} size_t cache_hash */
+
+static void cache_generation_unlink (cache_entry_t *ce) /* {{{ */
+{
+	if (ce->gen_prev != NULL)
+		ce->gen_prev->gen_next = ce->gen_next;
+	else
+		cache_generations[ce->generation % CACHE_GENERATIONS] = ce->gen_next;
+
+	if (ce->gen_next != NULL)
+		ce->gen_next->gen_prev = ce->gen_prev;
+
+	ce->gen_prev = NULL;
+	ce->gen_next = NULL;
+} /* }}} void cache_generation_unlink */
+
+static void cache_generation_link (cache_entry_t *ce) /* {{{ */
 {
-	char **keys = NULL;
-	int    keys_num = 0;
+	cache_entry_t **head;
 
-	char **tmp;
-	int    i;
+	ce->generation = cache_generation;
+	head = &cache_generations[ce->generation % CACHE_GENERATIONS];
 
-	char   *key;
-	time_t *value;
-	c_avl_iterator_t *iter;
+	ce->gen_prev = NULL;
+	ce->gen_next = *head;
+	if (*head != NULL)
+		(*head)->gen_prev = ce;
+	*head = ce;
+} /* }}} void cache_generation_link */
+
+static int cache_grow (void) /* {{{ */
+{
+	cache_entry_t **table;
+	size_t size;
+	size_t i;
 
-	time_t curtime = time (NULL);
+	size = (cache_table_size == 0)
+		? CACHE_TABLE_SIZE_MIN : (2 * cache_table_size);
 
-	iter = c_avl_get_iterator (cache_tree);
-	while (c_avl_iterator_next (iter, (void *) &key, (void *) &value) == 0)
+	table = calloc (size, sizeof (*table));
+	if (table == NULL)
 	{
-		if ((curtime - *value) <= cache_flush_interval)
-			continue;
-		tmp = (char **) realloc (keys,
-				(keys_num + 1) * sizeof (char *));
-		if (tmp == NULL)
-		{
-			sfree (keys);
-			c_avl_iterator_destroy (iter);
-			ERROR ("network plugin: cache_flush: realloc"
-					" failed.");
-			return (-1);
-		}
-		keys = tmp;
-		keys[keys_num] = key;
-		keys_num++;
-	} /* while (c_avl_iterator_next) */
-	c_avl_iterator_destroy (iter);
+		ERROR ("network plugin: cache_grow: calloc failed.");
+		return (-1);
+	}
 
-	for (i = 0; i < keys_num; i++)
+	for (i = 0; i < cache_table_size; i++)
 	{
-		if (c_avl_remove (cache_tree, keys[i], (void *) &key,
-					(void *) &value) != 0)
+		while (cache_table[i] != NULL)
 		{
-			WARNING ("network plugin: cache_flush: c_avl_remove"
-					" (%s) failed.", keys[i]);
-			continue;
-		}
+			cache_entry_t *ce = cache_table[i];
+			size_t bucket = cache_hash (ce->key) & (size - 1);
 
-		sfree (key);
-		sfree (value);
+			cache_table[i] = ce->next;
+			ce->next = table[bucket];
+			table[bucket] = ce;
+		}
 	}
 
-	sfree (keys);
+	sfree (cache_table);
+	cache_table = table;
+	cache_table_size = size;
 
-	DEBUG ("network plugin: cache_flush: Removed %i %s",
-			keys_num, (keys_num == 1) ? "entry" : "entries");
-	cache_flush_last = curtime;
 	return (0);
-} /* int cache_flush */
+} /* }}} int cache_grow */
+
+/* Removes the entries of all generations which have become too old since
+ * the last call. Only the removed entries are touched. */
+static void cache_flush (cdtime_t now) /* {{{ */
+{
+	uint64_t generation;
+	cdtime_t generation_length;
+	int removed = 0;
+
+	if (now < cache_generation_end)
+		return;
+
+	generation_length = TIME_T_TO_CDTIME_T (cache_flush_interval)
+		/ (CACHE_GENERATIONS - 1);
+	if (generation_length == 0)
+		generation_length = 1;
+	generation = now / generation_length;
+	cache_generation_end = (generation + 1) * generation_length;
+
+	if (generation <= cache_generation)
+		return;
+
+	/* Skipping more than a full round is the same as a full round. */
+	if ((generation - cache_generation) > CACHE_GENERATIONS)
+		cache_generation = generation - CACHE_GENERATIONS;
+
+	while (cache_generation < generation)
+	{
+		cache_entry_t *ce;
+
+		cache_generation++;
+
+		while ((ce = cache_generations[cache_generation % CACHE_GENERATIONS])
+				!= NULL)
+		{
+			cache_entry_t **prev;
+
+			cache_generation_unlink (ce);
+
+			prev = &cache_table[cache_hash (ce->key) & (cache_table_size - 1)];
+			while (*prev != ce)
+				prev = &(*prev)->next;
+			*prev = ce->next;
+
+			ident_release (ce->key);
+			sfree (ce);
+			cache_entries_num--;
+			removed++;
+		}
+	}
+
+	DEBUG ("network plugin: cache_flush: Removed %i %s",
+			removed, (removed == 1) ? "entry" : "entries");
+} /* }}} void cache_flush */
 
 static int cache_check (const value_list_t *vl)
 {
-	char key[1024];
-	time_t *value = NULL;
+	const identifier_t *key;
+	cache_entry_t *ce;
 	int retval = -1;
 
-	if (cache_tree == NULL)
+	key = ident_get (vl);
+	if (key == NULL)
 		return (-1);
 
-	if (format_name (key, sizeof (key), vl->host, vl->plugin,
-				vl->plugin_instance, vl->type, vl->type_instance))
+	pthread_mutex_lock (&cache_lock);
+
+	if (cache_table == NULL)
+	{
+		pthread_mutex_unlock (&cache_lock);
+		ident_release (key);
 		return (-1);
+	}
 
-	pthread_mutex_lock (&cache_lock);
+	cache_flush (cdtime ());
+
+	for (ce = cache_table[cache_hash (key) & (cache_table_size - 1)];
+			ce != NULL; ce = ce->next)
+		if (ce->key == key)
+			break;
 
-	if (c_avl_get (cache_tree, key, (void *) &value) == 0)
+	if (ce != NULL)
 	{
-		if (*value < vl->time)
+		if (ce->time < vl->time)
 		{
-			*value = vl->time;
+			ce->time = vl->time;
 			retval = 0;
 		}
 		else
 		{
-			DEBUG ("network plugin: cache_check: *value = %i >= vl->time = %i",
-					(int) *value, (int) vl->time);
+			DEBUG ("network plugin: cache_check: ce->time = %.3f >= "
+					"vl->time = %.3f",
+					CDTIME_T_TO_DOUBLE (ce->time),
+					CDTIME_T_TO_DOUBLE (vl->time));
 			retval = 1;
 		}
+
+		if (ce->generation != cache_generation)
+		{
+			cache_generation_unlink (ce);
+			cache_generation_link (ce);
+		}
 	}
-	else
+	else if ((cache_entries_num < cache_table_size)
+			|| (cache_grow () == 0))
 	{
-		char *key_copy = strdup (key);
-		value = malloc (sizeof (time_t));
-		if ((key_copy != NULL) && (value != NULL))
+		ce = malloc (sizeof (*ce));
+		if (ce != NULL)
 		{
-			*value = vl->time;
-			c_avl_insert (cache_tree, key_copy, value);
+			size_t bucket = cache_hash (key) & (cache_table_size - 1);
+
+			ce->key = ident_ref (key);
+			ce->time = vl->time;
+			ce->next = cache_table[bucket];
+			cache_table[bucket] = ce;
+			cache_generation_link (ce);
+			cache_entries_num++;
 			retval = 0;
 		}
-		else
-		{
-			sfree (key_copy);
-			sfree (value);
-		}
 	}
 
-	if ((time (NULL) - cache_flush_last) > cache_flush_interval)
-		cache_flush ();
-
 	pthread_mutex_unlock (&cache_lock);
+	ident_release (key);
 
 	return (retval);
 } /* int cache_check */
 
+static int cache_create (void) /* {{{ */
+{
+	int status;
+
+	pthread_mutex_lock (&cache_lock);
+	memset (cache_generations, 0, sizeof (cache_generations));
+	cache_generation = 0;
+	cache_generation_end = 0;
+	cache_entries_num = 0;
+	status = cache_grow ();
+	pthread_mutex_unlock (&cache_lock);
+
+	return (status);
+} /* }}} int cache_create */
+
+static void cache_destroy (void) /* {{{ */
+{
+	size_t i;
+
+	pthread_mutex_lock (&cache_lock);
+	for (i = 0; i < cache_table_size; i++)
+	{
+		while (cache_table[i] != NULL)
+		{
+			cache_entry_t *ce = cache_table[i];
+			cache_table[i] = ce->next;
+			ident_release (ce->key);
+			sfree (ce);
+		}
+	}
+	sfree (cache_table);
+	cache_table_size = 0;
+	cache_entries_num = 0;
+	memset (cache_generations, 0, sizeof (cache_generations));
+	pthread_mutex_unlock (&cache_lock);
+} /* }}} void cache_destroy */
+
 #if HAVE_GCRYPT_H
+static void network_crypto_destroy (void *arg) /* {{{ */
+{
+  network_crypto_t *crypto = arg;
+
+  if (crypto->cypher != NULL)
+    gcry_cipher_close (crypto->cypher);
+  if (crypto->hmac != NULL)
+    gcry_md_close (crypto->hmac);
+  sfree (crypto);
+} /* }}} void network_crypto_destroy */
+
+static void network_crypto_key_create (void) /* {{{ */
+{
+  pthread_key_create (&crypto_key, network_crypto_destroy);
+} /* }}} void network_crypto_key_create */
+
+/* Returns the calling thread's crypto handles, allocating them on first
+ * use. */
+static network_crypto_t *network_get_crypto (void) /* {{{ */
+{
+  network_crypto_t *crypto;
+
+  pthread_once (&crypto_key_once, network_crypto_key_create);
+
+  crypto = pthread_getspecific (crypto_key);
+  if (crypto != NULL)
+    return (crypto);
+
+  crypto = calloc (1, sizeof (*crypto));
+  if (crypto == NULL)
+  {
+    ERROR ("network plugin: calloc failed.");
+    return (NULL);
+  }
+  pthread_setspecific (crypto_key, crypto);
+
+  return (crypto);
+} /* }}} network_crypto_t *network_get_crypto */
+
+/* Returns the calling thread's cipher handle, initialized with the key of
+ * `se' and the given IV. The key schedule is only computed again when the
+ * thread handles a packet of a socket with a different shared secret. */
 static gcry_cipher_hd_t network_get_aes256_cypher (sockent_t *se, /* {{{ */
     const void *iv, size_t iv_size)
 {
+  network_crypto_t *crypto;
   gcry_error_t err;
 
-  if (se->cypher == NULL)
+  crypto = network_get_crypto ();
+  if (crypto == NULL)
+    return (NULL);
+
+  if (crypto->cypher == NULL)
   {
-    err = gcry_cipher_open (&se->cypher,
+    err = gcry_cipher_open (&crypto->cypher,
         GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CBC, /* flags = */ 0);
     if (err != 0)
     {
       ERROR ("network plugin: gcry_cipher_open returned: %s",
           gcry_strerror (err));
-      se->cypher = NULL;
+      crypto->cypher = NULL;
       return (NULL);
     }
+    crypto->cypher_key_set = 0;
   }
-  else
+
+  if (!crypto->cypher_key_set
+      || (memcmp (crypto->cypher_key, se->shared_secret_hash,
+          sizeof (crypto->cypher_key)) != 0))
   {
-    gcry_cipher_reset (se->cypher);
+    crypto->cypher_key_set = 0;
+    err = gcry_cipher_setkey (crypto->cypher,
+        se->shared_secret_hash, sizeof (se->shared_secret_hash));
+    if (err != 0)
+    {
+      ERROR ("network plugin: gcry_cipher_setkey returned: %s",
+          gcry_strerror (err));
+      return (NULL);
+    }
+    memcpy (crypto->cypher_key, se->shared_secret_hash,
+        sizeof (crypto->cypher_key));
+    crypto->cypher_key_set = 1;
   }
-  assert (se->cypher != NULL);
 
-  err = gcry_cipher_setkey (se->cypher,
-      se->shared_secret_hash, sizeof (se->shared_secret_hash));
+  /* In CBC mode, setting the IV is all that is needed to start a new
+   * message. */
+  err = gcry_cipher_setiv (crypto->cypher, iv, iv_size);
   if (err != 0)
   {
-    ERROR ("network plugin: gcry_cipher_setkey returned: %s",
+    ERROR ("network plugin: gcry_cipher_setiv returned: %s",
         gcry_strerror (err));
-    gcry_cipher_close (se->cypher);
-    se->cypher = NULL;
     return (NULL);
   }
 
-  err = gcry_cipher_setiv (se->cypher, iv, iv_size);
+  return (crypto->cypher);
+} /* }}} int network_get_aes256_cypher */
+
+/* Returns the calling thread's HMAC-SHA-256 handle, keyed with the shared
+ * secret of `se' and ready for a new message. Resetting an HMAC handle keeps
+ * the key, so it is only set again when the secret changes. */
+static gcry_md_hd_t network_get_hmac_sha256 (const sockent_t *se) /* {{{ */
+{
+  network_crypto_t *crypto;
+  gcry_error_t err;
+
+  crypto = network_get_crypto ();
+  if (crypto == NULL)
+    return (NULL);
+
+  if (crypto->hmac == NULL)
+  {
+    err = gcry_md_open (&crypto->hmac, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+    if (err != 0)
+    {
+      ERROR ("network plugin: Creating HMAC-SHA-256 object failed: %s",
+          gcry_strerror (err));
+      crypto->hmac = NULL;
+      return (NULL);
+    }
+    crypto->hmac_key_set = 0;
+  }
+
+  if (crypto->hmac_key_set
+      && (memcmp (crypto->hmac_key, se->shared_secret_hash,
+          sizeof (crypto->hmac_key)) == 0))
+  {
+    gcry_md_reset (crypto->hmac);
+    return (crypto->hmac);
+  }
+
+  crypto->hmac_key_set = 0;
+  err = gcry_md_setkey (crypto->hmac, se->shared_secret,
+      strlen (se->shared_secret));
   if (err != 0)
   {
-    ERROR ("network plugin: gcry_cipher_setkey returned: %s",
+    ERROR ("network plugin: gcry_md_setkey failed: %s",
         gcry_strerror (err));
-    gcry_cipher_close (se->cypher);
-    se->cypher = NULL;
     return (NULL);
   }
+  memcpy (crypto->hmac_key, se->shared_secret_hash,
+      sizeof (crypto->hmac_key));
+  crypto->hmac_key_set = 1;
 
-  return (se->cypher);
-} /* }}} int network_get_aes256_cypher */
+  return (crypto->hmac);
+} /* }}} gcry_md_hd_t network_get_hmac_sha256 */
 #endif /* HAVE_GCRYPT_H */
 
+#if HAVE_ZLIB_H
+static void network_inflate_destroy (void *arg) /* {{{ */
+{
+  z_stream *zs = arg;
+
+  inflateEnd (zs);
+  sfree (zs);
+} /* }}} void network_inflate_destroy */
+
+static void network_inflate_key_create (void) /* {{{ */
+{
+  pthread_key_create (&inflate_key, network_inflate_destroy);
+} /* }}} void network_inflate_key_create */
+
+/* Returns the calling thread's decompression stream, ready for a new part.
+ * Allocating the stream is expensive, so it's reused for all packets. */
+static z_stream *network_get_inflate_stream (void) /* {{{ */
+{
+  z_stream *zs;
+  int status;
+
+  pthread_once (&inflate_key_once, network_inflate_key_create);
+
+  zs = pthread_getspecific (inflate_key);
+  if (zs != NULL)
+  {
+    inflateReset (zs);
+    return (zs);
+  }
+
+  zs = calloc (1, sizeof (*zs));
+  if (zs == NULL)
+  {
+    ERROR ("network plugin: calloc failed.");
+    return (NULL);
+  }
+
+  /* Raw deflate data, see `part_compress_zlib_t'. */
+  status = inflateInit2 (zs, -MAX_WBITS);
+  if (status != Z_OK)
+  {
+    ERROR ("network plugin: inflateInit2 failed with status %i.", status);
+    sfree (zs);
+    return (NULL);
+  }
+
+  pthread_setspecific (inflate_key, zs);
+  return (zs);
+} /* }}} z_stream *network_get_inflate_stream */
+#endif /* HAVE_ZLIB_H */
+
 static int write_part_values (char **ret_buffer, int *ret_buffer_len,
 		const data_set_t *ds, const value_list_t *vl)
 {
@@ -428,9 +1030,8 @@ static int write_part_values (char **ret_buffer, int *ret_buffer_len,
 	part_header_t pkg_ph;
 	uint16_t      pkg_num_values;
 	uint8_t      *pkg_values_types;
-	value_t      *pkg_values;
+	char         *pkg_values;
 
-	int offset;
 	int i;
 
 	num_values = vl->values_len;
@@ -441,63 +1042,45 @@ static int write_part_values (char **ret_buffer, int *ret_buffer_len,
 	if (*ret_buffer_len < packet_len)
 		return (-1);
 
-	pkg_values_types = (uint8_t *) malloc (num_values * sizeof (uint8_t));
-	if (pkg_values_types == NULL)
-	{
-		ERROR ("network plugin: write_part_values: malloc failed.");
-		return (-1);
-	}
-
-	pkg_values = (value_t *) malloc (num_values * sizeof (value_t));
-	if (pkg_values == NULL)
-	{
-		free (pkg_values_types);
-		ERROR ("network plugin: write_part_values: malloc failed.");
-		return (-1);
-	}
-
 	pkg_ph.type = htons (TYPE_VALUES);
 	pkg_ph.length = htons (packet_len);
 
 	pkg_num_values = htons ((uint16_t) vl->values_len);
 
+	/*
+	 * Use `memcpy' to write everything to the buffer, because the pointer
+	 * may be unaligned and some architectures, such as SPARC, can't handle
+	 * that. The types and values are converted straight into the buffer.
+	 */
+	packet_ptr = *ret_buffer;
+	memcpy (packet_ptr, &pkg_ph, sizeof (pkg_ph));
+	memcpy (packet_ptr + sizeof (pkg_ph), &pkg_num_values,
+			sizeof (pkg_num_values));
+
+	pkg_values_types = (uint8_t *) (packet_ptr + sizeof (pkg_ph)
+			+ sizeof (pkg_num_values));
+	pkg_values = (char *) (pkg_values_types + num_values);
+
 	for (i = 0; i < num_values; i++)
 	{
+		value_t value;
+
 		if (ds->ds[i].type == DS_TYPE_COUNTER)
 		{
 			pkg_values_types[i] = DS_TYPE_COUNTER;
-			pkg_values[i].counter = htonll (vl->values[i].counter);
+			value.counter = htonll (vl->values[i].counter);
 		}
 		else
 		{
 			pkg_values_types[i] = DS_TYPE_GAUGE;
-			pkg_values[i].gauge = htond (vl->values[i].gauge);
+			value.gauge = htond (vl->values[i].gauge);
 		}
+		memcpy (pkg_values + (i * sizeof (value_t)), &value, sizeof (value));
 	}
 
-	/*
-	 * Use `memcpy' to write everything to the buffer, because the pointer
-	 * may be unaligned and some architectures, such as SPARC, can't handle
-	 * that.
-	 */
-	packet_ptr = *ret_buffer;
-	offset = 0;
-	memcpy (packet_ptr + offset, &pkg_ph, sizeof (pkg_ph));
-	offset += sizeof (pkg_ph);
-	memcpy (packet_ptr + offset, &pkg_num_values, sizeof (pkg_num_values));
-	offset += sizeof (pkg_num_values);
-	memcpy (packet_ptr + offset, pkg_values_types, num_values * sizeof (uint8_t));
-	offset += num_values * sizeof (uint8_t);
-	memcpy (packet_ptr + offset, pkg_values, num_values * sizeof (value_t));
-	offset += num_values * sizeof (value_t);
-
-	assert (offset == packet_len);
-
 	*ret_buffer = packet_ptr + packet_len;
 	*ret_buffer_len -= packet_len;
 
-	free (pkg_values_types);
-	free (pkg_values);
 
 	return (0);
 } /* int write_part_values */
@@ -537,6 +1120,35 @@ static int write_part_number (char **ret_buffer, int *ret_buffer_len,
 	return (0);
 } /* int write_part_number */
 
+/* Writes a time or interval. The whole seconds are always written as `type',
+ * which all versions understand. If there is a fractional part, the full
+ * resolution follows as `type_hr', which overrides `type' on receivers that
+ * know it. Old receivers ignore it and use the truncated value. */
+static int write_part_time (char **ret_buffer, int *ret_buffer_len,
+		int type, int type_hr, cdtime_t value)
+{
+	char *buffer = *ret_buffer;
+	int buffer_len = *ret_buffer_len;
+	uint64_t seconds;
+
+	seconds = (uint64_t) CDTIME_T_TO_TIME_T (value);
+	/* Don't let a sub-second interval become zero, which means "unset". */
+	if ((seconds == 0) && (value != 0))
+		seconds = 1;
+
+	if (write_part_number (&buffer, &buffer_len, type, seconds) != 0)
+		return (-1);
+
+	if (!CDTIME_T_IS_INTEGRAL (value)
+			&& (write_part_number (&buffer, &buffer_len, type_hr,
+					(uint64_t) value) != 0))
+		return (-1);
+
+	*ret_buffer = buffer;
+	*ret_buffer_len = buffer_len;
+	return (0);
+} /* int write_part_time */
+
 static int write_part_string (char **ret_buffer, int *ret_buffer_len,
 		int type, const char *str, int str_len)
 {
@@ -574,7 +1186,11 @@ static int write_part_string (char **ret_buffer, int *ret_buffer_len,
 	return (0);
 } /* int write_part_string */
 
+/* Decodes a values part into `values', which has room for `values_size'
+ * values. If the part has more values, a new array is allocated, which the
+ * caller must free. The types are read from the packet directly. */
 static int parse_part_values (void **ret_buffer, size_t *ret_buffer_len,
+		value_t *values, int values_size,
 		value_t **ret_values, int *ret_num_values)
 {
 	char *buffer = *ret_buffer;
@@ -588,7 +1204,7 @@ static int parse_part_values (void **ret_buffer, size_t *ret_buffer_len,
 	uint16_t pkg_type;
 	uint16_t pkg_numval;
 
-	uint8_t *pkg_types;
+	const uint8_t *pkg_types;
 	value_t *pkg_values;
 
 	if (buffer_len < 15)
@@ -632,17 +1248,21 @@ static int parse_part_values (void **ret_buffer, size_t *ret_buffer_len,
 		return (-1);
 	}
 
-	pkg_types = (uint8_t *) malloc (pkg_numval * sizeof (uint8_t));
-	pkg_values = (value_t *) malloc (pkg_numval * sizeof (value_t));
-	if ((pkg_types == NULL) || (pkg_values == NULL))
+	if (pkg_numval <= values_size)
 	{
-		sfree (pkg_types);
-		sfree (pkg_values);
-		ERROR ("network plugin: parse_part_values: malloc failed.");
-		return (-1);
+		pkg_values = values;
+	}
+	else
+	{
+		pkg_values = (value_t *) malloc (pkg_numval * sizeof (value_t));
+		if (pkg_values == NULL)
+		{
+			ERROR ("network plugin: parse_part_values: malloc failed.");
+			return (-1);
+		}
 	}
 
-	memcpy ((void *) pkg_types, (void *) buffer, pkg_numval * sizeof (uint8_t));
+	pkg_types = (const uint8_t *) buffer;
 	buffer += pkg_numval * sizeof (uint8_t);
 	memcpy ((void *) pkg_values, (void *) buffer, pkg_numval * sizeof (value_t));
 	buffer += pkg_numval * sizeof (value_t);
@@ -660,8 +1280,6 @@ static int parse_part_values (void **ret_buffer, size_t *ret_buffer_len,
 	*ret_num_values = pkg_numval;
 	*ret_values     = pkg_values;
 
-	sfree (pkg_types);
-
 	return (0);
 } /* int parse_part_values */
 
@@ -789,10 +1407,11 @@ static int parse_part_string (void **ret_buffer, size_t *ret_buffer_len,
 	return (0);
 } /* int parse_part_string */
 
-/* Forward declaration: parse_part_sign_sha256 and parse_part_encr_aes256 call
- * parse_packet and vice versa. */
-#define PP_SIGNED    0x01
-#define PP_ENCRYPTED 0x02
+/* Forward declaration: parse_part_sign_sha256, parse_part_encr_aes256 and
+ * parse_part_compress_zlib call parse_packet and vice versa. */
+#define PP_SIGNED     0x01
+#define PP_ENCRYPTED  0x02
+#define PP_COMPRESSED 0x04
 static int parse_packet (sockent_t *se,
 		void *buffer, size_t buffer_size, int flags);
 
@@ -813,7 +1432,6 @@ static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
   char hash[sizeof (pss.hash)];
 
   gcry_md_hd_t hd;
-  gcry_error_t err;
   unsigned char *hash_ptr;
 
   buffer = *ret_buffer;
@@ -842,38 +1460,19 @@ static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
     return (-1);
   }
 
-  hd = NULL;
-  err = gcry_md_open (&hd, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
-  if (err != 0)
-  {
-    ERROR ("network plugin: Creating HMAC-SHA-256 object failed: %s",
-        gcry_strerror (err));
-    return (-1);
-  }
-
-  err = gcry_md_setkey (hd, se->shared_secret,
-      strlen (se->shared_secret));
-  if (err != 0)
-  {
-    ERROR ("network plugin: gcry_md_setkey failed: %s",
-        gcry_strerror (err));
-    gcry_md_close (hd);
+  hd = network_get_hmac_sha256 (se);
+  if (hd == NULL)
     return (-1);
-  }
 
   gcry_md_write (hd, buffer + buffer_offset, buffer_len - buffer_offset);
   hash_ptr = gcry_md_read (hd, GCRY_MD_SHA256);
   if (hash_ptr == NULL)
   {
     ERROR ("network plugin: gcry_md_read failed.");
-    gcry_md_close (hd);
     return (-1);
   }
   memcpy (hash, hash_ptr, sizeof (hash));
 
-  gcry_md_close (hd);
-  hd = NULL;
-
   if (memcmp (pss.hash, hash, sizeof (pss.hash)) != 0)
   {
     WARNING ("network plugin: Verifying HMAC-SHA-256 signature failed: "
@@ -1094,15 +1693,155 @@ static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
 } /* }}} int parse_part_encr_aes256 */
 #endif /* !HAVE_GCRYPT_H */
 
+#if HAVE_ZLIB_H
+static int parse_part_compress_zlib (sockent_t *se, /* {{{ */
+    void **ret_buffer, size_t *ret_buffer_size, int flags)
+{
+  char *buffer;
+  size_t buffer_size;
+  size_t buffer_offset;
+
+  part_compress_zlib_t pcz;
+  size_t part_size;
+  size_t orig_size;
+  char orig[PART_COMPRESS_ZLIB_ORIG_MAX];
+
+  z_stream *zs;
+  int status;
+
+  buffer = *ret_buffer;
+  buffer_size = *ret_buffer_size;
+  buffer_offset = 0;
+
+  if (buffer_size < PART_COMPRESS_ZLIB_SIZE)
+    return (-1);
+
+  BUFFER_READ (&pcz.head.type, sizeof (pcz.head.type));
+  BUFFER_READ (&pcz.head.length, sizeof (pcz.head.length));
+  BUFFER_READ (&pcz.orig_length, sizeof (pcz.orig_length));
+
+  part_size = ntohs (pcz.head.length);
+  orig_size = ntohs (pcz.orig_length);
+  if ((part_size < PART_COMPRESS_ZLIB_SIZE) || (part_size > buffer_size))
+  {
+    NOTICE ("network plugin: parse_part_compress_zlib: "
+        "Discarding part with invalid length.");
+    return (-1);
+  }
+
+  /* Compressed parts are never nested by the sender. Refusing them keeps
+   * the amount of data a packet can expand to bounded. */
+  if ((flags & PP_COMPRESSED) != 0)
+  {
+    NOTICE ("network plugin: parse_part_compress_zlib: "
+        "Discarding nested compressed part.");
+    return (-1);
+  }
+
+  zs = network_get_inflate_stream ();
+  if (zs == NULL)
+    return (-1);
+
+  zs->next_in = (Bytef *) (buffer + buffer_offset);
+  zs->avail_in = (uInt) (part_size - buffer_offset);
+  zs->next_out = (Bytef *) orig;
+  zs->avail_out = (uInt) orig_size;
+
+  /* The sender ends every block with a sync flush instead of finishing the
+   * stream, so `Z_BUF_ERROR' is expected once all output has been
+   * produced. */
+  status = inflate (zs, Z_SYNC_FLUSH);
+  if (((status != Z_OK) && (status != Z_STREAM_END) && (status != Z_BUF_ERROR))
+      || (zs->total_out != orig_size))
+  {
+    ERROR ("network plugin: Decompressing a part failed: %s",
+        (zs->msg != NULL) ? zs->msg : "Invalid original length.");
+    return (-1);
+  }
+
+  parse_packet (se, orig, orig_size, flags | PP_COMPRESSED);
+
+  *ret_buffer = buffer + part_size;
+  *ret_buffer_size = buffer_size - part_size;
+
+  return (0);
+} /* }}} int parse_part_compress_zlib */
+
+#else /* if !HAVE_ZLIB_H */
+static int parse_part_compress_zlib (sockent_t *se, /* {{{ */
+    void **ret_buffer, size_t *ret_buffer_size, int flags)
+{
+  static int warning_has_been_printed = 0;
+
+  char *buffer;
+  size_t buffer_size;
+  size_t buffer_offset;
+
+  part_header_t ph;
+  size_t ph_length;
+
+  buffer = *ret_buffer;
+  buffer_size = *ret_buffer_size;
+  buffer_offset = 0;
+
+  /* parse_packet assures this minimum size. */
+  assert (buffer_size >= (sizeof (ph.type) + sizeof (ph.length)));
+
+  BUFFER_READ (&ph.type, sizeof (ph.type));
+  BUFFER_READ (&ph.length, sizeof (ph.length));
+  ph_length = ntohs (ph.length);
+
+  if ((ph_length < PART_COMPRESS_ZLIB_SIZE)
+      || (ph_length > buffer_size))
+  {
+    ERROR ("network plugin: Compressed part "
+        "with invalid length received.");
+    return (-1);
+  }
+
+  if (warning_has_been_printed == 0)
+  {
+    WARNING ("network plugin: Received compressed packet, but the network "
+        "plugin was not linked with zlib, so I cannot "
+        "decompress it. The part will be discarded.");
+    warning_has_been_printed = 1;
+  }
+
+  *ret_buffer += ph_length;
+  *ret_buffer_size -= ph_length;
+
+  return (0);
+} /* }}} int parse_part_compress_zlib */
+#endif /* !HAVE_ZLIB_H */
+
 #undef BUFFER_READ
 
+static void parse_batch_key_create (void) /* {{{ */
+{
+  pthread_key_create (&parse_batch_key, /* destructor = */ NULL);
+} /* }}} void parse_batch_key_create */
+
+/* Dispatches the value lists collected in `batch'. */
+static void parse_batch_flush (parse_batch_t *batch) /* {{{ */
+{
+  if (batch->vls_num > 0)
+    plugin_dispatch_values_batch (batch->vls, (size_t) batch->vls_num);
+
+  batch->vls_num = 0;
+  batch->values_num = 0;
+} /* }}} void parse_batch_flush */
+
+/* Parses a packet and adds its value lists to the batch of the dispatch
+ * thread. Packets nested in signed, encrypted or compressed parts are parsed
+ * recursively and add to the same batch, so the order is kept. */
 static int parse_packet (sockent_t *se, /* {{{ */
 		void *buffer, size_t buffer_size, int flags)
 {
 	int status;
 
-	value_list_t vl = VALUE_LIST_INIT;
-	notification_t n;
+	parse_batch_t *batch;
+	value_list_t vl;
+	int severity = 0;
 
 #if HAVE_GCRYPT_H
 	int packet_was_signed = (flags & PP_SIGNED);
@@ -1111,8 +1850,20 @@ static int parse_packet (sockent_t *se, /* {{{ */
 #endif /* HAVE_GCRYPT_H */
 
 
-	memset (&vl, '\0', sizeof (vl));
-	memset (&n, '\0', sizeof (n));
+	batch = pthread_getspecific (parse_batch_key);
+
+	/* The name fields are only read up to their null byte, so there is no
+	 * need to clear all of the structure. */
+	vl.values = NULL;
+	vl.values_len = 0;
+	vl.time = 0;
+	vl.interval = 0;
+	vl.host[0] = 0;
+	vl.plugin[0] = 0;
+	vl.plugin_instance[0] = 0;
+	vl.type[0] = 0;
+	vl.type_instance[0] = 0;
+	vl.ident = NULL;
 	status = 0;
 
 	while ((status == 0) && (0 < buffer_size)
@@ -1190,21 +1941,67 @@ static int parse_packet (sockent_t *se, /* {{{ */
 			continue;
 		}
 #endif /* HAVE_GCRYPT_H */
+		else if (pkg_type == TYPE_COMPRESS_ZLIB)
+		{
+			status = parse_part_compress_zlib (se,
+					&buffer, &buffer_size, flags);
+			if (status != 0)
+			{
+				ERROR ("network plugin: Decompressing part "
+						"failed with status %i.", status);
+				break;
+			}
+		}
 		else if (pkg_type == TYPE_VALUES)
 		{
+			value_t *values = NULL;
+			int values_size = 0;
+
+			/* Decode the values into the batch, making room for
+			 * them first if necessary. */
+			if (batch != NULL)
+			{
+				size_t values_num = 0;
+
+				if (pkg_length > (3 * sizeof (uint16_t)))
+					values_num = (pkg_length - 3 * sizeof (uint16_t))
+						/ (sizeof (uint8_t) + sizeof (value_t));
+				if ((batch->vls_num >= PARSE_BATCH_SIZE)
+						|| ((batch->values_num + values_num)
+							> PARSE_BATCH_VALUES))
+					parse_batch_flush (batch);
+
+				values = batch->values + batch->values_num;
+				values_size = PARSE_BATCH_VALUES - batch->values_num;
+			}
+
 			status = parse_part_values (&buffer, &buffer_size,
+					values, values_size,
 					&vl.values, &vl.values_len);
 
 			if (status != 0)
 				break;
 
 			if ((vl.time > 0)
-					&& (strlen (vl.host) > 0)
-					&& (strlen (vl.plugin) > 0)
-					&& (strlen (vl.type) > 0)
+					&& (vl.host[0] != 0)
+					&& (vl.plugin[0] != 0)
+					&& (vl.type[0] != 0)
 					&& (cache_check (&vl) == 0))
 			{
-				plugin_dispatch_values (&vl);
+				if ((batch != NULL) && (vl.values == values))
+				{
+					memcpy (batch->vls + batch->vls_num, &vl,
+							sizeof (vl));
+					batch->vls_num++;
+					batch->values_num += vl.values_len;
+				}
+				else
+				{
+					/* Too many values for the batch. */
+					if (batch != NULL)
+						parse_batch_flush (batch);
+					plugin_dispatch_values (&vl);
+				}
 			}
 			else
 			{
@@ -1212,7 +2009,10 @@ static int parse_packet (sockent_t *se, /* {{{ */
 						" NOT dispatching values");
 			}
 
-			sfree (vl.values);
+			if (vl.values != values)
+				sfree (vl.values);
+			vl.values = NULL;
+			vl.values_len = 0;
 		}
 		else if (pkg_type == TYPE_TIME)
 		{
@@ -1220,10 +2020,15 @@ static int parse_packet (sockent_t *se, /* {{{ */
 			status = parse_part_number (&buffer, &buffer_size,
 					&tmp);
 			if (status == 0)
-			{
-				vl.time = (time_t) tmp;
-				n.time = (time_t) tmp;
-			}
+				vl.time = TIME_T_TO_CDTIME_T (tmp);
+		}
+		else if (pkg_type == TYPE_TIME_HR)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				vl.time = (cdtime_t) tmp;
 		}
 		else if (pkg_type == TYPE_INTERVAL)
 		{
@@ -1231,53 +2036,61 @@ static int parse_packet (sockent_t *se, /* {{{ */
 			status = parse_part_number (&buffer, &buffer_size,
 					&tmp);
 			if (status == 0)
-				vl.interval = (int) tmp;
+				vl.interval = TIME_T_TO_CDTIME_T (tmp);
+		}
+		else if (pkg_type == TYPE_INTERVAL_HR)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				vl.interval = (cdtime_t) tmp;
 		}
 		else if (pkg_type == TYPE_HOST)
 		{
 			status = parse_part_string (&buffer, &buffer_size,
 					vl.host, sizeof (vl.host));
-			if (status == 0)
-				sstrncpy (n.host, vl.host, sizeof (n.host));
 		}
 		else if (pkg_type == TYPE_PLUGIN)
 		{
 			status = parse_part_string (&buffer, &buffer_size,
 					vl.plugin, sizeof (vl.plugin));
-			if (status == 0)
-				sstrncpy (n.plugin, vl.plugin,
-						sizeof (n.plugin));
 		}
 		else if (pkg_type == TYPE_PLUGIN_INSTANCE)
 		{
 			status = parse_part_string (&buffer, &buffer_size,
 					vl.plugin_instance,
 					sizeof (vl.plugin_instance));
-			if (status == 0)
-				sstrncpy (n.plugin_instance,
-						vl.plugin_instance,
-						sizeof (n.plugin_instance));
 		}
 		else if (pkg_type == TYPE_TYPE)
 		{
 			status = parse_part_string (&buffer, &buffer_size,
 					vl.type, sizeof (vl.type));
-			if (status == 0)
-				sstrncpy (n.type, vl.type, sizeof (n.type));
 		}
 		else if (pkg_type == TYPE_TYPE_INSTANCE)
 		{
 			status = parse_part_string (&buffer, &buffer_size,
 					vl.type_instance,
 					sizeof (vl.type_instance));
-			if (status == 0)
-				sstrncpy (n.type_instance, vl.type_instance,
-						sizeof (n.type_instance));
 		}
 		else if (pkg_type == TYPE_MESSAGE)
 		{
+			/* Notifications are rare, so the notification is only
+			 * built from the value list's fields when needed. */
+			notification_t n;
+
+			memset (&n, '\0', sizeof (n));
 			status = parse_part_string (&buffer, &buffer_size,
 					n.message, sizeof (n.message));
+			n.severity = severity;
+			n.time = vl.time;
+			sstrncpy (n.host, vl.host, sizeof (n.host));
+			sstrncpy (n.plugin, vl.plugin, sizeof (n.plugin));
+			sstrncpy (n.plugin_instance, vl.plugin_instance,
+					sizeof (n.plugin_instance));
+			sstrncpy (n.type, vl.type, sizeof (n.type));
+			sstrncpy (n.type_instance, vl.type_instance,
+					sizeof (n.type_instance));
 
 			if (status != 0)
 			{
@@ -1292,7 +2105,7 @@ static int parse_packet (sockent_t *se, /* {{{ */
 						"unknown severity %i.",
 						n.severity);
 			}
-			else if (n.time <= 0)
+			else if (n.time == 0)
 			{
 				INFO ("network plugin: "
 						"Ignoring notification with "
@@ -1306,6 +2119,8 @@ static int parse_packet (sockent_t *se, /* {{{ */
 			}
 			else
 			{
+				if (batch != NULL)
+					parse_batch_flush (batch);
 				plugin_dispatch_notification (&n);
 			}
 		}
@@ -1315,7 +2130,7 @@ static int parse_packet (sockent_t *se, /* {{{ */
 			status = parse_part_number (&buffer, &buffer_size,
 					&tmp);
 			if (status == 0)
-				n.severity = (int) tmp;
+				severity = (int) tmp;
 		}
 		else
 		{
@@ -1336,14 +2151,25 @@ static void free_sockent (sockent_t *se) /* {{{ */
 		next = se->next;
 
 #if HAVE_GCRYPT_H
-		if (se->cypher != NULL)
-		{
-			gcry_cipher_close (se->cypher);
-			se->cypher = NULL;
-		}
 		free (se->shared_secret);
 #endif /* HAVE_GCRYPT_H */
 
+		if (se->stream != NULL)
+		{
+			stream_frame_t *frame = se->stream->spool_head;
+
+			while (frame != NULL)
+			{
+				stream_frame_t *frame_next = frame->next;
+				sfree (frame);
+				frame = frame_next;
+			}
+			spool_destroy (se->stream->disk);
+
+			pthread_mutex_destroy (&se->stream->lock);
+			sfree (se->stream);
+		}
+
 		free (se->addr);
 		free (se);
 
@@ -1428,6 +2254,20 @@ static int network_bind_socket (const sockent_t *se, const struct addrinfo *ai)
 		return (-1);
 	}
 
+#ifdef SO_RXQ_OVFL
+	/* Have the kernel report the number of packets it dropped on this
+	 * socket, see `network_receive_dropped'. */
+	if (setsockopt (se->fd, SOL_SOCKET, SO_RXQ_OVFL,
+				&yes, sizeof (yes)) == -1)
+	{
+		char errbuf[1024];
+		WARNING ("network plugin: setsockopt (SO_RXQ_OVFL): %s. "
+				"Packets dropped by the kernel will not be "
+				"counted.",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+#endif
+
 	DEBUG ("fd = %i; calling `bind'", se->fd);
 
 	if (bind (se->fd, ai->ai_addr, ai->ai_addrlen) == -1)
@@ -1521,7 +2361,59 @@ static int network_bind_socket (const sockent_t *se, const struct addrinfo *ai)
 	return (0);
 } /* int network_bind_socket */
 
+static int network_set_nonblocking (int fd) /* {{{ */
+{
+	int flags;
+
+	flags = fcntl (fd, F_GETFL);
+	if ((flags == -1)
+			|| (fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1))
+	{
+		char errbuf[1024];
+		ERROR ("network plugin: fcntl: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	return (0);
+} /* }}} int network_set_nonblocking */
+
+static int network_listen_stream_socket (const sockent_t *se, /* {{{ */
+		const struct addrinfo *ai)
+{
+	int yes = 1;
+
+	if (setsockopt (se->fd, SOL_SOCKET, SO_REUSEADDR,
+				&yes, sizeof (yes)) == -1)
+	{
+		char errbuf[1024];
+		ERROR ("setsockopt: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	if (bind (se->fd, ai->ai_addr, ai->ai_addrlen) == -1)
+	{
+		char errbuf[1024];
+		ERROR ("bind: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	if (listen (se->fd, SOMAXCONN) == -1)
+	{
+		char errbuf[1024];
+		ERROR ("listen: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	/* The receive thread accepts connections until it would block. */
+	return (network_set_nonblocking (se->fd));
+} /* }}} int network_listen_stream_socket */
+
 #define CREATE_SOCKET_FLAGS_LISTEN    0x0001
+#define CREATE_SOCKET_FLAGS_STREAM    0x0002
 static sockent_t *network_create_socket (const char *node, /* {{{ */
 		const char *service,
 		const char *shared_secret,
@@ -1546,8 +2438,16 @@ static sockent_t *network_create_socket (const char *node, /* {{{ */
 	ai_hints.ai_flags |= AI_ADDRCONFIG;
 #endif
 	ai_hints.ai_family   = AF_UNSPEC;
-	ai_hints.ai_socktype = SOCK_DGRAM;
-	ai_hints.ai_protocol = IPPROTO_UDP;
+	if ((flags & CREATE_SOCKET_FLAGS_STREAM) != 0)
+	{
+		ai_hints.ai_socktype = SOCK_STREAM;
+		ai_hints.ai_protocol = IPPROTO_TCP;
+	}
+	else
+	{
+		ai_hints.ai_socktype = SOCK_DGRAM;
+		ai_hints.ai_protocol = IPPROTO_UDP;
+	}
 
 	ai_return = getaddrinfo (node, service, &ai_hints, &ai_list);
 	if (ai_return != 0)
@@ -1590,13 +2490,39 @@ static sockent_t *network_create_socket (const char *node, /* {{{ */
 		memset (se->addr, '\0', sizeof (struct sockaddr_storage));
 		memcpy (se->addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
 		se->addrlen = ai_ptr->ai_addrlen;
-
-		se->fd   = socket (ai_ptr->ai_family,
-				ai_ptr->ai_socktype,
-				ai_ptr->ai_protocol);
+		se->type = ai_ptr->ai_socktype;
+		se->stream = NULL;
 		se->next = NULL;
 
-		if (se->fd == -1)
+		if (((flags & CREATE_SOCKET_FLAGS_STREAM) != 0)
+				&& ((flags & CREATE_SOCKET_FLAGS_LISTEN) == 0))
+		{
+			/* Stream servers are connected when the first
+			 * packet is sent, see `network_stream_connect'. */
+			se->stream = calloc (1, sizeof (*se->stream));
+			if (se->stream == NULL)
+			{
+				ERROR ("network plugin: calloc failed.");
+				free (se->addr);
+				free (se);
+				continue;
+			}
+			pthread_mutex_init (&se->stream->lock, /* attr = */ NULL);
+			se->stream->family = ai_ptr->ai_family;
+			se->stream->reconnect_delay = STREAM_RECONNECT_MIN;
+			se->stream->spool_max = STREAM_SPOOL_SIZE;
+			ssnprintf (se->stream->name, sizeof (se->stream->name),
+					"%s:%s", node, service);
+			se->fd = -1;
+		}
+		else
+		{
+			se->fd = socket (ai_ptr->ai_family,
+					ai_ptr->ai_socktype,
+					ai_ptr->ai_protocol);
+		}
+
+		if ((se->fd == -1) && (se->stream == NULL))
 		{
 			char errbuf[1024];
 			ERROR ("socket: %s",
@@ -1609,7 +2535,10 @@ static sockent_t *network_create_socket (const char *node, /* {{{ */
 
 		if ((flags & CREATE_SOCKET_FLAGS_LISTEN) != 0)
 		{
-			status = network_bind_socket (se, ai_ptr);
+			if ((flags & CREATE_SOCKET_FLAGS_STREAM) != 0)
+				status = network_listen_stream_socket (se, ai_ptr);
+			else
+				status = network_bind_socket (se, ai_ptr);
 			if (status != 0)
 			{
 				close (se->fd);
@@ -1618,7 +2547,7 @@ static sockent_t *network_create_socket (const char *node, /* {{{ */
 				continue;
 			}
 		}
-		else /* sending socket */
+		else if (se->stream == NULL) /* sending datagram socket */
 		{
 			network_set_ttl (se, ai_ptr);
 		}
@@ -1626,7 +2555,6 @@ static sockent_t *network_create_socket (const char *node, /* {{{ */
 #if HAVE_GCRYPT_H
 		se->security_level = security_level;
 		se->shared_secret = NULL;
-		se->cypher = NULL;
 		if (shared_secret != NULL)
 		{
 			se->shared_secret = sstrdup (shared_secret);
@@ -1700,15 +2628,14 @@ static sockent_t *network_create_default_socket (int flags) /* {{{ */
 } /* }}} sockent_t *network_create_default_socket */
 
 static int network_add_listen_socket (const char *node, /* {{{ */
-    const char *service, const char *shared_secret, int security_level)
+    const char *service, const char *shared_secret, int security_level,
+    int flags)
 {
 	sockent_t *se;
 	sockent_t *se_ptr;
 	int se_num = 0;
 
-        int flags;
-
-        flags = CREATE_SOCKET_FLAGS_LISTEN;
+        flags |= CREATE_SOCKET_FLAGS_LISTEN;
 
 	if (service == NULL)
 		service = NET_DEFAULT_PORT;
@@ -1750,7 +2677,8 @@ static int network_add_listen_socket (const char *node, /* {{{ */
 } /* }}} int network_add_listen_socket */
 
 static int network_add_sending_socket (const char *node, /* {{{ */
-    const char *service, const char *shared_secret, int security_level)
+    const char *service, const char *shared_secret, int security_level,
+    int flags, const stream_options_t *opts)
 {
 	sockent_t *se;
 	sockent_t *se_ptr;
@@ -1759,15 +2687,34 @@ static int network_add_sending_socket (const char *node, /* {{{ */
 		service = NET_DEFAULT_PORT;
 
 	if (node == NULL)
-		se = network_create_default_socket (/* flags = */ 0);
+		se = network_create_default_socket (flags);
 	else
 		se = network_create_socket (node, service,
-				shared_secret, security_level,
-                                /* flags = */ 0);
+				shared_secret, security_level, flags);
 
 	if (se == NULL)
 		return (-1);
 
+	for (se_ptr = se; se_ptr != NULL; se_ptr = se_ptr->next)
+	{
+		if (se_ptr->stream == NULL)
+			continue;
+
+		se_ptr->stream->spool_max = opts->spool_size;
+		se_ptr->stream->replay_rate = opts->replay_rate;
+		/* A spool directory belongs to one server. */
+		if ((opts->spool_dir != NULL) && (se_ptr == se))
+		{
+			se_ptr->stream->disk = spool_create (opts->spool_dir,
+					opts->spool_disk_size);
+			if (se_ptr->stream->disk == NULL)
+				ERROR ("network plugin: Opening the spool directory "
+						"%s failed. Packets for %s will not be "
+						"spooled to disk.", opts->spool_dir,
+						se_ptr->stream->name);
+		}
+	}
+
 	if (sending_sockets == NULL)
 	{
 		sending_sockets = se;
@@ -1781,247 +2728,1582 @@ static int network_add_sending_socket (const char *node, /* {{{ */
 	return (0);
 } /* }}} int network_add_sending_socket */
 
-static void *dispatch_thread (void __attribute__((unused)) *arg) /* {{{ */
+static int receive_pool_create (void) /* {{{ */
+{
+	int i;
+
+	if (receive_pool != NULL)
+		return (0);
+
+	receive_pool = calloc ((size_t) receive_pool_size,
+			sizeof (*receive_pool));
+	/* Pages of this area are only touched when a packet of the size is
+	 * actually received. */
+	receive_pool_data = calloc ((size_t) receive_pool_size,
+			network_config_packet_size);
+	if ((receive_pool == NULL) || (receive_pool_data == NULL))
+	{
+		ERROR ("network plugin: calloc failed.");
+		sfree (receive_pool);
+		sfree (receive_pool_data);
+		return (-1);
+	}
+
+	for (i = 0; i < receive_pool_size; i++)
+		receive_pool[i].data = receive_pool_data
+			+ (((size_t) i) * network_config_packet_size);
+
+	for (i = 0; i < (receive_pool_size - 1); i++)
+		receive_pool[i].next = receive_pool + (i + 1);
+	receive_pool[receive_pool_size - 1].next = NULL;
+	receive_pool_free = receive_pool;
+
+	return (0);
+} /* }}} int receive_pool_create */
+
+static void receive_pool_destroy (void) /* {{{ */
+{
+	pthread_mutex_lock (&receive_pool_lock);
+	sfree (receive_pool);
+	sfree (receive_pool_data);
+	receive_pool_free = NULL;
+	pthread_mutex_unlock (&receive_pool_lock);
+} /* }}} void receive_pool_destroy */
+
+/* Moves free entries from the pool to `list' until it holds
+ * RECEIVE_BATCH_SIZE entries. If `wait' is non-zero and the pool is empty,
+ * waits for the dispatch thread to return entries. The statistics collected
+ * by the receive thread are added to the global counters while holding the
+ * lock anyway. */
+static void receive_pool_get (receive_list_entry_t **list, int *list_num, /* {{{ */
+		int wait, counter_t *received, counter_t *dropped)
+{
+	pthread_mutex_lock (&receive_pool_lock);
+
+	stats_packets_received += *received;
+	stats_packets_dropped += *dropped;
+	*received = 0;
+	*dropped = 0;
+
+	if (wait && (receive_pool_free == NULL) && (listen_loop == 0))
+	{
+		stats_pool_exhausted++;
+		while ((receive_pool_free == NULL) && (listen_loop == 0))
+			pthread_cond_wait (&receive_pool_cond, &receive_pool_lock);
+	}
+
+	while ((receive_pool_free != NULL) && (*list_num < RECEIVE_BATCH_SIZE))
+	{
+		receive_list_entry_t *ent = receive_pool_free;
+
+		receive_pool_free = ent->next;
+		ent->next = *list;
+		*list = ent;
+		(*list_num)++;
+	}
+
+	pthread_mutex_unlock (&receive_pool_lock);
+} /* }}} void receive_pool_get */
+
+static void receive_pool_put (receive_list_entry_t *head, /* {{{ */
+		receive_list_entry_t *tail)
+{
+	if (head == NULL)
+		return;
+
+	pthread_mutex_lock (&receive_pool_lock);
+	tail->next = receive_pool_free;
+	receive_pool_free = head;
+	pthread_cond_signal (&receive_pool_cond);
+	pthread_mutex_unlock (&receive_pool_lock);
+} /* }}} void receive_pool_put */
+
+/* Appends the receive thread's private list of `q' to the queue. If `wait'
+ * is zero, gives up (returning EBUSY) if the lock is held by the dispatch
+ * thread: Blocking here has led to insufficient performance in the past. */
+static int receive_queue_append (receive_queue_t *q, int wait) /* {{{ */
+{
+	if (q->private_head == NULL)
+		return (0);
+
+	if (wait)
+		pthread_mutex_lock (&q->lock);
+	else if (pthread_mutex_trylock (&q->lock) != 0)
+		return (EBUSY);
+
+	if (q->head == NULL)
+		q->head = q->private_head;
+	else
+		q->tail->next = q->private_head;
+	q->tail = q->private_tail;
+	q->length += q->private_num;
+
+	q->private_head = NULL;
+	q->private_tail = NULL;
+	q->private_num = 0;
+
+	pthread_cond_signal (&q->cond);
+	pthread_mutex_unlock (&q->lock);
+
+	return (0);
+} /* }}} int receive_queue_append */
+
+static void receive_queue_append_all (int wait) /* {{{ */
+{
+	int i;
+
+	for (i = 0; i < receive_queues_num; i++)
+		receive_queue_append (receive_queues + i, wait);
+} /* }}} void receive_queue_append_all */
+
+static void *dispatch_thread (void *arg) /* {{{ */
 {
+  receive_queue_t *q = arg;
+  parse_batch_t *batch;
+
+  /* The batch is allocated once, so parsing packets doesn't allocate
+   * memory. Without it, value lists are dispatched one by one. */
+  pthread_once (&parse_batch_key_once, parse_batch_key_create);
+  batch = malloc (sizeof (*batch));
+  if (batch == NULL)
+    ERROR ("network plugin: malloc failed.");
+  else
+  {
+    batch->vls_num = 0;
+    batch->values_num = 0;
+  }
+  pthread_setspecific (parse_batch_key, batch);
+
   while (42)
   {
-    receive_list_entry_t *ent;
-    sockent_t *se;
+    receive_list_entry_t *head;
 
     /* Lock and wait for more data to come in */
-    pthread_mutex_lock (&receive_list_lock);
+    pthread_mutex_lock (&q->lock);
     while ((listen_loop == 0)
-	&& (receive_list_head == NULL))
-      pthread_cond_wait (&receive_list_cond, &receive_list_lock);
+	&& (q->head == NULL))
+      pthread_cond_wait (&q->cond, &q->lock);
 
-    /* Remove the head entry and unlock */
-    ent = receive_list_head;
-    if (ent != NULL)
-      receive_list_head = ent->next;
-    pthread_mutex_unlock (&receive_list_lock);
+    /* Take the entire list and unlock */
+    head = q->head;
+    q->head = NULL;
+    q->tail = NULL;
+    q->length = 0;
+    pthread_mutex_unlock (&q->lock);
 
     /* Check whether we are supposed to exit. We do NOT check `listen_loop'
      * because we dispatch all missing packets before shutting down. */
-    if (ent == NULL)
+    if (head == NULL)
       break;
 
-    /* Look for the correct `sockent_t' */
-    se = listen_sockets;
-    while ((se != NULL) && (se->fd != ent->fd))
-	    se = se->next;
-
-    if (se == NULL)
+    /* Return the entries to the pool in batches, so the receive thread
+     * doesn't have to wait for the entire list to be parsed. */
+    while (head != NULL)
     {
-	    ERROR ("network plugin: Got packet from FD %i, but can't "
-			    "find an appropriate socket entry.",
-			    ent->fd);
-	    sfree (ent);
-	    continue;
+      receive_list_entry_t *done_head = head;
+      receive_list_entry_t *done_tail = NULL;
+      int i;
+
+      for (i = 0; (head != NULL) && (i < RECEIVE_BATCH_SIZE); i++)
+      {
+	parse_packet (head->se, head->data, head->data_len, /* flags = */ 0);
+	done_tail = head;
+	head = head->next;
+      }
+
+      receive_pool_put (done_head, done_tail);
+      if (batch != NULL)
+	parse_batch_flush (batch);
     }
-
-    parse_packet (se, ent->data, ent->data_len, /* flags = */ 0);
-    sfree (ent);
   } /* while (42) */
 
+  pthread_setspecific (parse_batch_key, NULL);
+  sfree (batch);
+
   return (NULL);
 } /* }}} void *dispatch_thread */
 
-static int network_receive (void)
+static int receive_queues_create (void) /* {{{ */
 {
-	char buffer[BUFF_SIZE];
-	int  buffer_len;
-
 	int i;
-	int status;
-
-	receive_list_entry_t *private_list_head;
-	receive_list_entry_t *private_list_tail;
 
-	if (listen_sockets_num == 0)
-		network_add_listen_socket (/* node = */ NULL,
-				/* service = */ NULL,
-				/* shared secret = */ NULL,
-				/* encryption = */ 0);
+	if (receive_queues != NULL)
+		return (0);
 
-	if (listen_sockets_num == 0)
+	receive_queues = calloc ((size_t) dispatch_threads_num,
+			sizeof (*receive_queues));
+	if (receive_queues == NULL)
 	{
-		ERROR ("network: Failed to open a listening socket.");
+		ERROR ("network plugin: calloc failed.");
+		return (-1);
+	}
+
+	for (i = 0; i < dispatch_threads_num; i++)
+	{
+		receive_queue_t *q = receive_queues + i;
+		int status;
+
+		pthread_mutex_init (&q->lock, /* attr = */ NULL);
+		pthread_cond_init (&q->cond, /* attr = */ NULL);
+
+		status = pthread_create (&q->thread, /* attr = */ NULL,
+				dispatch_thread, /* arg = */ q);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network: pthread_create failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			break;
+		}
+		q->thread_running = 1;
+		receive_queues_num++;
+	}
+
+	if (receive_queues_num == 0)
+	{
+		sfree (receive_queues);
 		return (-1);
 	}
 
-	private_list_head = NULL;
-	private_list_tail = NULL;
+	return (0);
+} /* }}} int receive_queues_create */
+
+/* Stops the dispatch threads after they have parsed all queued packets. */
+static void receive_queues_destroy (void) /* {{{ */
+{
+	int i;
 
-	while (listen_loop == 0)
+	for (i = 0; i < receive_queues_num; i++)
 	{
-		status = poll (listen_sockets_pollfd, listen_sockets_num, -1);
+		receive_queue_t *q = receive_queues + i;
 
-		if (status <= 0)
+		if (q->thread_running == 0)
+			continue;
+
+		pthread_mutex_lock (&q->lock);
+		pthread_cond_broadcast (&q->cond);
+		pthread_mutex_unlock (&q->lock);
+		pthread_join (q->thread, /* ret = */ NULL);
+		q->thread_running = 0;
+
+		pthread_mutex_destroy (&q->lock);
+		pthread_cond_destroy (&q->cond);
+	}
+
+	sfree (receive_queues);
+	receive_queues_num = 0;
+} /* }}} void receive_queues_destroy */
+
+/* Returns the queue responsible for packets sent from `addr'. Only the
+ * address is considered, not the port. */
+static receive_queue_t *receive_queue_get (const struct sockaddr_storage *addr) /* {{{ */
+{
+	const unsigned char *data;
+	size_t data_size;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	if (receive_queues_num == 1)
+		return (receive_queues);
+
+	if (addr->ss_family == AF_INET)
+	{
+		const struct sockaddr_in *sa = (const void *) addr;
+		data = (const void *) &sa->sin_addr;
+		data_size = sizeof (sa->sin_addr);
+	}
+	else if (addr->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *sa = (const void *) addr;
+		data = (const void *) &sa->sin6_addr;
+		data_size = sizeof (sa->sin6_addr);
+	}
+	else
+	{
+		return (receive_queues);
+	}
+
+	/* FNV-1a */
+	for (i = 0; i < data_size; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+
+	return (receive_queues + (hash % ((uint32_t) receive_queues_num)));
+} /* }}} receive_queue_t *receive_queue_get */
+
+/* Adds the number of packets the kernel dropped on the socket, as reported
+ * by the `SO_RXQ_OVFL' control message, to `dropped'. */
+static void network_receive_dropped (sockent_t *se, /* {{{ */
+		struct msghdr *msg, counter_t *dropped)
+{
+#ifdef SO_RXQ_OVFL
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR (msg);
+			cmsg != NULL;
+			cmsg = CMSG_NXTHDR (msg, cmsg))
+	{
+		uint32_t tmp;
+
+		if ((cmsg->cmsg_level != SOL_SOCKET)
+				|| (cmsg->cmsg_type != SO_RXQ_OVFL))
+			continue;
+
+		/* The kernel reports the total for the socket. */
+		memcpy (&tmp, CMSG_DATA (cmsg), sizeof (tmp));
+		*dropped += (counter_t) ((uint32_t) (tmp - se->rx_dropped));
+		se->rx_dropped = tmp;
+	}
+#endif /* SO_RXQ_OVFL */
+} /* }}} void network_receive_dropped */
+
+static void network_receive_truncated (const struct msghdr *msg) /* {{{ */
+{
+	static c_complain_t complaint = C_COMPLAIN_INIT_STATIC;
+
+	if ((msg->msg_flags & MSG_TRUNC) == 0)
+		return;
+
+	c_complain (LOG_WARNING, &complaint, "network plugin: Received a "
+			"packet larger than %zu bytes. Please increase the "
+			"`MaxPacketSize' option.", network_config_packet_size);
+} /* }}} void network_receive_truncated */
+
+/* Receives up to `entries_num' packets from the socket `se' directly into the
+ * data buffers of `entries' and stores the senders' addresses in `addrs'.
+ * Returns the number of packets received, which may be zero, or less than
+ * zero on error. Without recvmmsg(2) only one packet is read per call, since
+ * the socket may block. */
+static int network_receive_batch (sockent_t *se, /* {{{ */
+		receive_list_entry_t **entries, int entries_num,
+		struct sockaddr_storage *addrs, counter_t *dropped)
+{
+	struct iovec iov[RECEIVE_BATCH_SIZE];
+	union
+	{
+		struct cmsghdr cmsg;
+		char buffer[CMSG_SPACE (sizeof (uint32_t))];
+	} control[RECEIVE_BATCH_SIZE];
+#if HAVE_RECVMMSG
+	struct mmsghdr msgs[RECEIVE_BATCH_SIZE];
+#else
+	struct msghdr msgs[1];
+#endif
+	int status;
+	int i;
+
+	assert (entries_num <= RECEIVE_BATCH_SIZE);
+#if !HAVE_RECVMMSG
+	entries_num = 1;
+#endif
+
+	memset (msgs, 0, sizeof (msgs));
+	for (i = 0; i < entries_num; i++)
+	{
+		struct msghdr *msg;
+
+#if HAVE_RECVMMSG
+		msg = &msgs[i].msg_hdr;
+#else
+		msg = &msgs[i];
+#endif
+
+		iov[i].iov_base = entries[i]->data;
+		iov[i].iov_len = network_config_packet_size;
+
+		msg->msg_name = addrs + i;
+		msg->msg_namelen = sizeof (addrs[i]);
+		msg->msg_iov = iov + i;
+		msg->msg_iovlen = 1;
+		msg->msg_control = control[i].buffer;
+		msg->msg_controllen = sizeof (control[i].buffer);
+	}
+
+#if HAVE_RECVMMSG
+	status = recvmmsg (se->fd, msgs, (unsigned int) entries_num,
+			MSG_DONTWAIT, /* timeout = */ NULL);
+#else
+	status = (int) recvmsg (se->fd, &msgs[0], /* flags = */ 0);
+#endif
+	if (status < 0)
+	{
+		if ((errno == EINTR) || (errno == EAGAIN)
+				|| (errno == EWOULDBLOCK))
+			return (0);
+		return (-1);
+	}
+
+#if HAVE_RECVMMSG
+	for (i = 0; i < status; i++)
+	{
+		entries[i]->data_len = (int) msgs[i].msg_len;
+		network_receive_dropped (se, &msgs[i].msg_hdr, dropped);
+		network_receive_truncated (&msgs[i].msg_hdr);
+	}
+#else
+	entries[0]->data_len = status;
+	network_receive_dropped (se, &msgs[0], dropped);
+	network_receive_truncated (&msgs[0]);
+	status = 1;
+#endif
+
+	return (status);
+} /* }}} int network_receive_batch */
+
+/* Takes one entry from the spare list, refilling it from the pool. If the
+ * pool is exhausted, everything is handed to the dispatch threads first and
+ * the function waits for free entries. Returns NULL when shutting down. */
+static receive_list_entry_t *receive_spare_take ( /* {{{ */
+		receive_list_entry_t **spare_list, int *spare_list_num,
+		counter_t *received, counter_t *dropped)
+{
+	receive_list_entry_t *ent;
+
+	if (*spare_list_num == 0)
+		receive_pool_get (spare_list, spare_list_num,
+				/* wait = */ 0, received, dropped);
+
+	if (*spare_list_num == 0)
+	{
+		receive_queue_append_all (/* wait = */ 1);
+		receive_pool_get (spare_list, spare_list_num,
+				/* wait = */ 1, received, dropped);
+		if (*spare_list_num == 0) /* shutting down */
+			return (NULL);
+	}
+
+	ent = *spare_list;
+	*spare_list = ent->next;
+	(*spare_list_num)--;
+
+	ent->next = NULL;
+	return (ent);
+} /* }}} receive_list_entry_t *receive_spare_take */
+
+static void receive_queue_private_append (receive_queue_t *q, /* {{{ */
+		receive_list_entry_t *ent)
+{
+	if (q->private_head == NULL)
+		q->private_head = ent;
+	else
+		q->private_tail->next = ent;
+	q->private_tail = ent;
+	q->private_num++;
+} /* }}} void receive_queue_private_append */
+
+/* Accepts all pending connections on the listening stream socket `se'.
+ * Returns the number of new connections. */
+static int network_stream_accept (sockent_t *se) /* {{{ */
+{
+	int num = 0;
+
+	while (42)
+	{
+		stream_conn_t *conn;
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof (addr);
+		int fd;
+
+		fd = accept (se->fd, (struct sockaddr *) &addr, &addrlen);
+		if (fd < 0)
 		{
 			char errbuf[1024];
+
 			if (errno == EINTR)
 				continue;
-			ERROR ("poll failed: %s",
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				ERROR ("network plugin: accept failed: %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+			break;
+		}
+
+		if (network_set_nonblocking (fd) != 0)
+		{
+			close (fd);
+			continue;
+		}
+
+		conn = calloc (1, sizeof (*conn));
+		if (conn != NULL)
+			conn->buffer = malloc (STREAM_FRAME_HEADER_SIZE
+					+ network_config_packet_size);
+		if ((conn == NULL) || (conn->buffer == NULL))
+		{
+			ERROR ("network plugin: malloc failed.");
+			if (conn != NULL)
+				sfree (conn);
+			close (fd);
+			continue;
+		}
+
+		conn->fd = fd;
+		conn->se = se;
+		memcpy (&conn->addr, &addr, sizeof (addr));
+		conn->buffer_fill = 0;
+
+		conn->next = stream_conns;
+		stream_conns = conn;
+		stream_conns_num++;
+		num++;
+	}
+
+	return (num);
+} /* }}} int network_stream_accept */
+
+static void network_stream_conn_close (stream_conn_t *conn) /* {{{ */
+{
+	close (conn->fd);
+	sfree (conn->buffer);
+	sfree (conn);
+} /* }}} void network_stream_conn_close */
+
+/* Reads from a stream connection and queues the complete packets for the
+ * dispatch thread of the sender. Returns less than zero if the connection
+ * has been closed by the peer or is broken. */
+static int network_stream_receive (stream_conn_t *conn, /* {{{ */
+		receive_list_entry_t **spare_list, int *spare_list_num,
+		counter_t *received, counter_t *dropped)
+{
+	size_t buffer_size = STREAM_FRAME_HEADER_SIZE
+		+ network_config_packet_size;
+	receive_queue_t *q = receive_queue_get (&conn->addr);
+	int i;
+
+	/* Don't starve the other sockets. */
+	for (i = 0; i < RECEIVE_BATCH_SIZE; i++)
+	{
+		ssize_t status;
+		size_t offset;
+
+		status = read (conn->fd, conn->buffer + conn->buffer_fill,
+				buffer_size - conn->buffer_fill);
+		if (status < 0)
+		{
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return (0);
+			ERROR ("network plugin: read failed: %s",
 					sstrerror (errno, errbuf, sizeof (errbuf)));
 			return (-1);
 		}
+		else if (status == 0)
+		{
+			return (-1);
+		}
+		conn->buffer_fill += (size_t) status;
 
-		for (i = 0; (i < listen_sockets_num) && (status > 0); i++)
+		offset = 0;
+		while ((conn->buffer_fill - offset) >= STREAM_FRAME_HEADER_SIZE)
 		{
 			receive_list_entry_t *ent;
+			size_t packet_size;
+			uint32_t tmp;
 
-			if ((listen_sockets_pollfd[i].revents
-						& (POLLIN | POLLPRI)) == 0)
-				continue;
-			status--;
-
-			buffer_len = recv (listen_sockets_pollfd[i].fd,
-					buffer, sizeof (buffer),
-					0 /* no flags */);
-			if (buffer_len < 0)
+			memcpy (&tmp, conn->buffer + offset, sizeof (tmp));
+			packet_size = (size_t) ntohl (tmp);
+			if ((packet_size == 0)
+					|| (packet_size > network_config_packet_size))
 			{
-				char errbuf[1024];
-				ERROR ("recv failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
+				ERROR ("network plugin: Received a packet of "
+						"%zu bytes on a stream connection, "
+						"the maximum is %zu. Please increase "
+						"the `MaxPacketSize' option. Closing "
+						"the connection.",
+						packet_size, network_config_packet_size);
 				return (-1);
 			}
 
-			/* TODO: Possible performance enhancement: Do not free
-			 * these entries in the dispatch thread but put them in
-			 * another list, so we don't have to allocate more and
-			 * more of these structures. */
-			ent = malloc (sizeof (receive_list_entry_t));
+			if ((conn->buffer_fill - offset)
+					< (STREAM_FRAME_HEADER_SIZE + packet_size))
+				break;
+
+			ent = receive_spare_take (spare_list, spare_list_num,
+					received, dropped);
 			if (ent == NULL)
-			{
-				ERROR ("network plugin: malloc failed.");
 				return (-1);
-			}
-			memset (ent, 0, sizeof (receive_list_entry_t));
-			ent->fd = listen_sockets_pollfd[i].fd;
-			ent->next = NULL;
 
-			/* Hopefully this be optimized out by the compiler. It
-			 * might help prevent stupid bugs in the future though.
-			 */
-			assert (sizeof (ent->data) == sizeof (buffer));
+			memcpy (ent->data,
+					conn->buffer + offset + STREAM_FRAME_HEADER_SIZE,
+					packet_size);
+			ent->data_len = (int) packet_size;
+			ent->se = conn->se;
+			receive_queue_private_append (q, ent);
+			(*received)++;
 
-			memcpy (ent->data, buffer, buffer_len);
-			ent->data_len = buffer_len;
+			offset += STREAM_FRAME_HEADER_SIZE + packet_size;
+		}
 
-			if (private_list_head == NULL)
-				private_list_head = ent;
-			else
-				private_list_tail->next = ent;
-			private_list_tail = ent;
+		if (offset > 0)
+		{
+			memmove (conn->buffer, conn->buffer + offset,
+					conn->buffer_fill - offset);
+			conn->buffer_fill -= offset;
+		}
+	}
+
+	return (0);
+} /* }}} int network_stream_receive */
+
+/* Resizes `listen_sockets_pollfd' for the listening sockets, which come
+ * first, and the stream connections. */
+static int network_receive_pollfd_update (void) /* {{{ */
+{
+	struct pollfd *tmp;
+	stream_conn_t *conn;
+	int i;
+
+	tmp = realloc (listen_sockets_pollfd,
+			(listen_sockets_num + stream_conns_num)
+			* sizeof (*listen_sockets_pollfd));
+	if (tmp == NULL)
+	{
+		ERROR ("network plugin: realloc failed.");
+		return (-1);
+	}
+	listen_sockets_pollfd = tmp;
+
+	for (i = listen_sockets_num, conn = stream_conns;
+			conn != NULL;
+			i++, conn = conn->next)
+	{
+		listen_sockets_pollfd[i].fd = conn->fd;
+		listen_sockets_pollfd[i].events = POLLIN | POLLPRI;
+		listen_sockets_pollfd[i].revents = 0;
+	}
+
+	return (0);
+} /* }}} int network_receive_pollfd_update */
+
+static int network_receive (void) /* {{{ */
+{
+	sockent_t *se;
+	int i;
+	int status;
+	int ret = 0;
+
+	/* Free entries taken from the pool, ready to receive into. */
+	receive_list_entry_t *spare_list = NULL;
+	int                   spare_list_num = 0;
+
+	counter_t received = 0;
+	counter_t dropped = 0;
+
+	if (listen_sockets_num == 0)
+		network_add_listen_socket (/* node = */ NULL,
+				/* service = */ NULL,
+				/* shared secret = */ NULL,
+				/* encryption = */ 0,
+				/* flags = */ 0);
+
+	if (listen_sockets_num == 0)
+	{
+		ERROR ("network: Failed to open a listening socket.");
+		return (-1);
+	}
+
+	while ((listen_loop == 0) && (ret == 0))
+	{
+		stream_conn_t *conn;
+		stream_conn_t **conn_prev;
+		int conns_changed = 0;
+
+		status = poll (listen_sockets_pollfd,
+				listen_sockets_num + stream_conns_num, -1);
+
+		if (status <= 0)
+		{
+			char errbuf[1024];
+			if (errno == EINTR)
+				continue;
+			ERROR ("poll failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			ret = -1;
+			break;
+		}
+
+		/* The stream connections follow the listening sockets in
+		 * `listen_sockets_pollfd'. They are handled first, since
+		 * accepting connections changes the list. */
+		for (i = listen_sockets_num, conn_prev = &stream_conns;
+				(*conn_prev != NULL) && (status > 0);
+				i++)
+		{
+			conn = *conn_prev;
 
-			/* Do not block here. Blocking here has led to
-			 * insufficient performance in the past. */
-			if (pthread_mutex_trylock (&receive_list_lock) == 0)
+			if ((listen_sockets_pollfd[i].revents == 0)
+					|| (network_stream_receive (conn,
+							&spare_list, &spare_list_num,
+							&received, &dropped) == 0))
 			{
-				if (receive_list_head == NULL)
-					receive_list_head = private_list_head;
-				else
-					receive_list_tail->next = private_list_head;
-				receive_list_tail = private_list_tail;
+				if (listen_sockets_pollfd[i].revents != 0)
+					status--;
+				conn_prev = &conn->next;
+				continue;
+			}
+			status--;
 
-				private_list_head = NULL;
-				private_list_tail = NULL;
+			*conn_prev = conn->next;
+			stream_conns_num--;
+			network_stream_conn_close (conn);
+			conns_changed = 1;
+		}
+		receive_queue_append_all (/* wait = */ 0);
+
+		/* `listen_sockets' is in the same order as
+		 * `listen_sockets_pollfd'. */
+		for (i = 0, se = listen_sockets;
+				(i < listen_sockets_num) && (se != NULL)
+				&& (status > 0) && (ret == 0);
+				i++, se = se->next)
+		{
+			if ((listen_sockets_pollfd[i].revents
+						& (POLLIN | POLLPRI)) == 0)
+				continue;
+			status--;
 
-				pthread_cond_signal (&receive_list_cond);
-				pthread_mutex_unlock (&receive_list_lock);
+			if (se->type == SOCK_STREAM)
+			{
+				if (network_stream_accept (se) > 0)
+					conns_changed = 1;
+				continue;
 			}
+
+			/* Read until the socket's buffer is empty. */
+			while (42)
+			{
+				receive_list_entry_t *entries[RECEIVE_BATCH_SIZE];
+				struct sockaddr_storage addrs[RECEIVE_BATCH_SIZE];
+				receive_list_entry_t *ent;
+				int entries_num;
+				int received_num;
+				int j;
+
+				if (spare_list_num < RECEIVE_BATCH_SIZE)
+					receive_pool_get (&spare_list, &spare_list_num,
+							/* wait = */ 0, &received, &dropped);
+
+				if (spare_list_num == 0)
+				{
+					/* The pool is exhausted. Hand everything to the
+					 * dispatch threads and wait for them to return
+					 * entries. Meanwhile the socket's buffer takes
+					 * incoming packets. */
+					receive_queue_append_all (/* wait = */ 1);
+					receive_pool_get (&spare_list, &spare_list_num,
+							/* wait = */ 1, &received, &dropped);
+					if (spare_list_num == 0) /* shutting down */
+						break;
+				}
+
+				entries_num = 0;
+				for (ent = spare_list;
+						(ent != NULL) && (entries_num < RECEIVE_BATCH_SIZE);
+						ent = ent->next)
+					entries[entries_num++] = ent;
+
+				received_num = network_receive_batch (se,
+						entries, entries_num, addrs, &dropped);
+				if (received_num < 0)
+				{
+					char errbuf[1024];
+					ERROR ("recv failed: %s",
+							sstrerror (errno, errbuf,
+								sizeof (errbuf)));
+					ret = -1;
+					break;
+				}
+
+				/* The packets were received into the first
+				 * `received_num' entries of the spare list. */
+				for (j = 0; j < received_num; j++)
+				{
+					ent = spare_list;
+					spare_list = ent->next;
+					spare_list_num--;
+
+					ent->se = se;
+					ent->next = NULL;
+
+					receive_queue_private_append (
+							receive_queue_get (addrs + j), ent);
+				}
+				received += (counter_t) received_num;
+
+				receive_queue_append_all (/* wait = */ 0);
+
+				if (received_num < RECEIVE_BATCH_SIZE)
+					break;
+			} /* while (42) */
 		} /* for (listen_sockets_pollfd) */
+
+		if (conns_changed && (network_receive_pollfd_update () != 0))
+			ret = -1;
 	} /* while (listen_loop == 0) */
 
-	/* Make sure everything is dispatched before exiting. */
-	if (private_list_head != NULL)
+	while (stream_conns != NULL)
 	{
-		pthread_mutex_lock (&receive_list_lock);
-
-		if (receive_list_head == NULL)
-			receive_list_head = private_list_head;
-		else
-			receive_list_tail->next = private_list_head;
-		receive_list_tail = private_list_tail;
+		stream_conn_t *conn = stream_conns;
+		stream_conns = conn->next;
+		network_stream_conn_close (conn);
+	}
+	stream_conns_num = 0;
 
-		private_list_head = NULL;
-		private_list_tail = NULL;
+	/* Make sure everything is dispatched before exiting. */
+	receive_queue_append_all (/* wait = */ 1);
 
-		pthread_cond_signal (&receive_list_cond);
-		pthread_mutex_unlock (&receive_list_lock);
+	if (spare_list != NULL)
+	{
+		receive_list_entry_t *tail = spare_list;
+		while (tail->next != NULL)
+			tail = tail->next;
+		receive_pool_put (spare_list, tail);
 	}
 
-	return (0);
-} /* int network_receive */
+	/* Publish the remaining statistics. */
+	pthread_mutex_lock (&receive_pool_lock);
+	stats_packets_received += received;
+	stats_packets_dropped += dropped;
+	pthread_mutex_unlock (&receive_pool_lock);
+
+	return (ret);
+} /* }}} int network_receive */
 
 static void *receive_thread (void __attribute__((unused)) *arg)
 {
 	return (network_receive () ? (void *) 1 : (void *) 0);
 } /* void *receive_thread */
 
-static void network_init_buffer (void)
+static void send_state_init_buffer (send_state_t *state) /* {{{ */
 {
-	memset (send_buffer, 0, sizeof (send_buffer));
-	send_buffer_ptr = send_buffer;
-	send_buffer_fill = 0;
+	state->buffer = state->buffers[state->buffers_num];
+#if HAVE_ZLIB_H
+	if (state->segment != NULL)
+		state->buffer = state->segment;
+#endif
+	state->buffer_ptr = state->buffer;
+	state->buffer_fill = 0;
 
-	memset (&send_buffer_vl, 0, sizeof (send_buffer_vl));
-} /* int network_init_buffer */
+	ident_release (state->buffer_vl.ident);
+	memset (&state->buffer_vl, 0, sizeof (state->buffer_vl));
+} /* }}} void send_state_init_buffer */
 
-static void networt_send_buffer_plain (const sockent_t *se, /* {{{ */
-		const char *buffer, size_t buffer_size)
+#if HAVE_ZLIB_H
+/* Starts a new compressed packet in `buffers[buffers_num]'. */
+static void send_state_packet_start (send_state_t *state) /* {{{ */
 {
-	int status;
+	deflateReset (&state->zstream);
+	state->zstream.next_out = (Bytef *) (state->buffers[state->buffers_num]
+			+ PART_COMPRESS_ZLIB_SIZE);
+	state->zstream.avail_out = (uInt) (network_config_packet_size
+			- (BUFF_SIG_SIZE + PART_COMPRESS_ZLIB_SIZE));
+	state->packet_fill = 0;
+	state->packet_orig = 0;
+} /* }}} void send_state_packet_start */
+#endif
 
-	while (42)
+static void send_state_destroy (send_state_t *state) /* {{{ */
+{
+	int i;
+
+	if (state == NULL)
+		return;
+
+	ident_release (state->buffer_vl.ident);
+	for (i = 0; i < (SEND_BATCH_SIZE + 1); i++)
+		sfree (state->buffers[i]);
+#if HAVE_GCRYPT_H
+	for (i = 0; i < SEND_BATCH_SIZE; i++)
+		sfree (state->scratch[i]);
+#endif
+#if HAVE_ZLIB_H
+	if (state->segment != NULL)
 	{
-		status = sendto (se->fd, buffer, buffer_size, 0 /* no flags */,
-				(struct sockaddr *) se->addr, se->addrlen);
+		deflateEnd (&state->zstream);
+		sfree (state->segment);
+	}
+#endif
+	pthread_mutex_destroy (&state->lock);
+	sfree (state);
+} /* }}} void send_state_destroy */
+
+static send_state_t *send_state_create (void) /* {{{ */
+{
+	send_state_t *state;
+	int i;
+
+	state = calloc (1, sizeof (*state));
+	if (state == NULL)
+	{
+		ERROR ("network plugin: calloc failed.");
+		return (NULL);
+	}
+	pthread_mutex_init (&state->lock, /* attr = */ NULL);
+
+	for (i = 0; i < (SEND_BATCH_SIZE + 1); i++)
+	{
+		state->buffers[i] = malloc (network_config_packet_size);
+		if (state->buffers[i] == NULL)
+		{
+			ERROR ("network plugin: malloc failed.");
+			send_state_destroy (state);
+			return (NULL);
+		}
+	}
+
+#if HAVE_GCRYPT_H
+	/* Signing and encrypting adds up to BUFF_SIG_SIZE bytes. Notifications
+	 * don't reserve this space. */
+	for (i = 0; i < SEND_BATCH_SIZE; i++)
+	{
+		state->scratch[i] = malloc (network_config_packet_size
+				+ BUFF_SIG_SIZE);
+		if (state->scratch[i] == NULL)
+		{
+			ERROR ("network plugin: malloc failed.");
+			send_state_destroy (state);
+			return (NULL);
+		}
+	}
+#endif
+
+#if HAVE_ZLIB_H
+	if (network_config_compress)
+	{
+		int status;
+
+		/* Raw deflate data, see `part_compress_zlib_t'. */
+		status = deflateInit2 (&state->zstream, Z_BEST_SPEED, Z_DEFLATED,
+				-MAX_WBITS, /* memLevel = */ 8, Z_DEFAULT_STRATEGY);
+		if (status != Z_OK)
+		{
+			ERROR ("network plugin: deflateInit2 failed with status %i.",
+					status);
+			send_state_destroy (state);
+			return (NULL);
+		}
+
+		state->segment = malloc (network_config_packet_size);
+		if (state->segment == NULL)
+		{
+			ERROR ("network plugin: malloc failed.");
+			deflateEnd (&state->zstream);
+			send_state_destroy (state);
+			return (NULL);
+		}
+
+		send_state_packet_start (state);
+	}
+#endif
+
+	send_state_init_buffer (state);
+
+	return (state);
+} /* }}} send_state_t *send_state_create */
+
+/* Sends the packets with one system call, if sendmmsg(2) is available. */
+static void network_send_plain (const sockent_t *se, /* {{{ */
+		char **packets, const size_t *packets_size, int packets_num)
+{
+#if HAVE_SENDMMSG
+	struct mmsghdr msgs[SEND_BATCH_SIZE];
+	struct iovec iov[SEND_BATCH_SIZE];
+	int offset;
+	int i;
+
+	assert (packets_num <= SEND_BATCH_SIZE);
+
+	memset (msgs, 0, sizeof (msgs));
+	for (i = 0; i < packets_num; i++)
+	{
+		iov[i].iov_base = packets[i];
+		iov[i].iov_len = packets_size[i];
+
+		msgs[i].msg_hdr.msg_name = se->addr;
+		msgs[i].msg_hdr.msg_namelen = se->addrlen;
+		msgs[i].msg_hdr.msg_iov = iov + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	offset = 0;
+	while (offset < packets_num)
+	{
+		int status;
+
+		status = sendmmsg (se->fd, msgs + offset,
+				(unsigned int) (packets_num - offset), /* flags = */ 0);
 		if (status < 0)
 		{
 			char errbuf[1024];
 			if (errno == EINTR)
 				continue;
-			ERROR ("network plugin: sendto failed: %s",
+			ERROR ("network plugin: sendmmsg failed: %s",
 					sstrerror (errno, errbuf,
 						sizeof (errbuf)));
 			break;
 		}
 
-		break;
-	} /* while (42) */
-} /* }}} void networt_send_buffer_plain */
+		offset += status;
+	} /* while (offset < packets_num) */
+#else /* if !HAVE_SENDMMSG */
+	int i;
+
+	for (i = 0; i < packets_num; i++)
+	{
+		while (42)
+		{
+			int status;
+
+			status = sendto (se->fd, packets[i], packets_size[i],
+					0 /* no flags */,
+					(struct sockaddr *) se->addr, se->addrlen);
+			if (status < 0)
+			{
+				char errbuf[1024];
+				if (errno == EINTR)
+					continue;
+				ERROR ("network plugin: sendto failed: %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				break;
+			}
+
+			break;
+		} /* while (42) */
+	}
+#endif /* !HAVE_SENDMMSG */
+} /* }}} void network_send_plain */
+
+/* Closes the connection to a stream server and schedules the next attempt to
+ * connect. The caller must hold the lock of `se->stream'. */
+static void network_stream_disconnect (sockent_t *se) /* {{{ */
+{
+	sockent_stream_t *st = se->stream;
+
+	if (se->fd >= 0)
+	{
+		close (se->fd);
+		se->fd = -1;
+	}
+
+	/* The server discards the incomplete frame. */
+	st->spool_head_sent = 0;
+	st->disk_head_sent = 0;
+
+	st->reconnect_next = cdtime () + st->reconnect_delay;
+	st->reconnect_delay *= 2;
+	if (st->reconnect_delay > STREAM_RECONNECT_MAX)
+		st->reconnect_delay = STREAM_RECONNECT_MAX;
+} /* }}} void network_stream_disconnect */
+
+/* Starts connecting to a stream server, unless the last attempt failed too
+ * recently. The connection is established in the background: Until then,
+ * writing to the socket fails with EAGAIN and packets are spooled. The caller
+ * must hold the lock of `se->stream'. */
+static void network_stream_connect (sockent_t *se) /* {{{ */
+{
+	sockent_stream_t *st = se->stream;
+	int fd;
+	int yes = 1;
+	struct addrinfo ai;
+
+	if ((se->fd >= 0) || (cdtime () < st->reconnect_next))
+		return;
+
+	fd = socket (st->family, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+	{
+		char errbuf[1024];
+		c_complain (LOG_ERR, &st->complaint,
+				"network plugin: socket: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		network_stream_disconnect (se);
+		return;
+	}
+
+	if (network_set_nonblocking (fd) != 0)
+	{
+		close (fd);
+		network_stream_disconnect (se);
+		return;
+	}
+
+#ifdef TCP_NODELAY
+	/* Packets are batched already, don't delay them any further. */
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof (yes));
+#else
+	yes = 0; /* Make compiler happy */
+#endif
+
+	if ((connect (fd, (struct sockaddr *) se->addr, se->addrlen) != 0)
+			&& (errno != EINPROGRESS))
+	{
+		char errbuf[1024];
+		c_complain (LOG_ERR, &st->complaint,
+				"network plugin: Connecting to %s failed: %s",
+				st->name, sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (fd);
+		network_stream_disconnect (se);
+		return;
+	}
+
+	se->fd = fd;
+
+	memset (&ai, 0, sizeof (ai));
+	ai.ai_family = st->family;
+	ai.ai_addr = (struct sockaddr *) se->addr;
+	ai.ai_addrlen = se->addrlen;
+	network_set_ttl (se, &ai);
+} /* }}} void network_stream_connect */
+
+/* Writes as much of `iov' as the socket takes without blocking. Returns the
+ * number of bytes written, or less than zero if the connection is broken, in
+ * which case it has been closed. The caller must hold the lock of
+ * `se->stream'. */
+static ssize_t network_stream_write (sockent_t *se, /* {{{ */
+		struct iovec *iov, int iov_num)
+{
+	sockent_stream_t *st = se->stream;
+	struct msghdr msg;
+	ssize_t status;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_num;
+
+	while (42)
+	{
+		status = sendmsg (se->fd, &msg, /* flags = */ 0);
+		if (status >= 0)
+			break;
+
+		if (errno == EINTR)
+			continue;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return (0);
+
+		{
+			char errbuf[1024];
+			c_complain (LOG_ERR, &st->complaint,
+					"network plugin: Sending to %s failed: %s",
+					st->name,
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+		}
+		network_stream_disconnect (se);
+		return (-1);
+	}
+
+	if (status > 0)
+	{
+		st->reconnect_delay = STREAM_RECONNECT_MIN;
+		c_release (LOG_INFO, &st->complaint,
+				"network plugin: Connected to %s.", st->name);
+	}
+
+	return (status);
+} /* }}} ssize_t network_stream_write */
+
+/* Appends `packet' to the disk spool. Returns less than zero if it's full
+ * or writing fails. */
+static int network_stream_spool_disk (sockent_stream_t *st, /* {{{ */
+		const char *packet, size_t packet_size)
+{
+	int status;
+
+	status = spool_append (st->disk, packet, packet_size);
+	if (status == 0)
+		return (0);
+
+	if (status == ENOSPC)
+		c_complain (LOG_WARNING, &st->disk_complaint,
+				"network plugin: The disk spool for %s is full, "
+				"discarding packets. Increase the `SpoolDiskSize' "
+				"option to survive longer outages.", st->name);
+	else
+		c_complain (LOG_ERR, &st->disk_complaint,
+				"network plugin: Writing to the disk spool for %s "
+				"failed, discarding packets.", st->name);
+	return (-1);
+} /* }}} int network_stream_spool_disk */
+
+/* Moves the frames of the spool to the disk spool, except for a partially
+ * written head. Frames the disk spool doesn't take are discarded, so the
+ * order of the packets is kept. */
+static void network_stream_spool_to_disk (sockent_stream_t *st) /* {{{ */
+{
+	stream_frame_t *frame;
+	stream_frame_t **frame_prev = &st->spool_head;
+
+	if (st->spool_head_sent > 0)
+		frame_prev = &st->spool_head->next;
+
+	while ((frame = *frame_prev) != NULL)
+	{
+		network_stream_spool_disk (st,
+				frame->data + STREAM_FRAME_HEADER_SIZE,
+				frame->size - STREAM_FRAME_HEADER_SIZE);
+
+		*frame_prev = frame->next;
+		st->spool_size -= frame->size;
+		sfree (frame);
+	}
+
+	st->spool_tail = (st->spool_head_sent > 0) ? st->spool_head : NULL;
+} /* }}} void network_stream_spool_to_disk */
+
+/* Appends a frame holding `packet' to the spool. The spool takes at least
+ * one frame, so a partially written frame can always be kept. If the spool is
+ * full, or the disk spool isn't empty, the packet goes to the disk spool, if
+ * there is one. Returns less than zero if the packet is discarded. */
+static int network_stream_spool (sockent_stream_t *st, /* {{{ */
+		const char *packet, size_t packet_size)
+{
+	stream_frame_t *frame;
+	size_t size = STREAM_FRAME_HEADER_SIZE + packet_size;
+	uint32_t tmp;
+
+	if ((st->disk != NULL) && !spool_is_empty (st->disk))
+		return (network_stream_spool_disk (st, packet, packet_size));
+
+	if ((st->spool_head != NULL)
+			&& ((st->spool_size + size) > st->spool_max))
+	{
+		if (st->disk != NULL)
+		{
+			network_stream_spool_to_disk (st);
+			return (network_stream_spool_disk (st, packet, packet_size));
+		}
+
+		c_complain (LOG_WARNING, &st->spool_complaint,
+				"network plugin: The spool for %s is full, "
+				"discarding packets. The server is not "
+				"reachable or doesn't keep up. Increase the "
+				"`SpoolSize' option or set `SpoolDirectory' to "
+				"survive longer outages.",
+				st->name);
+		return (-1);
+	}
+
+	frame = malloc (sizeof (*frame) + size);
+	if (frame == NULL)
+	{
+		ERROR ("network plugin: malloc failed.");
+		return (-1);
+	}
+	frame->data = (char *) (frame + 1);
+	frame->size = size;
+	frame->next = NULL;
+
+	tmp = htonl ((uint32_t) packet_size);
+	memcpy (frame->data, &tmp, sizeof (tmp));
+	memcpy (frame->data + STREAM_FRAME_HEADER_SIZE, packet, packet_size);
+
+	if (st->spool_tail == NULL)
+		st->spool_head = frame;
+	else
+		st->spool_tail->next = frame;
+	st->spool_tail = frame;
+	st->spool_size += size;
+
+	return (0);
+} /* }}} int network_stream_spool */
+
+/* Returns true if the rate limit allows to start sending another packet of
+ * the disk spool. Tokens accumulate for up to one second. */
+static int network_stream_replay_allowed (sockent_stream_t *st) /* {{{ */
+{
+	cdtime_t now;
+	double max;
+
+	if (st->replay_rate <= 0.0)
+		return (1);
+
+	now = cdtime ();
+	max = (st->replay_rate > 1.0) ? st->replay_rate : 1.0;
+	st->replay_tokens += st->replay_rate
+		* CDTIME_T_TO_DOUBLE (now - st->replay_last);
+	if (st->replay_tokens > max)
+		st->replay_tokens = max;
+	st->replay_last = now;
+
+	return (st->replay_tokens >= 1.0);
+} /* }}} int network_stream_replay_allowed */
+
+/* Writes the packets of the disk spool, one at a time, until it is empty, the
+ * socket would block or the rate limit is reached. The caller must hold the
+ * lock of `se->stream'. */
+static void network_stream_flush_disk (sockent_t *se) /* {{{ */
+{
+	sockent_stream_t *st = se->stream;
+
+	while (se->fd >= 0)
+	{
+		struct iovec iov[2];
+		int iov_num = 0;
+		const void *data;
+		size_t size;
+		uint32_t header;
+		ssize_t status;
+
+		if ((st->disk_head_sent == 0) && !network_stream_replay_allowed (st))
+			break;
+
+		if (spool_peek (st->disk, &data, &size) != 0)
+			break;
+
+		header = htonl ((uint32_t) size);
+		if (st->disk_head_sent < sizeof (header))
+		{
+			iov[iov_num].iov_base = ((char *) &header) + st->disk_head_sent;
+			iov[iov_num].iov_len = sizeof (header) - st->disk_head_sent;
+			iov_num++;
+			iov[iov_num].iov_base = (void *) data;
+			iov[iov_num].iov_len = size;
+			iov_num++;
+		}
+		else
+		{
+			iov[iov_num].iov_base = ((char *) data)
+				+ (st->disk_head_sent - sizeof (header));
+			iov[iov_num].iov_len = size
+				- (st->disk_head_sent - sizeof (header));
+			iov_num++;
+		}
+
+		status = network_stream_write (se, iov, iov_num);
+		if (status <= 0)
+			break;
+
+		st->disk_head_sent += (size_t) status;
+		if (st->disk_head_sent >= (sizeof (header) + size))
+		{
+			spool_shift (st->disk);
+			st->disk_head_sent = 0;
+			st->replay_tokens -= 1.0;
+		}
+	}
+} /* }}} void network_stream_flush_disk */
+
+/* Writes spooled frames until the spool is empty or the socket would block,
+ * followed by the disk spool. The caller must hold the lock of
+ * `se->stream'. */
+static void network_stream_flush_spool (sockent_t *se) /* {{{ */
+{
+	sockent_stream_t *st = se->stream;
+
+	while ((st->spool_head != NULL) && (se->fd >= 0))
+	{
+		struct iovec iov[STREAM_IOV_MAX];
+		int iov_num = 0;
+		stream_frame_t *frame;
+		ssize_t status;
+		size_t written;
+
+		for (frame = st->spool_head;
+				(frame != NULL) && (iov_num < STREAM_IOV_MAX);
+				frame = frame->next)
+		{
+			iov[iov_num].iov_base = frame->data;
+			iov[iov_num].iov_len = frame->size;
+			iov_num++;
+		}
+		iov[0].iov_base = st->spool_head->data + st->spool_head_sent;
+		iov[0].iov_len = st->spool_head->size - st->spool_head_sent;
+
+		status = network_stream_write (se, iov, iov_num);
+		if (status <= 0)
+			break;
+
+		/* Remove the frames which have been written completely. */
+		written = st->spool_head_sent + (size_t) status;
+		while ((st->spool_head != NULL)
+				&& (written >= st->spool_head->size))
+		{
+			frame = st->spool_head;
+			st->spool_head = frame->next;
+			if (st->spool_head == NULL)
+				st->spool_tail = NULL;
+
+			written -= frame->size;
+			st->spool_size -= frame->size;
+			sfree (frame);
+		}
+		st->spool_head_sent = written;
+	}
+
+	if (st->spool_head == NULL)
+		c_release (LOG_INFO, &st->spool_complaint,
+				"network plugin: The spool for %s is empty again.",
+				st->name);
+
+	if ((st->spool_head == NULL) && (st->disk != NULL))
+	{
+		network_stream_flush_disk (se);
+		if (spool_is_empty (st->disk))
+			c_release (LOG_INFO, &st->disk_complaint,
+					"network plugin: The disk spool for %s is "
+					"empty again.", st->name);
+	}
+} /* }}} void network_stream_flush_spool */
+
+/* Sends packets to a stream server. Packets are written directly if nothing
+ * is spooled; whatever the socket doesn't take is spooled, so the writing
+ * thread never blocks. */
+static void network_send_stream (sockent_t *se, /* {{{ */
+		char **packets, const size_t *packets_size, int packets_num)
+{
+	sockent_stream_t *st = se->stream;
+	struct iovec iov[2 * SEND_BATCH_SIZE];
+	uint32_t headers[SEND_BATCH_SIZE];
+	ssize_t written = 0;
+	int status;
+	int i;
+
+	assert (packets_num <= SEND_BATCH_SIZE);
+
+	pthread_mutex_lock (&st->lock);
+
+	network_stream_connect (se);
+	network_stream_flush_spool (se);
+
+	if ((se->fd >= 0) && (st->spool_head == NULL)
+			&& ((st->disk == NULL) || spool_is_empty (st->disk)))
+	{
+		for (i = 0; i < packets_num; i++)
+		{
+			headers[i] = htonl ((uint32_t) packets_size[i]);
+			iov[2 * i].iov_base = headers + i;
+			iov[2 * i].iov_len = sizeof (headers[i]);
+			iov[2 * i + 1].iov_base = packets[i];
+			iov[2 * i + 1].iov_len = packets_size[i];
+		}
+
+		written = network_stream_write (se, iov, 2 * packets_num);
+		if (written < 0)
+			written = 0;
+	}
+
+	for (i = 0; i < packets_num; i++)
+	{
+		size_t frame_size = STREAM_FRAME_HEADER_SIZE + packets_size[i];
+
+		if ((size_t) written >= frame_size)
+		{
+			written -= (ssize_t) frame_size;
+			continue;
+		}
+
+		status = network_stream_spool (st, packets[i], packets_size[i]);
+		if (written > 0)
+		{
+			/* The spool was empty, so the partially written frame
+			 * is its head now. The spool always takes it, see
+			 * `network_stream_spool'; if it didn't, the server
+			 * would misinterpret the rest of the stream. */
+			if (status == 0)
+				st->spool_head_sent = (size_t) written;
+			else
+				network_stream_disconnect (se);
+		}
+		written = 0;
+	}
+
+	pthread_mutex_unlock (&st->lock);
+} /* }}} void network_send_stream */
+
+static void network_stream_close_all (void) /* {{{ */
+{
+	sockent_t *se;
+
+	for (se = sending_sockets; se != NULL; se = se->next)
+	{
+		sockent_stream_t *st = se->stream;
+
+		if (st == NULL)
+			continue;
+
+		pthread_mutex_lock (&st->lock);
+		/* The disk spool is sent after the spool, so the spool can
+		 * only be saved in front of it if it's empty. */
+		if ((st->spool_size > 0) && (st->disk != NULL)
+				&& spool_is_empty (st->disk))
+		{
+			st->spool_head_sent = 0;
+			network_stream_spool_to_disk (st);
+			INFO ("network plugin: Saved the spool for %s to disk.",
+					st->name);
+		}
+		if (st->spool_size > 0)
+			WARNING ("network plugin: Discarding %zu spooled bytes "
+					"for %s.", st->spool_size, st->name);
+		if (se->fd >= 0)
+		{
+			close (se->fd);
+			se->fd = -1;
+		}
+		pthread_mutex_unlock (&st->lock);
+	}
+} /* }}} void network_stream_close_all */
+
+/* Writes the spools of all stream servers, reconnecting if necessary. If
+ * `timeout' is greater than zero, waits up to that long for slow servers. */
+static void network_stream_flush_all (cdtime_t timeout) /* {{{ */
+{
+	sockent_t *se;
+	cdtime_t end = cdtime () + timeout;
+
+	for (se = sending_sockets; se != NULL; se = se->next)
+	{
+		sockent_stream_t *st = se->stream;
+
+		if (st == NULL)
+			continue;
+
+		pthread_mutex_lock (&st->lock);
+		network_stream_connect (se);
+		network_stream_flush_spool (se);
+		while ((st->spool_head != NULL) && (se->fd >= 0))
+		{
+			struct pollfd pfd;
+			cdtime_t now = cdtime ();
+
+			if (now >= end)
+				break;
+
+			pfd.fd = se->fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			poll (&pfd, 1, (int) CDTIME_T_TO_MS (end - now));
+
+			network_stream_flush_spool (se);
+		}
+		pthread_mutex_unlock (&st->lock);
+	}
+} /* }}} void network_stream_flush_all */
 
 #if HAVE_GCRYPT_H
-static void networt_send_buffer_signed (const sockent_t *se, /* {{{ */
-		const char *in_buffer, size_t in_buffer_size)
+/* Writes the signature part followed by the payload to `buffer'. Returns the
+ * size of the packet or less than zero on error. */
+static ssize_t network_sign_buffer (const sockent_t *se, /* {{{ */
+		const char *in_buffer, size_t in_buffer_size,
+		char *buffer, size_t buffer_size)
 {
 	part_signature_sha256_t ps;
-	char buffer[sizeof (ps) + in_buffer_size];
 
 	gcry_md_hd_t hd;
-	gcry_error_t err;
 	unsigned char *hash;
 
-	hd = NULL;
-	err = gcry_md_open (&hd, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
-	if (err != 0)
-	{
-		ERROR ("network plugin: Creating HMAC object failed: %s",
-				gcry_strerror (err));
-		return;
-	}
+	assert (buffer_size >= (sizeof (ps) + in_buffer_size));
 
-	err = gcry_md_setkey (hd, se->shared_secret,
-			strlen (se->shared_secret));
-	if (err != 0)
-	{
-		ERROR ("network plugin: gcry_md_setkey failed: %s",
-				gcry_strerror (err));
-		gcry_md_close (hd);
-		return;
-	}
+	hd = network_get_hmac_sha256 (se);
+	if (hd == NULL)
+		return (-1);
 
 	/* Initialize the `ps' structure. */
 	memset (&ps, 0, sizeof (ps));
@@ -2034,8 +4316,7 @@ static void networt_send_buffer_signed (const sockent_t *se, /* {{{ */
 	if (hash == NULL)
 	{
 		ERROR ("network plugin: gcry_md_read failed.");
-		gcry_md_close (hd);
-		return;
+		return (-1);
 	}
 
 	/* Add the signature and fill the rest of the buffer. */
@@ -2043,17 +4324,16 @@ static void networt_send_buffer_signed (const sockent_t *se, /* {{{ */
 	memcpy (buffer, &ps, sizeof (ps));
 	memcpy (buffer + sizeof (ps), in_buffer, in_buffer_size);
 
-	gcry_md_close (hd);
-	hd = NULL;
-
-	networt_send_buffer_plain (se, buffer, sizeof (buffer));
-} /* }}} void networt_send_buffer_signed */
+	return ((ssize_t) (sizeof (ps) + in_buffer_size));
+} /* }}} ssize_t network_sign_buffer */
 
-static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
-		const char *in_buffer, size_t in_buffer_size)
+/* Writes the encryption part containing the encrypted payload to `buffer'.
+ * Returns the size of the packet or less than zero on error. */
+static ssize_t network_encrypt_buffer (sockent_t *se, /* {{{ */
+		const char *in_buffer, size_t in_buffer_size,
+		char *buffer, size_t buffer_max)
 {
   part_encryption_aes256_t pea;
-  char buffer[sizeof (pea) + in_buffer_size];
   size_t buffer_size;
   size_t buffer_offset;
   size_t padding_size;
@@ -2073,8 +4353,9 @@ static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
   assert (padding_size <= sizeof (pea.padding));
   /* Now add the unencrypted bytes. */
   buffer_size += PART_ENCRYPTION_AES256_UNENCR_SIZE;
+  assert (buffer_size <= buffer_max);
 
-  DEBUG ("network plugin: networt_send_buffer_encrypted: "
+  DEBUG ("network plugin: network_encrypt_buffer: "
       "buffer_size = %zu;", buffer_size);
 
   /* Initialize the header fields */
@@ -2083,8 +4364,10 @@ static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
   pea.head.length = htons ((uint16_t) buffer_size);
   pea.orig_length = htons ((uint16_t) in_buffer_size);
 
-  /* Chose a random initialization vector. */
-  gcry_randomize ((void *) &pea.iv, sizeof (pea.iv), GCRY_STRONG_RANDOM);
+  /* Chose a random initialization vector. The nonce generator is meant for
+   * IVs and padding; it is unpredictable, but much cheaper than
+   * `GCRY_STRONG_RANDOM', which cost about 10 usec per call. */
+  gcry_create_nonce ((void *) &pea.iv, sizeof (pea.iv));
 
   /* Create hash of the payload */
   gcry_md_hash_buffer (GCRY_MD_SHA1, pea.hash, in_buffer, in_buffer_size);
@@ -2092,11 +4375,10 @@ static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
   /* Fill the extra field with random values. Some entropy in the encrypted
    * data is usually not a bad thing, I hope. */
   if (padding_size > 0)
-    gcry_randomize ((void *) &pea.padding, padding_size, GCRY_STRONG_RANDOM);
+    gcry_create_nonce ((void *) &pea.padding, padding_size);
 
   /* Initialize the buffer */
   buffer_offset = 0;
-  memset (buffer, 0, sizeof (buffer));
 
 #define BUFFER_ADD(p,s) do { \
   memcpy (buffer + buffer_offset, (p), (s)); \
@@ -2118,7 +4400,7 @@ static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
 
   cypher = network_get_aes256_cypher (se, pea.iv, sizeof (pea.iv));
   if (cypher == NULL)
-    return;
+    return (-1);
 
   /* Encrypt the buffer in-place */
   err = gcry_cipher_encrypt (cypher,
@@ -2129,41 +4411,104 @@ static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
   {
     ERROR ("network plugin: gcry_cipher_encrypt returned: %s",
         gcry_strerror (err));
-    return;
+    return (-1);
   }
 
-  /* Send it out without further modifications */
-  networt_send_buffer_plain (se, buffer, buffer_size);
 #undef BUFFER_ADD
-} /* }}} void networt_send_buffer_encrypted */
+  return ((ssize_t) buffer_size);
+} /* }}} ssize_t network_encrypt_buffer */
 #endif /* HAVE_GCRYPT_H */
 
-static void network_send_buffer (char *buffer, size_t buffer_len) /* {{{ */
+/* Sends the buffers to all sending sockets, signing or encrypting them as
+ * configured. The caller must hold the lock of `state'. */
+static void network_send_packets (send_state_t *state, /* {{{ */
+		char **buffers, const size_t *buffers_size, int buffers_num)
 {
   sockent_t *se;
 
-  DEBUG ("network plugin: network_send_buffer: buffer_len = %zu", buffer_len);
+  DEBUG ("network plugin: network_send_packets: buffers_num = %i",
+      buffers_num);
+
+  assert (buffers_num <= SEND_BATCH_SIZE);
 
   for (se = sending_sockets; se != NULL; se = se->next)
   {
+    char   *packets[SEND_BATCH_SIZE];
+    size_t  packets_size[SEND_BATCH_SIZE];
+    int     packets_num = 0;
+    int     i;
+
+    for (i = 0; i < buffers_num; i++)
+    {
+      char   *packet = buffers[i];
+      ssize_t packet_size = (ssize_t) buffers_size[i];
+
 #if HAVE_GCRYPT_H
-    if (se->security_level == SECURITY_LEVEL_ENCRYPT)
-      networt_send_buffer_encrypted (se, buffer, buffer_len);
-    else if (se->security_level == SECURITY_LEVEL_SIGN)
-      networt_send_buffer_signed (se, buffer, buffer_len);
-    else /* if (se->security_level == SECURITY_LEVEL_NONE) */
+      if (se->security_level == SECURITY_LEVEL_ENCRYPT)
+      {
+        packet = state->scratch[i];
+        packet_size = network_encrypt_buffer (se, buffers[i], buffers_size[i],
+            packet, network_config_packet_size + BUFF_SIG_SIZE);
+      }
+      else if (se->security_level == SECURITY_LEVEL_SIGN)
+      {
+        packet = state->scratch[i];
+        packet_size = network_sign_buffer (se, buffers[i], buffers_size[i],
+            packet, network_config_packet_size + BUFF_SIG_SIZE);
+      }
 #endif /* HAVE_GCRYPT_H */
-      networt_send_buffer_plain (se, buffer, buffer_len);
+
+      if (packet_size < 0)
+        continue;
+
+      packets[packets_num] = packet;
+      packets_size[packets_num] = (size_t) packet_size;
+      packets_num++;
+    }
+
+    if (se->stream != NULL)
+      network_send_stream (se, packets, packets_size, packets_num);
+    else
+      network_send_plain (se, packets, packets_size, packets_num);
   } /* for (sending_sockets) */
-} /* }}} void network_send_buffer */
+} /* }}} void network_send_packets */
+
+/* Sends all full buffers and moves the buffer currently being filled to the
+ * front. The caller must hold the lock of `state'. */
+static void network_send_buffers (send_state_t *state) /* {{{ */
+{
+	char *tmp;
+
+	if (state->buffers_num == 0)
+		return;
+
+	network_send_packets (state, state->buffers, state->buffers_fill,
+			state->buffers_num);
+
+	tmp = state->buffers[0];
+	state->buffers[0] = state->buffers[state->buffers_num];
+	state->buffers[state->buffers_num] = tmp;
+	state->buffers_num = 0;
+
+#if HAVE_ZLIB_H
+	/* The compressed packet being built has moved along, the segment
+	 * stays where it is. */
+	if (state->segment != NULL)
+		return;
+#endif
+	state->buffer = state->buffers[0];
+	state->buffer_ptr = state->buffer + state->buffer_fill;
+} /* }}} void network_send_buffers */
 
 static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
 		value_list_t *vl_def,
 		const data_set_t *ds, const value_list_t *vl)
 {
 	char *buffer_orig = buffer;
+	/* Interned identifiers are equal if and only if all names are equal. */
+	int same_ident = ((vl->ident != NULL) && (vl->ident == vl_def->ident));
 
-	if (strcmp (vl_def->host, vl->host) != 0)
+	if (!same_ident && (strcmp (vl_def->host, vl->host) != 0))
 	{
 		if (write_part_string (&buffer, &buffer_size, TYPE_HOST,
 					vl->host, strlen (vl->host)) != 0)
@@ -2173,21 +4518,21 @@ static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
 
 	if (vl_def->time != vl->time)
 	{
-		if (write_part_number (&buffer, &buffer_size, TYPE_TIME,
-					(uint64_t) vl->time))
+		if (write_part_time (&buffer, &buffer_size,
+					TYPE_TIME, TYPE_TIME_HR, vl->time))
 			return (-1);
 		vl_def->time = vl->time;
 	}
 
 	if (vl_def->interval != vl->interval)
 	{
-		if (write_part_number (&buffer, &buffer_size, TYPE_INTERVAL,
-					(uint64_t) vl->interval))
+		if (write_part_time (&buffer, &buffer_size,
+					TYPE_INTERVAL, TYPE_INTERVAL_HR, vl->interval))
 			return (-1);
 		vl_def->interval = vl->interval;
 	}
 
-	if (strcmp (vl_def->plugin, vl->plugin) != 0)
+	if (!same_ident && (strcmp (vl_def->plugin, vl->plugin) != 0))
 	{
 		if (write_part_string (&buffer, &buffer_size, TYPE_PLUGIN,
 					vl->plugin, strlen (vl->plugin)) != 0)
@@ -2195,7 +4540,7 @@ static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
 		sstrncpy (vl_def->plugin, vl->plugin, sizeof (vl_def->plugin));
 	}
 
-	if (strcmp (vl_def->plugin_instance, vl->plugin_instance) != 0)
+	if (!same_ident && (strcmp (vl_def->plugin_instance, vl->plugin_instance) != 0))
 	{
 		if (write_part_string (&buffer, &buffer_size, TYPE_PLUGIN_INSTANCE,
 					vl->plugin_instance,
@@ -2204,7 +4549,7 @@ static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
 		sstrncpy (vl_def->plugin_instance, vl->plugin_instance, sizeof (vl_def->plugin_instance));
 	}
 
-	if (strcmp (vl_def->type, vl->type) != 0)
+	if (!same_ident && (strcmp (vl_def->type, vl->type) != 0))
 	{
 		if (write_part_string (&buffer, &buffer_size, TYPE_TYPE,
 					vl->type, strlen (vl->type)) != 0)
@@ -2212,7 +4557,7 @@ static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
 		sstrncpy (vl_def->type, ds->type, sizeof (vl_def->type));
 	}
 
-	if (strcmp (vl_def->type_instance, vl->type_instance) != 0)
+	if (!same_ident && (strcmp (vl_def->type_instance, vl->type_instance) != 0))
 	{
 		if (write_part_string (&buffer, &buffer_size, TYPE_TYPE_INSTANCE,
 					vl->type_instance,
@@ -2220,25 +4565,273 @@ static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
 			return (-1);
 		sstrncpy (vl_def->type_instance, vl->type_instance, sizeof (vl_def->type_instance));
 	}
-	
+	/* Hold a reference, so the address can't be reused by another
+	 * identifier while `vl_def' refers to it. */
+	if (vl_def->ident != vl->ident)
+	{
+		ident_release (vl_def->ident);
+		vl_def->ident = ident_ref (vl->ident);
+	}
+
 	if (write_part_values (&buffer, &buffer_size, ds, vl) != 0)
 		return (-1);
 
 	return (buffer - buffer_orig);
 } /* }}} int add_to_buffer */
 
-static void flush_buffer (void)
+/* Adds the packet `buffers[buffers_num]' to the batch of packets to be sent.
+ * The batch is sent when it is complete or when its first packet has waited
+ * long enough. */
+static void queue_packet (send_state_t *state, size_t packet_size) /* {{{ */
+{
+	cdtime_t now = cdtime ();
+
+	state->buffers_fill[state->buffers_num] = packet_size;
+	if (state->buffers_num == 0)
+		state->buffers_first = now;
+	state->buffers_num++;
+
+	if ((state->buffers_num >= SEND_BATCH_SIZE)
+			|| ((now - state->buffers_first) >= SEND_BATCH_DELAY))
+		network_send_buffers (state);
+} /* }}} void queue_packet */
+
+#if HAVE_ZLIB_H
+/* Writes the header of the compressed packet being built and queues it. */
+static void send_state_packet_finish (send_state_t *state) /* {{{ */
+{
+	part_compress_zlib_t pcz;
+	char *packet;
+
+	if (state->packet_orig == 0)
+		return;
+
+	packet = state->buffers[state->buffers_num];
+
+	pcz.head.type = htons (TYPE_COMPRESS_ZLIB);
+	pcz.head.length = htons ((uint16_t) (PART_COMPRESS_ZLIB_SIZE
+				+ state->packet_fill));
+	pcz.orig_length = htons ((uint16_t) state->packet_orig);
+
+	memcpy (packet, &pcz.head.type, sizeof (pcz.head.type));
+	memcpy (packet + sizeof (pcz.head.type), &pcz.head.length,
+			sizeof (pcz.head.length));
+	memcpy (packet + sizeof (pcz.head), &pcz.orig_length,
+			sizeof (pcz.orig_length));
+
+	queue_packet (state, PART_COMPRESS_ZLIB_SIZE + state->packet_fill);
+	send_state_packet_start (state);
+} /* }}} void send_state_packet_finish */
+
+/* Compresses the full segment into the packet being built. Each segment
+ * ends with a sync flush, so the packet can be cut after any segment: If
+ * the segment doesn't fit anymore, the packet is queued without it and the
+ * segment goes into the next one. */
+static void send_state_compress_segment (send_state_t *state) /* {{{ */
+{
+	z_stream *zs = &state->zstream;
+	int status;
+
+	if (state->buffer_fill <= 0)
+		return;
+
+	/* Don't waste time on a segment which is unlikely to fit. */
+	if ((state->packet_orig > 0)
+			&& (((state->packet_orig + state->buffer_fill)
+					> PART_COMPRESS_ZLIB_ORIG_MAX)
+				|| (zs->avail_out < state->segment_last)))
+		send_state_packet_finish (state);
+
+	zs->next_in = (Bytef *) state->segment;
+	zs->avail_in = (uInt) state->buffer_fill;
+
+	status = deflate (zs, Z_SYNC_FLUSH);
+	if ((status == Z_OK) && (zs->avail_in == 0) && (zs->avail_out > 0))
+	{
+		state->segment_last = zs->total_out - state->packet_fill;
+		state->packet_fill = zs->total_out;
+		state->packet_orig += state->buffer_fill;
+		send_state_init_buffer (state);
+		return;
+	}
+
+	if (state->packet_orig > 0)
+	{
+		/* Discards what has been written of this segment. */
+		send_state_packet_finish (state);
+		send_state_compress_segment (state);
+		return;
+	}
+
+	/* The segment doesn't even fit into an empty packet, so it doesn't
+	 * compress at all. It's a valid packet on its own, though. */
+	memcpy (state->buffers[state->buffers_num], state->segment,
+			state->buffer_fill);
+	queue_packet (state, (size_t) state->buffer_fill);
+	send_state_packet_start (state);
+	send_state_init_buffer (state);
+} /* }}} void send_state_compress_segment */
+#endif /* HAVE_ZLIB_H */
+
+/* Queues the full buffer, compressing it first if configured. */
+static void queue_buffer (send_state_t *state) /* {{{ */
+{
+#if HAVE_ZLIB_H
+	if (state->segment != NULL)
+	{
+		send_state_compress_segment (state);
+		return;
+	}
+#endif
+
+	queue_packet (state, (size_t) state->buffer_fill);
+	send_state_init_buffer (state);
+} /* }}} void queue_buffer */
+
+/* Sends all buffers, including the one currently being filled. */
+static void flush_buffer (send_state_t *state)
 {
-	DEBUG ("network plugin: flush_buffer: send_buffer_fill = %i",
-			send_buffer_fill);
+	DEBUG ("network plugin: flush_buffer: buffer_fill = %i",
+			state->buffer_fill);
+
+	if (state->buffer_fill > 0)
+		queue_buffer (state);
+#if HAVE_ZLIB_H
+	if (state->segment != NULL)
+		send_state_packet_finish (state);
+#endif
 
-	network_send_buffer (send_buffer, (size_t) send_buffer_fill);
-	network_init_buffer ();
+	network_send_buffers (state);
 }
 
+/* Returns non-zero if values are waiting to be sent. */
+static int send_state_pending (const send_state_t *state) /* {{{ */
+{
+	if ((state->buffer_fill > 0) || (state->buffers_num > 0))
+		return (1);
+#if HAVE_ZLIB_H
+	if (state->packet_orig > 0)
+		return (1);
+#endif
+	return (0);
+} /* }}} int send_state_pending */
+
+/* Called when a thread exits: Sends what is left in the thread's buffers. */
+static void send_state_key_destroy (void *arg) /* {{{ */
+{
+	send_state_t *state = arg;
+	send_state_t *prev;
+	int closed;
+
+	pthread_mutex_lock (&send_states_lock);
+	if (send_states == state)
+		send_states = state->next;
+	else
+	{
+		for (prev = send_states; prev != NULL; prev = prev->next)
+			if (prev->next == state)
+				break;
+		if (prev != NULL)
+			prev->next = state->next;
+	}
+	closed = send_states_closed;
+	pthread_mutex_unlock (&send_states_lock);
+
+	pthread_mutex_lock (&state->lock);
+	if (!closed)
+		flush_buffer (state);
+	pthread_mutex_unlock (&state->lock);
+
+	send_state_destroy (state);
+} /* }}} void send_state_key_destroy */
+
+static void send_state_key_create (void) /* {{{ */
+{
+	pthread_key_create (&send_state_key, send_state_key_destroy);
+} /* }}} void send_state_key_create */
+
+/* Returns the calling thread's send state, creating it if necessary. Returns
+ * NULL after the plugin has been shut down. */
+static send_state_t *network_get_send_state (void) /* {{{ */
+{
+	send_state_t *state;
+
+	pthread_once (&send_state_key_once, send_state_key_create);
+
+	state = pthread_getspecific (send_state_key);
+	if (state != NULL)
+		return (state);
+
+	state = send_state_create ();
+	if (state == NULL)
+		return (NULL);
+
+	pthread_mutex_lock (&send_states_lock);
+	if (send_states_closed)
+	{
+		pthread_mutex_unlock (&send_states_lock);
+		send_state_destroy (state);
+		return (NULL);
+	}
+	state->next = send_states;
+	send_states = state;
+	pthread_mutex_unlock (&send_states_lock);
+
+	pthread_setspecific (send_state_key, state);
+	return (state);
+} /* }}} send_state_t *network_get_send_state */
+
+/* Sends the buffers of all threads which have passed their deadline and the
+ * full buffers which have waited too long for their batch to complete. */
+static void network_send_stale (cdtime_t now) /* {{{ */
+{
+	send_state_t *state;
+	cdtime_t next = (cdtime_t) -1;
+
+	/* Until the walk is complete, other writers must keep seeing the
+	 * deadline as passed, so they wait for the stale values to be sent
+	 * before sending newer ones. */
+	pthread_mutex_lock (&send_states_deadline_lock);
+	send_states_deadline_new = (cdtime_t) -1;
+	pthread_mutex_unlock (&send_states_deadline_lock);
+
+	pthread_mutex_lock (&send_states_lock);
+	for (state = send_states; state != NULL; state = state->next)
+	{
+		pthread_mutex_lock (&state->lock);
+		if (!send_state_pending (state))
+		{
+			/* nothing queued */
+		}
+		else if (now >= state->deadline)
+		{
+			flush_buffer (state);
+		}
+		else
+		{
+			if ((state->buffers_num > 0)
+					&& ((now - state->buffers_first) >= SEND_BATCH_DELAY))
+				network_send_buffers (state);
+			if (state->deadline < next)
+				next = state->deadline;
+		}
+		pthread_mutex_unlock (&state->lock);
+	}
+	pthread_mutex_unlock (&send_states_lock);
+
+	pthread_mutex_lock (&send_states_deadline_lock);
+	if (send_states_deadline_new < next)
+		next = send_states_deadline_new;
+	send_states_deadline = next;
+	pthread_mutex_unlock (&send_states_deadline_lock);
+} /* }}} void network_send_stale */
+
 static int network_write (const data_set_t *ds, const value_list_t *vl,
 		user_data_t __attribute__((unused)) *user_data)
 {
+	send_state_t *state;
+	cdtime_t now;
+	cdtime_t deadline = 0;
 	int status;
 
 	/* If the value is already in the cache, we have received it via the
@@ -2249,31 +4842,57 @@ static int network_write (const data_set_t *ds, const value_list_t *vl,
 			&& (status != 0))
 		return (0);
 
-	pthread_mutex_lock (&send_buffer_lock);
+	state = network_get_send_state ();
+	if (state == NULL)
+		return (-1);
+
+	now = cdtime ();
+	if (now >= send_states_deadline)
+		network_send_stale (now);
+
+	pthread_mutex_lock (&state->lock);
+
+	/* Already shut down. */
+	if (send_states_closed)
+	{
+		pthread_mutex_unlock (&state->lock);
+		return (-1);
+	}
+
+	if (!send_state_pending (state))
+	{
+		state->deadline = now + (vl->interval / 2);
+		deadline = state->deadline;
+	}
+	if (state->buffer_fill == 0)
+		state->buffer_first = now;
 
-	status = add_to_buffer (send_buffer_ptr,
-			sizeof (send_buffer) - (send_buffer_fill + BUFF_SIG_SIZE),
-			&send_buffer_vl,
+	status = add_to_buffer (state->buffer_ptr,
+			network_config_packet_size
+			- (state->buffer_fill + BUFF_SIG_SIZE),
+			&state->buffer_vl,
 			ds, vl);
 	if (status >= 0)
 	{
 		/* status == bytes added to the buffer */
-		send_buffer_fill += status;
-		send_buffer_ptr  += status;
+		state->buffer_fill += status;
+		state->buffer_ptr  += status;
 	}
 	else
 	{
-		flush_buffer ();
+		queue_buffer (state);
+		state->buffer_first = cdtime ();
 
-		status = add_to_buffer (send_buffer_ptr,
-				sizeof (send_buffer) - (send_buffer_fill + BUFF_SIG_SIZE),
-				&send_buffer_vl,
+		status = add_to_buffer (state->buffer_ptr,
+				network_config_packet_size
+				- (state->buffer_fill + BUFF_SIG_SIZE),
+				&state->buffer_vl,
 				ds, vl);
 
 		if (status >= 0)
 		{
-			send_buffer_fill += status;
-			send_buffer_ptr  += status;
+			state->buffer_fill += status;
+			state->buffer_ptr  += status;
 		}
 	}
 
@@ -2282,12 +4901,22 @@ static int network_write (const data_set_t *ds, const value_list_t *vl,
 		ERROR ("network plugin: Unable to append to the "
 				"buffer for some weird reason");
 	}
-	else if ((sizeof (send_buffer) - send_buffer_fill) < 15)
+	else if ((network_config_packet_size - state->buffer_fill) < 15)
 	{
-		flush_buffer ();
+		queue_buffer (state);
 	}
 
-	pthread_mutex_unlock (&send_buffer_lock);
+	pthread_mutex_unlock (&state->lock);
+
+	if (deadline != 0)
+	{
+		pthread_mutex_lock (&send_states_deadline_lock);
+		if (deadline < send_states_deadline)
+			send_states_deadline = deadline;
+		if (deadline < send_states_deadline_new)
+			send_states_deadline_new = deadline;
+		pthread_mutex_unlock (&send_states_deadline_lock);
+	}
 
 	return ((status < 0) ? -1 : 0);
 } /* int network_write */
@@ -2383,12 +5012,88 @@ static int network_config_set_security_level (oconfig_item_t *ci, /* {{{ */
 } /* }}} int network_config_set_security_level */
 #endif /* HAVE_GCRYPT_H */
 
+static int network_config_set_protocol (const oconfig_item_t *ci, /* {{{ */
+    int *flags)
+{
+  char *str;
+
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `Protocol' config option needs exactly "
+        "one string argument.");
+    return (-1);
+  }
+
+  str = ci->values[0].value.string;
+  if (strcasecmp ("TCP", str) == 0)
+    *flags |= CREATE_SOCKET_FLAGS_STREAM;
+  else if (strcasecmp ("UDP", str) == 0)
+    *flags &= ~CREATE_SOCKET_FLAGS_STREAM;
+  else
+  {
+    WARNING ("network plugin: Unknown protocol: %s.", str);
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int network_config_set_protocol */
+
+static int network_config_set_spool_size (const oconfig_item_t *ci, /* {{{ */
+    size_t *retval)
+{
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER)
+      || (ci->values[0].value.number < 0.0))
+  {
+    WARNING ("network plugin: The `%s' config option needs exactly "
+        "one non-negative numeric argument.", ci->key);
+    return (-1);
+  }
+
+  *retval = (size_t) ci->values[0].value.number;
+  return (0);
+} /* }}} int network_config_set_spool_size */
+
+static int network_config_set_spool_dir (const oconfig_item_t *ci, /* {{{ */
+    char **retval)
+{
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `SpoolDirectory' config option needs "
+        "exactly one string argument.");
+    return (-1);
+  }
+
+  *retval = ci->values[0].value.string;
+  return (0);
+} /* }}} int network_config_set_spool_dir */
+
+static int network_config_set_replay_rate (const oconfig_item_t *ci, /* {{{ */
+    double *retval)
+{
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER)
+      || (ci->values[0].value.number < 0.0))
+  {
+    WARNING ("network plugin: The `SpoolReplayRate' config option needs "
+        "exactly one non-negative numeric argument.");
+    return (-1);
+  }
+
+  *retval = ci->values[0].value.number;
+  return (0);
+} /* }}} int network_config_set_replay_rate */
+
 static int network_config_listen_server (const oconfig_item_t *ci) /* {{{ */
 {
   char *node;
   char *service;
   char *shared_secret = NULL;
   int security_level = SECURITY_LEVEL_NONE;
+  int flags = 0;
+  stream_options_t opts;
   int i;
 
   if ((ci->values_num < 1) || (ci->values_num > 2)
@@ -2406,10 +5111,29 @@ static int network_config_listen_server (const oconfig_item_t *ci) /* {{{ */
   else
     service = NULL;
 
+  memset (&opts, 0, sizeof (opts));
+  opts.spool_size = STREAM_SPOOL_SIZE;
+  opts.spool_disk_size = STREAM_SPOOL_DISK_SIZE;
+
   for (i = 0; i < ci->children_num; i++)
   {
     oconfig_item_t *child = ci->children + i;
 
+    if (strcasecmp ("Protocol", child->key) == 0)
+      network_config_set_protocol (child, &flags);
+    else if ((strcasecmp ("SpoolSize", child->key) == 0)
+        && (strcasecmp ("Server", ci->key) == 0))
+      network_config_set_spool_size (child, &opts.spool_size);
+    else if ((strcasecmp ("SpoolDirectory", child->key) == 0)
+        && (strcasecmp ("Server", ci->key) == 0))
+      network_config_set_spool_dir (child, &opts.spool_dir);
+    else if ((strcasecmp ("SpoolDiskSize", child->key) == 0)
+        && (strcasecmp ("Server", ci->key) == 0))
+      network_config_set_spool_size (child, &opts.spool_disk_size);
+    else if ((strcasecmp ("SpoolReplayRate", child->key) == 0)
+        && (strcasecmp ("Server", ci->key) == 0))
+      network_config_set_replay_rate (child, &opts.replay_rate);
+    else
 #if HAVE_GCRYPT_H
     if (strcasecmp ("Secret", child->key) == 0)
     {
@@ -2438,10 +5162,21 @@ static int network_config_listen_server (const oconfig_item_t *ci) /* {{{ */
     return (-1);
   }
 
+  /* Outages of a datagram server go unnoticed, so there is nothing to
+   * spool. */
+  if ((opts.spool_dir != NULL) && ((flags & CREATE_SOCKET_FLAGS_STREAM) == 0))
+  {
+    WARNING ("network plugin: The `SpoolDirectory' option is only used with "
+        "`Protocol TCP'. Ignoring it for %s.", node);
+    opts.spool_dir = NULL;
+  }
+
   if (strcasecmp ("Listen", ci->key) == 0)
-    network_add_listen_socket (node, service, shared_secret, security_level);
+    network_add_listen_socket (node, service, shared_secret, security_level,
+        flags);
   else
-    network_add_sending_socket (node, service, shared_secret, security_level);
+    network_add_sending_socket (node, service, shared_secret, security_level,
+        flags, &opts);
 
   return (0);
 } /* }}} int network_config_listen_server */
@@ -2459,11 +5194,53 @@ static int network_config_set_cache_flush (const oconfig_item_t *ci) /* {{{ */
 
   tmp = (int) ci->values[0].value.number;
   if (tmp > 0)
-    network_config_ttl = tmp;
+    cache_flush_interval = tmp;
 
   return (0);
 } /* }}} int network_config_set_cache_flush */
 
+static int network_config_set_int (const oconfig_item_t *ci, /* {{{ */
+    int *retval)
+{
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `%s' config option needs exactly "
+        "one numeric argument.", ci->key);
+    return (-1);
+  }
+
+  tmp = (int) ci->values[0].value.number;
+  if (tmp <= 0)
+  {
+    WARNING ("network plugin: The `%s' config option must be positive.",
+        ci->key);
+    return (-1);
+  }
+
+  *retval = tmp;
+  return (0);
+} /* }}} int network_config_set_int */
+
+static int network_config_set_packet_size (const oconfig_item_t *ci) /* {{{ */
+{
+  int tmp = 0;
+
+  if (network_config_set_int (ci, &tmp) != 0)
+    return (-1);
+
+  if ((tmp < BUFF_SIZE) || (tmp > BUFF_SIZE_MAX))
+  {
+    WARNING ("network plugin: The `MaxPacketSize' option must be between "
+        "%i and %i.", BUFF_SIZE, BUFF_SIZE_MAX);
+    return (-1);
+  }
+
+  network_config_packet_size = (size_t) tmp;
+  return (0);
+} /* }}} int network_config_set_packet_size */
+
 static int network_config (oconfig_item_t *ci) /* {{{ */
 {
   int i;
@@ -2481,6 +5258,23 @@ static int network_config (oconfig_item_t *ci) /* {{{ */
       network_config_set_boolean (child, &network_config_forward);
     else if (strcasecmp ("CacheFlush", child->key) == 0)
       network_config_set_cache_flush (child);
+    else if (strcasecmp ("MaxPacketSize", child->key) == 0)
+      network_config_set_packet_size (child);
+    else if (strcasecmp ("ReceivePoolSize", child->key) == 0)
+      network_config_set_int (child, &receive_pool_size);
+    else if (strcasecmp ("DispatchThreads", child->key) == 0)
+      network_config_set_int (child, &dispatch_threads_num);
+    else if (strcasecmp ("ReportStats", child->key) == 0)
+      network_config_set_boolean (child, &network_config_stats);
+    else if (strcasecmp ("Compress", child->key) == 0)
+    {
+#if HAVE_ZLIB_H
+      network_config_set_boolean (child, &network_config_compress);
+#else
+      WARNING ("network plugin: The `Compress' option is not available, "
+          "because the plugin has been built without zlib.");
+#endif
+    }
     else
     {
       WARNING ("network plugin: Option `%s' is not allowed here.",
@@ -2497,13 +5291,15 @@ static int network_notification (const notification_t *n,
   char  buffer[BUFF_SIZE];
   char *buffer_ptr = buffer;
   int   buffer_free = sizeof (buffer);
+  size_t buffer_size;
+  send_state_t *state;
   int   status;
 
   memset (buffer, '\0', sizeof (buffer));
 
 
-  status = write_part_number (&buffer_ptr, &buffer_free, TYPE_TIME,
-      (uint64_t) n->time);
+  status = write_part_time (&buffer_ptr, &buffer_free,
+      TYPE_TIME, TYPE_TIME_HR, n->time);
   if (status != 0)
     return (-1);
 
@@ -2558,15 +5354,96 @@ static int network_notification (const notification_t *n,
   if (status != 0)
     return (-1);
 
-  network_send_buffer (buffer, sizeof (buffer) - buffer_free);
+  buffer_size = sizeof (buffer) - buffer_free;
+  buffer_ptr = buffer;
+
+  state = network_get_send_state ();
+  if (state == NULL)
+    return (-1);
+
+  pthread_mutex_lock (&state->lock);
+  if (!send_states_closed)
+    network_send_packets (state, &buffer_ptr, &buffer_size,
+        /* buffers_num = */ 1);
+  pthread_mutex_unlock (&state->lock);
 
   return (0);
 } /* int network_notification */
 
+static void network_stats_submit (const char *type, /* {{{ */
+		const char *type_instance, value_t value)
+{
+	value_list_t vl = VALUE_LIST_INIT;
+
+	vl.values = &value;
+	vl.values_len = 1;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "network", sizeof (vl.plugin));
+	sstrncpy (vl.type, type, sizeof (vl.type));
+	sstrncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
+
+	plugin_dispatch_values (&vl);
+} /* }}} void network_stats_submit */
+
+static int network_stats_read (void) /* {{{ */
+{
+	counter_t received;
+	counter_t dropped;
+	counter_t exhausted;
+	gauge_t queue_length;
+	value_t v;
+	int i;
+
+	pthread_mutex_lock (&receive_pool_lock);
+	received = stats_packets_received;
+	dropped = stats_packets_dropped;
+	exhausted = stats_pool_exhausted;
+	pthread_mutex_unlock (&receive_pool_lock);
+
+	queue_length = 0.0;
+	for (i = 0; i < receive_queues_num; i++)
+	{
+		pthread_mutex_lock (&receive_queues[i].lock);
+		queue_length += (gauge_t) receive_queues[i].length;
+		pthread_mutex_unlock (&receive_queues[i].lock);
+	}
+
+	v.counter = received;
+	network_stats_submit ("counter", "packets-received", v);
+	v.counter = dropped;
+	network_stats_submit ("counter", "packets-dropped", v);
+	v.counter = exhausted;
+	network_stats_submit ("counter", "pool-exhausted", v);
+	v.gauge = queue_length;
+	network_stats_submit ("queue_length", "receive", v);
+
+	return (0);
+} /* }}} int network_stats_read */
+
+static int network_read (void) /* {{{ */
+{
+	/* Values written by a thread which doesn't write again for a while
+	 * must not wait indefinitely. */
+	network_send_stale (cdtime ());
+	network_stream_flush_all (/* timeout = */ 0);
+
+	if (network_config_stats != 0)
+		network_stats_read ();
+
+	return (0);
+} /* }}} int network_read */
+
 static int network_shutdown (void)
 {
+	send_state_t *state;
+
 	listen_loop++;
 
+	/* Wake up the receive thread if it is waiting for free entries. */
+	pthread_mutex_lock (&receive_pool_lock);
+	pthread_cond_broadcast (&receive_pool_cond);
+	pthread_mutex_unlock (&receive_pool_lock);
+
 	/* Kill the listening thread */
 	if (receive_thread_running != 0)
 	{
@@ -2577,35 +5454,36 @@ static int network_shutdown (void)
 		receive_thread_running = 0;
 	}
 
-	/* Shutdown the dispatching thread */
-	if (dispatch_thread_running != 0)
+	/* Shutdown the dispatching threads */
+	if (receive_queues_num > 0)
 	{
-		INFO ("network plugin: Stopping dispatch thread.");
-		pthread_mutex_lock (&receive_list_lock);
-		pthread_cond_broadcast (&receive_list_cond);
-		pthread_mutex_unlock (&receive_list_lock);
-		pthread_join (dispatch_thread_id, /* ret = */ NULL);
-		dispatch_thread_running = 0;
+		INFO ("network plugin: Stopping %i dispatch thread%s.",
+				receive_queues_num,
+				(receive_queues_num == 1) ? "" : "s");
+		receive_queues_destroy ();
 	}
 
-	free_sockent (listen_sockets);
+	receive_pool_destroy ();
 
-	if (send_buffer_fill > 0)
-		flush_buffer ();
+	free_sockent (listen_sockets);
 
-	if (cache_tree != NULL)
+	/* Send everything left. The states are freed when their threads
+	 * exit. */
+	pthread_mutex_lock (&send_states_lock);
+	send_states_closed = 1;
+	for (state = send_states; state != NULL; state = state->next)
 	{
-		void *key;
-		void *value;
-
-		while (c_avl_pick (cache_tree, &key, &value) == 0)
-		{
-			sfree (key);
-			sfree (value);
-		}
-		c_avl_destroy (cache_tree);
-		cache_tree = NULL;
+		pthread_mutex_lock (&state->lock);
+		flush_buffer (state);
+		pthread_mutex_unlock (&state->lock);
 	}
+	pthread_mutex_unlock (&send_states_lock);
+
+	/* Give stream servers a moment to take the spooled packets. */
+	network_stream_flush_all (TIME_T_TO_CDTIME_T (2));
+	network_stream_close_all ();
+
+	cache_destroy ();
 
 	/* TODO: Close `sending_sockets' */
 
@@ -2614,9 +5492,6 @@ static int network_shutdown (void)
 	plugin_unregister_write ("network");
 	plugin_unregister_shutdown ("network");
 
-	/* Let the init function do it's move again ;) */
-	cache_flush_last = 0;
-
 	return (0);
 } /* int network_shutdown */
 
@@ -2624,15 +5499,16 @@ static int network_init (void)
 {
 	/* Check if we were already initialized. If so, just return - there's
 	 * nothing more to do (for now, that is). */
-	if (cache_flush_last != 0)
+	if (cache_table != NULL)
 		return (0);
 
 	plugin_register_shutdown ("network", network_shutdown);
 
-	network_init_buffer ();
+	if (cache_create () != 0)
+		return (-1);
 
-	cache_tree = c_avl_create ((int (*) (const void *, const void *)) strcmp);
-	cache_flush_last = time (NULL);
+	if ((sending_sockets != NULL) || (network_config_stats != 0))
+		plugin_register_read ("network", network_read);
 
 	/* setup socket(s) and so on */
 	if (sending_sockets != NULL)
@@ -2645,29 +5521,16 @@ static int network_init (void)
 
 	/* If no threads need to be started, return here. */
 	if ((listen_sockets_num == 0)
-			|| ((dispatch_thread_running != 0)
+			|| ((receive_queues_num != 0)
 				&& (receive_thread_running != 0)))
 		return (0);
 
-	if (dispatch_thread_running == 0)
-	{
-		int status;
-		status = pthread_create (&dispatch_thread_id,
-				NULL /* no attributes */,
-				dispatch_thread,
-				NULL /* no argument */);
-		if (status != 0)
-		{
-			char errbuf[1024];
-			ERROR ("network: pthread_create failed: %s",
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-		}
-		else
-		{
-			dispatch_thread_running = 1;
-		}
-	}
+	if (receive_pool_create () != 0)
+		return (-1);
+
+	/* The receive thread needs the queues of the dispatch threads. */
+	if (receive_queues_create () != 0)
+		return (-1);
 
 	if (receive_thread_running == 0)
 	{
@@ -2703,21 +5566,34 @@ static int network_flush (int timeout,
 		const char __attribute__((unused)) *identifier,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	pthread_mutex_lock (&send_buffer_lock);
+	send_state_t *state;
+	cdtime_t now = cdtime ();
 
-	if (((time (NULL) - cache_flush_last) >= timeout)
-			&& (send_buffer_fill > 0))
+	/* Send the buffers holding values older than `timeout' seconds. */
+	pthread_mutex_lock (&send_states_lock);
+	for (state = send_states; state != NULL; state = state->next)
 	{
-		flush_buffer ();
+		pthread_mutex_lock (&state->lock);
+		if (send_state_pending (state)
+				&& ((timeout <= 0)
+					|| ((now - state->buffer_first)
+						>= TIME_T_TO_CDTIME_T (timeout))))
+			flush_buffer (state);
+		pthread_mutex_unlock (&state->lock);
 	}
-
-	pthread_mutex_unlock (&send_buffer_lock);
+	pthread_mutex_unlock (&send_states_lock);
 
 	return (0);
 } /* int network_flush */
 
 void module_register (void)
 {
+#if HAVE_GCRYPT_H
+	/* libgcrypt is used by several threads at once. This has to be done
+	 * before any other libgcrypt function is called. */
+	gcry_control (GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+#endif
+
 	plugin_register_complex_config ("network", network_config);
 	plugin_register_init   ("network", network_init);
 	plugin_register_flush   ("network", network_flush,
@@ -62,6 +62,8 @@
 #define TYPE_TYPE_INSTANCE   0x0005
 #define TYPE_VALUES          0x0006
 #define TYPE_INTERVAL        0x0007
+#define TYPE_TIME_HR         0x0008
+#define TYPE_INTERVAL_HR     0x0009
 
 /* Types to transmit notifications */
 #define TYPE_MESSAGE         0x0100
@@ -69,5 +71,6 @@
 
 #define TYPE_SIGN_SHA256     0x0200
 #define TYPE_ENCR_AES256     0x0210
+#define TYPE_COMPRESS_ZLIB   0x0220
 
 #endif /* NETWORK_H */
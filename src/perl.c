@@ -225,9 +225,9 @@ struct {
 };
 
 struct {
-	char  name[64];
-	int  *var;
-} g_integers[] =
+	char      name[64];
+	cdtime_t *var;
+} g_times[] =
 {
 	{ "Collectd::interval_g", &interval_g },
 	{ "", NULL }
@@ -379,10 +379,10 @@ static int hv2value_list (pTHX_ HV *hash, value_list_t *vl)
 	}
 
 	if (NULL != (tmp = hv_fetch (hash, "time", 4, 0)))
-		vl->time = (time_t)SvIV (*tmp);
+		vl->time = DOUBLE_TO_CDTIME_T (SvNV (*tmp));
 
 	if (NULL != (tmp = hv_fetch (hash, "interval", 8, 0)))
-		vl->interval = SvIV (*tmp);
+		vl->interval = DOUBLE_TO_CDTIME_T (SvNV (*tmp));
 
 	if (NULL != (tmp = hv_fetch (hash, "host", 4, 0)))
 		sstrncpy (vl->host, SvPV_nolen (*tmp), sizeof (vl->host));
@@ -534,9 +534,9 @@ static int hv2notification (pTHX_ HV *hash, notification_t *n)
 		n->severity = NOTIF_FAILURE;
 
 	if (NULL != (tmp = hv_fetch (hash, "time", 4, 0)))
-		n->time = (time_t)SvIV (*tmp);
+		n->time = DOUBLE_TO_CDTIME_T (SvNV (*tmp));
 	else
-		n->time = time (NULL);
+		n->time = cdtime ();
 
 	if (NULL != (tmp = hv_fetch (hash, "message", 7, 0)))
 		sstrncpy (n->message, SvPV_nolen (*tmp), sizeof (n->message));
@@ -650,10 +650,12 @@ static int value_list2hv (pTHX_ value_list_t *vl, data_set_t *ds, HV *hash)
 		return -1;
 
 	if (0 != vl->time)
-		if (NULL == hv_store (hash, "time", 4, newSViv (vl->time), 0))
+		if (NULL == hv_store (hash, "time", 4,
+					newSVnv (CDTIME_T_TO_DOUBLE (vl->time)), 0))
 			return -1;
 
-	if (NULL == hv_store (hash, "interval", 8, newSViv (vl->interval), 0))
+	if (NULL == hv_store (hash, "interval", 8,
+				newSVnv (CDTIME_T_TO_DOUBLE (vl->interval)), 0))
 		return -1;
 
 	if ('\0' != vl->host[0])
@@ -732,7 +734,8 @@ static int notification2hv (pTHX_ notification_t *n, HV *hash)
 		return -1;
 
 	if (0 != n->time)
-		if (NULL == hv_store (hash, "time", 4, newSViv (n->time), 0))
+		if (NULL == hv_store (hash, "time", 4,
+					newSVnv (CDTIME_T_TO_DOUBLE (n->time)), 0))
 			return -1;
 
 	if ('\0' != *n->message)
@@ -2077,19 +2080,19 @@ static int g_pv_set (pTHX_ SV *var, MAGIC *mg)
 	return 0;
 } /* static int g_pv_set (pTHX_ SV *, MAGIC *) */
 
-static int g_iv_get (pTHX_ SV *var, MAGIC *mg)
+static int g_time_get (pTHX_ SV *var, MAGIC *mg)
 {
-	int *iv = (int *)mg->mg_ptr;
-	sv_setiv (var, *iv);
+	cdtime_t *t = (cdtime_t *)mg->mg_ptr;
+	sv_setnv (var, CDTIME_T_TO_DOUBLE (*t));
 	return 0;
-} /* static int g_iv_get (pTHX_ SV *, MAGIC *) */
+} /* static int g_time_get (pTHX_ SV *, MAGIC *) */
 
-static int g_iv_set (pTHX_ SV *var, MAGIC *mg)
+static int g_time_set (pTHX_ SV *var, MAGIC *mg)
 {
-	int *iv = (int *)mg->mg_ptr;
-	*iv = (int)SvIV (var);
+	cdtime_t *t = (cdtime_t *)mg->mg_ptr;
+	*t = DOUBLE_TO_CDTIME_T (SvNV (var));
 	return 0;
-} /* static int g_iv_set (pTHX_ SV *, MAGIC *) */
+} /* static int g_time_set (pTHX_ SV *, MAGIC *) */
 
 static MGVTBL g_pv_vtbl = {
 	g_pv_get, g_pv_set, NULL, NULL, NULL, NULL, NULL
@@ -2097,8 +2100,8 @@ static MGVTBL g_pv_vtbl = {
 		, NULL
 #endif
 };
-static MGVTBL g_iv_vtbl = {
-	g_iv_get, g_iv_set, NULL, NULL, NULL, NULL, NULL
+static MGVTBL g_time_vtbl = {
+	g_time_get, g_time_set, NULL, NULL, NULL, NULL, NULL
 #if HAVE_PERL_STRUCT_MGVTBL_SVT_LOCAL
 		, NULL
 #endif
@@ -2140,11 +2143,11 @@ static void xs_init (pTHX)
 				g_strings[i].var, 0);
 	}
 
-	/* global integers */
-	for (i = 0; '\0' != g_integers[i].name[0]; ++i) {
-		tmp = get_sv (g_integers[i].name, 1);
-		sv_magicext (tmp, NULL, PERL_MAGIC_ext, &g_iv_vtbl,
-				(char *)g_integers[i].var, 0);
+	/* global times, in seconds */
+	for (i = 0; '\0' != g_times[i].name[0]; ++i) {
+		tmp = get_sv (g_times[i].name, 1);
+		sv_magicext (tmp, NULL, PERL_MAGIC_ext, &g_time_vtbl,
+				(char *)g_times[i].var, 0);
 	}
 	return;
 } /* static void xs_init (pTHX) */
@@ -36,6 +36,7 @@
 #include "utils_llist.h"
 #include "utils_heap.h"
 #include "utils_cache.h"
+#include "utils_ident.h"
 #include "utils_threshold.h"
 #include "filter_chain.h"
 
@@ -66,12 +67,81 @@ struct read_func_s
 };
 typedef struct read_func_s read_func_t;
 
+/* A value list waiting to be written. One item is shared by the queues of all
+ * write callbacks it has been handed to and freed when `refs' drops to
+ * zero. The thread enqueueing the item holds a reference, too, since it may
+ * wait for space in a queue while write threads release the others. The
+ * values and the rates are stored right after the structure. The rates are
+ * taken from the value cache when the item is created, since the cache may
+ * hold newer values by the time the item is written. `rates' is NULL if the
+ * cache had no rates. */
+struct write_item_s
+{
+	int refs;
+	const data_set_t *ds;
+	cdtime_t queued;
+	gauge_t *rates;
+	value_list_t vl;
+};
+typedef struct write_item_s write_item_t;
+
+/* Items waiting for one write callback. A queue is handled by at most one
+ * write thread at a time, so each callback sees the values in the order in
+ * which they were dispatched. */
+struct write_queue_s;
+typedef struct write_queue_s write_queue_t;
+struct write_queue_s
+{
+	char *name;
+	callback_func_t *cf;
+
+	/* Ring buffer of `items_size' entries, starting at `items_head'. */
+	write_item_t **items;
+	size_t items_size;
+	size_t items_head;
+	size_t items_num;
+
+	int busy;
+	int ready;
+
+	/* Number of items pushed and of items written or dropped since, used
+	 * by `plugin_flush' to wait for the items queued before it. */
+	uint64_t pushed;
+	uint64_t done;
+
+	/* Statistics, reported if `WriteQueueStats' is enabled. */
+	counter_t written;
+	counter_t dropped;
+	cdtime_t delay_sum;
+	uint64_t delay_num;
+
+	write_queue_t *next;
+	write_queue_t *ready_next;
+};
+
+#define WRITE_POLICY_BLOCK 0
+#define WRITE_POLICY_DROP  1
+
+/* Maximum number of items a write thread takes from a queue at once. */
+#define WRITE_BATCH_SIZE 64
+
+/* Items of a `plugin_dispatch_values_batch' call. They are handed to the
+ * write queues together, taking `write_lock' once, when the batch ends or the
+ * array is full. */
+struct write_batch_s
+{
+	write_item_t *items[WRITE_BATCH_SIZE];
+	size_t items_num;
+};
+typedef struct write_batch_s write_batch_t;
+
 /*
  * Private variables
  */
 static llist_t *list_init;
 static llist_t *list_write;
 static llist_t *list_flush;
+static llist_t *list_history;
 static llist_t *list_shutdown;
 static llist_t *list_log;
 static llist_t *list_notification;
@@ -90,6 +160,40 @@ static pthread_cond_t  read_cond = PTHREAD_COND_INITIALIZER;
 static pthread_t      *read_threads = NULL;
 static int             read_threads_num = 0;
 
+/* All write queues and the queues with items but without a write thread, in
+ * the order in which they became ready. Everything is protected by
+ * `write_lock'. Write threads wait for `write_cond', threads blocked by a
+ * full queue for `write_space_cond'. */
+static write_queue_t  *write_queues = NULL;
+static write_queue_t  *write_ready_head = NULL;
+static write_queue_t  *write_ready_tail = NULL;
+static int             write_loop = 0;
+static int             write_blocked = 0;
+static size_t          write_queue_limit = 10000;
+static int             write_queue_policy = WRITE_POLICY_BLOCK;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  write_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  write_space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t      *write_threads = NULL;
+static int             write_threads_num = 0;
+
+/* Set in write threads, which must never wait for a full queue. */
+static pthread_key_t   write_thread_key;
+static pthread_once_t  write_thread_once = PTHREAD_ONCE_INIT;
+
+/* Points to the batch of the `plugin_dispatch_values_batch' call the
+ * calling thread is in, if any. */
+static pthread_key_t   write_batch_key;
+
+/* Points to the item whose values the calling thread is handing to write
+ * callbacks, if any. See `plugin_write_rates'. */
+static pthread_key_t   write_item_key;
+
+/* Points to the `rf_interval' of the read function being run by the
+ * calling thread, if any. See `plugin_get_interval'. */
+static pthread_key_t   read_interval_key;
+static pthread_once_t  read_interval_once = PTHREAD_ONCE_INIT;
+
 /*
  * Static functions
  */
@@ -101,6 +205,11 @@ static const char *plugin_get_dir (void)
 		return (plugindir);
 }
 
+static void read_interval_init (void)
+{
+	pthread_key_create (&read_interval_key, /* destructor = */ NULL);
+}
+
 static void destroy_callback (callback_func_t *cf) /* {{{ */
 {
 	if (cf == NULL)
@@ -302,6 +411,8 @@ static int plugin_load_file (char *file)
 
 static void *plugin_read_thread (void __attribute__((unused)) *args)
 {
+	pthread_once (&read_interval_once, read_interval_init);
+
 	while (read_loop != 0)
 	{
 		read_func_t *rf;
@@ -314,10 +425,7 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 		{
 			struct timespec abstime;
 
-			gettimeofday (&now, /* timezone = */ NULL);
-
-			abstime.tv_sec = now.tv_sec + interval_g;
-			abstime.tv_nsec = 1000 * now.tv_usec;
+			cdtime_to_timespec (cdtime () + interval_g, &abstime);
 
 			pthread_mutex_lock (&read_lock);
 			pthread_cond_timedwait (&read_cond, &read_lock,
@@ -330,8 +438,7 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 		{
 			gettimeofday (&now, /* timezone = */ NULL);
 
-			rf->rf_interval.tv_sec = interval_g;
-			rf->rf_interval.tv_nsec = 0;
+			cdtime_to_timespec (interval_g, &rf->rf_interval);
 
 			rf->rf_effective_interval = rf->rf_interval;
 
@@ -357,6 +464,8 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 
 		DEBUG ("plugin_read_thread: Handling `%s'.", rf->rf_name);
 
+		pthread_setspecific (read_interval_key, &rf->rf_interval);
+
 		if (rf->rf_type == RF_SIMPLE)
 		{
 			int (*callback) (void);
@@ -372,6 +481,8 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 			status = (*callback) (&rf->rf_udata);
 		}
 
+		pthread_setspecific (read_interval_key, NULL);
+
 		/* If the function signals failure, we will increase the
 		 * intervals in which it will be called. */
 		if (status != 0)
@@ -496,6 +607,706 @@ static void stop_read_threads (void)
 	read_threads_num = 0;
 } /* void stop_read_threads */
 
+static void write_thread_init (void)
+{
+	pthread_key_create (&write_thread_key, /* destructor = */ NULL);
+	pthread_key_create (&write_batch_key, /* destructor = */ NULL);
+	pthread_key_create (&write_item_key, /* destructor = */ NULL);
+}
+
+static write_item_t *write_item_create (const data_set_t *ds,
+		const value_list_t *vl)
+{
+	write_item_t *item;
+	gauge_t *rates = NULL;
+	int counters = 0;
+	int i;
+
+	item = (write_item_t *) malloc (sizeof (*item)
+			+ vl->values_len * (sizeof (value_t) + sizeof (gauge_t)));
+	if (item == NULL)
+		return (NULL);
+
+	item->refs = 1;
+	item->ds = ds;
+	item->queued = cdtime ();
+	memcpy (&item->vl, vl, sizeof (item->vl));
+	item->vl.values = (value_t *) (item + 1);
+	memcpy (item->vl.values, vl->values,
+			vl->values_len * sizeof (value_t));
+	item->vl.ident = ident_ref (vl->ident);
+	item->rates = (gauge_t *) (item->vl.values + vl->values_len);
+
+	/* The rate of a gauge is its value, so the cache is only asked if there
+	 * are counters. */
+	for (i = 0; i < ds->ds_num; i++)
+		if (ds->ds[i].type != DS_TYPE_GAUGE)
+			counters++;
+
+	if (counters > 0)
+	{
+		rates = uc_get_rate (ds, vl);
+		if (rates == NULL)
+			item->rates = NULL;
+		else
+			memcpy (item->rates, rates,
+					vl->values_len * sizeof (gauge_t));
+		sfree (rates);
+	}
+	else
+	{
+		for (i = 0; i < vl->values_len; i++)
+			item->rates[i] = vl->values[i].gauge;
+	}
+
+	return (item);
+} /* write_item_t *write_item_create */
+
+static void write_item_free (write_item_t *item)
+{
+	ident_release (item->vl.ident);
+	free (item);
+} /* void write_item_free */
+
+/* Must be called with `write_lock' held. */
+static void write_item_release (write_item_t *item)
+{
+	item->refs--;
+	if (item->refs <= 0)
+		write_item_free (item);
+} /* void write_item_release */
+
+/* Must be called with `write_lock' held. */
+static void write_queue_set_ready (write_queue_t *q)
+{
+	if (q->busy || q->ready || (q->items_num == 0))
+		return;
+
+	q->ready = 1;
+	q->ready_next = NULL;
+	if (write_ready_tail == NULL)
+		write_ready_head = q;
+	else
+		write_ready_tail->ready_next = q;
+	write_ready_tail = q;
+
+	pthread_cond_signal (&write_cond);
+} /* void write_queue_set_ready */
+
+/* Appends `item' to `q', growing the ring buffer if necessary. Must be called
+ * with `write_lock' held. */
+static int write_queue_push (write_queue_t *q, write_item_t *item)
+{
+	if (q->items_num >= q->items_size)
+	{
+		write_item_t **tmp;
+		size_t new_size;
+		size_t i;
+
+		new_size = (q->items_size == 0) ? 64 : (2 * q->items_size);
+		tmp = (write_item_t **) malloc (new_size * sizeof (*tmp));
+		if (tmp == NULL)
+			return (-1);
+
+		for (i = 0; i < q->items_num; i++)
+			tmp[i] = q->items[(q->items_head + i) % q->items_size];
+
+		sfree (q->items);
+		q->items = tmp;
+		q->items_size = new_size;
+		q->items_head = 0;
+	}
+
+	q->items[(q->items_head + q->items_num) % q->items_size] = item;
+	q->items_num++;
+	q->pushed++;
+	item->refs++;
+
+	return (0);
+} /* int write_queue_push */
+
+/* Must be called with `write_lock' held. */
+static write_item_t *write_queue_shift (write_queue_t *q)
+{
+	write_item_t *item;
+
+	if (q->items_num == 0)
+		return (NULL);
+
+	item = q->items[q->items_head];
+	q->items_head = (q->items_head + 1) % q->items_size;
+	q->items_num--;
+
+	return (item);
+} /* write_item_t *write_queue_shift */
+
+/* Must be called with `write_lock' held. */
+static int write_queue_add (const char *name, callback_func_t *cf)
+{
+	write_queue_t *q;
+
+	q = (write_queue_t *) malloc (sizeof (*q));
+	if (q == NULL)
+		return (-1);
+	memset (q, 0, sizeof (*q));
+
+	q->name = strdup (name);
+	if (q->name == NULL)
+	{
+		sfree (q);
+		return (-1);
+	}
+	q->cf = cf;
+
+	q->next = write_queues;
+	write_queues = q;
+
+	return (0);
+} /* int write_queue_add */
+
+/* Removes the queue of `name', discarding its items. Waits for a write
+ * thread handling the queue to finish and for threads waiting for space in
+ * any queue, which may be this one. Must be called with `write_lock'
+ * held. */
+static void write_queue_remove (const char *name)
+{
+	write_queue_t *q;
+	write_queue_t *prev;
+	write_item_t *item;
+
+	while (42)
+	{
+		prev = NULL;
+		for (q = write_queues; q != NULL; q = q->next)
+		{
+			if (strcasecmp (name, q->name) == 0)
+				break;
+			prev = q;
+		}
+
+		if ((q == NULL) || (!q->busy && (write_blocked == 0)))
+			break;
+
+		pthread_cond_wait (&write_space_cond, &write_lock);
+	}
+
+	if (q == NULL)
+		return;
+
+	if (prev == NULL)
+		write_queues = q->next;
+	else
+		prev->next = q->next;
+
+	if (q->ready)
+	{
+		write_queue_t *r;
+
+		prev = NULL;
+		for (r = write_ready_head; r != q; r = r->ready_next)
+			prev = r;
+
+		if (prev == NULL)
+			write_ready_head = q->ready_next;
+		else
+			prev->ready_next = q->ready_next;
+		if (write_ready_tail == q)
+			write_ready_tail = prev;
+	}
+
+	while ((item = write_queue_shift (q)) != NULL)
+		write_item_release (item);
+
+	sfree (q->items);
+	sfree (q->name);
+	sfree (q);
+} /* void write_queue_remove */
+
+/* Hands `item' to the queue of `plugin', or of all write callbacks if
+ * `plugin' is NULL. Returns the number of queues found. Must be called with
+ * `write_lock' held. */
+static int write_queue_enqueue_locked (const char *plugin,
+		write_item_t *item, int may_block)
+{
+	write_queue_t *q;
+	int found = 0;
+
+	for (q = write_queues; q != NULL; q = q->next)
+	{
+		if ((plugin != NULL) && (strcasecmp (plugin, q->name) != 0))
+			continue;
+		found++;
+
+		if ((write_queue_limit > 0) && (q->items_num >= write_queue_limit))
+		{
+			if (may_block)
+			{
+				/* Once the write threads are stopping, the queue
+				 * is drained anyway, so stop waiting. */
+				write_blocked++;
+				while ((write_loop != 0)
+						&& (q->items_num >= write_queue_limit))
+					pthread_cond_wait (&write_space_cond, &write_lock);
+				write_blocked--;
+			}
+			else
+			{
+				write_item_t *old;
+
+				old = write_queue_shift (q);
+				if (old != NULL)
+				{
+					write_item_release (old);
+					q->done++;
+				}
+				q->dropped++;
+			}
+		}
+
+		if (write_queue_push (q, item) != 0)
+		{
+			q->dropped++;
+			continue;
+		}
+
+		write_queue_set_ready (q);
+	} /* for (write_queues) */
+
+	return (found);
+} /* int write_queue_enqueue_locked */
+
+/* Write callbacks writing values themselves must not wait for a write thread,
+ * which may well be their own. */
+static int write_queue_may_block (void)
+{
+	return ((write_queue_policy == WRITE_POLICY_BLOCK)
+			&& (pthread_getspecific (write_thread_key) == NULL));
+} /* int write_queue_may_block */
+
+/* Hands the items of `batch' to the write queues. If the write threads are
+ * stopping, the values are written directly, see `plugin_write'. */
+static void write_batch_flush (write_batch_t *batch)
+{
+	int may_block;
+	size_t i;
+
+	if (batch->items_num == 0)
+		return;
+
+	may_block = write_queue_may_block ();
+
+	pthread_mutex_lock (&write_lock);
+
+	if (write_loop == 0)
+	{
+		pthread_mutex_unlock (&write_lock);
+		for (i = 0; i < batch->items_num; i++)
+		{
+			pthread_setspecific (write_item_key, batch->items[i]);
+			plugin_write (NULL, batch->items[i]->ds,
+					&batch->items[i]->vl);
+			pthread_setspecific (write_item_key, NULL);
+			write_item_free (batch->items[i]);
+		}
+		batch->items_num = 0;
+		return;
+	}
+
+	for (i = 0; i < batch->items_num; i++)
+	{
+		write_queue_enqueue_locked (/* plugin = */ NULL,
+				batch->items[i], may_block);
+		write_item_release (batch->items[i]);
+	}
+
+	pthread_mutex_unlock (&write_lock);
+
+	batch->items_num = 0;
+} /* void write_batch_flush */
+
+/* Hands `vl' to the queue of `plugin', or of all write callbacks if `plugin'
+ * is NULL. Returns ENOENT if there is no such callback and -1 if the values
+ * could not be queued because the write threads are stopping. Values for all
+ * write callbacks dispatched by `plugin_dispatch_values_batch' are added to
+ * its batch instead. */
+static int write_queue_enqueue (const char *plugin,
+		const data_set_t *ds, const value_list_t *vl)
+{
+	write_item_t *item;
+	write_batch_t *batch;
+	int may_block;
+	int found;
+
+	item = write_item_create (ds, vl);
+	if (item == NULL)
+	{
+		ERROR ("plugin_write: malloc failed.");
+		return (-1);
+	}
+
+	batch = pthread_getspecific (write_batch_key);
+	if ((batch != NULL) && (plugin == NULL))
+	{
+		if (batch->items_num >= WRITE_BATCH_SIZE)
+			write_batch_flush (batch);
+		batch->items[batch->items_num] = item;
+		batch->items_num++;
+		return (0);
+	}
+	else if (batch != NULL)
+	{
+		/* Keep the order of the values handed to this callback. */
+		write_batch_flush (batch);
+	}
+
+	may_block = write_queue_may_block ();
+
+	pthread_mutex_lock (&write_lock);
+
+	if (write_loop == 0)
+	{
+		pthread_mutex_unlock (&write_lock);
+		write_item_free (item);
+		return (-1);
+	}
+
+	found = write_queue_enqueue_locked (plugin, item, may_block);
+	write_item_release (item);
+
+	pthread_mutex_unlock (&write_lock);
+
+	if (found == 0)
+		return (ENOENT);
+	return (0);
+} /* int write_queue_enqueue */
+
+/* Waits until the values queued for `plugin', or for all write callbacks if
+ * `plugin' is NULL, have been handed to the callbacks. Values queued while
+ * waiting may be waited for, too. Does not wait when called by a write
+ * thread, which may have to handle the queue itself. */
+static void write_queue_wait (const char *plugin)
+{
+	write_batch_t *batch;
+	write_queue_t *q;
+
+	pthread_once (&write_thread_once, write_thread_init);
+	if (pthread_getspecific (write_thread_key) != NULL)
+		return;
+
+	batch = pthread_getspecific (write_batch_key);
+	if (batch != NULL)
+		write_batch_flush (batch);
+
+	pthread_mutex_lock (&write_lock);
+
+	/* Counting as blocked keeps `write_queue_remove' from freeing the
+	 * queue and the write threads from exiting while waiting. */
+	write_blocked++;
+	for (q = write_queues; (q != NULL) && (write_loop != 0); q = q->next)
+	{
+		uint64_t target;
+
+		if ((plugin != NULL) && (strcasecmp (plugin, q->name) != 0))
+			continue;
+
+		target = q->pushed;
+		while ((write_loop != 0) && (q->done < target))
+			pthread_cond_wait (&write_space_cond, &write_lock);
+	}
+	write_blocked--;
+	pthread_cond_broadcast (&write_space_cond);
+
+	pthread_mutex_unlock (&write_lock);
+} /* void write_queue_wait */
+
+static void *plugin_write_thread (void __attribute__((unused)) *args)
+{
+	write_item_t *batch[WRITE_BATCH_SIZE];
+
+	pthread_setspecific (write_thread_key, (void *) 1);
+
+	pthread_mutex_lock (&write_lock);
+
+	while (42)
+	{
+		write_queue_t *q;
+		plugin_write_cb callback;
+		cdtime_t start;
+		size_t batch_num;
+		size_t i;
+
+		q = write_ready_head;
+		if (q == NULL)
+		{
+			/* When stopping, keep going until all queues have been
+			 * drained and nobody is about to add to them. */
+			if ((write_loop == 0) && (write_blocked == 0))
+				break;
+			pthread_cond_wait (&write_cond, &write_lock);
+			continue;
+		}
+
+		write_ready_head = q->ready_next;
+		if (write_ready_head == NULL)
+			write_ready_tail = NULL;
+		q->ready = 0;
+		q->ready_next = NULL;
+		q->busy = 1;
+
+		batch_num = 0;
+		while (batch_num < WRITE_BATCH_SIZE)
+		{
+			batch[batch_num] = write_queue_shift (q);
+			if (batch[batch_num] == NULL)
+				break;
+			batch_num++;
+		}
+		pthread_cond_broadcast (&write_space_cond);
+
+		callback = q->cf->cf_callback;
+
+		pthread_mutex_unlock (&write_lock);
+
+		start = cdtime ();
+		for (i = 0; i < batch_num; i++)
+		{
+			pthread_setspecific (write_item_key, batch[i]);
+			(*callback) (batch[i]->ds, &batch[i]->vl, &q->cf->cf_udata);
+		}
+		pthread_setspecific (write_item_key, NULL);
+
+		pthread_mutex_lock (&write_lock);
+
+		for (i = 0; i < batch_num; i++)
+		{
+			if (start > batch[i]->queued)
+				q->delay_sum += start - batch[i]->queued;
+			q->delay_num++;
+			write_item_release (batch[i]);
+		}
+		q->written += batch_num;
+		q->done += batch_num;
+
+		q->busy = 0;
+		write_queue_set_ready (q);
+
+		/* `write_queue_remove' may be waiting for this queue. */
+		pthread_cond_broadcast (&write_space_cond);
+	} /* while (42) */
+
+	/* Wake up the other write threads, so they notice, too. */
+	pthread_cond_broadcast (&write_cond);
+	pthread_mutex_unlock (&write_lock);
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* void *plugin_write_thread */
+
+static void write_queue_submit (const char *queue, const char *type,
+		const char *type_instance, value_t value)
+{
+	value_list_t vl = VALUE_LIST_INIT;
+
+	vl.values = &value;
+	vl.values_len = 1;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "collectd", sizeof (vl.plugin));
+	ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+			"write-%s", queue);
+	sstrncpy (vl.type, type, sizeof (vl.type));
+	if (type_instance != NULL)
+		sstrncpy (vl.type_instance, type_instance,
+				sizeof (vl.type_instance));
+
+	plugin_dispatch_values (&vl);
+} /* void write_queue_submit */
+
+/* Read callback reporting the length, the number of written and dropped
+ * values and the average time values spent in the queue of each write
+ * callback. */
+static int write_queue_read (void)
+{
+	write_queue_t *q;
+	size_t stats_num = 0;
+	size_t i;
+
+	struct
+	{
+		char name[DATA_MAX_NAME_LEN];
+		gauge_t length;
+		counter_t written;
+		counter_t dropped;
+		gauge_t delay;
+	} *stats = NULL;
+
+	pthread_mutex_lock (&write_lock);
+
+	for (q = write_queues; q != NULL; q = q->next)
+		stats_num++;
+
+	if (stats_num > 0)
+		stats = calloc (stats_num, sizeof (*stats));
+	if (stats == NULL)
+	{
+		pthread_mutex_unlock (&write_lock);
+		return ((stats_num > 0) ? -1 : 0);
+	}
+
+	for (q = write_queues, i = 0; q != NULL; q = q->next, i++)
+	{
+		sstrncpy (stats[i].name, q->name, sizeof (stats[i].name));
+		stats[i].length = (gauge_t) q->items_num;
+		stats[i].written = q->written;
+		stats[i].dropped = q->dropped;
+		if (q->delay_num > 0)
+			stats[i].delay = CDTIME_T_TO_DOUBLE (q->delay_sum)
+				/ ((double) q->delay_num);
+		else
+			stats[i].delay = NAN;
+
+		q->delay_sum = 0;
+		q->delay_num = 0;
+	}
+
+	pthread_mutex_unlock (&write_lock);
+
+	for (i = 0; i < stats_num; i++)
+	{
+		value_t v;
+
+		v.gauge = stats[i].length;
+		write_queue_submit (stats[i].name, "queue_length", NULL, v);
+		v.counter = stats[i].written;
+		write_queue_submit (stats[i].name, "counter", "written", v);
+		v.counter = stats[i].dropped;
+		write_queue_submit (stats[i].name, "counter", "dropped", v);
+		v.gauge = stats[i].delay;
+		write_queue_submit (stats[i].name, "delay", "queue", v);
+	}
+
+	sfree (stats);
+	return (0);
+} /* int write_queue_read */
+
+static void start_write_threads (int num)
+{
+	const char *str;
+	llentry_t *le;
+	int i;
+
+	if (write_threads != NULL)
+		return;
+
+	pthread_once (&write_thread_once, write_thread_init);
+
+	str = global_option_get ("WriteQueueLimit");
+	i = atoi (str);
+	write_queue_limit = (i > 0) ? ((size_t) i) : 0;
+
+	str = global_option_get ("WriteQueuePolicy");
+	if (strcasecmp ("Drop", str) == 0)
+		write_queue_policy = WRITE_POLICY_DROP;
+	else
+	{
+		if (strcasecmp ("Block", str) != 0)
+			WARNING ("plugin: Unknown WriteQueuePolicy `%s'. "
+					"Using `Block' instead.", str);
+		write_queue_policy = WRITE_POLICY_BLOCK;
+	}
+
+	write_threads = (pthread_t *) calloc (num, sizeof (pthread_t));
+	if (write_threads == NULL)
+	{
+		ERROR ("plugin: start_write_threads: calloc failed.");
+		return;
+	}
+
+	pthread_mutex_lock (&write_lock);
+
+	for (le = llist_head (list_write); le != NULL; le = le->next)
+	{
+		if (write_queue_add (le->key, le->value) != 0)
+		{
+			ERROR ("plugin: start_write_threads: "
+					"write_queue_add failed.");
+			while (write_queues != NULL)
+				write_queue_remove (write_queues->name);
+			pthread_mutex_unlock (&write_lock);
+			sfree (write_threads);
+			return;
+		}
+	}
+
+	write_loop = 1;
+
+	pthread_mutex_unlock (&write_lock);
+
+	write_threads_num = 0;
+	for (i = 0; i < num; i++)
+	{
+		if (pthread_create (write_threads + write_threads_num, NULL,
+					plugin_write_thread, NULL) == 0)
+		{
+			write_threads_num++;
+		}
+		else
+		{
+			ERROR ("plugin: start_write_threads: pthread_create failed.");
+			break;
+		}
+	} /* for (i) */
+
+	/* Without a single write thread, values have to be written directly. */
+	if (write_threads_num == 0)
+	{
+		pthread_mutex_lock (&write_lock);
+		write_loop = 0;
+		while (write_queues != NULL)
+			write_queue_remove (write_queues->name);
+		pthread_mutex_unlock (&write_lock);
+		sfree (write_threads);
+		return;
+	}
+
+	if (IS_TRUE (global_option_get ("WriteQueueStats")))
+		plugin_register_read ("collectd", write_queue_read);
+} /* void start_write_threads */
+
+/* Writes all queued values and stops the write threads. Values dispatched
+ * afterwards are written directly. */
+static void stop_write_threads (void)
+{
+	int i;
+
+	if (write_threads == NULL)
+		return;
+
+	INFO ("collectd: Stopping %i write threads.", write_threads_num);
+
+	pthread_mutex_lock (&write_lock);
+	write_loop = 0;
+	DEBUG ("plugin: stop_write_threads: Signalling `write_cond'");
+	pthread_cond_broadcast (&write_cond);
+	pthread_cond_broadcast (&write_space_cond);
+	pthread_mutex_unlock (&write_lock);
+
+	for (i = 0; i < write_threads_num; i++)
+	{
+		if (pthread_join (write_threads[i], NULL) != 0)
+		{
+			ERROR ("plugin: stop_write_threads: pthread_join failed.");
+		}
+		write_threads[i] = (pthread_t) 0;
+	}
+	sfree (write_threads);
+	write_threads_num = 0;
+
+	pthread_mutex_lock (&write_lock);
+	while (write_queues != NULL)
+		write_queue_remove (write_queues->name);
+	pthread_mutex_unlock (&write_lock);
+} /* void stop_write_threads */
+
 /*
  * Public functions
  */
@@ -730,8 +1541,32 @@ int plugin_register_complex_read (const char *name,
 int plugin_register_write (const char *name,
 		plugin_write_cb callback, user_data_t *ud)
 {
-	return (create_register_callback (&list_write, name,
-				(void *) callback, ud));
+	llentry_t *le;
+	int status;
+
+	pthread_mutex_lock (&write_lock);
+
+	/* Replacing a callback frees the old one, which its queue refers to. */
+	if (write_loop != 0)
+		write_queue_remove (name);
+
+	status = create_register_callback (&list_write, name,
+			(void *) callback, ud);
+
+	if ((status == 0) && (write_loop != 0))
+	{
+		le = llist_search (list_write, name);
+		if ((le == NULL) || (write_queue_add (name, le->value) != 0))
+		{
+			ERROR ("plugin_register_write: Unable to create the "
+					"write queue of `%s'.", name);
+			status = -1;
+		}
+	}
+
+	pthread_mutex_unlock (&write_lock);
+
+	return (status);
 } /* int plugin_register_write */
 
 int plugin_register_flush (const char *name,
@@ -741,6 +1576,13 @@ int plugin_register_flush (const char *name,
 				(void *) callback, ud));
 } /* int plugin_register_flush */
 
+int plugin_register_history (const char *name,
+		plugin_history_cb callback, user_data_t *ud)
+{
+	return (create_register_callback (&list_history, name,
+				(void *) callback, ud));
+} /* int plugin_register_history */
+
 int plugin_register_shutdown (char *name,
 		int (*callback) (void))
 {
@@ -825,7 +1667,14 @@ int plugin_unregister_read (const char *name)
 
 int plugin_unregister_write (const char *name)
 {
-	return (plugin_unregister (list_write, name));
+	int status;
+
+	pthread_mutex_lock (&write_lock);
+	write_queue_remove (name);
+	status = plugin_unregister (list_write, name);
+	pthread_mutex_unlock (&write_lock);
+
+	return (status);
 }
 
 int plugin_unregister_flush (const char *name)
@@ -833,6 +1682,11 @@ int plugin_unregister_flush (const char *name)
 	return (plugin_unregister (list_flush, name));
 }
 
+int plugin_unregister_history (const char *name)
+{
+	return (plugin_unregister (list_history, name));
+}
+
 int plugin_unregister_shutdown (const char *name)
 {
 	return (plugin_unregister (list_shutdown, name));
@@ -912,6 +1766,17 @@ void plugin_init_all (void)
 		le = le->next;
 	}
 
+	/* Start write-threads. They are not used when reading only once
+	 * (`-T'), so the values are written before the daemon exits. */
+	if ((list_write != NULL)
+			&& (atoi (global_option_get ("ReadThreads")) != -1))
+	{
+		int num;
+		num = atoi (global_option_get ("WriteThreads"));
+		if (num > 0)
+			start_write_threads (num);
+	}
+
 	/* Start read-threads */
 	if (read_heap != NULL)
 	{
@@ -1002,6 +1867,15 @@ int plugin_write (const char *plugin, /* {{{ */
     }
   }
 
+  /* Hand the values to the write threads, if running. If they are
+   * stopping, write the values directly. */
+  if (write_loop != 0)
+  {
+    status = write_queue_enqueue (plugin, ds, vl);
+    if (status >= 0)
+      return (status);
+  }
+
   if (plugin == NULL)
   {
     int success = 0;
@@ -1056,6 +1930,32 @@ int plugin_write (const char *plugin, /* {{{ */
   return (status);
 } /* }}} int plugin_write */
 
+int plugin_write_rates (const data_set_t *ds, const value_list_t *vl,
+		gauge_t **ret_rates)
+{
+	write_item_t *item;
+	gauge_t *rates;
+
+	pthread_once (&write_thread_once, write_thread_init);
+
+	item = pthread_getspecific (write_item_key);
+	if ((item == NULL) || (vl != &item->vl))
+		return (ENOENT);
+
+	if ((item->rates == NULL) || (ds->ds_num != item->vl.values_len))
+	{
+		*ret_rates = NULL;
+		return (0);
+	}
+
+	rates = (gauge_t *) malloc (ds->ds_num * sizeof (*rates));
+	if (rates != NULL)
+		memcpy (rates, item->rates, ds->ds_num * sizeof (*rates));
+
+	*ret_rates = rates;
+	return (0);
+} /* int plugin_write_rates */
+
 int plugin_flush (const char *plugin, int timeout, const char *identifier)
 {
   llentry_t *le;
@@ -1063,6 +1963,9 @@ int plugin_flush (const char *plugin, int timeout, const char *identifier)
   if (list_flush == NULL)
     return (0);
 
+  /* Values still waiting in the write queues would be missed otherwise. */
+  write_queue_wait (plugin);
+
   le = llist_head (list_flush);
   while (le != NULL)
   {
@@ -1086,11 +1989,43 @@ int plugin_flush (const char *plugin, int timeout, const char *identifier)
   return (0);
 } /* int plugin_flush */
 
+int plugin_history (const char *plugin, const char *identifier,
+    cdtime_t begin, cdtime_t end,
+    cdtime_t **ret_times, gauge_t **ret_values, size_t *ret_values_num)
+{
+  llentry_t *le;
+  int status = ENOENT;
+
+  if (list_history == NULL)
+    return (ENOENT);
+
+  for (le = llist_head (list_history); le != NULL; le = le->next)
+  {
+    callback_func_t *cf;
+    plugin_history_cb callback;
+
+    if ((plugin != NULL)
+        && (strcmp (plugin, le->key) != 0))
+      continue;
+
+    cf = le->value;
+    callback = cf->cf_callback;
+
+    status = (*callback) (identifier, begin, end,
+        ret_times, ret_values, ret_values_num, &cf->cf_udata);
+    if (status == 0)
+      break;
+  }
+
+  return (status);
+} /* int plugin_history */
+
 void plugin_shutdown_all (void)
 {
 	llentry_t *le;
 
 	stop_read_threads ();
+	stop_write_threads ();
 
 	destroy_all_callbacks (&list_init);
 	destroy_read_heap ();
@@ -1121,6 +2056,7 @@ void plugin_shutdown_all (void)
 
 	destroy_all_callbacks (&list_write);
 	destroy_all_callbacks (&list_flush);
+	destroy_all_callbacks (&list_history);
 	destroy_all_callbacks (&list_notification);
 	destroy_all_callbacks (&list_shutdown);
 	destroy_all_callbacks (&list_log);
@@ -1133,6 +2069,8 @@ int plugin_dispatch_values (value_list_t *vl)
 
 	value_t *saved_values;
 	int      saved_values_len;
+	const identifier_t *saved_ident;
+	const identifier_t *ident;
 
 	data_set_t *ds;
 
@@ -1164,16 +2102,17 @@ int plugin_dispatch_values (value_list_t *vl)
 	}
 
 	if (vl->time == 0)
-		vl->time = time (NULL);
+		vl->time = cdtime ();
 
-	if (vl->interval <= 0)
-		vl->interval = interval_g;
+	if (vl->interval == 0)
+		vl->interval = plugin_get_interval ();
 
-	DEBUG ("plugin_dispatch_values: time = %u; interval = %i; "
+	DEBUG ("plugin_dispatch_values: time = %.3f; interval = %.3f; "
 			"host = %s; "
 			"plugin = %s; plugin_instance = %s; "
 			"type = %s; type_instance = %s;",
-			(unsigned int) vl->time, vl->interval,
+			CDTIME_T_TO_DOUBLE (vl->time),
+			CDTIME_T_TO_DOUBLE (vl->interval),
 			vl->host,
 			vl->plugin, vl->plugin_instance,
 			vl->type, vl->type_instance);
@@ -1254,6 +2193,12 @@ int plugin_dispatch_values (value_list_t *vl)
 		}
 	}
 
+	/* Intern the identifier once, so the cache and the write plugins don't
+	 * need to format and compare the name again. */
+	saved_ident = vl->ident;
+	ident = ident_intern (vl);
+	vl->ident = ident;
+
 	/* Update the value cache */
 	uc_update (ds, vl);
 
@@ -1279,19 +2224,65 @@ int plugin_dispatch_values (value_list_t *vl)
 		vl->values     = saved_values;
 		vl->values_len = saved_values_len;
 	}
+	vl->ident = saved_ident;
+	ident_release (ident);
 
 	return (0);
 } /* int plugin_dispatch_values */
 
+int plugin_dispatch_values_batch (value_list_t *vls, size_t vls_num)
+{
+	write_batch_t batch;
+	int failed = 0;
+	size_t i;
+
+	pthread_once (&write_thread_once, write_thread_init);
+
+	/* Nested calls, e.g. from a write callback, add to the outer batch. */
+	if (pthread_getspecific (write_batch_key) != NULL)
+	{
+		for (i = 0; i < vls_num; i++)
+			if (plugin_dispatch_values (vls + i) != 0)
+				failed++;
+		return ((failed == 0) ? 0 : -1);
+	}
+
+	batch.items_num = 0;
+	pthread_setspecific (write_batch_key, &batch);
+
+	for (i = 0; i < vls_num; i++)
+		if (plugin_dispatch_values (vls + i) != 0)
+			failed++;
+
+	pthread_setspecific (write_batch_key, NULL);
+	write_batch_flush (&batch);
+
+	return ((failed == 0) ? 0 : -1);
+} /* int plugin_dispatch_values_batch */
+
+cdtime_t plugin_get_interval (void)
+{
+	const struct timespec *interval;
+
+	pthread_once (&read_interval_once, read_interval_init);
+
+	interval = pthread_getspecific (read_interval_key);
+	if ((interval == NULL)
+			|| ((interval->tv_sec == 0) && (interval->tv_nsec == 0)))
+		return (interval_g);
+
+	return (TIMESPEC_TO_CDTIME_T (interval));
+} /* cdtime_t plugin_get_interval */
+
 int plugin_dispatch_notification (const notification_t *notif)
 {
 	llentry_t *le;
 	/* Possible TODO: Add flap detection here */
 
 	DEBUG ("plugin_dispatch_notification: severity = %i; message = %s; "
-			"time = %u; host = %s;",
+			"time = %.3f; host = %s;",
 			notif->severity, notif->message,
-			(unsigned int) notif->time, notif->host);
+			CDTIME_T_TO_DOUBLE (notif->time), notif->host);
 
 	/* Nobody cares for notifications */
 	if (list_notification == NULL)
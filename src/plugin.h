@@ -24,6 +24,7 @@
 
 #include "collectd.h"
 #include "configfile.h"
+#include "utils_time.h"
 
 #define DATA_MAX_NAME_LEN 64
 
@@ -65,22 +66,27 @@ union value_u
 };
 typedef union value_u value_t;
 
+struct identifier_s;
+
 struct value_list_s
 {
 	value_t *values;
 	int      values_len;
-	time_t   time;
-	int      interval;
+	cdtime_t time;
+	cdtime_t interval;
 	char     host[DATA_MAX_NAME_LEN];
 	char     plugin[DATA_MAX_NAME_LEN];
 	char     plugin_instance[DATA_MAX_NAME_LEN];
 	char     type[DATA_MAX_NAME_LEN];
 	char     type_instance[DATA_MAX_NAME_LEN];
+	/* Interned identifier, set by `plugin_dispatch_values'. Targets changing
+	 * any of the name fields must reset this to NULL. See utils_ident.h. */
+	const struct identifier_s *ident;
 };
 typedef struct value_list_s value_list_t;
 
-#define VALUE_LIST_INIT { NULL, 0, 0, interval_g, "localhost", "", "", "", "" }
-#define VALUE_LIST_STATIC { NULL, 0, 0, 0, "localhost", "", "", "", "" }
+#define VALUE_LIST_INIT { NULL, 0, 0, 0, "localhost", "", "", "", "", NULL }
+#define VALUE_LIST_STATIC { NULL, 0, 0, 0, "localhost", "", "", "", "", NULL }
 
 struct data_source_s
 {
@@ -126,7 +132,7 @@ typedef struct notification_meta_s
 typedef struct notification_s
 {
 	int    severity;
-	time_t time;
+	cdtime_t time;
 	char   message[NOTIF_MAX_MSG_LEN];
 	char   host[DATA_MAX_NAME_LEN];
 	char   plugin[DATA_MAX_NAME_LEN];
@@ -152,6 +158,10 @@ typedef int (*plugin_write_cb) (const data_set_t *, const value_list_t *,
 		user_data_t *);
 typedef int (*plugin_flush_cb) (int timeout, const char *identifier,
 		user_data_t *);
+typedef int (*plugin_history_cb) (const char *identifier,
+		cdtime_t begin, cdtime_t end,
+		cdtime_t **ret_times, gauge_t **ret_values, size_t *ret_values_num,
+		user_data_t *);
 typedef void (*plugin_log_cb) (int severity, const char *message,
 		user_data_t *);
 typedef int (*plugin_shutdown_cb) (void);
@@ -231,8 +241,52 @@ void plugin_shutdown_all (void);
 int plugin_write (const char *plugin,
     const data_set_t *ds, const value_list_t *vl);
 
+/*
+ * NAME
+ *  plugin_write_rates
+ *
+ * DESCRIPTION
+ *  Returns the rates of `vl' as they were when `vl' was queued for the write
+ *  threads, if `vl' is the value list a write callback of the calling thread
+ *  is being called with. Used by `uc_get_rate', so write callbacks get the
+ *  rates of the values they write rather than those of newer values.
+ *
+ * RETURN VALUE
+ *  ENOENT if `vl' is not being written from a write queue. Otherwise zero
+ *  and `*ret_rates' is set to an array of `ds->ds_num' rates, which the
+ *  caller has to free, or to NULL if the rates are not available.
+ */
+int plugin_write_rates (const data_set_t *ds, const value_list_t *vl,
+    gauge_t **ret_rates);
+
 int plugin_flush (const char *plugin, int timeout, const char *identifier);
 
+/*
+ * NAME
+ *  plugin_history
+ *
+ * DESCRIPTION
+ *  Reads the values stored for `identifier' between `begin' and `end' from
+ *  a plugin which has registered a history callback. If `plugin' is NULL,
+ *  the callbacks are tried in the order they have been registered until one
+ *  of them succeeds.
+ *
+ * ARGUMENTS
+ *  `ret_times'       Set to an array of the `*ret_values_num' times.
+ *  `ret_values'      Set to an array of `*ret_values_num' times the number of
+ *                    data sources of the type of `identifier' values. Like
+ *                    `uc_get_rate', counters are converted to rates.
+ *  `ret_values_num'  Set to the number of values found.
+ *
+ * RETURN VALUE
+ *  Zero upon success, ENOENT if no plugin knows `identifier' or another
+ *  non-zero value if an error occurred. On success the caller has to free
+ *  `*ret_times' and `*ret_values'.
+ */
+int plugin_history (const char *plugin, const char *identifier,
+		cdtime_t begin, cdtime_t end,
+		cdtime_t **ret_times, gauge_t **ret_values, size_t *ret_values_num);
+
 /*
  * The `plugin_register_*' functions are used to make `config', `init',
  * `read', `write' and `shutdown' functions known to the plugin
@@ -255,6 +309,8 @@ int plugin_register_write (const char *name,
 		plugin_write_cb callback, user_data_t *user_data);
 int plugin_register_flush (const char *name,
 		plugin_flush_cb callback, user_data_t *user_data);
+int plugin_register_history (const char *name,
+		plugin_history_cb callback, user_data_t *user_data);
 int plugin_register_shutdown (char *name,
 		plugin_shutdown_cb callback);
 int plugin_register_data_set (const data_set_t *ds);
@@ -270,6 +326,7 @@ int plugin_unregister_read (const char *name);
 int plugin_unregister_complex_read (const char *name, void **user_data);
 int plugin_unregister_write (const char *name);
 int plugin_unregister_flush (const char *name);
+int plugin_unregister_history (const char *name);
 int plugin_unregister_shutdown (const char *name);
 int plugin_unregister_data_set (const char *name);
 int plugin_unregister_log (const char *name);
@@ -286,12 +343,41 @@ int plugin_unregister_notification (const char *name);
  *  registered using `plugin_register_data_set') and calls _all_ registered
  *  write-functions.
  *
+ *  If `vl->time' is zero, the current time is used. If `vl->interval' is
+ *  zero, the interval of the read callback calling this function is used, or
+ *  the global interval if it is called from elsewhere.
+ *
  * ARGUMENTS
  *  `vl'        Value list of the values that have been read by a `read'
  *              function.
  */
 int plugin_dispatch_values (value_list_t *vl);
 
+/*
+ * NAME
+ *  plugin_dispatch_values_batch
+ *
+ * DESCRIPTION
+ *  Dispatches `vls_num' value lists like `plugin_dispatch_values', but hands
+ *  them to the write threads at once. Plugins receiving many value lists at a
+ *  time, such as the network plugin, use this to take the lock of the write
+ *  queues once per batch instead of once per value list.
+ *
+ * RETURN VALUE
+ *  Zero if all value lists have been dispatched, less than zero otherwise.
+ */
+int plugin_dispatch_values_batch (value_list_t *vls, size_t vls_num);
+
+/*
+ * NAME
+ *  plugin_get_interval
+ *
+ * DESCRIPTION
+ *  Returns the interval of the read callback that is currently being run by
+ *  the calling thread, or the global interval if there is none.
+ */
+cdtime_t plugin_get_interval (void);
+
 int plugin_dispatch_notification (const notification_t *notif);
 
 void plugin_log (int level, const char *format, ...)
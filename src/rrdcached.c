@@ -22,10 +22,46 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "utils_avltree.h"
+#include "utils_complain.h"
 #include "utils_rrdcreate.h"
 
 #include <rrd_client.h>
 
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#define RC_DEFAULT_PORT "42217"
+/* Timeout for sending a batch and receiving the daemon's reply. */
+#define RC_SOCKET_TIMEOUT 10
+
+/*
+ * Private types
+ */
+/* State kept for each RRD file. Entries are never removed, so the existence
+ * of a file only has to be checked once. Values are buffered as
+ * " <time>:<value>[:<value>...]" until the flush thread sends them. */
+struct rc_file_s
+{
+  char *filename; /* also the key in `files' */
+  char *escaped;  /* filename as sent to the daemon */
+  int exists;
+  int creating;   /* a write callback is creating the file */
+  time_t last_value;
+
+  char  *values;
+  size_t values_len;
+  size_t values_size;
+
+  /* Next file with buffered values. */
+  struct rc_file_s *next;
+};
+typedef struct rc_file_s rc_file_t;
+
 /*
  * Private variables
  */
@@ -34,7 +70,9 @@ static const char *config_keys[] =
   "DaemonAddress",
   "DataDir",
   "CreateFiles",
-  "CollectStatistics"
+  "CollectStatistics",
+  "FlushInterval",
+  "FlushValues"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -56,6 +94,35 @@ static rrdcreate_config_t rrdcreate_config =
 	/* consolidation_functions_num = */ 0
 };
 
+/* Buffered values are sent every `flush_interval' or as soon as
+ * `flush_values' values are waiting, whichever comes first. */
+static cdtime_t flush_interval = TIME_T_TO_CDTIME_T (1);
+static int flush_values = 1024;
+
+/* XXX: `files_lock' protects the file entries, the pending list and the
+ * statistics. The connection is only used by the flush thread. */
+static c_avl_tree_t *files = NULL;
+static rc_file_t *pending_head = NULL;
+static int pending_values = 0;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t create_cond = PTHREAD_COND_INITIALIZER;
+static int create_busy = 0;
+static pthread_t flush_thread;
+static int flush_thread_running = 0;
+static int flush_now = 0;
+static int do_shutdown = 0;
+
+static int sock_fd = -1;
+static FILE *sock_fh = NULL;
+static c_complain_t sock_complaint = C_COMPLAIN_INIT_STATIC;
+
+static counter_t stats_values = 0;
+static counter_t stats_batches = 0;
+static counter_t stats_errors = 0;
+static cdtime_t stats_latency_sum = 0;
+static int stats_latency_num = 0;
+
 static int value_list_to_string (char *buffer, int buffer_len,
     const data_set_t *ds, const value_list_t *vl)
 {
@@ -67,7 +134,8 @@ static int value_list_to_string (char *buffer, int buffer_len,
 
   memset (buffer, '\0', buffer_len);
 
-  status = ssnprintf (buffer, buffer_len, "%u", (unsigned int) vl->time);
+  status = ssnprintf (buffer, buffer_len, "%u",
+      (unsigned int) CDTIME_T_TO_TIME_T (vl->time));
   if ((status < 1) || (status >= buffer_len))
     return (-1);
   offset = status;
@@ -197,6 +265,26 @@ static int rc_config (const char *key, const char *value)
     else
       config_collect_stats = 1;
   }
+  else if (strcasecmp ("FlushInterval", key) == 0)
+  {
+    double tmp = atof (value);
+    if (tmp < 0.0)
+    {
+      ERROR ("rrdcached plugin: `FlushInterval' must not be negative.");
+      return (1);
+    }
+    flush_interval = DOUBLE_TO_CDTIME_T (tmp);
+  }
+  else if (strcasecmp ("FlushValues", key) == 0)
+  {
+    int tmp = atoi (value);
+    if (tmp < 1)
+    {
+      ERROR ("rrdcached plugin: `FlushValues' must be greater than 0.");
+      return (1);
+    }
+    flush_values = tmp;
+  }
   else
   {
     return (-1);
@@ -204,6 +292,511 @@ static int rc_config (const char *key, const char *value)
   return (0);
 } /* int rc_config */
 
+static void rc_disconnect (void)
+{
+  if (sock_fh != NULL)
+    fclose (sock_fh); /* closes `sock_fd', too */
+  else if (sock_fd >= 0)
+    close (sock_fd);
+  sock_fh = NULL;
+  sock_fd = -1;
+} /* void rc_disconnect */
+
+static int rc_connect_unix (const char *path)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  sstrncpy (sa.sun_path, path, sizeof (sa.sun_path));
+
+  fd = socket (PF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return (-1);
+
+  if (connect (fd, (struct sockaddr *) &sa, sizeof (sa)) != 0)
+  {
+    close (fd);
+    return (-1);
+  }
+
+  return (fd);
+} /* int rc_connect_unix */
+
+static int rc_connect_network (const char *address)
+{
+  struct addrinfo  ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  char addr_copy[NI_MAXHOST];
+  char *node = addr_copy;
+  char *service = RC_DEFAULT_PORT;
+  char *ptr;
+  int fd = -1;
+  int status;
+
+  sstrncpy (addr_copy, address, sizeof (addr_copy));
+
+  /* "[<IPv6 address>]:<port>", "<host>:<port>" or just "<host>" */
+  if (node[0] == '[')
+  {
+    node++;
+    ptr = strchr (node, ']');
+    if (ptr == NULL)
+      return (-1);
+    *ptr = 0;
+    if (ptr[1] == ':')
+      service = ptr + 2;
+  }
+  else if (((ptr = strchr (node, ':')) != NULL)
+      && (strchr (ptr + 1, ':') == NULL))
+  {
+    *ptr = 0;
+    service = ptr + 1;
+  }
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+  ai_hints.ai_flags = 0;
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+
+  ai_list = NULL;
+  status = getaddrinfo (node, service, &ai_hints, &ai_list);
+  if (status != 0)
+    return (-1);
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+        ai_ptr->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    if (connect (fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == 0)
+      break;
+
+    close (fd);
+    fd = -1;
+  }
+
+  freeaddrinfo (ai_list);
+  return (fd);
+} /* int rc_connect_network */
+
+/* Opens the connection used for sending updates. The connection is kept open
+ * and only re-established after an error. */
+static int rc_connect (void)
+{
+  struct timeval tv;
+  int fd;
+
+  if (sock_fd >= 0)
+    return (0);
+
+  if (strncmp ("unix:", daemon_address, strlen ("unix:")) == 0)
+    fd = rc_connect_unix (daemon_address + strlen ("unix:"));
+  else if (daemon_address[0] == '/')
+    fd = rc_connect_unix (daemon_address);
+  else
+    fd = rc_connect_network (daemon_address);
+
+  if (fd < 0)
+  {
+    c_complain (LOG_ERR, &sock_complaint,
+        "rrdcached plugin: Connecting to %s failed.", daemon_address);
+    return (-1);
+  }
+
+  tv.tv_sec = RC_SOCKET_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+  sock_fh = fdopen (fd, "r");
+  if (sock_fh == NULL)
+  {
+    close (fd);
+    return (-1);
+  }
+  sock_fd = fd;
+
+  c_release (LOG_INFO, &sock_complaint,
+      "rrdcached plugin: Connected to %s.", daemon_address);
+  return (0);
+} /* int rc_connect */
+
+/* Reads a response from the daemon. The first line starts with a status,
+ * which is the number of lines following if it is positive. Only the first
+ * line is returned in `buffer'; if `lines' is not NULL, the remaining lines
+ * are passed to it. */
+static int rc_read_response (char *buffer, size_t buffer_size,
+    void (*lines) (char *line, rc_file_t **batch, int batch_num),
+    rc_file_t **batch, int batch_num)
+{
+  char line[1024];
+  char *endptr;
+  int status;
+  int i;
+
+  if (fgets (buffer, (int) buffer_size, sock_fh) == NULL)
+    return (-1);
+
+  endptr = NULL;
+  status = (int) strtol (buffer, &endptr, 10);
+  if (endptr == buffer)
+    return (-1);
+
+  for (i = 0; i < status; i++)
+  {
+    if (fgets (line, sizeof (line), sock_fh) == NULL)
+      return (-1);
+    if (lines != NULL)
+      lines (line, batch, batch_num);
+  }
+
+  return (status);
+} /* int rc_read_response */
+
+/* Handles a "<command number> <message>" line of a BATCH reply. The file may
+ * have been removed behind our back, so its existence is checked again with
+ * the next value. */
+static void rc_batch_error (char *line, rc_file_t **batch, int batch_num)
+{
+  size_t len = strlen (line);
+  int num;
+
+  while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+    line[--len] = 0;
+
+  num = atoi (line);
+  if ((num < 1) || (num > batch_num))
+  {
+    ERROR ("rrdcached plugin: Update failed: %s", line);
+    return;
+  }
+
+  ERROR ("rrdcached plugin: Updating %s failed: %s",
+      batch[num - 1]->filename, line);
+
+  pthread_mutex_lock (&files_lock);
+  batch[num - 1]->exists = 0;
+  pthread_mutex_unlock (&files_lock);
+} /* void rc_batch_error */
+
+/* Sends `buffer', which holds a complete "BATCH" command, and waits for the
+ * daemon's replies. The commands are pipelined, i. e. they are sent without
+ * waiting for the "go ahead" first. Returns the number of failed updates or
+ * less than zero if the connection failed. */
+static int rc_send_batch (const char *buffer, size_t buffer_len,
+    rc_file_t **batch, int batch_num)
+{
+  char response[1024];
+  size_t offset = 0;
+  int status;
+
+  if (rc_connect () != 0)
+    return (-1);
+
+  while (offset < buffer_len)
+  {
+    ssize_t bytes = send (sock_fd, buffer + offset, buffer_len - offset,
+        MSG_NOSIGNAL);
+    if (bytes < 0)
+    {
+      char errbuf[1024];
+
+      if (errno == EINTR)
+        continue;
+
+      ERROR ("rrdcached plugin: send failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      rc_disconnect ();
+      return (-1);
+    }
+    offset += (size_t) bytes;
+  }
+
+  /* "0 Go ahead. End with dot '.' on its own line." */
+  status = rc_read_response (response, sizeof (response), NULL, NULL, 0);
+  if (status != 0)
+  {
+    ERROR ("rrdcached plugin: The daemon did not accept the BATCH "
+        "command (status %i).", status);
+    rc_disconnect ();
+    return (-1);
+  }
+
+  /* "<num> errors", followed by one line per failed update. */
+  status = rc_read_response (response, sizeof (response), rc_batch_error,
+      batch, batch_num);
+  if (status < 0)
+  {
+    ERROR ("rrdcached plugin: Reading the reply to the BATCH command "
+        "failed.");
+    rc_disconnect ();
+    return (-1);
+  }
+
+  return (status);
+} /* int rc_send_batch */
+
+/* Appends `len' bytes to a buffer which is grown as necessary. */
+static int rc_buffer_append (char **buffer, size_t *buffer_len,
+    size_t *buffer_size, const char *data, size_t len)
+{
+  if ((*buffer_len + len) > *buffer_size)
+  {
+    size_t new_size = (*buffer_size > 0) ? *buffer_size : 256;
+    char *tmp;
+
+    while ((*buffer_len + len) > new_size)
+      new_size *= 2;
+
+    tmp = realloc (*buffer, new_size);
+    if (tmp == NULL)
+      return (-1);
+    *buffer = tmp;
+    *buffer_size = new_size;
+  }
+
+  memcpy (*buffer + *buffer_len, data, len);
+  *buffer_len += len;
+  return (0);
+} /* int rc_buffer_append */
+
+/* Moves the buffered values of all files into a "BATCH" command. The files
+ * are stored in `*batch' in the order of the commands. The caller has to hold
+ * `files_lock'. Returns the number of values in the batch. */
+static int rc_batch_build (char **buffer, size_t *buffer_len,
+    size_t *buffer_size, rc_file_t ***batch, int *batch_num, int *batch_size)
+{
+  rc_file_t *file;
+  int values_num = pending_values;
+
+  *buffer_len = 0;
+  *batch_num = 0;
+  rc_buffer_append (buffer, buffer_len, buffer_size, "BATCH\n", 6);
+
+  while ((file = pending_head) != NULL)
+  {
+    pending_head = file->next;
+    file->next = NULL;
+
+    if (*batch_num >= *batch_size)
+    {
+      int new_size = (*batch_size > 0) ? (2 * *batch_size) : 64;
+      rc_file_t **tmp = realloc (*batch, new_size * sizeof (**batch));
+      if (tmp == NULL)
+      {
+        ERROR ("rrdcached plugin: realloc failed.");
+        file->values_len = 0;
+        values_num = -1;
+        continue;
+      }
+      *batch = tmp;
+      *batch_size = new_size;
+    }
+    (*batch)[*batch_num] = file;
+    (*batch_num)++;
+
+    if ((rc_buffer_append (buffer, buffer_len, buffer_size,
+            "UPDATE ", 7) != 0)
+        || (rc_buffer_append (buffer, buffer_len, buffer_size,
+            file->escaped, strlen (file->escaped)) != 0)
+        || (rc_buffer_append (buffer, buffer_len, buffer_size,
+            file->values, file->values_len) != 0)
+        || (rc_buffer_append (buffer, buffer_len, buffer_size,
+            "\n", 1) != 0))
+    {
+      ERROR ("rrdcached plugin: realloc failed.");
+      values_num = -1;
+    }
+
+    file->values_len = 0;
+  }
+  pending_values = 0;
+
+  if (rc_buffer_append (buffer, buffer_len, buffer_size, ".\n", 2) != 0)
+    values_num = -1;
+
+  return (values_num);
+} /* int rc_batch_build */
+
+static void *rc_flush_thread (void __attribute__((unused)) *arg)
+{
+  char *buffer = NULL;
+  size_t buffer_len = 0;
+  size_t buffer_size = 0;
+  rc_file_t **batch = NULL;
+  int batch_num = 0;
+  int batch_size = 0;
+  cdtime_t next_flush;
+
+  pthread_mutex_lock (&files_lock);
+  next_flush = cdtime () + flush_interval;
+
+  while (42)
+  {
+    struct timespec ts_wait;
+    cdtime_t flush_start;
+    int values_num;
+    int status;
+
+    while ((do_shutdown == 0) && (flush_now == 0)
+        && (pending_values < flush_values))
+    {
+      /* Values are sent at most `flush_interval' after the first one has
+       * been buffered. */
+      if (pending_head == NULL)
+      {
+        pthread_cond_wait (&flush_cond, &files_lock);
+        next_flush = cdtime () + flush_interval;
+        continue;
+      }
+
+      cdtime_to_timespec (next_flush, &ts_wait);
+      status = pthread_cond_timedwait (&flush_cond, &files_lock, &ts_wait);
+      if (status == ETIMEDOUT)
+        break;
+    }
+
+    flush_now = 0;
+
+    if (pending_head == NULL)
+    {
+      if (do_shutdown != 0)
+        break;
+      continue;
+    }
+
+    values_num = rc_batch_build (&buffer, &buffer_len, &buffer_size,
+        &batch, &batch_num, &batch_size);
+    next_flush = cdtime () + flush_interval;
+    pthread_mutex_unlock (&files_lock);
+
+    flush_start = cdtime ();
+    if (values_num < 0)
+      status = -1;
+    else
+      status = rc_send_batch (buffer, buffer_len, batch, batch_num);
+
+    pthread_mutex_lock (&files_lock);
+    if (status < 0)
+    {
+      stats_errors += (values_num > 0) ? values_num : 0;
+    }
+    else
+    {
+      stats_values += values_num;
+      stats_errors += status;
+      stats_batches++;
+      stats_latency_sum += cdtime () - flush_start;
+      stats_latency_num++;
+    }
+  } /* while (42) */
+
+  pthread_mutex_unlock (&files_lock);
+
+  sfree (buffer);
+  sfree (batch);
+  return ((void *) 0);
+} /* void *rc_flush_thread */
+
+/* Returns the entry for `filename', creating it if necessary. The caller has
+ * to hold `files_lock'. */
+static rc_file_t *rc_file_get (const char *filename)
+{
+  rc_file_t *file = NULL;
+  char escaped[1024];
+  size_t i;
+  size_t j;
+
+  if (c_avl_get (files, filename, (void *) &file) == 0)
+    return (file);
+
+  /* Spaces and backslashes in the file name have to be escaped. */
+  for (i = 0, j = 0; (filename[i] != 0) && (j < sizeof (escaped) - 2); i++)
+  {
+    if ((filename[i] == ' ') || (filename[i] == '\\'))
+      escaped[j++] = '\\';
+    escaped[j++] = filename[i];
+  }
+  escaped[j] = 0;
+
+  file = calloc (1, sizeof (*file));
+  if (file == NULL)
+    return (NULL);
+
+  file->filename = strdup (filename);
+  file->escaped = strdup (escaped);
+  if ((file->filename == NULL) || (file->escaped == NULL)
+      || (c_avl_insert (files, file->filename, file) != 0))
+  {
+    sfree (file->filename);
+    sfree (file->escaped);
+    sfree (file);
+    return (NULL);
+  }
+
+  return (file);
+} /* rc_file_t *rc_file_get */
+
+static void rc_submit_client (const char *type, const char *type_instance,
+    value_t value)
+{
+  value_list_t vl = VALUE_LIST_INIT;
+
+  vl.values = &value;
+  vl.values_len = 1;
+  sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+  sstrncpy (vl.plugin, "rrdcached", sizeof (vl.plugin));
+  sstrncpy (vl.plugin_instance, "client", sizeof (vl.plugin_instance));
+  sstrncpy (vl.type, type, sizeof (vl.type));
+  if (type_instance != NULL)
+    sstrncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
+
+  plugin_dispatch_values (&vl);
+} /* void rc_submit_client */
+
+/* Reports the number of buffered values, the number of values and batches
+ * sent, the number of failed updates and the average time a batch took. */
+static void rc_read_client (void)
+{
+  value_t v;
+  gauge_t pending;
+  counter_t values;
+  counter_t batches;
+  counter_t errors;
+  gauge_t latency = NAN;
+
+  pthread_mutex_lock (&files_lock);
+  pending = (gauge_t) pending_values;
+  values = stats_values;
+  batches = stats_batches;
+  errors = stats_errors;
+  if (stats_latency_num > 0)
+    latency = CDTIME_T_TO_DOUBLE (stats_latency_sum)
+      / ((double) stats_latency_num);
+  stats_latency_sum = 0;
+  stats_latency_num = 0;
+  pthread_mutex_unlock (&files_lock);
+
+  v.gauge = pending;
+  rc_submit_client ("queue_length", NULL, v);
+  v.counter = values;
+  rc_submit_client ("counter", "values", v);
+  v.counter = batches;
+  rc_submit_client ("counter", "batches", v);
+  v.counter = errors;
+  rc_submit_client ("counter", "errors", v);
+  v.gauge = latency;
+  rc_submit_client ("delay", "flush", v);
+} /* void rc_read_client */
+
 static int rc_read (void)
 {
   int status;
@@ -229,6 +822,18 @@ static int rc_read (void)
     sstrncpy (vl.host, daemon_address, sizeof (vl.host));
   sstrncpy (vl.plugin, "rrdcached", sizeof (vl.plugin));
 
+  rc_read_client ();
+
+  /* Updates are sent over a connection of our own, so the library may not
+   * be connected yet. */
+  status = rrdc_connect (daemon_address);
+  if (status != 0)
+  {
+    ERROR ("rrdcached plugin: rrdc_connect (%s) failed with status %i.",
+        daemon_address, status);
+    return (-1);
+  }
+
   head = NULL;
   status = rrdc_stats_get (&head);
   if (status != 0)
@@ -308,18 +913,70 @@ static int rc_read (void)
 
 static int rc_init (void)
 {
+  int status;
+
+  pthread_mutex_lock (&files_lock);
+  files = c_avl_create ((int (*) (const void *, const void *)) strcmp);
+  pthread_mutex_unlock (&files_lock);
+  if (files == NULL)
+  {
+    ERROR ("rrdcached plugin: c_avl_create failed.");
+    return (-1);
+  }
+
+  status = pthread_create (&flush_thread, /* attr = */ NULL,
+      rc_flush_thread, /* arg = */ NULL);
+  if (status != 0)
+  {
+    ERROR ("rrdcached plugin: Cannot create the flush thread.");
+    return (-1);
+  }
+  flush_thread_running = 1;
+
   if (config_collect_stats != 0)
     plugin_register_read ("rrdcached", rc_read);
 
   return (0);
 } /* int rc_init */
 
+/* Creates `filename' unless it exists. Called without holding `files_lock',
+ * because creating a file may take a while. */
+static int rc_file_create (const char *filename, const data_set_t *ds,
+    const value_list_t *vl)
+{
+  struct stat statbuf;
+  int status;
+
+  status = stat (filename, &statbuf);
+  if (status == 0)
+    return (0);
+
+  if (errno != ENOENT)
+  {
+    char errbuf[1024];
+    ERROR ("rrdcached plugin: stat (%s) failed: %s",
+        filename, sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  status = cu_rrd_create_file (filename, ds, vl, &rrdcreate_config);
+  if (status != 0)
+  {
+    ERROR ("rrdcached plugin: cu_rrd_create_file (%s) failed.",
+        filename);
+    return (-1);
+  }
+
+  return (0);
+} /* int rc_file_create */
+
 static int rc_write (const data_set_t *ds, const value_list_t *vl,
     user_data_t __attribute__((unused)) *user_data)
 {
   char filename[512];
   char values[512];
-  char *values_array[2];
+  time_t value_time;
+  rc_file_t *file;
   int status;
 
   if (daemon_address == NULL)
@@ -341,63 +998,177 @@ static int rc_write (const data_set_t *ds, const value_list_t *vl,
     return (-1);
   }
 
-  if (value_list_to_string (values, sizeof (values), ds, vl) != 0)
+  /* The leading space separates the value from the previous one. */
+  values[0] = ' ';
+  if (value_list_to_string (values + 1, sizeof (values) - 1, ds, vl) != 0)
   {
     ERROR ("rrdcached plugin: value_list_to_string failed.");
     return (-1);
   }
 
-  values_array[0] = values;
-  values_array[1] = NULL;
+  value_time = CDTIME_T_TO_TIME_T (vl->time);
+
+  pthread_mutex_lock (&files_lock);
 
-  if (config_create_files != 0)
+  if (files == NULL)
   {
-    struct stat statbuf;
+    pthread_mutex_unlock (&files_lock);
+    return (-1);
+  }
 
-    status = stat (filename, &statbuf);
-    if (status != 0)
+  file = rc_file_get (filename);
+  if (file == NULL)
+  {
+    pthread_mutex_unlock (&files_lock);
+    ERROR ("rrdcached plugin: rc_file_get (%s) failed.", filename);
+    return (-1);
+  }
+
+  /* The file is marked while it is being created, so the lock can be
+   * released in the meantime. Values for the same file wait until it
+   * exists, all others are not held up. Values may still be written
+   * directly while `rc_shutdown' runs (see `stop_write_threads'), so
+   * `create_busy' counts the threads using `file' without holding the
+   * lock and `rc_shutdown' waits for them before freeing the entries. */
+  if ((config_create_files != 0) && (file->exists == 0))
+  {
+    status = 0;
+    create_busy++;
+
+    while (file->exists == 0)
     {
-      if (errno != ENOENT)
+      if (do_shutdown)
       {
-        char errbuf[1024];
-        ERROR ("rrdcached plugin: stat (%s) failed: %s",
-            filename, sstrerror (errno, errbuf, sizeof (errbuf)));
-        return (-1);
+        status = -1;
+        break;
       }
 
-      status = cu_rrd_create_file (filename, ds, vl, &rrdcreate_config);
-      if (status != 0)
+      if (file->creating)
       {
-        ERROR ("rrdcached plugin: cu_rrd_create_file (%s) failed.",
-            filename);
-        return (-1);
+        pthread_cond_wait (&create_cond, &files_lock);
+        continue;
       }
+
+      file->creating = 1;
+      pthread_mutex_unlock (&files_lock);
+
+      status = rc_file_create (filename, ds, vl);
+
+      pthread_mutex_lock (&files_lock);
+      file->creating = 0;
+      pthread_cond_broadcast (&create_cond);
+
+      if (status != 0)
+        break;
+      file->exists = 1;
+    }
+
+    create_busy--;
+    if (do_shutdown && (create_busy == 0))
+      pthread_cond_broadcast (&create_cond);
+
+    if (status != 0)
+    {
+      pthread_mutex_unlock (&files_lock);
+      return (-1);
     }
   }
 
-  status = rrdc_connect (daemon_address);
-  if (status != 0)
+  /* The daemon rejects the remaining values of an update once one of them
+   * is out of order, so those are dropped here. */
+  if (file->last_value >= value_time)
   {
-    ERROR ("rrdcached plugin: rrdc_connect (%s) failed with status %i.",
-        daemon_address, status);
+    pthread_mutex_unlock (&files_lock);
+    WARNING ("rrdcached plugin: (last_value = %u) >= (value_time = %u) "
+        "for %s", (unsigned int) file->last_value,
+        (unsigned int) value_time, filename);
     return (-1);
   }
 
-  status = rrdc_update (filename, /* values_num = */ 1, (void *) values_array);
+  status = rc_buffer_append (&file->values, &file->values_len,
+      &file->values_size, values, strlen (values));
   if (status != 0)
   {
-    ERROR ("rrdcached plugin: rrdc_update (%s, [%s], 1) failed with "
-        "status %i.",
-        filename, values_array[0], status);
+    pthread_mutex_unlock (&files_lock);
+    ERROR ("rrdcached plugin: realloc failed.");
     return (-1);
   }
+  file->last_value = value_time;
+
+  /* The first buffered value puts the file on the pending list. The flush
+   * thread is woken up when the first file is added, so it can start
+   * waiting for the flush interval. */
+  if (file->values_len == strlen (values))
+  {
+    if (pending_head == NULL)
+      pthread_cond_signal (&flush_cond);
+    file->next = pending_head;
+    pending_head = file;
+  }
+
+  pending_values++;
+  if (pending_values == flush_values)
+    pthread_cond_signal (&flush_cond);
+
+  pthread_mutex_unlock (&files_lock);
 
   return (0);
 } /* int rc_write */
 
+static int rc_flush (int __attribute__((unused)) timeout,
+    const char __attribute__((unused)) *identifier,
+    user_data_t __attribute__((unused)) *user_data)
+{
+  /* Send all buffered values right away. */
+  pthread_mutex_lock (&files_lock);
+  flush_now = 1;
+  pthread_cond_signal (&flush_cond);
+  pthread_mutex_unlock (&files_lock);
+
+  return (0);
+} /* int rc_flush */
+
 static int rc_shutdown (void)
 {
+  void *key;
+  rc_file_t *file;
+
+  pthread_mutex_lock (&files_lock);
+  do_shutdown = 1;
+  pthread_cond_signal (&flush_cond);
+  pthread_mutex_unlock (&files_lock);
+
+  /* The flush thread sends the remaining values before exiting. */
+  if (flush_thread_running != 0)
+  {
+    pthread_join (flush_thread, NULL);
+    flush_thread_running = 0;
+  }
+
+  rc_disconnect ();
   rrdc_disconnect ();
+
+  pthread_mutex_lock (&files_lock);
+  /* Write callbacks may still be creating files. Since `do_shutdown' is
+   * set, they give up waiting for other threads' files. */
+  while (create_busy > 0)
+    pthread_cond_wait (&create_cond, &files_lock);
+  if (files != NULL)
+  {
+    while (c_avl_pick (files, &key, (void *) &file) == 0)
+    {
+      sfree (file->filename);
+      sfree (file->escaped);
+      sfree (file->values);
+      sfree (file);
+    }
+    c_avl_destroy (files);
+    files = NULL;
+  }
+  pending_head = NULL;
+  pending_values = 0;
+  pthread_mutex_unlock (&files_lock);
+
   return (0);
 } /* int rc_shutdown */
 
@@ -407,6 +1178,7 @@ void module_register (void)
       config_keys, config_keys_num);
   plugin_register_init ("rrdcached", rc_init);
   plugin_register_write ("rrdcached", rc_write, /* user_data = */ NULL);
+  plugin_register_flush ("rrdcached", rc_flush, /* user_data = */ NULL);
   plugin_register_shutdown ("rrdcached", rc_shutdown);
 } /* void module_register */
 
@@ -34,10 +34,25 @@
 /*
  * Private types
  */
+/* A cached sample. The records are stored back to back in a buffer, each
+ * being `sample_size' bytes long, so `values' actually holds `ds->ds_num'
+ * elements. */
+struct rrd_sample_s
+{
+	time_t  time;
+	value_t values[1];
+};
+typedef struct rrd_sample_s rrd_sample_t;
+
 struct rrd_cache_s
 {
+	char  *filename; /* also the key in `cache' */
+	const data_set_t *ds;
+
+	char  *samples;
+	size_t sample_size;
 	int    values_num;
-	char **values;
+	int    values_size;
 	time_t first_value;
 	time_t last_value;
 	enum
@@ -46,9 +61,23 @@ struct rrd_cache_s
 		FLAG_QUEUED = 0x01,
 		FLAG_FLUSHQ = 0x02
 	} flags;
+
+	/* Entries which are not queued (flags == FLAG_NONE) are kept in the
+	 * expire list, ordered by the time they were added to it. */
+	time_t expire_time;
+	struct rrd_cache_s *expire_prev;
+	struct rrd_cache_s *expire_next;
 };
 typedef struct rrd_cache_s rrd_cache_t;
 
+#define RRD_SAMPLE_SIZE(ds_num) \
+	(offsetof (rrd_sample_t, values) + (ds_num) * sizeof (value_t))
+/* Space reserved for the update string of one sample. */
+#define RRD_STRING_SIZE 512
+
+#define RRD_SAMPLE(rc, i) \
+	((rrd_sample_t *) ((rc)->samples + (i) * (rc)->sample_size))
+
 enum rrd_queue_dir_e
 {
   QUEUE_INSERT_FRONT,
@@ -59,10 +88,36 @@ typedef enum rrd_queue_dir_e rrd_queue_dir_t;
 struct rrd_queue_s
 {
 	char *filename;
+	cdtime_t time; /* when the entry was queued */
 	struct rrd_queue_s *next;
 };
 typedef struct rrd_queue_s rrd_queue_t;
 
+/* Each writer thread has its own queues. Files are assigned to a writer by
+ * the hash of their name, so every RRD file is only ever updated by one
+ * thread. */
+struct rrd_writer_s
+{
+	int index;
+	pthread_t thread;
+	int thread_running;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	rrd_queue_t *queue_head;
+	rrd_queue_t *queue_tail;
+	rrd_queue_t *flushq_head;
+	rrd_queue_t *flushq_tail;
+
+	/* Statistics, protected by `lock'. */
+	int       queue_length;
+	counter_t updates;
+	cdtime_t  delay_sum;
+	cdtime_t  update_sum;
+	int       delay_num;
+};
+typedef struct rrd_writer_s rrd_writer_t;
+
 /*
  * Private variables
  */
@@ -76,7 +131,9 @@ static const char *config_keys[] =
 	"RRARows",
 	"RRATimespan",
 	"XFF",
-	"WritesPerSecond"
+	"WritesPerSecond",
+	"WriteThreads",
+	"ReportStats"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -99,22 +156,19 @@ static rrdcreate_config_t rrdcreate_config =
 	/* consolidation_functions_num = */ 0
 };
 
-/* XXX: If you need to lock both, cache_lock and queue_lock, at the same time,
- * ALWAYS lock `cache_lock' first! */
+/* XXX: If you need to lock both, cache_lock and a writer's lock, at the same
+ * time, ALWAYS lock `cache_lock' first! */
 static int         cache_timeout = 0;
 static int         cache_flush_timeout = 0;
 static time_t      cache_flush_last;
 static c_avl_tree_t *cache = NULL;
+static rrd_cache_t *expire_head = NULL;
+static rrd_cache_t *expire_tail = NULL;
 static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static rrd_queue_t    *queue_head = NULL;
-static rrd_queue_t    *queue_tail = NULL;
-static rrd_queue_t    *flushq_head = NULL;
-static rrd_queue_t    *flushq_tail = NULL;
-static pthread_t       queue_thread;
-static int             queue_thread_running = 1;
-static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+static rrd_writer_t *writers = NULL;
+static int           writers_num = 1;
+static int           report_stats = 0;
 
 #if !HAVE_THREADSAFE_LIBRRD
 static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -187,32 +241,27 @@ static int srrd_update (char *filename, char *template,
 } /* int srrd_update */
 #endif /* !HAVE_THREADSAFE_LIBRRD */
 
-static int value_list_to_string (char *buffer, int buffer_len,
-		const data_set_t *ds, const value_list_t *vl)
+static int sample_to_string (char *buffer, int buffer_len,
+		const data_set_t *ds, const rrd_sample_t *sample)
 {
 	int offset;
 	int status;
 	int i;
 
-	memset (buffer, '\0', buffer_len);
-
-	status = ssnprintf (buffer, buffer_len, "%u", (unsigned int) vl->time);
+	status = ssnprintf (buffer, buffer_len, "%u",
+			(unsigned int) sample->time);
 	if ((status < 1) || (status >= buffer_len))
 		return (-1);
 	offset = status;
 
 	for (i = 0; i < ds->ds_num; i++)
 	{
-		if ((ds->ds[i].type != DS_TYPE_COUNTER)
-				&& (ds->ds[i].type != DS_TYPE_GAUGE))
-			return (-1);
-
 		if (ds->ds[i].type == DS_TYPE_COUNTER)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%llu", vl->values[i].counter);
+					":%llu", sample->values[i].counter);
 		else
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%lf", vl->values[i].gauge);
+					":%lf", sample->values[i].gauge);
 
 		if ((status < 1) || (status >= (buffer_len - offset)))
 			return (-1);
@@ -221,7 +270,7 @@ static int value_list_to_string (char *buffer, int buffer_len,
 	} /* for ds->ds_num */
 
 	return (0);
-} /* int value_list_to_string */
+} /* int sample_to_string */
 
 static int value_list_to_filename (char *buffer, int buffer_len,
 		const data_set_t __attribute__((unused)) *ds, const value_list_t *vl)
@@ -267,37 +316,152 @@ static int value_list_to_filename (char *buffer, int buffer_len,
 	return (0);
 } /* int value_list_to_filename */
 
-static void *rrd_queue_thread (void __attribute__((unused)) *data)
+/* Appends `rc' to the expire list. The caller has to hold `cache_lock'. */
+static void rrd_expire_append (rrd_cache_t *rc, time_t now)
+{
+	rc->expire_time = now;
+	rc->expire_next = NULL;
+	rc->expire_prev = expire_tail;
+	if (expire_tail == NULL)
+		expire_head = rc;
+	else
+		expire_tail->expire_next = rc;
+	expire_tail = rc;
+} /* void rrd_expire_append */
+
+/* Removes `rc' from the expire list. The caller has to hold `cache_lock'. */
+static void rrd_expire_remove (rrd_cache_t *rc)
+{
+	if (rc->expire_prev == NULL)
+		expire_head = rc->expire_next;
+	else
+		rc->expire_prev->expire_next = rc->expire_next;
+
+	if (rc->expire_next == NULL)
+		expire_tail = rc->expire_prev;
+	else
+		rc->expire_next->expire_prev = rc->expire_prev;
+
+	rc->expire_prev = NULL;
+	rc->expire_next = NULL;
+} /* void rrd_expire_remove */
+
+/* Formats `samples_num' samples as arguments for `rrd_update'. The strings are
+ * stored in `*buffer' and pointed to by `*argv'. Both are grown as necessary
+ * and reused by the caller. Returns the number of arguments. */
+static int rrd_samples_to_argv (const data_set_t *ds,
+		const char *samples, size_t sample_size, int samples_num,
+		char **buffer, size_t *buffer_size, char ***argv, int *argv_size)
 {
+	size_t offset = 0;
+	int argc = 0;
+	char *ptr;
+	int i;
+
+	for (i = 0; i < samples_num; i++)
+	{
+		const rrd_sample_t *sample;
+		int status;
+
+		if ((*buffer_size - offset) < RRD_STRING_SIZE)
+		{
+			size_t new_size = (*buffer_size > 0)
+				? 2 * *buffer_size : 16 * RRD_STRING_SIZE;
+			char *tmp;
+
+			while ((new_size - offset) < RRD_STRING_SIZE)
+				new_size *= 2;
+
+			tmp = (char *) realloc (*buffer, new_size);
+			if (tmp == NULL)
+			{
+				ERROR ("rrdtool plugin: realloc failed.");
+				break;
+			}
+			*buffer = tmp;
+			*buffer_size = new_size;
+		}
+
+		sample = (const rrd_sample_t *) (samples + i * sample_size);
+		status = sample_to_string (*buffer + offset, RRD_STRING_SIZE,
+				ds, sample);
+		if (status != 0)
+		{
+			WARNING ("rrdtool plugin: Formatting the value at %u failed.",
+					(unsigned int) sample->time);
+			continue;
+		}
+
+		offset += strlen (*buffer + offset) + 1;
+		argc++;
+	}
+
+	if (argc > *argv_size)
+	{
+		char **tmp = (char **) realloc (*argv, argc * sizeof (char *));
+		if (tmp == NULL)
+		{
+			ERROR ("rrdtool plugin: realloc failed.");
+			return (-1);
+		}
+		*argv = tmp;
+		*argv_size = argc;
+	}
+
+	ptr = *buffer;
+	for (i = 0; i < argc; i++)
+	{
+		(*argv)[i] = ptr;
+		ptr += strlen (ptr) + 1;
+	}
+
+	return (argc);
+} /* int rrd_samples_to_argv */
+
+static void *rrd_queue_thread (void *data)
+{
+	rrd_writer_t *w = data;
         struct timeval tv_next_update;
         struct timeval tv_now;
 
+        /* `WritesPerSecond' limits the writes of all threads together. */
+        double thread_write_rate = write_rate * ((double) writers_num);
+
+	/* Update strings are only formatted here. The buffers are reused for
+	 * all files. */
+	char  *buffer = NULL;
+	size_t buffer_size = 0;
+	char **argv = NULL;
+	int    argv_size = 0;
+
         gettimeofday (&tv_next_update, /* timezone = */ NULL);
 
 	while (42)
 	{
 		rrd_queue_t *queue_entry;
 		rrd_cache_t *cache_entry;
-		char **values;
+		const data_set_t *ds;
+		char  *samples;
+		size_t sample_size;
 		int    values_num;
 		int    status;
-		int    i;
+		cdtime_t update_start;
 
-                pthread_mutex_lock (&queue_lock);
+                pthread_mutex_lock (&w->lock);
                 /* Wait for values to arrive */
                 while (true)
                 {
                   struct timespec ts_wait;
 
-                  while ((flushq_head == NULL) && (queue_head == NULL)
+                  while ((w->flushq_head == NULL) && (w->queue_head == NULL)
                       && (do_shutdown == 0))
-                    pthread_cond_wait (&queue_cond, &queue_lock);
+                    pthread_cond_wait (&w->cond, &w->lock);
 
-                  if ((flushq_head == NULL) && (queue_head == NULL))
+                  if ((w->flushq_head == NULL) && (w->queue_head == NULL))
                     break;
 
                   /* Don't delay if there's something to flush */
-                  if (flushq_head != NULL)
+                  if (w->flushq_head != NULL)
                     break;
 
                   /* Don't delay if we're shutting down */
@@ -305,7 +469,7 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                     break;
 
                   /* Don't delay if no delay was configured. */
-                  if (write_rate <= 0.0)
+                  if (thread_write_rate <= 0.0)
                     break;
 
                   gettimeofday (&tv_now, /* timezone = */ NULL);
@@ -320,43 +484,44 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                   ts_wait.tv_sec = tv_next_update.tv_sec;
                   ts_wait.tv_nsec = 1000 * tv_next_update.tv_usec;
 
-                  status = pthread_cond_timedwait (&queue_cond, &queue_lock,
+                  status = pthread_cond_timedwait (&w->cond, &w->lock,
                       &ts_wait);
                   if (status == ETIMEDOUT)
                     break;
                 } /* while (true) */
 
-                /* XXX: If you need to lock both, cache_lock and queue_lock, at
-                 * the same time, ALWAYS lock `cache_lock' first! */
+                /* XXX: If you need to lock both, cache_lock and a writer's
+                 * lock, at the same time, ALWAYS lock `cache_lock' first! */
 
                 /* We're in the shutdown phase */
-                if ((flushq_head == NULL) && (queue_head == NULL))
+                if ((w->flushq_head == NULL) && (w->queue_head == NULL))
                 {
-                  pthread_mutex_unlock (&queue_lock);
+                  pthread_mutex_unlock (&w->lock);
                   break;
                 }
 
-                if (flushq_head != NULL)
+                if (w->flushq_head != NULL)
                 {
                   /* Dequeue the first flush entry */
-                  queue_entry = flushq_head;
-                  if (flushq_head == flushq_tail)
-                    flushq_head = flushq_tail = NULL;
+                  queue_entry = w->flushq_head;
+                  if (w->flushq_head == w->flushq_tail)
+                    w->flushq_head = w->flushq_tail = NULL;
                   else
-                    flushq_head = flushq_head->next;
+                    w->flushq_head = w->flushq_head->next;
                 }
-                else /* if (queue_head != NULL) */
+                else /* if (w->queue_head != NULL) */
                 {
                   /* Dequeue the first regular entry */
-                  queue_entry = queue_head;
-                  if (queue_head == queue_tail)
-                    queue_head = queue_tail = NULL;
+                  queue_entry = w->queue_head;
+                  if (w->queue_head == w->queue_tail)
+                    w->queue_head = w->queue_tail = NULL;
                   else
-                    queue_head = queue_head->next;
+                    w->queue_head = w->queue_head->next;
                 }
+                w->queue_length--;
 
 		/* Unlock the queue again */
-		pthread_mutex_unlock (&queue_lock);
+		pthread_mutex_unlock (&w->lock);
 
 		/* We now need the cache lock so the entry isn't updated while
 		 * we make a copy of it's values */
@@ -367,12 +532,19 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
 
 		if (status == 0)
 		{
-			values = cache_entry->values;
+			ds = cache_entry->ds;
+			samples = cache_entry->samples;
+			sample_size = cache_entry->sample_size;
 			values_num = cache_entry->values_num;
 
-			cache_entry->values = NULL;
+			cache_entry->samples = NULL;
 			cache_entry->values_num = 0;
-			cache_entry->flags = FLAG_NONE;
+			cache_entry->values_size = 0;
+			if (cache_entry->flags != FLAG_NONE)
+			{
+				cache_entry->flags = FLAG_NONE;
+				rrd_expire_append (cache_entry, time (NULL));
+			}
 		}
 
 		pthread_mutex_unlock (&cache_lock);
@@ -385,12 +557,12 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
 		}
 
 		/* Update `tv_next_update' */
-		if (write_rate > 0.0) 
+		if (thread_write_rate > 0.0) 
                 {
                   gettimeofday (&tv_now, /* timezone = */ NULL);
                   tv_next_update.tv_sec = tv_now.tv_sec;
                   tv_next_update.tv_usec = tv_now.tv_usec
-                    + ((suseconds_t) (1000000 * write_rate));
+                    + ((suseconds_t) (1000000 * thread_write_rate));
                   while (tv_next_update.tv_usec > 1000000)
                   {
                     tv_next_update.tv_sec++;
@@ -398,35 +570,63 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                   }
                 }
 
-		/* Write the values to the RRD-file */
-		srrd_update (queue_entry->filename, NULL,
-				values_num, (const char **)values);
-		DEBUG ("rrdtool plugin: queue thread: Wrote %i value%s to %s",
-				values_num, (values_num == 1) ? "" : "s",
+		/* Format the samples and write them to the RRD-file */
+		update_start = cdtime ();
+		values_num = rrd_samples_to_argv (ds, samples, sample_size,
+				values_num, &buffer, &buffer_size, &argv, &argv_size);
+		if (values_num > 0)
+			srrd_update (queue_entry->filename, NULL,
+					values_num, (const char **) argv);
+		DEBUG ("rrdtool plugin: writer %i: Wrote %i value%s to %s",
+				w->index, values_num, (values_num == 1) ? "" : "s",
 				queue_entry->filename);
 
-		for (i = 0; i < values_num; i++)
+		if (report_stats)
 		{
-			sfree (values[i]);
+			cdtime_t now = cdtime ();
+
+			pthread_mutex_lock (&w->lock);
+			w->updates++;
+			w->delay_sum += update_start - queue_entry->time;
+			w->update_sum += now - update_start;
+			w->delay_num++;
+			pthread_mutex_unlock (&w->lock);
 		}
-		sfree (values);
+
+		sfree (samples);
 		sfree (queue_entry->filename);
 		sfree (queue_entry);
 	} /* while (42) */
 
-	pthread_mutex_lock (&cache_lock);
-	c_avl_destroy (cache);
-	cache = NULL;
-	pthread_mutex_unlock (&cache_lock);
+	sfree (buffer);
+	sfree (argv);
 
 	pthread_exit ((void *) 0);
 	return ((void *) 0);
 } /* void *rrd_queue_thread */
 
-static int rrd_queue_enqueue (const char *filename,
-    rrd_queue_t **head, rrd_queue_t **tail)
+/* Returns the writer responsible for `filename', using the FNV-1a hash of the
+ * file name. */
+static rrd_writer_t *rrd_writer_get (const char *filename)
 {
+  uint32_t hash = 2166136261U;
+  const char *ptr;
+
+  for (ptr = filename; *ptr != 0; ptr++)
+  {
+    hash ^= (uint32_t) ((unsigned char) *ptr);
+    hash *= 16777619U;
+  }
+
+  return (writers + (hash % ((uint32_t) writers_num)));
+} /* rrd_writer_t *rrd_writer_get */
+
+static int rrd_queue_enqueue (const char *filename, int flush)
+{
+  rrd_writer_t *w;
   rrd_queue_t *queue_entry;
+  rrd_queue_t **head;
+  rrd_queue_t **tail;
 
   queue_entry = (rrd_queue_t *) malloc (sizeof (rrd_queue_t));
   if (queue_entry == NULL)
@@ -439,32 +639,41 @@ static int rrd_queue_enqueue (const char *filename,
     return (-1);
   }
 
+  queue_entry->time = report_stats ? cdtime () : 0;
   queue_entry->next = NULL;
 
-  pthread_mutex_lock (&queue_lock);
+  w = rrd_writer_get (filename);
+  head = flush ? &w->flushq_head : &w->queue_head;
+  tail = flush ? &w->flushq_tail : &w->queue_tail;
+
+  pthread_mutex_lock (&w->lock);
 
   if (*tail == NULL)
     *head = queue_entry;
   else
     (*tail)->next = queue_entry;
   *tail = queue_entry;
+  w->queue_length++;
 
-  pthread_cond_signal (&queue_cond);
-  pthread_mutex_unlock (&queue_lock);
+  pthread_cond_signal (&w->cond);
+  pthread_mutex_unlock (&w->lock);
 
   return (0);
 } /* int rrd_queue_enqueue */
 
-static int rrd_queue_dequeue (const char *filename,
-    rrd_queue_t **head, rrd_queue_t **tail)
+/* Removes `filename' from the regular (non-flush) queue. */
+static int rrd_queue_dequeue (const char *filename)
 {
+  rrd_writer_t *w;
   rrd_queue_t *this;
   rrd_queue_t *prev;
 
-  pthread_mutex_lock (&queue_lock);
+  w = rrd_writer_get (filename);
+
+  pthread_mutex_lock (&w->lock);
 
   prev = NULL;
-  this = *head;
+  this = w->queue_head;
 
   while (this != NULL)
   {
@@ -477,19 +686,20 @@ static int rrd_queue_dequeue (const char *filename,
 
   if (this == NULL)
   {
-    pthread_mutex_unlock (&queue_lock);
+    pthread_mutex_unlock (&w->lock);
     return (-1);
   }
 
   if (prev == NULL)
-    *head = this->next;
+    w->queue_head = this->next;
   else
     prev->next = this->next;
 
   if (this->next == NULL)
-    *tail = prev;
+    w->queue_tail = prev;
+  w->queue_length--;
 
-  pthread_mutex_unlock (&queue_lock);
+  pthread_mutex_unlock (&w->lock);
 
   sfree (this->filename);
   sfree (this);
@@ -502,72 +712,44 @@ static void rrd_cache_flush (int timeout)
 	rrd_cache_t *rc;
 	time_t       now;
 
-	char **keys = NULL;
-	int    keys_num = 0;
-
-	char *key;
-	c_avl_iterator_t *iter;
-	int i;
-
 	DEBUG ("rrdtool plugin: Flushing cache, timeout = %i", timeout);
 
 	now = time (NULL);
 
-	/* Build a list of entries to be flushed */
-	iter = c_avl_get_iterator (cache);
-	while (c_avl_iterator_next (iter, (void *) &key, (void *) &rc) == 0)
+	/* The expire list is ordered by age, so only the expired entries at its
+	 * head have to be looked at. */
+	while ((rc = expire_head) != NULL)
 	{
-		if (rc->flags != FLAG_NONE)
-			continue;
-		else if ((now - rc->first_value) < timeout)
-			continue;
-		else if (rc->values_num > 0)
+		if ((now - rc->expire_time) < timeout)
+			break;
+
+		if (rc->values_num > 0)
 		{
 			int status;
 
-			status = rrd_queue_enqueue (key, &queue_head,  &queue_tail);
-			if (status == 0)
-				rc->flags = FLAG_QUEUED;
+			/* Try again with the next flush if this fails. */
+			status = rrd_queue_enqueue (rc->filename, /* flush = */ 0);
+			if (status != 0)
+				break;
+
+			rrd_expire_remove (rc);
+			rc->flags = FLAG_QUEUED;
 		}
 		else /* ancient and no values -> waste of memory */
 		{
-			char **tmp = (char **) realloc ((void *) keys,
-					(keys_num + 1) * sizeof (char *));
-			if (tmp == NULL)
+			rrd_expire_remove (rc);
+			if (c_avl_remove (cache, rc->filename, NULL, NULL) != 0)
 			{
-				char errbuf[1024];
-				ERROR ("rrdtool plugin: "
-						"realloc failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				c_avl_iterator_destroy (iter);
-				sfree (keys);
-				return;
+				DEBUG ("rrdtool plugin: c_avl_remove (%s) failed.",
+						rc->filename);
+				continue;
 			}
-			keys = tmp;
-			keys[keys_num] = key;
-			keys_num++;
-		}
-	} /* while (c_avl_iterator_next) */
-	c_avl_iterator_destroy (iter);
-	
-	for (i = 0; i < keys_num; i++)
-	{
-		if (c_avl_remove (cache, keys[i], (void *) &key, (void *) &rc) != 0)
-		{
-			DEBUG ("rrdtool plugin: c_avl_remove (%s) failed.", keys[i]);
-			continue;
-		}
-
-		assert (rc->values == NULL);
-		assert (rc->values_num == 0);
-
-		sfree (rc);
-		sfree (key);
-		keys[i] = NULL;
-	} /* for (i = 0..keys_num) */
 
-	sfree (keys);
+			assert (rc->samples == NULL);
+			sfree (rc->filename);
+			sfree (rc);
+		}
+	} /* while (expire_head) */
 
 	cache_flush_last = now;
 } /* void rrd_cache_flush */
@@ -610,8 +792,8 @@ static int rrd_cache_flush_identifier (int timeout, const char *identifier)
   }
   else if (rc->flags == FLAG_QUEUED)
   {
-    rrd_queue_dequeue (key, &queue_head, &queue_tail);
-    status = rrd_queue_enqueue (key, &flushq_head, &flushq_tail);
+    rrd_queue_dequeue (key);
+    status = rrd_queue_enqueue (key, /* flush = */ 1);
     if (status == 0)
       rc->flags = FLAG_FLUSHQ;
   }
@@ -621,20 +803,24 @@ static int rrd_cache_flush_identifier (int timeout, const char *identifier)
   }
   else if (rc->values_num > 0)
   {
-    status = rrd_queue_enqueue (key, &flushq_head, &flushq_tail);
+    status = rrd_queue_enqueue (key, /* flush = */ 1);
     if (status == 0)
+    {
+      rrd_expire_remove (rc);
       rc->flags = FLAG_FLUSHQ;
+    }
   }
 
   return (status);
 } /* int rrd_cache_flush_identifier */
 
 static int rrd_cache_insert (const char *filename,
-		const char *value, time_t value_time)
+		const data_set_t *ds, const value_list_t *vl)
 {
 	rrd_cache_t *rc = NULL;
-	int new_rc = 0;
-	char **values_new;
+	rrd_sample_t *sample;
+	time_t value_time = CDTIME_T_TO_TIME_T (vl->time);
+	time_t now = time (NULL);
 
 	pthread_mutex_lock (&cache_lock);
 
@@ -651,15 +837,28 @@ static int rrd_cache_insert (const char *filename,
 
 	if (rc == NULL)
 	{
-		rc = (rrd_cache_t *) malloc (sizeof (rrd_cache_t));
+		rc = (rrd_cache_t *) calloc (1, sizeof (rrd_cache_t));
 		if (rc == NULL)
+		{
+			pthread_mutex_unlock (&cache_lock);
+			ERROR ("rrdtool plugin: calloc failed.");
 			return (-1);
-		rc->values_num = 0;
-		rc->values = NULL;
-		rc->first_value = 0;
-		rc->last_value = 0;
+		}
+
+		rc->filename = strdup (filename);
+		if (rc->filename == NULL)
+		{
+			pthread_mutex_unlock (&cache_lock);
+			ERROR ("rrdtool plugin: strdup failed.");
+			sfree (rc);
+			return (-1);
+		}
+		rc->ds = ds;
+		rc->sample_size = RRD_SAMPLE_SIZE (ds->ds_num);
 		rc->flags = FLAG_NONE;
-		new_rc = 1;
+
+		c_avl_insert (cache, rc->filename, rc);
+		rrd_expire_append (rc, now);
 	}
 
 	if (rc->last_value >= value_time)
@@ -671,57 +870,42 @@ static int rrd_cache_insert (const char *filename,
 		return (-1);
 	}
 
-	values_new = (char **) realloc ((void *) rc->values,
-			(rc->values_num + 1) * sizeof (char *));
-	if (values_new == NULL)
+	/* Grow the sample buffer by doubling its size. */
+	if (rc->values_num >= rc->values_size)
 	{
-		char errbuf[1024];
-		void *cache_key = NULL;
-
-		sstrerror (errno, errbuf, sizeof (errbuf));
-
-		c_avl_remove (cache, filename, &cache_key, NULL);
-		pthread_mutex_unlock (&cache_lock);
-
-		ERROR ("rrdtool plugin: realloc failed: %s", errbuf);
+		int new_size = (rc->values_size > 0) ? (2 * rc->values_size) : 4;
+		char *samples_new;
 
-		sfree (cache_key);
-		sfree (rc->values);
-		sfree (rc);
-		return (-1);
+		samples_new = (char *) realloc (rc->samples,
+				new_size * rc->sample_size);
+		if (samples_new == NULL)
+		{
+			pthread_mutex_unlock (&cache_lock);
+			ERROR ("rrdtool plugin: realloc failed.");
+			return (-1);
+		}
+		rc->samples = samples_new;
+		rc->values_size = new_size;
 	}
-	rc->values = values_new;
 
-	rc->values[rc->values_num] = strdup (value);
-	if (rc->values[rc->values_num] != NULL)
-		rc->values_num++;
+	sample = RRD_SAMPLE (rc, rc->values_num);
+	sample->time = value_time;
+	memcpy (sample->values, vl->values, ds->ds_num * sizeof (value_t));
+	rc->values_num++;
 
 	if (rc->values_num == 1)
-		rc->first_value = value_time;
-	rc->last_value = value_time;
-
-	/* Insert if this is the first value */
-	if (new_rc == 1)
 	{
-		void *cache_key = strdup (filename);
+		rc->first_value = value_time;
 
-		if (cache_key == NULL)
+		/* The entry's age in the expire list starts with its first
+		 * value. */
+		if ((rc->flags == FLAG_NONE) && (rc->expire_time != now))
 		{
-			char errbuf[1024];
-			sstrerror (errno, errbuf, sizeof (errbuf));
-
-			pthread_mutex_unlock (&cache_lock);
-
-			ERROR ("rrdtool plugin: strdup failed: %s", errbuf);
-
-			sfree (rc->values[0]);
-			sfree (rc->values);
-			sfree (rc);
-			return (-1);
+			rrd_expire_remove (rc);
+			rrd_expire_append (rc, now);
 		}
-
-		c_avl_insert (cache, cache_key, rc);
 	}
+	rc->last_value = value_time;
 
 	DEBUG ("rrdtool plugin: rrd_cache_insert: file = %s; "
 			"values_num = %i; age = %lu;",
@@ -730,15 +914,18 @@ static int rrd_cache_insert (const char *filename,
 
 	if ((rc->last_value - rc->first_value) >= cache_timeout)
 	{
-		/* XXX: If you need to lock both, cache_lock and queue_lock, at
-		 * the same time, ALWAYS lock `cache_lock' first! */
+		/* XXX: If you need to lock both, cache_lock and a writer's
+		 * lock, at the same time, ALWAYS lock `cache_lock' first! */
 		if (rc->flags == FLAG_NONE)
 		{
 			int status;
 
-			status = rrd_queue_enqueue (filename, &queue_head, &queue_tail);
+			status = rrd_queue_enqueue (filename, /* flush = */ 0);
 			if (status == 0)
+			{
+				rrd_expire_remove (rc);
 				rc->flags = FLAG_QUEUED;
+			}
 		}
 		else
 		{
@@ -747,7 +934,7 @@ static int rrd_cache_insert (const char *filename,
 	}
 
 	if ((cache_timeout > 0) &&
-			((time (NULL) - cache_flush_last) > cache_flush_timeout))
+			((now - cache_flush_last) > cache_flush_timeout))
 		rrd_cache_flush (cache_flush_timeout);
 
 	pthread_mutex_unlock (&cache_lock);
@@ -773,8 +960,8 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 {
 	struct stat  statbuf;
 	char         filename[512];
-	char         values[512];
 	int          status;
+	int          i;
 
 	if (0 != strcmp (ds->type, vl->type)) {
 		ERROR ("rrdtool plugin: DS type does not match value list type");
@@ -784,8 +971,10 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 	if (value_list_to_filename (filename, sizeof (filename), ds, vl) != 0)
 		return (-1);
 
-	if (value_list_to_string (values, sizeof (values), ds, vl) != 0)
-		return (-1);
+	for (i = 0; i < ds->ds_num; i++)
+		if ((ds->ds[i].type != DS_TYPE_COUNTER)
+				&& (ds->ds[i].type != DS_TYPE_GAUGE))
+			return (-1);
 
 	if (stat (filename, &statbuf) == -1)
 	{
@@ -812,7 +1001,7 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 		return (-1);
 	}
 
-	status = rrd_cache_insert (filename, values, vl->time);
+	status = rrd_cache_insert (filename, ds, vl);
 
 	return (status);
 } /* int rrd_write */
@@ -977,6 +1166,23 @@ static int rrd_config (const char *key, const char *value)
 			write_rate = 1.0 / wps;
 		}
 	}
+	else if (strcasecmp ("WriteThreads", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			fprintf (stderr, "rrdtool: `WriteThreads' must "
+					"be greater than 0.\n");
+			ERROR ("rrdtool: `WriteThreads' must "
+					"be greater than 0.\n");
+			return (1);
+		}
+		writers_num = tmp;
+	}
+	else if (strcasecmp ("ReportStats", key) == 0)
+	{
+		report_stats = IS_TRUE (value) ? 1 : 0;
+	}
 	else
 	{
 		return (-1);
@@ -984,45 +1190,138 @@ static int rrd_config (const char *key, const char *value)
 	return (0);
 } /* int rrd_config */
 
+static void rrd_stats_submit (int writer, const char *type,
+		const char *type_instance, value_t value)
+{
+	value_list_t vl = VALUE_LIST_INIT;
+
+	vl.values = &value;
+	vl.values_len = 1;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "rrdtool", sizeof (vl.plugin));
+	ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+			"writer%i", writer);
+	sstrncpy (vl.type, type, sizeof (vl.type));
+	if (type_instance != NULL)
+		sstrncpy (vl.type_instance, type_instance,
+				sizeof (vl.type_instance));
+
+	plugin_dispatch_values (&vl);
+} /* void rrd_stats_submit */
+
+/* Read callback reporting the queue length, the number of updates and the
+ * average time files spent in the queue and in `rrd_update' for each writer
+ * thread. Registered if `ReportStats' is enabled. */
+static int rrd_stats_read (void)
+{
+	int i;
+
+	for (i = 0; i < writers_num; i++)
+	{
+		rrd_writer_t *w = writers + i;
+		gauge_t length;
+		counter_t updates;
+		gauge_t delay = NAN;
+		gauge_t update = NAN;
+		value_t v;
+
+		pthread_mutex_lock (&w->lock);
+		length = (gauge_t) w->queue_length;
+		updates = w->updates;
+		if (w->delay_num > 0)
+		{
+			delay = CDTIME_T_TO_DOUBLE (w->delay_sum)
+				/ ((double) w->delay_num);
+			update = CDTIME_T_TO_DOUBLE (w->update_sum)
+				/ ((double) w->delay_num);
+		}
+		w->delay_sum = 0;
+		w->update_sum = 0;
+		w->delay_num = 0;
+		pthread_mutex_unlock (&w->lock);
+
+		v.gauge = length;
+		rrd_stats_submit (i, "queue_length", NULL, v);
+		v.counter = updates;
+		rrd_stats_submit (i, "counter", "updates", v);
+		v.gauge = delay;
+		rrd_stats_submit (i, "delay", "queue", v);
+		v.gauge = update;
+		rrd_stats_submit (i, "delay", "update", v);
+	}
+
+	return (0);
+} /* int rrd_stats_read */
+
 static int rrd_shutdown (void)
 {
+	int queued = 0;
+	int i;
+
 	pthread_mutex_lock (&cache_lock);
 	rrd_cache_flush (-1);
 	pthread_mutex_unlock (&cache_lock);
 
-	pthread_mutex_lock (&queue_lock);
-	do_shutdown = 1;
-	pthread_cond_signal (&queue_cond);
-	pthread_mutex_unlock (&queue_lock);
+	for (i = 0; i < writers_num; i++)
+	{
+		rrd_writer_t *w = writers + i;
+
+		pthread_mutex_lock (&w->lock);
+		do_shutdown = 1;
+		pthread_cond_signal (&w->cond);
+		if (w->thread_running && (w->queue_length > 0))
+			queued = 1;
+		pthread_mutex_unlock (&w->lock);
+	}
 
-	if ((queue_thread_running != 0)
-			&& ((queue_head != NULL) || (flushq_head != NULL)))
+	if ((writers != NULL) && queued)
 	{
-		INFO ("rrdtool plugin: Shutting down the queue thread. "
+		INFO ("rrdtool plugin: Shutting down the queue threads. "
 				"This may take a while.");
 	}
-	else if (queue_thread_running != 0)
+	else if (writers != NULL)
 	{
-		INFO ("rrdtool plugin: Shutting down the queue thread.");
+		INFO ("rrdtool plugin: Shutting down the queue threads.");
 	}
 
 	/* Wait for all the values to be written to disk before returning. */
-	if (queue_thread_running != 0)
+	for (i = 0; (writers != NULL) && (i < writers_num); i++)
 	{
-		pthread_join (queue_thread, NULL);
-		memset (&queue_thread, 0, sizeof (queue_thread));
-		queue_thread_running = 0;
-		DEBUG ("rrdtool plugin: queue_thread exited.");
+		rrd_writer_t *w = writers + i;
+
+		if (w->thread_running == 0)
+			continue;
+
+		pthread_join (w->thread, NULL);
+		memset (&w->thread, 0, sizeof (w->thread));
+		w->thread_running = 0;
+		DEBUG ("rrdtool plugin: writer %i exited.", i);
 	}
 
-	/* TODO: Maybe it'd be a good idea to free the cache here.. */
+	pthread_mutex_lock (&cache_lock);
+	if (cache != NULL)
+	{
+		void *key;
+		rrd_cache_t *rc;
+
+		while (c_avl_pick (cache, &key, (void *) &rc) == 0)
+		{
+			sfree (rc->samples);
+			sfree (rc->filename);
+			sfree (rc);
+		}
+		c_avl_destroy (cache);
+		cache = NULL;
+		expire_head = expire_tail = NULL;
+	}
+	pthread_mutex_unlock (&cache_lock);
 
 	return (0);
 } /* int rrd_shutdown */
 
 static int rrd_init (void)
 {
-	int status;
+	int i;
 
 	if (rrdcreate_config.stepsize < 0)
 		rrdcreate_config.stepsize = 0;
@@ -1030,12 +1329,14 @@ static int rrd_init (void)
 		rrdcreate_config.heartbeat = 2 * rrdcreate_config.stepsize;
 
 	if ((rrdcreate_config.heartbeat > 0)
-			&& (rrdcreate_config.heartbeat < interval_g))
+			&& (TIME_T_TO_CDTIME_T (rrdcreate_config.heartbeat)
+				< interval_g))
 		WARNING ("rrdtool plugin: Your `heartbeat' is "
 				"smaller than your `interval'. This will "
 				"likely cause problems.");
 	else if ((rrdcreate_config.stepsize > 0)
-			&& (rrdcreate_config.stepsize < interval_g))
+			&& (TIME_T_TO_CDTIME_T (rrdcreate_config.stepsize)
+				< interval_g))
 		WARNING ("rrdtool plugin: Your `stepsize' is "
 				"smaller than your `interval'. This will "
 				"create needlessly big RRD-files.");
@@ -1046,6 +1347,7 @@ static int rrd_init (void)
 	cache = c_avl_create ((int (*) (const void *, const void *)) strcmp);
 	if (cache == NULL)
 	{
+		pthread_mutex_unlock (&cache_lock);
 		ERROR ("rrdtool plugin: c_avl_create failed.");
 		return (-1);
 	}
@@ -1061,22 +1363,51 @@ static int rrd_init (void)
 
 	pthread_mutex_unlock (&cache_lock);
 
-	status = pthread_create (&queue_thread, /* attr = */ NULL,
-			rrd_queue_thread, /* args = */ NULL);
-	if (status != 0)
+	writers = (rrd_writer_t *) calloc (writers_num, sizeof (*writers));
+	if (writers == NULL)
 	{
-		ERROR ("rrdtool plugin: Cannot create queue-thread.");
+		ERROR ("rrdtool plugin: calloc failed.");
+		pthread_mutex_lock (&cache_lock);
+		c_avl_destroy (cache);
+		cache = NULL;
+		pthread_mutex_unlock (&cache_lock);
 		return (-1);
 	}
-	queue_thread_running = 1;
+
+	for (i = 0; i < writers_num; i++)
+	{
+		writers[i].index = i;
+		pthread_mutex_init (&writers[i].lock, /* attr = */ NULL);
+		pthread_cond_init (&writers[i].cond, /* attr = */ NULL);
+	}
+
+	for (i = 0; i < writers_num; i++)
+	{
+		rrd_writer_t *w = writers + i;
+		int status;
+
+		status = pthread_create (&w->thread, /* attr = */ NULL,
+				rrd_queue_thread, /* args = */ w);
+		if (status != 0)
+		{
+			ERROR ("rrdtool plugin: Cannot create queue-thread.");
+			return (-1);
+		}
+		w->thread_running = 1;
+	}
+
+	if (report_stats)
+		plugin_register_read ("rrdtool", rrd_stats_read);
 
 	DEBUG ("rrdtool plugin: rrd_init: datadir = %s; stepsize = %i;"
-			" heartbeat = %i; rrarows = %i; xff = %lf;",
+			" heartbeat = %i; rrarows = %i; xff = %lf;"
+			" write threads = %i;",
 			(datadir == NULL) ? "(null)" : datadir,
 			rrdcreate_config.stepsize,
 			rrdcreate_config.heartbeat,
 			rrdcreate_config.rrarows,
-			rrdcreate_config.xff);
+			rrdcreate_config.xff,
+			writers_num);
 
 	return (0);
 } /* int rrd_init */
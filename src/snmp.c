@@ -986,7 +986,7 @@ static int csnmp_dispatch_table (host_definition_t *host, data_definition_t *dat
   sstrncpy (vl.host, host->name, sizeof (vl.host));
   sstrncpy (vl.plugin, "snmp", sizeof (vl.plugin));
 
-  vl.interval = host->interval;
+  vl.interval = TIME_T_TO_CDTIME_T (host->interval);
 
   subid = 0;
   have_more = 1;
@@ -1374,7 +1374,7 @@ static int csnmp_read_value (host_definition_t *host, data_definition_t *data)
   sstrncpy (vl.type, data->type, sizeof (vl.type));
   sstrncpy (vl.type_instance, data->instance.string, sizeof (vl.type_instance));
 
-  vl.interval = host->interval;
+  vl.interval = TIME_T_TO_CDTIME_T (host->interval);
 
   req = snmp_pdu_create (SNMP_MSG_GET);
   if (req == NULL)
@@ -1448,7 +1448,7 @@ static int csnmp_read_host (user_data_t *ud)
   host = ud->data;
 
   if (host->interval == 0)
-    host->interval = interval_g;
+    host->interval = (uint32_t) CDTIME_T_TO_TIME_T (interval_g);
 
   time_start = time (NULL);
   DEBUG ("snmp plugin: csnmp_read_host (%s) started at %u;", host->name,
@@ -376,6 +376,9 @@ static int tr_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
   /* HANDLE_FIELD (type); */
   HANDLE_FIELD (type_instance, 1);
 
+  /* The interned identifier no longer matches. */
+  vl->ident = NULL;
+
   return (FC_TARGET_CONTINUE);
 } /* }}} int tr_invoke */
 
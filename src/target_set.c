@@ -249,6 +249,9 @@ static int ts_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
   /* SET_FIELD (type); */
   SET_FIELD (type_instance);
 
+  /* The interned identifier no longer matches. */
+  vl->ident = NULL;
+
   return (FC_TARGET_CONTINUE);
 } /* }}} int ts_invoke */
 
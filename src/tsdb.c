@@ -0,0 +1,300 @@
+/**
+ * collectd - src/tsdb.c
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#include "collectd.h"
+#include "plugin.h"
+#include "common.h"
+#include "utils_ident.h"
+#include "utils_tsdb.h"
+
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/*
+ * Private variables
+ */
+static const char *config_keys[] =
+{
+	"DataDir",
+	"MaxSegments",
+	"FlushInterval"
+};
+static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
+
+static char *datadir = NULL;
+static int max_segments = 16;
+static int flush_interval = 10;
+
+/* XXX: `db_lock' protects all of the following. */
+static tsdb_t *db = NULL;
+static time_t last_flush = 0;
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tsdb_config (const char *key, const char *value)
+{
+	if (strcasecmp ("DataDir", key) == 0)
+	{
+		char *tmp;
+		int len;
+
+		tmp = strdup (value);
+		if (tmp == NULL)
+			return (1);
+
+		len = strlen (tmp);
+		while ((len > 1) && (tmp[len - 1] == '/'))
+			tmp[--len] = '\0';
+
+		sfree (datadir);
+		datadir = tmp;
+	}
+	else if (strcasecmp ("MaxSegments", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			ERROR ("tsdb plugin: `MaxSegments' must be "
+					"greater than 0.");
+			return (1);
+		}
+		max_segments = tmp;
+	}
+	else if (strcasecmp ("FlushInterval", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 0)
+		{
+			ERROR ("tsdb plugin: `FlushInterval' must not be "
+					"negative.");
+			return (1);
+		}
+		flush_interval = tmp;
+	}
+	else
+	{
+		return (-1);
+	}
+	return (0);
+} /* int tsdb_config */
+
+static int tsdb_write (const data_set_t *ds, const value_list_t *vl,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	const identifier_t *ident;
+	time_t now;
+	int status;
+
+	if (0 != strcmp (ds->type, vl->type)) {
+		ERROR ("tsdb plugin: DS type does not match value list type");
+		return -1;
+	}
+
+	ident = ident_get (vl);
+	if (ident == NULL)
+	{
+		ERROR ("tsdb plugin: ident_get failed.");
+		return (-1);
+	}
+
+	now = time (NULL);
+
+	pthread_mutex_lock (&db_lock);
+
+	if (db == NULL)
+	{
+		pthread_mutex_unlock (&db_lock);
+		ident_release (ident);
+		return (-1);
+	}
+
+	status = tsdb_append (db, ident, ds, vl);
+
+	if ((flush_interval > 0) && ((now - last_flush) >= flush_interval))
+	{
+		tsdb_sync (db);
+		last_flush = now;
+	}
+
+	pthread_mutex_unlock (&db_lock);
+
+	if (status == EINVAL)
+		WARNING ("tsdb plugin: Not storing a value for %s: The time "
+				"%.3f is not newer than the time of the last value.",
+				ident->name, CDTIME_T_TO_DOUBLE (vl->time));
+	else if (status != 0)
+		ERROR ("tsdb plugin: tsdb_append (%s) failed with status %i.",
+				ident->name, status);
+
+	ident_release (ident);
+	return (status);
+} /* int tsdb_write */
+
+static int tsdb_flush (int __attribute__((unused)) timeout,
+		const char __attribute__((unused)) *identifier,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	int status = 0;
+
+	pthread_mutex_lock (&db_lock);
+	if (db != NULL)
+	{
+		status = tsdb_sync (db);
+		last_flush = time (NULL);
+	}
+	pthread_mutex_unlock (&db_lock);
+
+	return (status);
+} /* int tsdb_flush */
+
+static int tsdb_history (const char *identifier,
+		cdtime_t begin, cdtime_t end,
+		cdtime_t **ret_times, gauge_t **ret_values, size_t *ret_values_num,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	const identifier_t *ident;
+	const data_set_t *ds;
+	cdtime_t *times = NULL;
+	value_t *values = NULL;
+	gauge_t *rates;
+	size_t values_num = 0;
+	size_t i;
+	int status;
+	int j;
+
+	ident = ident_lookup (identifier);
+	if (ident == NULL)
+		return (ENOENT);
+
+	ds = plugin_get_ds (ident->type);
+	if (ds == NULL)
+	{
+		ident_release (ident);
+		return (ENOENT);
+	}
+
+	pthread_mutex_lock (&db_lock);
+	if (db == NULL)
+		status = ENOENT;
+	else
+		status = tsdb_query (db, ident, ds, begin, end,
+				&times, &values, &values_num);
+	pthread_mutex_unlock (&db_lock);
+	ident_release (ident);
+
+	if (status != 0)
+		return (status);
+
+	rates = malloc (sizeof (*rates) * (values_num * ds->ds_num + 1));
+	if (rates == NULL)
+	{
+		sfree (times);
+		sfree (values);
+		return (ENOMEM);
+	}
+
+	/* Counters are converted to rates like in the value cache. The first
+	 * value has no predecessor, so its rate is unknown. */
+	for (i = 0; i < values_num; i++)
+	{
+		for (j = 0; j < ds->ds_num; j++)
+		{
+			size_t k = i * ds->ds_num + j;
+
+			if (ds->ds[j].type == DS_TYPE_GAUGE)
+			{
+				rates[k] = values[k].gauge;
+			}
+			else if (i == 0)
+			{
+				rates[k] = NAN;
+			}
+			else
+			{
+				counter_t prev = values[k - ds->ds_num].counter;
+				counter_t diff;
+
+				/* check if the counter has wrapped around */
+				if (values[k].counter < prev)
+				{
+					if (prev <= 4294967295U)
+						diff = (4294967295U - prev) + values[k].counter;
+					else
+						diff = (18446744073709551615ULL - prev)
+							+ values[k].counter;
+				}
+				else
+				{
+					diff = values[k].counter - prev;
+				}
+
+				rates[k] = ((double) diff)
+					/ CDTIME_T_TO_DOUBLE (times[i] - times[i - 1]);
+			}
+		}
+	}
+
+	sfree (values);
+
+	*ret_times = times;
+	*ret_values = rates;
+	*ret_values_num = values_num;
+	return (0);
+} /* int tsdb_history */
+
+static int tsdb_init (void)
+{
+	pthread_mutex_lock (&db_lock);
+	if (db == NULL)
+		db = tsdb_open ((datadir != NULL) ? datadir : "tsdb",
+				max_segments);
+	last_flush = time (NULL);
+	pthread_mutex_unlock (&db_lock);
+
+	if (db == NULL)
+	{
+		ERROR ("tsdb plugin: Opening the store in %s failed.",
+				(datadir != NULL) ? datadir : "tsdb");
+		return (-1);
+	}
+
+	return (0);
+} /* int tsdb_init */
+
+static int tsdb_shutdown (void)
+{
+	pthread_mutex_lock (&db_lock);
+	tsdb_close (db);
+	db = NULL;
+	pthread_mutex_unlock (&db_lock);
+
+	sfree (datadir);
+
+	return (0);
+} /* int tsdb_shutdown */
+
+void module_register (void)
+{
+	plugin_register_config ("tsdb", tsdb_config,
+			config_keys, config_keys_num);
+	plugin_register_init ("tsdb", tsdb_init);
+	plugin_register_write ("tsdb", tsdb_write, /* user_data = */ NULL);
+	plugin_register_flush ("tsdb", tsdb_flush, /* user_data = */ NULL);
+	plugin_register_history ("tsdb", tsdb_history, /* user_data = */ NULL);
+	plugin_register_shutdown ("tsdb", tsdb_shutdown);
+} /* void module_register */
@@ -25,6 +25,7 @@
 #include "configfile.h"
 
 #include "utils_cmd_flush.h"
+#include "utils_cmd_gethistory.h"
 #include "utils_cmd_getval.h"
 #include "utils_cmd_listval.h"
 #include "utils_cmd_putval.h"
@@ -257,6 +258,10 @@ static void *us_handle_client (void *arg)
 		{
 			handle_flush (fhout, buffer);
 		}
+		else if (strcasecmp (fields[0], "gethistory") == 0)
+		{
+			handle_gethistory (fhout, buffer);
+		}
 		else
 		{
 			if (fprintf (fhout, "-1 Unknown command: %s\n", fields[0]) < 0)
@@ -22,39 +22,163 @@
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"
-#include "utils_avltree.h"
 #include "utils_cache.h"
+#include "utils_ident.h"
 #include "utils_threshold.h"
 
 #include <assert.h>
 #include <pthread.h>
 
-typedef struct cache_entry_s
+typedef struct cache_entry_s cache_entry_t;
+struct cache_entry_s
 {
-	char name[6 * DATA_MAX_NAME_LEN];
+	const identifier_t *ident;
 	int        values_num;
 	gauge_t   *values_gauge;
 	counter_t *values_counter;
 	/* Time contained in the package
 	 * (for calculating rates) */
-	time_t last_time;
+	cdtime_t last_time;
 	/* Time according to the local clock
 	 * (for purging old entries) */
-	time_t last_update;
+	cdtime_t last_update;
 	/* Interval in which the data is collected
 	 * (for purding old entries) */
-	int interval;
+	cdtime_t interval;
 	int state;
-} cache_entry_t;
+	cache_entry_t *next;
+};
+
+/*
+ * The cache is split into partitions by the hash of the entry's identifier.
+ * Each partition is a hash table keyed by the interned identifier and has
+ * its own lock, so threads dispatching different values rarely contend for
+ * the same lock and lookups neither format nor compare names. Operations on
+ * a single entry only lock its partition; operations on all entries lock one
+ * partition at a time.
+ */
+#define CACHE_PARTITIONS 64 /* must be a power of two */
+#define CACHE_PARTITION_BITS 6
+
+typedef struct cache_partition_s
+{
+	cache_entry_t **buckets;
+	size_t          buckets_num;
+	size_t          entries_num;
+	pthread_mutex_t lock;
+} cache_partition_t;
+
+static cache_partition_t cache_partitions[CACHE_PARTITIONS];
+static int cache_initialized = 0;
+
+static cache_partition_t *cache_partition (const identifier_t *ident)
+{
+  return (cache_partitions + (ident->hash & (CACHE_PARTITIONS - 1)));
+} /* cache_partition_t *cache_partition */
+
+static size_t cache_bucket (const cache_partition_t *part,
+    const identifier_t *ident)
+{
+  return ((ident->hash >> CACHE_PARTITION_BITS) & (part->buckets_num - 1));
+} /* size_t cache_bucket */
+
+/* Must be called with `part->lock' held. */
+static cache_entry_t *cache_get (const cache_partition_t *part,
+    const identifier_t *ident)
+{
+  cache_entry_t *ce;
+
+  if (part->buckets_num == 0)
+    return (NULL);
+
+  for (ce = part->buckets[cache_bucket (part, ident)]; ce != NULL; ce = ce->next)
+    if (ce->ident == ident)
+      return (ce);
+
+  return (NULL);
+} /* cache_entry_t *cache_get */
+
+/* Doubles the number of buckets of `part'. Must be called with `part->lock'
+ * held. */
+static int cache_grow (cache_partition_t *part)
+{
+  cache_entry_t **buckets;
+  size_t buckets_num;
+  size_t i;
+
+  buckets_num = (part->buckets_num == 0) ? 64 : (2 * part->buckets_num);
+  buckets = (cache_entry_t **) calloc (buckets_num, sizeof (*buckets));
+  if (buckets == NULL)
+  {
+    ERROR ("utils_cache: cache_grow: calloc failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < part->buckets_num; i++)
+  {
+    cache_entry_t *ce;
+    cache_entry_t *next;
+
+    for (ce = part->buckets[i]; ce != NULL; ce = next)
+    {
+      size_t b;
+
+      next = ce->next;
+      b = (ce->ident->hash >> CACHE_PARTITION_BITS) & (buckets_num - 1);
+      ce->next = buckets[b];
+      buckets[b] = ce;
+    }
+  }
+
+  sfree (part->buckets);
+  part->buckets = buckets;
+  part->buckets_num = buckets_num;
+
+  return (0);
+} /* int cache_grow */
+
+/* Must be called with `part->lock' held. */
+static int cache_insert (cache_partition_t *part, cache_entry_t *ce)
+{
+  size_t b;
+
+  if ((part->entries_num >= part->buckets_num) && (cache_grow (part) != 0))
+    return (-1);
 
-static c_avl_tree_t   *cache_tree = NULL;
-static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+  b = cache_bucket (part, ce->ident);
+  ce->next = part->buckets[b];
+  part->buckets[b] = ce;
+  part->entries_num++;
+
+  return (0);
+} /* int cache_insert */
 
-static int cache_compare (const cache_entry_t *a, const cache_entry_t *b)
+/* Unlinks and returns the entry of `ident'. Must be called with `part->lock'
+ * held. */
+static cache_entry_t *cache_remove (cache_partition_t *part,
+    const identifier_t *ident)
 {
-  assert ((a != NULL) && (b != NULL));
-  return (strcmp (a->name, b->name));
-} /* int cache_compare */
+  cache_entry_t **ptr;
+
+  if (part->buckets_num == 0)
+    return (NULL);
+
+  for (ptr = part->buckets + cache_bucket (part, ident); *ptr != NULL;
+      ptr = &(*ptr)->next)
+  {
+    cache_entry_t *ce = *ptr;
+
+    if (ce->ident != ident)
+      continue;
+
+    *ptr = ce->next;
+    ce->next = NULL;
+    part->entries_num--;
+    return (ce);
+  }
+
+  return (NULL);
+} /* cache_entry_t *cache_remove */
 
 static cache_entry_t *cache_alloc (int values_num)
 {
@@ -88,110 +212,76 @@ static void cache_free (cache_entry_t *ce)
   if (ce == NULL)
     return;
 
+  ident_release (ce->ident);
   sfree (ce->values_gauge);
   sfree (ce->values_counter);
   sfree (ce);
 } /* void cache_free */
 
-static int uc_send_notification (const char *name)
+static int uc_send_notification (const identifier_t *ident)
 {
+  cache_partition_t *part;
   cache_entry_t *ce = NULL;
-  int status;
-
-  char *name_copy;
-  char *host;
-  char *plugin;
-  char *plugin_instance;
-  char *type;
-  char *type_instance;
 
   notification_t n;
 
-  name_copy = strdup (name);
-  if (name_copy == NULL)
-  {
-    ERROR ("uc_send_notification: strdup failed.");
-    return (-1);
-  }
-
-  status = parse_identifier (name_copy, &host,
-      &plugin, &plugin_instance,
-      &type, &type_instance);
-  if (status != 0)
-  {
-    ERROR ("uc_send_notification: Cannot parse name `%s'", name);
-    return (-1);
-  }
-
   /* Copy the associative members */
   notification_init (&n, NOTIF_FAILURE, /* host = */ NULL,
-      host, plugin, plugin_instance, type, type_instance);
+      ident->host, ident->plugin, ident->plugin_instance,
+      ident->type, ident->type_instance);
 
-  sfree (name_copy);
-  name_copy = host = plugin = plugin_instance = type = type_instance = NULL;
-
-  pthread_mutex_lock (&cache_lock);
+  part = cache_partition (ident);
+  pthread_mutex_lock (&part->lock);
 
   /*
    * Set the time _after_ getting the lock because we don't know how long
    * acquiring the lock takes and we will use this time later to decide
    * whether or not the state is OKAY.
    */
-  n.time = time (NULL);
+  n.time = cdtime ();
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0)
+  ce = cache_get (part, ident);
+  if (ce == NULL)
   {
-    pthread_mutex_unlock (&cache_lock);
-    sfree (name_copy);
+    pthread_mutex_unlock (&part->lock);
     return (-1);
   }
     
   /* Check if the entry has been updated in the meantime */
-  if ((n.time - ce->last_update) < (2 * ce->interval))
+  if ((ce->last_update + (2 * ce->interval)) > n.time)
   {
     ce->state = STATE_OKAY;
-    pthread_mutex_unlock (&cache_lock);
-    sfree (name_copy);
+    pthread_mutex_unlock (&part->lock);
     return (-1);
   }
 
   ssnprintf (n.message, sizeof (n.message),
-      "%s has not been updated for %i seconds.", name,
-      (int) (n.time - ce->last_update));
+      "%s has not been updated for %.3f seconds.", ident->name,
+      CDTIME_T_TO_DOUBLE (n.time - ce->last_update));
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&part->lock);
 
   plugin_dispatch_notification (&n);
 
   return (0);
 } /* int uc_send_notification */
 
-static int uc_insert (const data_set_t *ds, const value_list_t *vl,
-    const char *key)
+static int uc_insert (cache_partition_t *part, const data_set_t *ds,
+    const value_list_t *vl, const identifier_t *ident)
 {
   int i;
-  char *key_copy;
   cache_entry_t *ce;
 
-  /* `cache_lock' has been locked by `uc_update' */
-
-  key_copy = strdup (key);
-  if (key_copy == NULL)
-  {
-    ERROR ("uc_insert: strdup failed.");
-    return (-1);
-  }
+  /* `part->lock' has been locked by `uc_update' */
 
   ce = cache_alloc (ds->ds_num);
   if (ce == NULL)
   {
-    sfree (key_copy);
     ERROR ("uc_insert: cache_alloc (%i) failed.", ds->ds_num);
     return (-1);
   }
 
-  sstrncpy (ce->name, key, sizeof (ce->name));
+  ce->ident = ident_ref (ident);
 
   for (i = 0; i < ds->ds_num; i++)
   {
@@ -207,106 +297,165 @@ static int uc_insert (const data_set_t *ds, const value_list_t *vl,
   } /* for (i) */
 
   ce->last_time = vl->time;
-  ce->last_update = time (NULL);
+  ce->last_update = cdtime ();
   ce->interval = vl->interval;
   ce->state = STATE_OKAY;
 
-  if (c_avl_insert (cache_tree, key_copy, ce) != 0)
+  if (cache_insert (part, ce) != 0)
   {
-    sfree (key_copy);
-    ERROR ("uc_insert: c_avl_insert failed.");
+    cache_free (ce);
+    ERROR ("uc_insert: cache_insert failed.");
     return (-1);
   }
 
-  DEBUG ("uc_insert: Added %s to the cache.", key);
+  DEBUG ("uc_insert: Added %s to the cache.", ident->name);
   return (0);
 } /* int uc_insert */
 
 int uc_init (void)
 {
-  if (cache_tree == NULL)
-    cache_tree = c_avl_create ((int (*) (const void *, const void *))
-	cache_compare);
+  int i;
+
+  if (cache_initialized)
+    return (0);
 
+  for (i = 0; i < CACHE_PARTITIONS; i++)
+  {
+    memset (cache_partitions + i, 0, sizeof (cache_partitions[i]));
+    pthread_mutex_init (&cache_partitions[i].lock, /* attr = */ NULL);
+  }
+
+  cache_initialized = 1;
   return (0);
 } /* int uc_init */
 
-int uc_check_timeout (void)
+/* Appends the identifiers of all entries in `part' which have not been
+ * updated for two intervals to `keys', which has room for `keys_size'
+ * entries and is grown by doubling its size. */
+static int uc_check_timeout_partition (cache_partition_t *part, cdtime_t now,
+    const identifier_t ***keys, int *keys_len, int *keys_size)
 {
-  time_t now;
   cache_entry_t *ce;
+  size_t b;
+  int status = 0;
 
-  char **keys = NULL;
-  int keys_len = 0;
-
-  char *key;
-  c_avl_iterator_t *iter;
-  int i;
-  
-  pthread_mutex_lock (&cache_lock);
-
-  now = time (NULL);
+  pthread_mutex_lock (&part->lock);
 
-  /* Build a list of entries to be flushed */
-  iter = c_avl_get_iterator (cache_tree);
-  while (c_avl_iterator_next (iter, (void *) &key, (void *) &ce) == 0)
+  for (b = 0; (b < part->buckets_num) && (status == 0); b++)
   {
-    /* If entry has not been updated, add to `keys' array */
-    if ((now - ce->last_update) >= (2 * ce->interval))
+    for (ce = part->buckets[b]; ce != NULL; ce = ce->next)
     {
-      char **tmp;
+      const identifier_t **tmp;
 
-      tmp = (char **) realloc ((void *) keys,
-	  (keys_len + 1) * sizeof (char *));
-      if (tmp == NULL)
-      {
-	ERROR ("uc_purge: realloc failed.");
-	c_avl_iterator_destroy (iter);
-	pthread_mutex_unlock (&cache_lock);
-	return (-1);
-      }
+      /* If entry has not been updated, add to `keys' array */
+      if ((ce->last_update + (2 * ce->interval)) > now)
+	continue;
 
-      keys = tmp;
-      keys[keys_len] = strdup (key);
-      if (keys[keys_len] == NULL)
+      if (*keys_len >= *keys_size)
       {
-	ERROR ("uc_check_timeout: strdup failed.");
-	continue;
+	int new_size = (*keys_size > 0) ? (2 * *keys_size) : 64;
+
+	tmp = (const identifier_t **) realloc ((void *) *keys,
+	    new_size * sizeof (**keys));
+	if (tmp == NULL)
+	{
+	  ERROR ("uc_purge: realloc failed.");
+	  status = -1;
+	  break;
+	}
+
+	*keys = tmp;
+	*keys_size = new_size;
       }
-      keys_len++;
+
+      (*keys)[*keys_len] = ident_ref (ce->ident);
+      (*keys_len)++;
     }
-  } /* while (c_avl_iterator_next) */
+  } /* for (b) */
+
+  pthread_mutex_unlock (&part->lock);
+
+  return (status);
+} /* int uc_check_timeout_partition */
+
+int uc_check_timeout (void)
+{
+  cdtime_t now;
+  cache_entry_t *ce;
+
+  /* The entries may be removed while the list is processed, so it holds
+   * references to the identifiers. NULL entries don't need a
+   * notification. */
+  const identifier_t **keys = NULL;
+  int keys_len = 0;
+  int keys_size = 0;
+
+  int status;
+  int i;
+
+  now = cdtime ();
+
+  /* Build a list of entries to be flushed, locking one partition at a time.
+   * Deciding what to do with them requires the threshold configuration and
+   * is done without holding any cache lock. */
+  status = 0;
+  for (i = 0; (i < CACHE_PARTITIONS) && (status == 0); i++)
+    status = uc_check_timeout_partition (cache_partitions + i, now,
+	&keys, &keys_len, &keys_size);
+
+  if (status != 0)
+  {
+    for (i = 0; i < keys_len; i++)
+      ident_release (keys[i]);
+    sfree (keys);
+    return (-1);
+  }
 
   for (i = 0; i < keys_len; i++)
   {
-    int status;
+    cache_partition_t *part;
 
-    status = ut_check_interesting (keys[i]);
+    status = ut_check_interesting (keys[i]->name);
 
     if (status < 0)
     {
       ERROR ("uc_check_timeout: ut_check_interesting failed.");
-      sfree (keys[i]);
+      ident_release (keys[i]);
+      keys[i] = NULL;
+      continue;
     }
-    else if (status == 0) /* ``service'' is uninteresting */
+
+    part = cache_partition (keys[i]);
+    pthread_mutex_lock (&part->lock);
+
+    /* The entry may have been updated or removed since the partition was
+     * scanned. */
+    ce = cache_get (part, keys[i]);
+    if ((ce == NULL) || ((ce->last_update + (2 * ce->interval)) > now))
+    {
+      pthread_mutex_unlock (&part->lock);
+      ident_release (keys[i]);
+      keys[i] = NULL;
+      continue;
+    }
+
+    if (status == 0) /* ``service'' is uninteresting */
     {
-      ce = NULL;
       DEBUG ("uc_check_timeout: %s is missing but ``uninteresting''",
-	  keys[i]);
-      status = c_avl_remove (cache_tree, keys[i],
-	  (void *) &key, (void *) &ce);
-      if (status != 0)
+	  keys[i]->name);
+      ce = cache_remove (part, keys[i]);
+      if (ce == NULL)
       {
-	ERROR ("uc_check_timeout: c_avl_remove (%s) failed.", keys[i]);
+	ERROR ("uc_check_timeout: cache_remove (%s) failed.", keys[i]->name);
       }
-      sfree (keys[i]);
-      sfree (key);
       cache_free (ce);
+      ident_release (keys[i]);
+      keys[i] = NULL;
     }
     else if (status == 1) /* persist */
     {
       DEBUG ("uc_check_timeout: %s is missing, sending notification.",
-	  keys[i]);
+	  keys[i]->name);
       ce->state = STATE_MISSING;
     }
     else if (status == 2) /* do not persist */
@@ -315,13 +464,14 @@ int uc_check_timeout (void)
       {
 	DEBUG ("uc_check_timeout: %s is missing but "
 	    "notification has already been sent.",
-	    keys[i]);
-	sfree (keys[i]);
+	    keys[i]->name);
+	ident_release (keys[i]);
+	keys[i] = NULL;
       }
       else /* (ce->state != STATE_MISSING) */
       {
 	DEBUG ("uc_check_timeout: %s is missing, sending one notification.",
-	    keys[i]);
+	    keys[i]->name);
 	ce->state = STATE_MISSING;
       }
     }
@@ -329,13 +479,11 @@ int uc_check_timeout (void)
     {
       WARNING ("uc_check_timeout: ut_check_interesting (%s) returned "
 	  "invalid status %i.",
-	  keys[i], status);
+	  keys[i]->name, status);
     }
-  } /* for (keys[i]) */
-
-  c_avl_iterator_destroy (iter);
 
-  pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&part->lock);
+  } /* for (keys[i]) */
 
   for (i = 0; i < keys_len; i++)
   {
@@ -343,7 +491,7 @@ int uc_check_timeout (void)
       continue;
 
     uc_send_notification (keys[i]);
-    sfree (keys[i]);
+    ident_release (keys[i]);
   }
 
   sfree (keys);
@@ -353,39 +501,44 @@ int uc_check_timeout (void)
 
 int uc_update (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  const identifier_t *ident;
+  cache_partition_t *part;
   cache_entry_t *ce = NULL;
   int send_okay_notification = 0;
-  time_t update_delay = 0;
+  cdtime_t update_delay = 0;
   notification_t n;
   int status;
   int i;
 
-  if (FORMAT_VL (name, sizeof (name), vl, ds) != 0)
+  ident = ident_get (vl);
+  if (ident == NULL)
   {
-    ERROR ("uc_update: FORMAT_VL failed.");
+    ERROR ("uc_update: ident_get failed.");
     return (-1);
   }
 
-  pthread_mutex_lock (&cache_lock);
+  part = cache_partition (ident);
+  pthread_mutex_lock (&part->lock);
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0) /* entry does not yet exist */
+  ce = cache_get (part, ident);
+  if (ce == NULL) /* entry does not yet exist */
   {
-    status = uc_insert (ds, vl, name);
-    pthread_mutex_unlock (&cache_lock);
+    status = uc_insert (part, ds, vl, ident);
+    pthread_mutex_unlock (&part->lock);
+    ident_release (ident);
     return (status);
   }
 
-  assert (ce != NULL);
   assert (ce->values_num == ds->ds_num);
 
   if (ce->last_time >= vl->time)
   {
-    pthread_mutex_unlock (&cache_lock);
-    NOTICE ("uc_update: Value too old: name = %s; value time = %u; "
-	"last cache update = %u;",
-	name, (unsigned int) vl->time, (unsigned int) ce->last_time);
+    pthread_mutex_unlock (&part->lock);
+    NOTICE ("uc_update: Value too old: name = %s; value time = %.3f; "
+	"last cache update = %.3f;",
+	ident->name, CDTIME_T_TO_DOUBLE (vl->time),
+	CDTIME_T_TO_DOUBLE (ce->last_time));
+    ident_release (ident);
     return (-1);
   }
 
@@ -395,7 +548,7 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
   {
     send_okay_notification = 1;
     ce->state = STATE_OKAY;
-    update_delay = time (NULL) - ce->last_update;
+    update_delay = cdtime () - ce->last_update;
   }
 
   for (i = 0; i < ds->ds_num; i++)
@@ -420,30 +573,36 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
       }
 
       ce->values_gauge[i] = ((double) diff)
-	/ ((double) (vl->time - ce->last_time));
+	/ CDTIME_T_TO_DOUBLE (vl->time - ce->last_time);
       ce->values_counter[i] = vl->values[i].counter;
     }
     else /* if (ds->ds[i].type == DS_TYPE_GAUGE) */
     {
       ce->values_gauge[i] = vl->values[i].gauge;
     }
-    DEBUG ("uc_update: %s: ds[%i] = %lf", name, i, ce->values_gauge[i]);
+    DEBUG ("uc_update: %s: ds[%i] = %lf", ident->name, i, ce->values_gauge[i]);
   } /* for (i) */
 
   ce->last_time = vl->time;
-  ce->last_update = time (NULL);
+  ce->last_update = cdtime ();
   ce->interval = vl->interval;
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&part->lock);
 
   if (send_okay_notification == 0)
+  {
+    ident_release (ident);
     return (0);
+  }
 
   /* Do not send okay notifications for uninteresting values, i. e. values for
    * which no threshold is configured. */
-  status = ut_check_interesting (name);
+  status = ut_check_interesting (ident->name);
   if (status <= 0)
+  {
+    ident_release (ident);
     return (0);
+  }
 
   /* Initialize the notification */
   memset (&n, '\0', sizeof (n));
@@ -453,27 +612,31 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
   n.time = vl->time;
 
   ssnprintf (n.message, sizeof (n.message),
-      "Received a value for %s. It was missing for %u seconds.",
-      name, (unsigned int) update_delay);
+      "Received a value for %s. It was missing for %.3f seconds.",
+      ident->name, CDTIME_T_TO_DOUBLE (update_delay));
+  ident_release (ident);
 
   plugin_dispatch_notification (&n);
 
   return (0);
 } /* int uc_update */
 
-int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_values_num)
+/* Copies the rates of `ident'. */
+static int uc_get_rate_by_ident (const identifier_t *ident,
+    gauge_t **ret_values, size_t *ret_values_num)
 {
   gauge_t *ret = NULL;
   size_t ret_num = 0;
+  cache_partition_t *part;
   cache_entry_t *ce = NULL;
   int status = 0;
 
-  pthread_mutex_lock (&cache_lock);
+  part = cache_partition (ident);
+  pthread_mutex_lock (&part->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  ce = cache_get (part, ident);
+  if (ce != NULL)
   {
-    assert (ce != NULL);
-
     ret_num = ce->values_num;
     ret = (gauge_t *) malloc (ret_num * sizeof (gauge_t));
     if (ret == NULL)
@@ -488,11 +651,12 @@ int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_val
   }
   else
   {
-    DEBUG ("utils_cache: uc_get_rate_by_name: No such value: %s", name);
+    DEBUG ("utils_cache: uc_get_rate_by_name: No such value: %s",
+	ident->name);
     status = -1;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&part->lock);
 
   if (status == 0)
   {
@@ -500,23 +664,49 @@ int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_val
     *ret_values_num = ret_num;
   }
 
+  return (status);
+} /* int uc_get_rate_by_ident */
+
+int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_values_num)
+{
+  const identifier_t *ident;
+  int status;
+
+  /* Values which have never been dispatched have no identifier. */
+  ident = ident_lookup (name);
+  if (ident == NULL)
+  {
+    DEBUG ("utils_cache: uc_get_rate_by_name: No such value: %s", name);
+    return (-1);
+  }
+
+  status = uc_get_rate_by_ident (ident, ret_values, ret_values_num);
+  ident_release (ident);
+
   return (status);
 } /* gauge_t *uc_get_rate_by_name */
 
 gauge_t *uc_get_rate (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  const identifier_t *ident;
   gauge_t *ret = NULL;
   size_t ret_num = 0;
   int status;
 
-  if (FORMAT_VL (name, sizeof (name), vl, ds) != 0)
+  /* Values handed to write callbacks by the write threads carry the rates
+   * they had when they were queued. */
+  if (plugin_write_rates (ds, vl, &ret) == 0)
+    return (ret);
+
+  ident = ident_get (vl);
+  if (ident == NULL)
   {
-    ERROR ("utils_cache: uc_get_rate: FORMAT_VL failed.");
+    ERROR ("utils_cache: uc_get_rate: ident_get failed.");
     return (NULL);
   }
 
-  status = uc_get_rate_by_name (name, &ret, &ret_num);
+  status = uc_get_rate_by_ident (ident, &ret, &ret_num);
+  ident_release (ident);
   if (status != 0)
     return (NULL);
 
@@ -534,74 +724,120 @@ gauge_t *uc_get_rate (const data_set_t *ds, const value_list_t *vl)
   return (ret);
 } /* gauge_t *uc_get_rate */
 
+typedef struct uc_name_s
+{
+  char *name;
+  time_t time;
+} uc_name_t;
+
+static int uc_name_compare (const void *a, const void *b)
+{
+  return (strcmp (((const uc_name_t *) a)->name,
+	((const uc_name_t *) b)->name));
+} /* int uc_name_compare */
+
 int uc_get_names (char ***ret_names, time_t **ret_times, size_t *ret_number)
 {
-  c_avl_iterator_t *iter;
-  char *key;
-  cache_entry_t *value;
+  cache_entry_t *ce;
+  size_t b;
 
+  uc_name_t *entries = NULL;
+  size_t entries_size = 0;
   char **names = NULL;
   time_t *times = NULL;
   size_t number = 0;
+  size_t i;
+  int p;
 
   int status = 0;
 
   if ((ret_names == NULL) || (ret_number == NULL))
     return (-1);
 
-  pthread_mutex_lock (&cache_lock);
-
-  iter = c_avl_get_iterator (cache_tree);
-  while (c_avl_iterator_next (iter, (void *) &key, (void *) &value) == 0)
+  for (p = 0; (p < CACHE_PARTITIONS) && (status == 0); p++)
   {
-    char **temp;
+    cache_partition_t *part = cache_partitions + p;
+
+    pthread_mutex_lock (&part->lock);
 
-    if (ret_times != NULL)
+    /* Make room for all entries of the partition at once. The array grows
+     * at least by doubling, so few partitions need to reallocate it. */
+    if ((number + part->entries_num) > entries_size)
     {
-      time_t *tmp_times;
+      uc_name_t *temp;
+      size_t new_size;
 
-      tmp_times = (time_t *) realloc (times, sizeof (time_t) * (number + 1));
-      if (tmp_times == NULL)
-      {
+      new_size = 2 * entries_size;
+      if (new_size < (number + part->entries_num))
+	new_size = number + part->entries_num;
+
+      temp = (uc_name_t *) realloc (entries, sizeof (*entries) * new_size);
+      if (temp == NULL)
 	status = -1;
-	break;
+      else
+      {
+	entries = temp;
+	entries_size = new_size;
       }
-      times = tmp_times;
-      times[number] = value->last_time;
     }
 
-    temp = (char **) realloc (names, sizeof (char *) * (number + 1));
-    if (temp == NULL)
-    {
-      status = -1;
-      break;
-    }
-    names = temp;
-    names[number] = strdup (key);
-    if (names[number] == NULL)
+    for (b = 0; (b < part->buckets_num) && (status == 0); b++)
     {
+      for (ce = part->buckets[b]; ce != NULL; ce = ce->next)
+      {
+	entries[number].time = CDTIME_T_TO_TIME_T (ce->last_time);
+	entries[number].name = strdup (ce->ident->name);
+	if (entries[number].name == NULL)
+	{
+	  status = -1;
+	  break;
+	}
+	number++;
+      }
+    } /* for (b) */
+
+    pthread_mutex_unlock (&part->lock);
+  } /* for (p = 0; p < CACHE_PARTITIONS; p++) */
+
+  if (status == 0)
+  {
+    names = (char **) calloc (number + 1, sizeof (char *));
+    if (names == NULL)
       status = -1;
-      break;
-    }
-    number++;
-  } /* while (c_avl_iterator_next) */
+  }
 
-  c_avl_iterator_destroy (iter);
-  pthread_mutex_unlock (&cache_lock);
+  if ((status == 0) && (ret_times != NULL))
+  {
+    times = (time_t *) calloc (number + 1, sizeof (time_t));
+    if (times == NULL)
+      status = -1;
+  }
 
   if (status != 0)
   {
-    size_t i;
-    
     for (i = 0; i < number; i++)
     {
-      sfree (names[i]);
+      sfree (entries[i].name);
     }
+    sfree (entries);
     sfree (names);
 
     return (-1);
   }
 
+  /* Hash tables have no order, so sort the names to keep the output of
+   * LISTVAL stable. */
+  if (number > 1)
+    qsort (entries, number, sizeof (*entries), uc_name_compare);
+
+  for (i = 0; i < number; i++)
+  {
+    names[i] = entries[i].name;
+    if (times != NULL)
+      times[i] = entries[i].time;
+  }
+  sfree (entries);
+
   *ret_names = names;
   if (ret_times != NULL)
     *ret_times = times;
@@ -612,51 +848,59 @@ int uc_get_names (char ***ret_names, time_t **ret_times, size_t *ret_number)
 
 int uc_get_state (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  const identifier_t *ident;
+  cache_partition_t *part;
   cache_entry_t *ce = NULL;
   int ret = STATE_ERROR;
 
-  if (FORMAT_VL (name, sizeof (name), vl, ds) != 0)
+  ident = ident_get (vl);
+  if (ident == NULL)
   {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
+    ERROR ("uc_get_state: ident_get failed.");
     return (STATE_ERROR);
   }
 
-  pthread_mutex_lock (&cache_lock);
+  part = cache_partition (ident);
+  pthread_mutex_lock (&part->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  ce = cache_get (part, ident);
+  if (ce != NULL)
   {
-    assert (ce != NULL);
     ret = ce->state;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&part->lock);
+  ident_release (ident);
 
   return (ret);
 } /* int uc_get_state */
 
 int uc_set_state (const data_set_t *ds, const value_list_t *vl, int state)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  const identifier_t *ident;
+  cache_partition_t *part;
   cache_entry_t *ce = NULL;
   int ret = -1;
 
-  if (FORMAT_VL (name, sizeof (name), vl, ds) != 0)
+  ident = ident_get (vl);
+  if (ident == NULL)
   {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
+    ERROR ("uc_set_state: ident_get failed.");
     return (STATE_ERROR);
   }
 
-  pthread_mutex_lock (&cache_lock);
+  part = cache_partition (ident);
+  pthread_mutex_lock (&part->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  ce = cache_get (part, ident);
+  if (ce != NULL)
   {
-    assert (ce != NULL);
     ret = ce->state;
     ce->state = state;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&part->lock);
+  ident_release (ident);
 
   return (ret);
 } /* int uc_set_state */
@@ -0,0 +1,231 @@
+/**
+ * collectd - src/utils_cmd_gethistory.c
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+
+#include "utils_cmd_gethistory.h"
+#include "utils_parse_option.h"
+
+/* Values returned if no `begin' option is given. */
+#define GETHISTORY_DEFAULT_RANGE 3600
+
+#define print_to_socket(fh, ...) \
+  if (fprintf (fh, __VA_ARGS__) < 0) { \
+    char errbuf[1024]; \
+    WARNING ("handle_gethistory: failed to write to socket #%i: %s", \
+	fileno (fh), sstrerror (errno, errbuf, sizeof (errbuf))); \
+    sfree (times); \
+    sfree (values); \
+    sfree (identifier_copy); \
+    return -1; \
+  }
+
+static int parse_time (const char *str, cdtime_t *ret_time)
+{
+  char *endptr;
+  double tmp;
+
+  errno = 0;
+  endptr = NULL;
+  tmp = strtod (str, &endptr);
+  if ((errno != 0) || (endptr == str) || (*endptr != 0) || (tmp < 0.0))
+    return (-1);
+
+  *ret_time = DOUBLE_TO_CDTIME_T (tmp);
+  return (0);
+} /* int parse_time */
+
+int handle_gethistory (FILE *fh, char *buffer)
+{
+  char *command;
+  char *identifier;
+  char *identifier_copy = NULL;
+  char *plugin = NULL;
+
+  char *hostname;
+  char *plugin_name;
+  char *plugin_instance;
+  char *type;
+  char *type_instance;
+
+  cdtime_t begin = 0;
+  cdtime_t end = 0;
+  cdtime_t *times = NULL;
+  gauge_t *values = NULL;
+  size_t values_num = 0;
+
+  const data_set_t *ds;
+
+  int    status;
+  size_t i;
+  int    j;
+
+  if ((fh == NULL) || (buffer == NULL))
+    return (-1);
+
+  DEBUG ("utils_cmd_gethistory: handle_gethistory (fh = %p, buffer = %s);",
+      (void *) fh, buffer);
+
+  command = NULL;
+  status = parse_string (&buffer, &command);
+  if (status != 0)
+  {
+    print_to_socket (fh, "-1 Cannot parse command.\n");
+    return (-1);
+  }
+  assert (command != NULL);
+
+  if (strcasecmp ("GETHISTORY", command) != 0)
+  {
+    print_to_socket (fh, "-1 Unexpected command: `%s'.\n", command);
+    return (-1);
+  }
+
+  identifier = NULL;
+  status = parse_string (&buffer, &identifier);
+  if (status != 0)
+  {
+    print_to_socket (fh, "-1 Cannot parse identifier.\n");
+    return (-1);
+  }
+  assert (identifier != NULL);
+
+  while (*buffer != 0)
+  {
+    char *opt_key;
+    char *opt_value;
+
+    opt_key = NULL;
+    opt_value = NULL;
+    status = parse_option (&buffer, &opt_key, &opt_value);
+    if (status != 0)
+    {
+      print_to_socket (fh, "-1 Parsing options failed.\n");
+      return (-1);
+    }
+
+    if (strcasecmp ("begin", opt_key) == 0)
+    {
+      if (parse_time (opt_value, &begin) != 0)
+      {
+	print_to_socket (fh, "-1 Invalid value for option `begin': %s\n",
+	    opt_value);
+	return (-1);
+      }
+    }
+    else if (strcasecmp ("end", opt_key) == 0)
+    {
+      if (parse_time (opt_value, &end) != 0)
+      {
+	print_to_socket (fh, "-1 Invalid value for option `end': %s\n",
+	    opt_value);
+	return (-1);
+      }
+    }
+    else if (strcasecmp ("plugin", opt_key) == 0)
+    {
+      plugin = opt_value;
+    }
+    else
+    {
+      print_to_socket (fh, "-1 Cannot parse option %s\n", opt_key);
+      return (-1);
+    }
+  } /* while (*buffer != 0) */
+
+  if (end == 0)
+    end = cdtime ();
+  /* `cdtime_t' is unsigned, so don't go back before zero. */
+  if ((begin == 0) && (end > TIME_T_TO_CDTIME_T (GETHISTORY_DEFAULT_RANGE)))
+    begin = end - TIME_T_TO_CDTIME_T (GETHISTORY_DEFAULT_RANGE);
+  if (begin > end)
+  {
+    print_to_socket (fh, "-1 `begin' is after `end'.\n");
+    return (-1);
+  }
+
+  /* parse_identifier() modifies its first argument,
+   * returning pointers into it */
+  identifier_copy = sstrdup (identifier);
+
+  status = parse_identifier (identifier_copy, &hostname,
+      &plugin_name, &plugin_instance,
+      &type, &type_instance);
+  if (status != 0)
+  {
+    DEBUG ("handle_gethistory: Cannot parse identifier `%s'.", identifier);
+    print_to_socket (fh, "-1 Cannot parse identifier `%s'.\n", identifier);
+    sfree (identifier_copy);
+    return (-1);
+  }
+
+  ds = plugin_get_ds (type);
+  if (ds == NULL)
+  {
+    DEBUG ("handle_gethistory: plugin_get_ds (%s) == NULL;", type);
+    print_to_socket (fh, "-1 Type `%s' is unknown.\n", type);
+    sfree (identifier_copy);
+    return (-1);
+  }
+
+  status = plugin_history (plugin, identifier, begin, end,
+      &times, &values, &values_num);
+  if (status == ENOENT)
+  {
+    print_to_socket (fh, "-1 No such value\n");
+    sfree (identifier_copy);
+    return (-1);
+  }
+  else if (status != 0)
+  {
+    print_to_socket (fh, "-1 Reading the history failed.\n");
+    sfree (identifier_copy);
+    return (-1);
+  }
+
+  print_to_socket (fh, "%u Value%s found\n", (unsigned int) values_num,
+      (values_num == 1) ? "" : "s");
+  for (i = 0; i < values_num; i++)
+  {
+    print_to_socket (fh, "%.3f", CDTIME_T_TO_DOUBLE (times[i]));
+    for (j = 0; j < ds->ds_num; j++)
+    {
+      gauge_t v = values[i * ds->ds_num + j];
+
+      if (isnan (v))
+      {
+	print_to_socket (fh, ":NaN");
+      }
+      else
+      {
+	print_to_socket (fh, ":%e", v);
+      }
+    }
+    print_to_socket (fh, "\n");
+  }
+
+  sfree (times);
+  sfree (values);
+  sfree (identifier_copy);
+
+  return (0);
+} /* int handle_gethistory */
+
+/* vim: set sw=2 sts=2 ts=8 : */
@@ -49,13 +49,13 @@ static int set_option_severity (notification_t *n, const char *value)
 
 static int set_option_time (notification_t *n, const char *value)
 {
-  time_t tmp;
+  double tmp;
   
-  tmp = (time_t) atoi (value);
-  if (tmp <= 0)
+  tmp = atof (value);
+  if (tmp <= 0.0)
     return (-1);
 
-  n->time = tmp;
+  n->time = DOUBLE_TO_CDTIME_T (tmp);
 
   return (0);
 } /* int set_option_time */
@@ -39,6 +39,7 @@ static int dispatch_values (const data_set_t *ds, value_list_t *vl,
 	char *dummy;
 	char *ptr;
 	char *saveptr;
+	double time_tmp;
 	int i;
 
 	char *time_str = buffer;
@@ -50,7 +51,9 @@ static int dispatch_values (const data_set_t *ds, value_list_t *vl,
 	}
 	*value_str = '\0'; value_str++;
 
-	vl->time = (time_t) atoi (time_str);
+	/* The time may have a fractional part. Zero (and ``N'') means ``now''. */
+	time_tmp = atof (time_str);
+	vl->time = (time_tmp > 0.0) ? DOUBLE_TO_CDTIME_T (time_tmp) : 0;
 
 	i = 0;
 	dummy = value_str;
@@ -101,16 +104,16 @@ static int set_option (value_list_t *vl, const char *key, const char *value)
 
 	if (strcasecmp ("interval", key) == 0)
 	{
-		int tmp;
+		double tmp;
 		char *endptr;
 
 		endptr = NULL;
 		errno = 0;
-		tmp = strtol (value, &endptr, 0);
+		tmp = strtod (value, &endptr);
 
 		if ((errno == 0) && (endptr != NULL)
-				&& (endptr != value) && (tmp > 0))
-			vl->interval = tmp;
+				&& (endptr != value) && (tmp > 0.0))
+			vl->interval = DOUBLE_TO_CDTIME_T (tmp);
 	}
 	else
 		return (1);
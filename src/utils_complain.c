@@ -30,6 +30,7 @@ static int vcomplain (int level, c_complain_t *c,
 		const char *format, va_list ap)
 {
 	time_t now;
+	int    interval;
 	char   message[512];
 
 	now = time (NULL);
@@ -39,8 +40,13 @@ static int vcomplain (int level, c_complain_t *c,
 
 	c->last = now;
 
-	if (c->interval < interval_g)
-		c->interval = interval_g;
+	/* Start with the global interval, but at least one second. */
+	interval = (int) CDTIME_T_TO_TIME_T (interval_g);
+	if (interval < 1)
+		interval = 1;
+
+	if (c->interval < interval)
+		c->interval = interval;
 	else
 		c->interval *= 2;
 
@@ -0,0 +1,354 @@
+/**
+ * collectd - src/utils_ident.c
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_ident.h"
+
+#include <pthread.h>
+
+/*
+ * The table is split into partitions by the lower bits of the hash, each
+ * being a hash table with chaining and its own lock. The remaining bits
+ * select the bucket.
+ */
+#define IDENT_PARTITIONS 64 /* must be a power of two */
+#define IDENT_PARTITION_BITS 6
+
+typedef struct ident_partition_s
+{
+	identifier_t  **buckets;
+	size_t          buckets_num;
+	size_t          entries_num;
+	pthread_mutex_t lock;
+} ident_partition_t;
+
+static ident_partition_t ident_partitions[IDENT_PARTITIONS];
+static pthread_once_t ident_once = PTHREAD_ONCE_INIT;
+
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME  16777619U
+
+static void ident_init (void)
+{
+	int i;
+
+	memset (ident_partitions, 0, sizeof (ident_partitions));
+	for (i = 0; i < IDENT_PARTITIONS; i++)
+		pthread_mutex_init (&ident_partitions[i].lock, /* attr = */ NULL);
+} /* void ident_init */
+
+/* FNV-1a */
+static uint32_t ident_hash_update (uint32_t hash, const char *str)
+{
+	while (*str != 0)
+	{
+		hash ^= (uint32_t) ((unsigned char) *str);
+		hash *= FNV_PRIME;
+		str++;
+	}
+
+	return (hash);
+} /* uint32_t ident_hash_update */
+
+/* Hashes the fields of `vl' as if they had been formatted by `format_name'
+ * first. */
+static uint32_t ident_hash_vl (const value_list_t *vl)
+{
+	uint32_t hash = FNV_OFFSET;
+
+	hash = ident_hash_update (hash, vl->host);
+	hash = ident_hash_update (hash, "/");
+	hash = ident_hash_update (hash, vl->plugin);
+	if (vl->plugin_instance[0] != 0)
+	{
+		hash = ident_hash_update (hash, "-");
+		hash = ident_hash_update (hash, vl->plugin_instance);
+	}
+	hash = ident_hash_update (hash, "/");
+	hash = ident_hash_update (hash, vl->type);
+	if (vl->type_instance[0] != 0)
+	{
+		hash = ident_hash_update (hash, "-");
+		hash = ident_hash_update (hash, vl->type_instance);
+	}
+
+	return (hash);
+} /* uint32_t ident_hash_vl */
+
+uint32_t ident_hash (const char *name)
+{
+	return (ident_hash_update (FNV_OFFSET, name));
+} /* uint32_t ident_hash */
+
+static ident_partition_t *ident_partition (uint32_t hash)
+{
+	return (ident_partitions + (hash & (IDENT_PARTITIONS - 1)));
+} /* ident_partition_t *ident_partition */
+
+static size_t ident_bucket (const ident_partition_t *part, uint32_t hash)
+{
+	return ((hash >> IDENT_PARTITION_BITS) & (part->buckets_num - 1));
+} /* size_t ident_bucket */
+
+static int ident_equal (const identifier_t *ident, const value_list_t *vl)
+{
+	return ((strcmp (ident->type_instance, vl->type_instance) == 0)
+			&& (strcmp (ident->type, vl->type) == 0)
+			&& (strcmp (ident->plugin_instance, vl->plugin_instance) == 0)
+			&& (strcmp (ident->plugin, vl->plugin) == 0)
+			&& (strcmp (ident->host, vl->host) == 0));
+} /* int ident_equal */
+
+/* Doubles the number of buckets of `part'. Must be called with `part->lock'
+ * held. */
+static int ident_partition_grow (ident_partition_t *part)
+{
+	identifier_t **buckets;
+	size_t buckets_num;
+	size_t i;
+
+	buckets_num = (part->buckets_num == 0) ? 64 : (2 * part->buckets_num);
+	buckets = (identifier_t **) calloc (buckets_num, sizeof (*buckets));
+	if (buckets == NULL)
+	{
+		ERROR ("utils_ident: calloc failed.");
+		return (-1);
+	}
+
+	for (i = 0; i < part->buckets_num; i++)
+	{
+		identifier_t *ident;
+		identifier_t *next;
+
+		for (ident = part->buckets[i]; ident != NULL; ident = next)
+		{
+			size_t b;
+
+			next = ident->next;
+			b = (ident->hash >> IDENT_PARTITION_BITS) & (buckets_num - 1);
+			ident->next = buckets[b];
+			buckets[b] = ident;
+		}
+	}
+
+	sfree (part->buckets);
+	part->buckets = buckets;
+	part->buckets_num = buckets_num;
+
+	return (0);
+} /* int ident_partition_grow */
+
+static identifier_t *ident_create (const value_list_t *vl, uint32_t hash)
+{
+	char name[6 * DATA_MAX_NAME_LEN];
+	const char *fields[6];
+	size_t lengths[6];
+	size_t size;
+	identifier_t *ident;
+	char *ptr;
+	int i;
+
+	if (format_name (name, sizeof (name), vl->host, vl->plugin,
+				vl->plugin_instance, vl->type, vl->type_instance) != 0)
+	{
+		ERROR ("utils_ident: format_name failed.");
+		return (NULL);
+	}
+
+	fields[0] = name;
+	fields[1] = vl->host;
+	fields[2] = vl->plugin;
+	fields[3] = vl->plugin_instance;
+	fields[4] = vl->type;
+	fields[5] = vl->type_instance;
+
+	/* The handle and all strings are allocated at once. */
+	size = sizeof (*ident);
+	for (i = 0; i < 6; i++)
+	{
+		lengths[i] = strlen (fields[i]) + 1;
+		size += lengths[i];
+	}
+
+	ident = (identifier_t *) malloc (size);
+	if (ident == NULL)
+	{
+		ERROR ("utils_ident: malloc failed.");
+		return (NULL);
+	}
+	memset (ident, 0, sizeof (*ident));
+	ident->hash = hash;
+
+	ptr = (char *) (ident + 1);
+	for (i = 0; i < 6; i++)
+	{
+		memcpy (ptr, fields[i], lengths[i]);
+		fields[i] = ptr;
+		ptr += lengths[i];
+	}
+
+	ident->name            = fields[0];
+	ident->host            = fields[1];
+	ident->plugin          = fields[2];
+	ident->plugin_instance = fields[3];
+	ident->type            = fields[4];
+	ident->type_instance   = fields[5];
+
+	return (ident);
+} /* identifier_t *ident_create */
+
+const identifier_t *ident_intern (const value_list_t *vl)
+{
+	ident_partition_t *part;
+	identifier_t *ident;
+	uint32_t hash;
+
+	pthread_once (&ident_once, ident_init);
+
+	hash = ident_hash_vl (vl);
+	part = ident_partition (hash);
+
+	pthread_mutex_lock (&part->lock);
+
+	if (part->buckets_num > 0)
+	{
+		for (ident = part->buckets[ident_bucket (part, hash)];
+				ident != NULL; ident = ident->next)
+		{
+			if ((ident->hash == hash) && ident_equal (ident, vl))
+			{
+				ident->refs++;
+				pthread_mutex_unlock (&part->lock);
+				return (ident);
+			}
+		}
+	}
+
+	if ((part->entries_num >= part->buckets_num)
+			&& (ident_partition_grow (part) != 0))
+	{
+		pthread_mutex_unlock (&part->lock);
+		return (NULL);
+	}
+
+	ident = ident_create (vl, hash);
+	if (ident != NULL)
+	{
+		size_t b = ident_bucket (part, hash);
+
+		ident->refs = 1;
+		ident->next = part->buckets[b];
+		part->buckets[b] = ident;
+		part->entries_num++;
+	}
+
+	pthread_mutex_unlock (&part->lock);
+	return (ident);
+} /* const identifier_t *ident_intern */
+
+const identifier_t *ident_get (const value_list_t *vl)
+{
+	if (vl->ident != NULL)
+		return (ident_ref (vl->ident));
+
+	return (ident_intern (vl));
+} /* const identifier_t *ident_get */
+
+const identifier_t *ident_lookup (const char *name)
+{
+	ident_partition_t *part;
+	identifier_t *ident = NULL;
+	uint32_t hash;
+
+	pthread_once (&ident_once, ident_init);
+
+	hash = ident_hash (name);
+	part = ident_partition (hash);
+
+	pthread_mutex_lock (&part->lock);
+
+	if (part->buckets_num > 0)
+	{
+		for (ident = part->buckets[ident_bucket (part, hash)];
+				ident != NULL; ident = ident->next)
+			if ((ident->hash == hash) && (strcmp (ident->name, name) == 0))
+				break;
+	}
+
+	if (ident != NULL)
+		ident->refs++;
+
+	pthread_mutex_unlock (&part->lock);
+	return (ident);
+} /* const identifier_t *ident_lookup */
+
+const identifier_t *ident_ref (const identifier_t *ident)
+{
+	ident_partition_t *part;
+
+	if (ident == NULL)
+		return (NULL);
+
+	part = ident_partition (ident->hash);
+
+	pthread_mutex_lock (&part->lock);
+	((identifier_t *) ident)->refs++;
+	pthread_mutex_unlock (&part->lock);
+
+	return (ident);
+} /* const identifier_t *ident_ref */
+
+void ident_release (const identifier_t *ident)
+{
+	ident_partition_t *part;
+	identifier_t *this = (identifier_t *) ident;
+	identifier_t **prev;
+
+	if (this == NULL)
+		return;
+
+	part = ident_partition (this->hash);
+
+	pthread_mutex_lock (&part->lock);
+
+	assert (this->refs > 0);
+	this->refs--;
+	if (this->refs > 0)
+	{
+		pthread_mutex_unlock (&part->lock);
+		return;
+	}
+
+	/* Lookups take the lock, too, so nobody can find the handle anymore. */
+	for (prev = part->buckets + ident_bucket (part, this->hash);
+			*prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == this)
+		{
+			*prev = this->next;
+			part->entries_num--;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock (&part->lock);
+
+	free (this);
+} /* void ident_release */
@@ -0,0 +1,119 @@
+/**
+ * collectd - src/utils_ident.h
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#ifndef UTILS_IDENT_H
+#define UTILS_IDENT_H 1
+
+#include "plugin.h"
+
+/*
+ * Interned identifiers
+ *
+ * Every distinct combination of host, plugin, plugin instance, type and type
+ * instance is stored exactly once, so handles can be compared by address and
+ * used as keys. `hash' is the hash of `name', the identifier formatted by
+ * `format_name', so an identifier can be found by its name just as well as by
+ * its fields.
+ *
+ * Handles are reference counted. All functions returning a handle return a
+ * new reference, which the caller has to give up with `ident_release'. An
+ * identifier is freed when its last reference is released, so whoever keeps
+ * a handle, e.g. as a key, has to hold a reference for as long. Values which
+ * are no longer dispatched lose their identifiers once the value cache
+ * forgets them.
+ */
+struct identifier_s
+{
+	uint32_t hash;
+	const char *name;
+	const char *host;
+	const char *plugin;
+	const char *plugin_instance;
+	const char *type;
+	const char *type_instance;
+
+	/* Managed by utils_ident.c */
+	int refs;
+	struct identifier_s *next;
+};
+typedef struct identifier_s identifier_t;
+
+/*
+ * NAME
+ *   ident_get
+ *
+ * DESCRIPTION
+ *   Returns a reference to the identifier of `vl'. If `vl->ident' is set, it
+ *   is returned without looking at the other fields. Otherwise the identifier
+ *   is interned, if necessary.
+ *
+ * RETURN VALUE
+ *   The handle or NULL if memory allocation failed.
+ */
+const identifier_t *ident_get (const value_list_t *vl);
+
+/*
+ * NAME
+ *   ident_intern
+ *
+ * DESCRIPTION
+ *   Like `ident_get', but ignores `vl->ident'. This is used by
+ *   `plugin_dispatch_values' to set `vl->ident'.
+ */
+const identifier_t *ident_intern (const value_list_t *vl);
+
+/*
+ * NAME
+ *   ident_lookup
+ *
+ * DESCRIPTION
+ *   Returns a reference to the identifier `name', which is formatted as by
+ *   `format_name', or NULL if no such identifier has been interned.
+ */
+const identifier_t *ident_lookup (const char *name);
+
+/*
+ * NAME
+ *   ident_ref
+ *
+ * DESCRIPTION
+ *   Returns a new reference to `ident', which may be NULL.
+ */
+const identifier_t *ident_ref (const identifier_t *ident);
+
+/*
+ * NAME
+ *   ident_release
+ *
+ * DESCRIPTION
+ *   Gives up a reference to `ident', which may be NULL. The identifier is
+ *   freed when the last reference is released.
+ */
+void ident_release (const identifier_t *ident);
+
+/*
+ * NAME
+ *   ident_hash
+ *
+ * DESCRIPTION
+ *   Returns the hash of the identifier `name', which is the same as the
+ *   `hash' member of its interned handle.
+ */
+uint32_t ident_hash (const char *name);
+
+#endif /* UTILS_IDENT_H */
@@ -54,6 +54,20 @@ static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
 /*
  * Private functions
  */
+
+/* RRD files have a resolution of one second, so intervals are rounded to
+ * whole seconds, but at least one second. */
+static int interval_to_seconds (cdtime_t interval) /* {{{ */
+{
+  int seconds;
+
+  seconds = (int) CDTIME_T_TO_TIME_T (interval + (TIME_T_TO_CDTIME_T (1) / 2));
+  if (seconds < 1)
+    seconds = 1;
+
+  return (seconds);
+} /* }}} int interval_to_seconds */
+
 static void rra_free (int rra_num, char **rra_def) /* {{{ */
 {
   int i;
@@ -103,7 +117,8 @@ static int rra_get (char ***ret, const value_list_t *vl, /* {{{ */
     return (-1);
   }
 
-  ss = (cfg->stepsize > 0) ? cfg->stepsize : vl->interval;
+  ss = (cfg->stepsize > 0) ? cfg->stepsize
+    : interval_to_seconds (vl->interval);
   if (ss <= 0)
   {
     *ret = NULL;
@@ -237,7 +252,8 @@ static int ds_get (char ***ret, /* {{{ */
     status = ssnprintf (buffer, sizeof (buffer),
         "DS:%s:%s:%i:%s:%s",
         d->name, type,
-        (cfg->heartbeat > 0) ? cfg->heartbeat : (2 * vl->interval),
+        (cfg->heartbeat > 0) ? cfg->heartbeat
+        : (2 * interval_to_seconds (vl->interval)),
         min, max);
     if ((status < 1) || ((size_t) status >= sizeof (buffer)))
       break;
@@ -394,10 +410,11 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   memcpy (argv + ds_num, rra_def, rra_num * sizeof (char *));
   argv[ds_num + rra_num] = NULL;
 
-  assert (vl->time > 10);
+  assert (CDTIME_T_TO_TIME_T (vl->time) > 10);
   status = srrd_create (filename,
-      (cfg->stepsize > 0) ? cfg->stepsize : vl->interval,
-      vl->time - 10,
+      (cfg->stepsize > 0) ? cfg->stepsize
+      : interval_to_seconds (vl->interval),
+      CDTIME_T_TO_TIME_T (vl->time) - 10,
       argc, (const char **) argv);
 
   free (argv);
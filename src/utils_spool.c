@@ -0,0 +1,472 @@
+/**
+ * collectd - src/utils_spool.c
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_spool.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+#if HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
+
+/*
+ * Segment layout:
+ *
+ *   +----------------------+----------------------+---------------------+
+ *   ! Magic (8 bytes)      ! Read offset (32 bit) ! Reserved (32 bit)   !
+ *   +----------------------+----------------------+---------------------+
+ *   ! Length (32 bit)      ! Data ...                                   !
+ *   +----------------------+--------------------------------------------+
+ *   : More records ...                                                  :
+ *   +-------------------------------------------------------------------+
+ *
+ * Integers are stored in network byte order. Segments are created with their
+ * full size, so the unused rest reads as zero: A length of zero marks the end
+ * of the records. When appending, the data is written before the length.
+ */
+#define SPOOL_MAGIC "cdspool1"
+#define SPOOL_HEADER_SIZE 16
+#define SPOOL_READ_OFFSET_POS 8
+#define SPOOL_RECORD_HEADER_SIZE 4
+
+struct spool_s
+{
+	char *dir;
+	uint32_t segments_max;
+
+	/* Oldest segment, records are read from here. NULL if empty. */
+	uint32_t read_seq;
+	char    *read_map;
+	size_t   read_offset;
+
+	/* Newest segment, records are appended here. NULL if empty. If both
+	 * are the same segment, `read_map' and `write_map' are the same
+	 * mapping. */
+	uint32_t write_seq;
+	char    *write_map;
+	size_t   write_offset;
+};
+
+static void spool_segment_path (const spool_t *s, uint32_t seq, /* {{{ */
+		char *buffer, size_t buffer_size)
+{
+	ssnprintf (buffer, buffer_size, "%s/%010u.spool", s->dir,
+			(unsigned int) seq);
+} /* }}} void spool_segment_path */
+
+/* Maps the segment `seq' into memory, creating it if `create' is true. */
+static char *spool_segment_open (const spool_t *s, uint32_t seq, /* {{{ */
+		int create)
+{
+	char path[PATH_MAX];
+	char *map;
+	int fd;
+
+	spool_segment_path (s, seq, path, sizeof (path));
+
+	fd = open (path, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		char errbuf[1024];
+		ERROR ("spool: open (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (NULL);
+	}
+
+	if (create && (ftruncate (fd, (off_t) SPOOL_SEGMENT_SIZE) != 0))
+	{
+		char errbuf[1024];
+		ERROR ("spool: ftruncate (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (fd);
+		unlink (path);
+		return (NULL);
+	}
+
+	map = mmap (/* addr = */ NULL, SPOOL_SEGMENT_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, /* offset = */ 0);
+	close (fd);
+	if (map == MAP_FAILED)
+	{
+		char errbuf[1024];
+		ERROR ("spool: mmap (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		if (create)
+			unlink (path);
+		return (NULL);
+	}
+
+	if (create)
+	{
+		uint32_t tmp = htonl ((uint32_t) SPOOL_HEADER_SIZE);
+
+		memcpy (map, SPOOL_MAGIC, strlen (SPOOL_MAGIC));
+		memcpy (map + SPOOL_READ_OFFSET_POS, &tmp, sizeof (tmp));
+	}
+	else if (memcmp (map, SPOOL_MAGIC, strlen (SPOOL_MAGIC)) != 0)
+	{
+		ERROR ("spool: %s is not a spool segment.", path);
+		munmap (map, SPOOL_SEGMENT_SIZE);
+		return (NULL);
+	}
+
+	return (map);
+} /* }}} char *spool_segment_open */
+
+static void spool_segment_remove (const spool_t *s, uint32_t seq) /* {{{ */
+{
+	char path[PATH_MAX];
+
+	spool_segment_path (s, seq, path, sizeof (path));
+	if ((unlink (path) != 0) && (errno != ENOENT))
+	{
+		char errbuf[1024];
+		ERROR ("spool: unlink (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+} /* }}} void spool_segment_remove */
+
+/* Returns the size of the record at `offset' or zero at the end of the
+ * records. */
+static size_t spool_record_size (const char *map, size_t offset) /* {{{ */
+{
+	uint32_t tmp;
+	size_t size;
+
+	if ((offset + SPOOL_RECORD_HEADER_SIZE) > SPOOL_SEGMENT_SIZE)
+		return (0);
+
+	memcpy (&tmp, map + offset, sizeof (tmp));
+	size = (size_t) ntohl (tmp);
+
+	if ((offset + SPOOL_RECORD_HEADER_SIZE + size) > SPOOL_SEGMENT_SIZE)
+	{
+		WARNING ("spool: Found an invalid record length. The rest of "
+				"the segment is ignored.");
+		return (0);
+	}
+
+	return (size);
+} /* }}} size_t spool_record_size */
+
+/* Closes and removes all segments; the next record starts a new one. */
+static void spool_clear (spool_t *s) /* {{{ */
+{
+	uint32_t seq;
+
+	if ((s->read_map != NULL) && (s->read_map != s->write_map))
+		munmap (s->read_map, SPOOL_SEGMENT_SIZE);
+	if (s->write_map != NULL)
+		munmap (s->write_map, SPOOL_SEGMENT_SIZE);
+
+	if (s->write_map != NULL)
+		for (seq = s->read_seq; seq != (s->write_seq + 1); seq++)
+			spool_segment_remove (s, seq);
+
+	s->read_map = NULL;
+	s->write_map = NULL;
+} /* }}} void spool_clear */
+
+/* Moves on to the segment after the current read segment. Returns non-zero
+ * if there is none. */
+static int spool_read_next_segment (spool_t *s) /* {{{ */
+{
+	if (s->read_seq == s->write_seq)
+	{
+		spool_clear (s);
+		return (-1);
+	}
+
+	if ((s->read_map != NULL) && (s->read_map != s->write_map))
+		munmap (s->read_map, SPOOL_SEGMENT_SIZE);
+	spool_segment_remove (s, s->read_seq);
+
+	s->read_seq++;
+	s->read_offset = SPOOL_HEADER_SIZE;
+
+	if (s->read_seq == s->write_seq)
+	{
+		s->read_map = s->write_map;
+	}
+	else
+	{
+		/* If a segment is missing or broken, the next one is tried
+		 * on the next call. */
+		s->read_map = spool_segment_open (s, s->read_seq, /* create = */ 0);
+		if (s->read_map == NULL)
+			s->read_offset = SPOOL_SEGMENT_SIZE;
+	}
+
+	if (s->read_map != NULL)
+	{
+		uint32_t tmp;
+		memcpy (&tmp, s->read_map + SPOOL_READ_OFFSET_POS, sizeof (tmp));
+		s->read_offset = (size_t) ntohl (tmp);
+	}
+
+	return (0);
+} /* }}} int spool_read_next_segment */
+
+/* Finds the existing segments in the spool directory. */
+static int spool_scan (spool_t *s) /* {{{ */
+{
+	DIR *dh;
+	struct dirent *de;
+	uint32_t seq_min = 0;
+	uint32_t seq_max = 0;
+	int num = 0;
+	uint32_t tmp;
+
+	dh = opendir (s->dir);
+	if (dh == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("spool: opendir (%s) failed: %s", s->dir,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	while ((de = readdir (dh)) != NULL)
+	{
+		unsigned int seq;
+		char suffix[8];
+
+		if ((sscanf (de->d_name, "%10u.%7s", &seq, suffix) != 2)
+				|| (strcmp (suffix, "spool") != 0))
+			continue;
+
+		if ((num == 0) || (seq < seq_min))
+			seq_min = (uint32_t) seq;
+		if ((num == 0) || (seq > seq_max))
+			seq_max = (uint32_t) seq;
+		num++;
+	}
+	closedir (dh);
+
+	s->read_seq = seq_min;
+	s->write_seq = seq_max;
+	if (num == 0)
+		return (0);
+
+	s->write_map = spool_segment_open (s, seq_max, /* create = */ 0);
+	if (s->write_map == NULL)
+		return (-1);
+
+	if (seq_min == seq_max)
+	{
+		s->read_map = s->write_map;
+	}
+	else
+	{
+		s->read_map = spool_segment_open (s, seq_min, /* create = */ 0);
+		if (s->read_map == NULL)
+		{
+			munmap (s->write_map, SPOOL_SEGMENT_SIZE);
+			s->write_map = NULL;
+			return (-1);
+		}
+	}
+
+	memcpy (&tmp, s->read_map + SPOOL_READ_OFFSET_POS, sizeof (tmp));
+	s->read_offset = (size_t) ntohl (tmp);
+	if ((s->read_offset < SPOOL_HEADER_SIZE)
+			|| (s->read_offset > SPOOL_SEGMENT_SIZE))
+		s->read_offset = SPOOL_SEGMENT_SIZE;
+
+	/* Find the end of the records in the newest segment. */
+	if (seq_min == seq_max)
+		s->write_offset = s->read_offset;
+	else
+		s->write_offset = SPOOL_HEADER_SIZE;
+	while (42)
+	{
+		size_t size = spool_record_size (s->write_map, s->write_offset);
+		if (size == 0)
+			break;
+		s->write_offset += SPOOL_RECORD_HEADER_SIZE + size;
+	}
+
+	INFO ("spool: Found %i segment%s in %s.", num, (num == 1) ? "" : "s",
+			s->dir);
+	return (0);
+} /* }}} int spool_scan */
+
+spool_t *spool_create (const char *dir, size_t max_size) /* {{{ */
+{
+	spool_t *s;
+	char dir_slash[PATH_MAX];
+
+	/* check_create_dir treats the last component as a file unless the
+	 * path ends with a slash. */
+	ssnprintf (dir_slash, sizeof (dir_slash), "%s/", dir);
+	if (check_create_dir (dir_slash) != 0)
+		return (NULL);
+
+	s = calloc (1, sizeof (*s));
+	if (s == NULL)
+		return (NULL);
+
+	s->dir = strdup (dir);
+	if (s->dir == NULL)
+	{
+		sfree (s);
+		return (NULL);
+	}
+
+	s->segments_max = (uint32_t) (max_size / SPOOL_SEGMENT_SIZE);
+	if (s->segments_max < 2)
+		s->segments_max = 2;
+
+	if (spool_scan (s) != 0)
+	{
+		sfree (s->dir);
+		sfree (s);
+		return (NULL);
+	}
+
+	return (s);
+} /* }}} spool_t *spool_create */
+
+void spool_destroy (spool_t *s) /* {{{ */
+{
+	if (s == NULL)
+		return;
+
+	if ((s->read_map != NULL) && (s->read_map != s->write_map))
+		munmap (s->read_map, SPOOL_SEGMENT_SIZE);
+	if (s->write_map != NULL)
+		munmap (s->write_map, SPOOL_SEGMENT_SIZE);
+
+	sfree (s->dir);
+	sfree (s);
+} /* }}} void spool_destroy */
+
+int spool_append (spool_t *s, const void *data, size_t size) /* {{{ */
+{
+	uint32_t tmp;
+
+	if ((SPOOL_HEADER_SIZE + SPOOL_RECORD_HEADER_SIZE + size)
+			> SPOOL_SEGMENT_SIZE)
+		return (EINVAL);
+
+	if (s->write_map == NULL)
+	{
+		s->write_map = spool_segment_open (s, s->write_seq + 1,
+				/* create = */ 1);
+		if (s->write_map == NULL)
+			return (-1);
+		s->write_seq++;
+		s->write_offset = SPOOL_HEADER_SIZE;
+
+		s->read_map = s->write_map;
+		s->read_seq = s->write_seq;
+		s->read_offset = SPOOL_HEADER_SIZE;
+	}
+	else if ((s->write_offset + SPOOL_RECORD_HEADER_SIZE + size)
+			> SPOOL_SEGMENT_SIZE)
+	{
+		char *map;
+
+		if ((s->write_seq - s->read_seq + 1) >= s->segments_max)
+			return (ENOSPC);
+
+		map = spool_segment_open (s, s->write_seq + 1, /* create = */ 1);
+		if (map == NULL)
+			return (-1);
+
+		if (s->write_map != s->read_map)
+			munmap (s->write_map, SPOOL_SEGMENT_SIZE);
+		s->write_map = map;
+		s->write_seq++;
+		s->write_offset = SPOOL_HEADER_SIZE;
+	}
+
+	/* The length is written last, so a partially written record is not
+	 * mistaken for a complete one. */
+	memcpy (s->write_map + s->write_offset + SPOOL_RECORD_HEADER_SIZE,
+			data, size);
+	tmp = htonl ((uint32_t) size);
+	memcpy (s->write_map + s->write_offset, &tmp, sizeof (tmp));
+	s->write_offset += SPOOL_RECORD_HEADER_SIZE + size;
+
+	return (0);
+} /* }}} int spool_append */
+
+int spool_peek (spool_t *s, const void **data, size_t *size) /* {{{ */
+{
+	while (s->read_map != NULL)
+	{
+		size_t tmp;
+
+		if ((s->read_seq == s->write_seq)
+				&& (s->read_offset >= s->write_offset))
+		{
+			spool_clear (s);
+			break;
+		}
+
+		tmp = spool_record_size (s->read_map, s->read_offset);
+		if (tmp > 0)
+		{
+			*data = s->read_map + s->read_offset
+				+ SPOOL_RECORD_HEADER_SIZE;
+			*size = tmp;
+			return (0);
+		}
+
+		if (spool_read_next_segment (s) != 0)
+			break;
+		while ((s->read_map == NULL) && (s->read_seq != s->write_seq))
+			spool_read_next_segment (s);
+	}
+
+	return (ENOENT);
+} /* }}} int spool_peek */
+
+void spool_shift (spool_t *s) /* {{{ */
+{
+	size_t size;
+	uint32_t tmp;
+
+	if (s->read_map == NULL)
+		return;
+
+	size = spool_record_size (s->read_map, s->read_offset);
+	if (size == 0)
+		return;
+
+	s->read_offset += SPOOL_RECORD_HEADER_SIZE + size;
+	tmp = htonl ((uint32_t) s->read_offset);
+	memcpy (s->read_map + SPOOL_READ_OFFSET_POS, &tmp, sizeof (tmp));
+
+	if ((s->read_seq == s->write_seq)
+			&& (s->read_offset >= s->write_offset))
+		spool_clear (s);
+} /* }}} void spool_shift */
+
+int spool_is_empty (const spool_t *s) /* {{{ */
+{
+	return (s->read_map == NULL);
+} /* }}} int spool_is_empty */
+
+/* vim: set sw=8 ts=8 noet fdm=marker : */
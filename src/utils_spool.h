@@ -0,0 +1,110 @@
+/**
+ * collectd - src/utils_spool.h
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#ifndef UTILS_SPOOL_H
+#define UTILS_SPOOL_H 1
+
+#include <stddef.h>
+
+/*
+ * Disk spool
+ *
+ * A first-in, first-out queue of records kept in a directory, so it survives
+ * restarts of the daemon. Records are appended to segment files of
+ * SPOOL_SEGMENT_SIZE bytes, which are mapped into memory. A segment file is
+ * removed once all of its records have been read. Each segment stores the
+ * position of the next record to read, so records which have been removed
+ * with `spool_shift' are not returned again after a restart.
+ *
+ * The functions are not thread-safe, the caller has to serialize access to
+ * a spool.
+ */
+#define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+
+struct spool_s;
+typedef struct spool_s spool_t;
+
+/*
+ * NAME
+ *   spool_create
+ *
+ * DESCRIPTION
+ *   Opens the spool in `dir', creating the directory if necessary. Records
+ *   left in the directory by a previous run are kept. The spool takes up to
+ *   `max_size' bytes of disk space, but at least two segments.
+ *
+ * RETURN VALUE
+ *   The spool or NULL on error.
+ */
+spool_t *spool_create (const char *dir, size_t max_size);
+
+/*
+ * NAME
+ *   spool_destroy
+ *
+ * DESCRIPTION
+ *   Closes the spool. The records remain on disk.
+ */
+void spool_destroy (spool_t *s);
+
+/*
+ * NAME
+ *   spool_append
+ *
+ * DESCRIPTION
+ *   Appends a record of `size' bytes.
+ *
+ * RETURN VALUE
+ *   Zero on success, ENOSPC if the spool is full, EINVAL if the record is
+ *   larger than a segment or another error number on failure.
+ */
+int spool_append (spool_t *s, const void *data, size_t size);
+
+/*
+ * NAME
+ *   spool_peek
+ *
+ * DESCRIPTION
+ *   Returns the oldest record. `*data' points into the mapped segment and is
+ *   valid until the next call to `spool_shift' or `spool_destroy'.
+ *
+ * RETURN VALUE
+ *   Zero on success or ENOENT if the spool is empty.
+ */
+int spool_peek (spool_t *s, const void **data, size_t *size);
+
+/*
+ * NAME
+ *   spool_shift
+ *
+ * DESCRIPTION
+ *   Removes the oldest record, which must have been returned by `spool_peek'
+ *   before.
+ */
+void spool_shift (spool_t *s);
+
+/*
+ * NAME
+ *   spool_is_empty
+ *
+ * DESCRIPTION
+ *   Returns true if the spool holds no records.
+ */
+int spool_is_empty (const spool_t *s);
+
+#endif /* UTILS_SPOOL_H */
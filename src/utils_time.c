@@ -0,0 +1,36 @@
+/**
+ * collectd - src/utils_time.c
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#include "collectd.h"
+#include "utils_time.h"
+
+cdtime_t cdtime (void)
+{
+	struct timeval tv;
+
+	if (gettimeofday (&tv, /* timezone = */ NULL) != 0)
+		return (TIME_T_TO_CDTIME_T (time (NULL)));
+
+	return (TIMEVAL_TO_CDTIME_T (&tv));
+} /* cdtime_t cdtime */
+
+void cdtime_to_timespec (cdtime_t t, struct timespec *ts)
+{
+	ts->tv_sec = CDTIME_T_TO_TIME_T (t);
+	ts->tv_nsec = (long) ((((uint64_t) (t & 0x3fffffff)) * 1000000000) >> 30);
+} /* void cdtime_to_timespec */
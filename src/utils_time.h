@@ -0,0 +1,80 @@
+/**
+ * collectd - src/utils_time.h
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#ifndef UTILS_TIME_H
+#define UTILS_TIME_H 1
+
+#include "collectd.h"
+
+/*
+ * High resolution time
+ *
+ * Points in time and intervals are stored as 64 bit fixed point numbers with
+ * 30 bits for the fraction of a second, i.e. in units of 2^-30 seconds (a
+ * little less than a nanosecond). The integer part covers more than 500
+ * years. Converting to and from seconds is a shift, and since a second is a
+ * power of two, whole seconds are represented exactly. Conversions round to
+ * the nearest unit.
+ */
+typedef uint64_t cdtime_t;
+
+#define TIME_T_TO_CDTIME_T(t) (((cdtime_t) (t)) << 30)
+#define CDTIME_T_TO_TIME_T(t) ((time_t) ((t) >> 30))
+
+#define CDTIME_T_TO_DOUBLE(t) (((double) (t)) / 1073741824.0)
+#define DOUBLE_TO_CDTIME_T(d) ((cdtime_t) (((d) * 1073741824.0) + 0.5))
+
+#define MS_TO_CDTIME_T(ms) (TIME_T_TO_CDTIME_T (((uint64_t) (ms)) / 1000) \
+    + (((((cdtime_t) (ms)) % 1000) << 30) + 500) / 1000)
+#define CDTIME_T_TO_MS(t)  ((uint64_t) ((((t) >> 30) * 1000) \
+      + (((((t) & 0x3fffffff) * 1000) + 0x20000000) >> 30)))
+
+#define US_TO_CDTIME_T(us) (TIME_T_TO_CDTIME_T (((uint64_t) (us)) / 1000000) \
+    + (((((cdtime_t) (us)) % 1000000) << 30) + 500000) / 1000000)
+#define NS_TO_CDTIME_T(ns) (TIME_T_TO_CDTIME_T (((uint64_t) (ns)) / 1000000000) \
+    + (((((cdtime_t) (ns)) % 1000000000) << 30) + 500000000) / 1000000000)
+#define CDTIME_T_TO_NS(t)  ((uint64_t) ((((t) >> 30) * 1000000000) \
+      + (((((t) & 0x3fffffff) * 1000000000) + 0x20000000) >> 30)))
+
+/* True if `t' is a whole number of seconds. */
+#define CDTIME_T_IS_INTEGRAL(t) (((t) & 0x3fffffff) == 0)
+
+#define TIMEVAL_TO_CDTIME_T(tv) (TIME_T_TO_CDTIME_T ((tv)->tv_sec) \
+    + US_TO_CDTIME_T ((tv)->tv_usec))
+#define TIMESPEC_TO_CDTIME_T(ts) (TIME_T_TO_CDTIME_T ((ts)->tv_sec) \
+    + NS_TO_CDTIME_T ((ts)->tv_nsec))
+
+/*
+ * NAME
+ *   cdtime
+ *
+ * DESCRIPTION
+ *   Returns the current (wall clock) time.
+ */
+cdtime_t cdtime (void);
+
+/*
+ * NAME
+ *   cdtime_to_timespec
+ *
+ * DESCRIPTION
+ *   Converts `t' to a `struct timespec', e.g. for `pthread_cond_timedwait'.
+ */
+void cdtime_to_timespec (cdtime_t t, struct timespec *ts);
+
+#endif /* UTILS_TIME_H */
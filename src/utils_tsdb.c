@@ -0,0 +1,1521 @@
+/**
+ * collectd - src/utils_tsdb.c
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_tsdb.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+/*
+ * Block layout:
+ *
+ *   +---------------------+---------------------+-----------+-----------+
+ *   ! Magic (32 bit)      ! Series ID (32 bit)  ! Count (16)! Bits (16) !
+ *   +---------------------+---------------------+-----------+-----------+
+ *   ! Reserved (32 bit)   ! Time of the first sample (64 bit)           !
+ *   +---------------------+---------------------------------------------+
+ *   ! Time of the last sample (64 bit)          ! Data ...              !
+ *   +-------------------------------------------+-----------------------+
+ *
+ * Segments are created with their full size, so unused blocks read as zero:
+ * The first block without the magic marks the end of a segment. When
+ * appending, the data is written before the count, so a sample is only seen
+ * once it is complete.
+ *
+ * Data is a stream of bits, most significant bit first. The first sample
+ * stores its time with 64 bits, the following ones the difference D of their
+ * time delta to the previous time delta as
+ *
+ *   `0'                 D = 0
+ *   `10'   + 16 bits    -2^15 <= D < 2^15
+ *   `110'  + 26 bits    -2^25 <= D < 2^25 (about 30 ms)
+ *   `1110' + 36 bits    -2^35 <= D < 2^35 (about 30 s)
+ *   `1111' + 64 bits    otherwise
+ *
+ * Then each value is XOR'ed with the previous value of the data source (zero
+ * for the first sample) and stored as
+ *
+ *   `0'                 equal to the previous value
+ *   `10'  + n bits      the meaningful bits, if they fit into the window of
+ *                       leading and trailing zeros of the previous value
+ *   `11'  + 6 bits number of leading zeros + 6 bits length - 1 + the bits
+ */
+#define TSDB_MAGIC 0x63647462 /* "cdtb" */
+#define TSDB_HEADER_SIZE 32
+#define TSDB_DATA_SIZE (TSDB_BLOCK_SIZE - TSDB_HEADER_SIZE)
+#define TSDB_DATA_BITS (8 * TSDB_DATA_SIZE)
+#define TSDB_BLOCKS_PER_SEGMENT (TSDB_SEGMENT_SIZE / TSDB_BLOCK_SIZE)
+
+/* Number of bits a sample may take at most: The time and, for every data
+ * source, the control bits, the leading zeros, the length and the value. */
+#define TSDB_SAMPLE_BITS_MAX(ds_num) (68 + (ds_num) * (2 + 6 + 6 + 64))
+
+/* No window of leading and trailing zeros yet. */
+#define TSDB_NO_WINDOW 0xff
+
+#define TSDB_ADDR(seq, index) ((((uint64_t) (seq)) << 32) | ((uint64_t) (index)))
+#define TSDB_ADDR_SEQ(addr) ((uint32_t) ((addr) >> 32))
+#define TSDB_ADDR_INDEX(addr) ((uint32_t) ((addr) & 0xffffffff))
+
+struct tsdb_block_s
+{
+	uint32_t magic;
+	uint32_t series;
+	uint16_t count;
+	uint16_t bits;
+	uint32_t reserved;
+	uint64_t first_time;
+	uint64_t last_time;
+	uint8_t  data[TSDB_DATA_SIZE];
+};
+typedef struct tsdb_block_s tsdb_block_t;
+
+struct tsdb_segment_s
+{
+	uint32_t seq;
+	char *map;      /* NULL if the segment does not exist */
+	uint32_t used;  /* number of blocks in use */
+
+	/* Range of blocks changed since the last `tsdb_sync'. */
+	uint32_t dirty_min;
+	uint32_t dirty_max;
+	int dirty;
+};
+typedef struct tsdb_segment_s tsdb_segment_t;
+
+/* Encoder state of one data source. */
+struct tsdb_value_state_s
+{
+	uint64_t word;      /* the last word XOR'ed */
+	counter_t counter;  /* the last value of a counter */
+	uint8_t leading;
+	uint8_t trailing;
+};
+typedef struct tsdb_value_state_s tsdb_value_state_t;
+
+struct tsdb_series_s
+{
+	const identifier_t *ident;
+	uint32_t id;
+	int ds_num;
+	int *ds_types;
+
+	/* Addresses of the blocks, oldest first. The first `blocks_first'
+	 * entries are unused. */
+	uint64_t *blocks;
+	size_t blocks_first;
+	size_t blocks_num;
+	size_t blocks_size;
+
+	/* The block samples are appended to. NULL if a new block has to be
+	 * started with the next sample. */
+	tsdb_block_t *block;
+	uint64_t block_addr;
+
+	cdtime_t last_time;
+	cdtime_t last_delta;
+	tsdb_value_state_t *values;
+
+	struct tsdb_series_s *next;
+};
+typedef struct tsdb_series_s tsdb_series_t;
+
+struct tsdb_s
+{
+	char *dir;
+	FILE *index_fh;
+	size_t page_size;
+
+	/* Ring of segments, the segment `seq' is at `seq % segments_max'. The
+	 * segments from `seq_first' to `seq_last' may exist. */
+	tsdb_segment_t *segments;
+	uint32_t segments_max;
+	uint32_t seq_first;
+	uint32_t seq_last;
+
+	/* Series by ID. */
+	tsdb_series_t **series;
+	uint32_t series_size;
+	uint32_t series_next_id;
+
+	/* Series by identifier, chained by `next'. */
+	tsdb_series_t **hash;
+	size_t hash_size;
+	size_t hash_num;
+
+	/* State saved while trying to append a sample. */
+	tsdb_value_state_t *values_saved;
+	int values_saved_num;
+};
+
+/*
+ * Bit streams
+ */
+static int bits_write (uint8_t *data, size_t *pos, /* {{{ */
+		uint64_t value, int n)
+{
+	if ((*pos + n) > TSDB_DATA_BITS)
+		return (-1);
+
+	while (n > 0)
+	{
+		size_t byte = *pos / 8;
+		int avail = 8 - (int) (*pos % 8);
+		int take = (n < avail) ? n : avail;
+		uint8_t chunk;
+
+		chunk = (uint8_t) ((value >> (n - take)) & ((1 << take) - 1));
+		/* Keep the bits before `pos', clear the ones after it. */
+		data[byte] = (uint8_t) ((data[byte] & (0xff << avail))
+				| (chunk << (avail - take)));
+
+		*pos += take;
+		n -= take;
+	}
+
+	return (0);
+} /* }}} int bits_write */
+
+static uint64_t bits_read (const uint8_t *data, size_t *pos, /* {{{ */
+		int n)
+{
+	uint64_t value = 0;
+
+	/* Only happens with a broken block. */
+	if ((*pos + n) > TSDB_DATA_BITS)
+	{
+		*pos = TSDB_DATA_BITS + 1;
+		return (0);
+	}
+
+	while (n > 0)
+	{
+		size_t byte = *pos / 8;
+		int avail = 8 - (int) (*pos % 8);
+		int take = (n < avail) ? n : avail;
+
+		value = (value << take)
+			| ((data[byte] >> (avail - take)) & ((1 << take) - 1));
+
+		*pos += take;
+		n -= take;
+	}
+
+	return (value);
+} /* }}} uint64_t bits_read */
+
+static int count_leading_zeros (uint64_t x) /* {{{ */
+{
+	int n = 0;
+
+	if (x == 0)
+		return (64);
+
+	if ((x & 0xffffffff00000000ULL) == 0) { n += 32; x <<= 32; }
+	if ((x & 0xffff000000000000ULL) == 0) { n += 16; x <<= 16; }
+	if ((x & 0xff00000000000000ULL) == 0) { n +=  8; x <<=  8; }
+	if ((x & 0xf000000000000000ULL) == 0) { n +=  4; x <<=  4; }
+	if ((x & 0xc000000000000000ULL) == 0) { n +=  2; x <<=  2; }
+	if ((x & 0x8000000000000000ULL) == 0) { n +=  1; }
+
+	return (n);
+} /* }}} int count_leading_zeros */
+
+static int count_trailing_zeros (uint64_t x) /* {{{ */
+{
+	int n = 0;
+
+	if (x == 0)
+		return (64);
+
+	if ((x & 0x00000000ffffffffULL) == 0) { n += 32; x >>= 32; }
+	if ((x & 0x000000000000ffffULL) == 0) { n += 16; x >>= 16; }
+	if ((x & 0x00000000000000ffULL) == 0) { n +=  8; x >>=  8; }
+	if ((x & 0x000000000000000fULL) == 0) { n +=  4; x >>=  4; }
+	if ((x & 0x0000000000000003ULL) == 0) { n +=  2; x >>=  2; }
+	if ((x & 0x0000000000000001ULL) == 0) { n +=  1; }
+
+	return (n);
+} /* }}} int count_trailing_zeros */
+
+/*
+ * Encoding and decoding of samples
+ */
+static uint64_t value_to_word (int ds_type, value_t value, /* {{{ */
+		tsdb_value_state_t *state)
+{
+	uint64_t word;
+
+	if (ds_type == DS_TYPE_GAUGE)
+	{
+		memcpy (&word, &value.gauge, sizeof (word));
+	}
+	else
+	{
+		word = (uint64_t) (value.counter - state->counter);
+		state->counter = value.counter;
+	}
+
+	return (word);
+} /* }}} uint64_t value_to_word */
+
+static value_t word_to_value (int ds_type, uint64_t word, /* {{{ */
+		tsdb_value_state_t *state)
+{
+	value_t value;
+
+	if (ds_type == DS_TYPE_GAUGE)
+	{
+		memcpy (&value.gauge, &word, sizeof (value.gauge));
+	}
+	else
+	{
+		value.counter = state->counter + (counter_t) word;
+		state->counter = value.counter;
+	}
+
+	return (value);
+} /* }}} value_t word_to_value */
+
+static int encode_time (uint8_t *data, size_t *pos, /* {{{ */
+		int64_t d)
+{
+	int status;
+
+	if (d == 0)
+		return (bits_write (data, pos, 0, 1));
+	else if ((d >= -(1LL << 15)) && (d < (1LL << 15)))
+	{
+		status = bits_write (data, pos, 2, 2);
+		if (status == 0)
+			status = bits_write (data, pos, (uint64_t) d, 16);
+	}
+	else if ((d >= -(1LL << 25)) && (d < (1LL << 25)))
+	{
+		status = bits_write (data, pos, 6, 3);
+		if (status == 0)
+			status = bits_write (data, pos, (uint64_t) d, 26);
+	}
+	else if ((d >= -(1LL << 35)) && (d < (1LL << 35)))
+	{
+		status = bits_write (data, pos, 14, 4);
+		if (status == 0)
+			status = bits_write (data, pos, (uint64_t) d, 36);
+	}
+	else
+	{
+		status = bits_write (data, pos, 15, 4);
+		if (status == 0)
+			status = bits_write (data, pos, (uint64_t) d, 64);
+	}
+
+	return (status);
+} /* }}} int encode_time */
+
+/* Reads `n' bits and extends the sign. */
+static int64_t decode_signed (const uint8_t *data, size_t *pos, /* {{{ */
+		int n)
+{
+	uint64_t tmp = bits_read (data, pos, n);
+
+	if ((n < 64) && ((tmp >> (n - 1)) != 0))
+		tmp |= ~((1ULL << n) - 1);
+
+	return ((int64_t) tmp);
+} /* }}} int64_t decode_signed */
+
+static int64_t decode_time (const uint8_t *data, size_t *pos) /* {{{ */
+{
+	if (bits_read (data, pos, 1) == 0)
+		return (0);
+	if (bits_read (data, pos, 1) == 0)
+		return (decode_signed (data, pos, 16));
+	if (bits_read (data, pos, 1) == 0)
+		return (decode_signed (data, pos, 26));
+	if (bits_read (data, pos, 1) == 0)
+		return (decode_signed (data, pos, 36));
+	return (decode_signed (data, pos, 64));
+} /* }}} int64_t decode_time */
+
+static int encode_word (uint8_t *data, size_t *pos, /* {{{ */
+		uint64_t word, tsdb_value_state_t *state)
+{
+	uint64_t x = word ^ state->word;
+	int leading;
+	int trailing;
+	int status;
+
+	state->word = word;
+
+	if (x == 0)
+		return (bits_write (data, pos, 0, 1));
+
+	leading = count_leading_zeros (x);
+	trailing = count_trailing_zeros (x);
+
+	if ((state->leading != TSDB_NO_WINDOW)
+			&& (leading >= state->leading)
+			&& (trailing >= state->trailing))
+	{
+		status = bits_write (data, pos, 2, 2);
+		if (status == 0)
+			status = bits_write (data, pos, x >> state->trailing,
+					64 - state->leading - state->trailing);
+		return (status);
+	}
+
+	state->leading = (uint8_t) leading;
+	state->trailing = (uint8_t) trailing;
+
+	status = bits_write (data, pos, 3, 2);
+	if (status == 0)
+		status = bits_write (data, pos, (uint64_t) leading, 6);
+	if (status == 0)
+		status = bits_write (data, pos,
+				(uint64_t) (64 - leading - trailing - 1), 6);
+	if (status == 0)
+		status = bits_write (data, pos, x >> trailing,
+				64 - leading - trailing);
+	return (status);
+} /* }}} int encode_word */
+
+static uint64_t decode_word (const uint8_t *data, size_t *pos, /* {{{ */
+		tsdb_value_state_t *state)
+{
+	uint64_t x;
+
+	if (bits_read (data, pos, 1) == 0)
+		return (state->word);
+
+	if (bits_read (data, pos, 1) == 0)
+	{
+		x = bits_read (data, pos, 64 - state->leading - state->trailing);
+		x <<= state->trailing;
+	}
+	else
+	{
+		int length;
+
+		state->leading = (uint8_t) bits_read (data, pos, 6);
+		length = (int) bits_read (data, pos, 6) + 1;
+		state->trailing = (uint8_t) (64 - state->leading - length);
+
+		x = bits_read (data, pos, length);
+		x <<= state->trailing;
+	}
+
+	state->word ^= x;
+	return (state->word);
+} /* }}} uint64_t decode_word */
+
+static void values_reset (tsdb_value_state_t *values, int values_num) /* {{{ */
+{
+	int i;
+
+	memset (values, 0, sizeof (*values) * values_num);
+	for (i = 0; i < values_num; i++)
+		values[i].leading = TSDB_NO_WINDOW;
+} /* }}} void values_reset */
+
+/*
+ * Segments
+ */
+static void tsdb_segment_path (const tsdb_t *db, uint32_t seq, /* {{{ */
+		char *buffer, size_t buffer_size)
+{
+	ssnprintf (buffer, buffer_size, "%s/%010u.tsdb", db->dir,
+			(unsigned int) seq);
+} /* }}} void tsdb_segment_path */
+
+/* Maps the segment `seq' into memory, creating it if `create' is true. */
+static int tsdb_segment_open (tsdb_t *db, uint32_t seq, int create) /* {{{ */
+{
+	tsdb_segment_t *seg = db->segments + (seq % db->segments_max);
+	char path[PATH_MAX];
+	char *map;
+	int fd;
+
+	tsdb_segment_path (db, seq, path, sizeof (path));
+
+	fd = open (path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR,
+			S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: open (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	if (create && (ftruncate (fd, (off_t) TSDB_SEGMENT_SIZE) != 0))
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: ftruncate (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (fd);
+		unlink (path);
+		return (-1);
+	}
+
+	map = mmap (/* addr = */ NULL, TSDB_SEGMENT_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, /* offset = */ 0);
+	close (fd);
+	if (map == MAP_FAILED)
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: mmap (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		if (create)
+			unlink (path);
+		return (-1);
+	}
+
+	memset (seg, 0, sizeof (*seg));
+	seg->seq = seq;
+	seg->map = map;
+
+	/* Find the end of the blocks. */
+	if (!create)
+	{
+		while (seg->used < TSDB_BLOCKS_PER_SEGMENT)
+		{
+			tsdb_block_t *b = (tsdb_block_t *) (map
+					+ ((size_t) seg->used) * TSDB_BLOCK_SIZE);
+			if (b->magic != TSDB_MAGIC)
+				break;
+			seg->used++;
+		}
+	}
+
+	return (0);
+} /* }}} int tsdb_segment_open */
+
+static tsdb_segment_t *tsdb_segment_get (tsdb_t *db, uint32_t seq) /* {{{ */
+{
+	tsdb_segment_t *seg = db->segments + (seq % db->segments_max);
+
+	if ((seg->map == NULL) || (seg->seq != seq))
+		return (NULL);
+	return (seg);
+} /* }}} tsdb_segment_t *tsdb_segment_get */
+
+static tsdb_block_t *tsdb_block_get (tsdb_t *db, uint64_t addr) /* {{{ */
+{
+	tsdb_segment_t *seg = tsdb_segment_get (db, TSDB_ADDR_SEQ (addr));
+
+	if (seg == NULL)
+		return (NULL);
+	return ((tsdb_block_t *) (seg->map
+				+ ((size_t) TSDB_ADDR_INDEX (addr)) * TSDB_BLOCK_SIZE));
+} /* }}} tsdb_block_t *tsdb_block_get */
+
+static void tsdb_series_push_block (tsdb_series_t *s, uint64_t addr);
+
+/* Unmaps the segment `seq' and removes its file. The blocks in it are removed
+ * from their series. */
+static void tsdb_segment_remove (tsdb_t *db, uint32_t seq) /* {{{ */
+{
+	tsdb_segment_t *seg = tsdb_segment_get (db, seq);
+	char path[PATH_MAX];
+	uint32_t i;
+
+	if (seg != NULL)
+	{
+		for (i = 0; i < seg->used; i++)
+		{
+			tsdb_block_t *b = (tsdb_block_t *) (seg->map
+					+ ((size_t) i) * TSDB_BLOCK_SIZE);
+			uint64_t addr = TSDB_ADDR (seq, i);
+			tsdb_series_t *s;
+
+			if (b->series >= db->series_size)
+				continue;
+			s = db->series[b->series];
+			if (s == NULL)
+				continue;
+
+			if ((s->blocks_num > 0)
+					&& (s->blocks[s->blocks_first] == addr))
+			{
+				s->blocks_first++;
+				s->blocks_num--;
+			}
+			if ((s->block != NULL) && (s->block_addr == addr))
+				s->block = NULL;
+		}
+
+		munmap (seg->map, TSDB_SEGMENT_SIZE);
+		seg->map = NULL;
+	}
+
+	tsdb_segment_path (db, seq, path, sizeof (path));
+	if ((unlink (path) != 0) && (errno != ENOENT))
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: unlink (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+} /* }}} void tsdb_segment_remove */
+
+/* Returns the address of a new block for the series `s', starting a new
+ * segment if necessary. */
+static tsdb_block_t *tsdb_block_new (tsdb_t *db, tsdb_series_t *s) /* {{{ */
+{
+	tsdb_segment_t *seg;
+	tsdb_block_t *b;
+	uint32_t index;
+
+	seg = tsdb_segment_get (db, db->seq_last);
+	if ((seg == NULL) || (seg->used >= TSDB_BLOCKS_PER_SEGMENT))
+	{
+		uint32_t seq = db->seq_last + 1;
+
+		while ((seq - db->seq_first) >= db->segments_max)
+		{
+			tsdb_segment_remove (db, db->seq_first);
+			db->seq_first++;
+		}
+
+		if (tsdb_segment_open (db, seq, /* create = */ 1) != 0)
+			return (NULL);
+		db->seq_last = seq;
+		seg = tsdb_segment_get (db, seq);
+	}
+
+	index = seg->used;
+	seg->used++;
+
+	b = (tsdb_block_t *) (seg->map + ((size_t) index) * TSDB_BLOCK_SIZE);
+	b->magic = TSDB_MAGIC;
+	b->series = s->id;
+
+	if (!seg->dirty || (index < seg->dirty_min))
+		seg->dirty_min = index;
+	if (!seg->dirty || (index > seg->dirty_max))
+		seg->dirty_max = index;
+	seg->dirty = 1;
+
+	s->block = b;
+	s->block_addr = TSDB_ADDR (seg->seq, index);
+	tsdb_series_push_block (s, s->block_addr);
+
+	return (b);
+} /* }}} tsdb_block_t *tsdb_block_new */
+
+/* Marks the block at `addr' as changed. */
+static void tsdb_block_touch (tsdb_t *db, uint64_t addr) /* {{{ */
+{
+	tsdb_segment_t *seg = tsdb_segment_get (db, TSDB_ADDR_SEQ (addr));
+	uint32_t index = TSDB_ADDR_INDEX (addr);
+
+	if (seg == NULL)
+		return;
+
+	if (!seg->dirty || (index < seg->dirty_min))
+		seg->dirty_min = index;
+	if (!seg->dirty || (index > seg->dirty_max))
+		seg->dirty_max = index;
+	seg->dirty = 1;
+} /* }}} void tsdb_block_touch */
+
+/*
+ * Series
+ */
+static void tsdb_series_push_block (tsdb_series_t *s, uint64_t addr) /* {{{ */
+{
+	if ((s->blocks_first + s->blocks_num) >= s->blocks_size)
+	{
+		if (s->blocks_first > 0)
+		{
+			memmove (s->blocks, s->blocks + s->blocks_first,
+					sizeof (*s->blocks) * s->blocks_num);
+			s->blocks_first = 0;
+		}
+		else
+		{
+			size_t size = (s->blocks_size == 0) ? 8 : (2 * s->blocks_size);
+			uint64_t *tmp;
+
+			tmp = realloc (s->blocks, sizeof (*s->blocks) * size);
+			if ((tmp == NULL) && (s->blocks_num == 0))
+			{
+				ERROR ("tsdb: realloc failed, dropping a block "
+						"of %s.", s->ident->name);
+				return;
+			}
+			else if (tmp == NULL)
+			{
+				/* Lose the oldest block rather than the new one. */
+				s->blocks_first++;
+				s->blocks_num--;
+				tsdb_series_push_block (s, addr);
+				return;
+			}
+			s->blocks = tmp;
+			s->blocks_size = size;
+		}
+	}
+
+	s->blocks[s->blocks_first + s->blocks_num] = addr;
+	s->blocks_num++;
+} /* }}} void tsdb_series_push_block */
+
+static void tsdb_series_free (tsdb_series_t *s) /* {{{ */
+{
+	if (s == NULL)
+		return;
+
+	ident_release (s->ident);
+	sfree (s->ds_types);
+	sfree (s->blocks);
+	sfree (s->values);
+	sfree (s);
+} /* }}} void tsdb_series_free */
+
+static tsdb_series_t *tsdb_series_lookup (const tsdb_t *db, /* {{{ */
+		const identifier_t *ident)
+{
+	tsdb_series_t *s;
+
+	if (db->hash_size == 0)
+		return (NULL);
+
+	for (s = db->hash[ident->hash & (db->hash_size - 1)];
+			s != NULL; s = s->next)
+		if (s->ident == ident)
+			return (s);
+
+	return (NULL);
+} /* }}} tsdb_series_t *tsdb_series_lookup */
+
+static void tsdb_series_unlink (tsdb_t *db, tsdb_series_t *s) /* {{{ */
+{
+	tsdb_series_t **prev;
+
+	for (prev = db->hash + (s->ident->hash & (db->hash_size - 1));
+			*prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == s)
+		{
+			*prev = s->next;
+			db->hash_num--;
+			break;
+		}
+	}
+
+	if (db->series[s->id] == s)
+		db->series[s->id] = NULL;
+} /* }}} void tsdb_series_unlink */
+
+static int tsdb_series_link (tsdb_t *db, tsdb_series_t *s) /* {{{ */
+{
+	size_t bucket;
+
+	if (s->id >= db->series_size)
+	{
+		uint32_t size = (db->series_size == 0) ? 1024 : db->series_size;
+		tsdb_series_t **tmp;
+
+		while (s->id >= size)
+			size *= 2;
+
+		tmp = realloc (db->series, sizeof (*db->series) * size);
+		if (tmp == NULL)
+			return (ENOMEM);
+		memset (tmp + db->series_size, 0,
+				sizeof (*tmp) * (size - db->series_size));
+		db->series = tmp;
+		db->series_size = size;
+	}
+
+	if (db->hash_num >= db->hash_size)
+	{
+		size_t size = (db->hash_size == 0) ? 1024 : (2 * db->hash_size);
+		tsdb_series_t **tmp;
+		size_t i;
+
+		tmp = calloc (size, sizeof (*tmp));
+		if (tmp == NULL)
+			return (ENOMEM);
+
+		for (i = 0; i < db->hash_size; i++)
+		{
+			while (db->hash[i] != NULL)
+			{
+				tsdb_series_t *this = db->hash[i];
+
+				db->hash[i] = this->next;
+				bucket = this->ident->hash & (size - 1);
+				this->next = tmp[bucket];
+				tmp[bucket] = this;
+			}
+		}
+
+		sfree (db->hash);
+		db->hash = tmp;
+		db->hash_size = size;
+	}
+
+	bucket = s->ident->hash & (db->hash_size - 1);
+	s->next = db->hash[bucket];
+	db->hash[bucket] = s;
+	db->hash_num++;
+
+	db->series[s->id] = s;
+	if (s->id >= db->series_next_id)
+		db->series_next_id = s->id + 1;
+
+	return (0);
+} /* }}} int tsdb_series_link */
+
+static tsdb_series_t *tsdb_series_create (tsdb_t *db, /* {{{ */
+		const identifier_t *ident, uint32_t id,
+		const int *ds_types, int ds_num)
+{
+	tsdb_series_t *s;
+
+	s = calloc (1, sizeof (*s));
+	if (s == NULL)
+		return (NULL);
+
+	s->ident = ident_ref (ident);
+	s->id = id;
+	s->ds_num = ds_num;
+	s->ds_types = malloc (sizeof (*s->ds_types) * ds_num);
+	s->values = malloc (sizeof (*s->values) * ds_num);
+	if ((s->ds_types == NULL) || (s->values == NULL))
+	{
+		tsdb_series_free (s);
+		return (NULL);
+	}
+	memcpy (s->ds_types, ds_types, sizeof (*s->ds_types) * ds_num);
+
+	if (tsdb_series_link (db, s) != 0)
+	{
+		tsdb_series_free (s);
+		return (NULL);
+	}
+
+	return (s);
+} /* }}} tsdb_series_t *tsdb_series_create */
+
+static int tsdb_series_matches (const tsdb_series_t *s, /* {{{ */
+		const data_set_t *ds)
+{
+	int i;
+
+	if (s->ds_num != ds->ds_num)
+		return (0);
+	for (i = 0; i < ds->ds_num; i++)
+		if (s->ds_types[i] != ds->ds[i].type)
+			return (0);
+	return (1);
+} /* }}} int tsdb_series_matches */
+
+/*
+ * Index
+ */
+static int tsdb_index_print (FILE *fh, const tsdb_series_t *s) /* {{{ */
+{
+	char types[DATA_MAX_NAME_LEN];
+	int i;
+
+	for (i = 0; (i < s->ds_num) && (i < ((int) sizeof (types)) - 1); i++)
+		types[i] = (s->ds_types[i] == DS_TYPE_GAUGE) ? 'g' : 'c';
+	types[i] = 0;
+
+	if (fprintf (fh, "%u %s %s\n", (unsigned int) s->id, types,
+				s->ident->name) < 0)
+		return (-1);
+	return (0);
+} /* }}} int tsdb_index_print */
+
+/* Creates a series from a line of the index, e.g.
+ * "42 cc myhost/interface/if_octets-eth0". */
+static int tsdb_index_parse (tsdb_t *db, char *line) /* {{{ */
+{
+	value_list_t vl = VALUE_LIST_INIT;
+	const identifier_t *ident;
+	char *fields[3];
+	char *name_copy;
+	char *host, *plugin, *plugin_instance, *type, *type_instance;
+	int ds_types[DATA_MAX_NAME_LEN];
+	int ds_num;
+	tsdb_series_t *s;
+	unsigned int id;
+	char *endptr;
+	int i;
+
+	fields[0] = line;
+	fields[1] = strchr (line, ' ');
+	if (fields[1] == NULL)
+		return (-1);
+	*fields[1]++ = 0;
+	fields[2] = strchr (fields[1], ' ');
+	if (fields[2] == NULL)
+		return (-1);
+	*fields[2]++ = 0;
+
+	errno = 0;
+	endptr = NULL;
+	id = (unsigned int) strtoul (fields[0], &endptr, 10);
+	if ((errno != 0) || (endptr == fields[0]) || (*endptr != 0))
+		return (-1);
+
+	/* Blocks of replaced series may still exist, so IDs are not reused. */
+	if (id >= db->series_next_id)
+		db->series_next_id = (uint32_t) id + 1;
+
+	ds_num = (int) strlen (fields[1]);
+	if ((ds_num < 1) || (ds_num >= DATA_MAX_NAME_LEN))
+		return (-1);
+	for (i = 0; i < ds_num; i++)
+		ds_types[i] = (fields[1][i] == 'g') ? DS_TYPE_GAUGE : DS_TYPE_COUNTER;
+
+	name_copy = sstrdup (fields[2]);
+	if (parse_identifier (name_copy, &host, &plugin, &plugin_instance,
+				&type, &type_instance) != 0)
+	{
+		sfree (name_copy);
+		return (-1);
+	}
+
+	sstrncpy (vl.host, host, sizeof (vl.host));
+	sstrncpy (vl.plugin, plugin, sizeof (vl.plugin));
+	if (plugin_instance != NULL)
+		sstrncpy (vl.plugin_instance, plugin_instance,
+				sizeof (vl.plugin_instance));
+	sstrncpy (vl.type, type, sizeof (vl.type));
+	if (type_instance != NULL)
+		sstrncpy (vl.type_instance, type_instance,
+				sizeof (vl.type_instance));
+	sfree (name_copy);
+
+	ident = ident_intern (&vl);
+	if (ident == NULL)
+		return (-1);
+
+	/* A later line for the same identifier replaces the series. */
+	s = tsdb_series_lookup (db, ident);
+	if (s != NULL)
+	{
+		tsdb_series_unlink (db, s);
+		tsdb_series_free (s);
+	}
+	if ((id < db->series_size) && (db->series[id] != NULL))
+	{
+		s = db->series[id];
+		tsdb_series_unlink (db, s);
+		tsdb_series_free (s);
+	}
+
+	s = tsdb_series_create (db, ident, (uint32_t) id, ds_types, ds_num);
+	ident_release (ident);
+	if (s == NULL)
+		return (-1);
+
+	return (0);
+} /* }}} int tsdb_index_parse */
+
+static int tsdb_index_read (tsdb_t *db) /* {{{ */
+{
+	char path[PATH_MAX];
+	char line[1024];
+	FILE *fh;
+
+	ssnprintf (path, sizeof (path), "%s/index", db->dir);
+	fh = fopen (path, "r");
+	if (fh == NULL)
+	{
+		char errbuf[1024];
+
+		if (errno == ENOENT)
+			return (0);
+		ERROR ("tsdb: fopen (%s) failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	while (fgets (line, sizeof (line), fh) != NULL)
+	{
+		size_t len = strlen (line);
+
+		while ((len > 0) && ((line[len - 1] == '\n')
+					|| (line[len - 1] == '\r')))
+			line[--len] = 0;
+		if (len == 0)
+			continue;
+
+		if (tsdb_index_parse (db, line) != 0)
+			WARNING ("tsdb: Ignoring invalid line in %s: %s", path, line);
+	}
+
+	fclose (fh);
+	return (0);
+} /* }}} int tsdb_index_read */
+
+/* Writes the series which still have blocks to a new index and opens it for
+ * appending. Series without blocks are forgotten. */
+static int tsdb_index_rewrite (tsdb_t *db) /* {{{ */
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	FILE *fh;
+	uint32_t i;
+
+	ssnprintf (path, sizeof (path), "%s/index", db->dir);
+	ssnprintf (tmp_path, sizeof (tmp_path), "%s/index.tmp", db->dir);
+
+	fh = fopen (tmp_path, "w");
+	if (fh == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: fopen (%s) failed: %s", tmp_path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	for (i = 0; i < db->series_size; i++)
+	{
+		tsdb_series_t *s = db->series[i];
+
+		if (s == NULL)
+			continue;
+
+		if (s->blocks_num == 0)
+		{
+			tsdb_series_unlink (db, s);
+			tsdb_series_free (s);
+			continue;
+		}
+
+		if (tsdb_index_print (fh, s) != 0)
+			break;
+	}
+
+	if ((i < db->series_size) || (fflush (fh) != 0)
+			|| (rename (tmp_path, path) != 0))
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: Writing %s failed: %s", path,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		fclose (fh);
+		unlink (tmp_path);
+		return (-1);
+	}
+
+	db->index_fh = fh;
+	return (0);
+} /* }}} int tsdb_index_rewrite */
+
+/* Finds the existing segments, removes the ones exceeding `segments_max' and
+ * assigns the blocks to their series. */
+static int tsdb_scan (tsdb_t *db) /* {{{ */
+{
+	DIR *dh;
+	struct dirent *de;
+	uint32_t *seqs = NULL;
+	size_t seqs_num = 0;
+	size_t seqs_size = 0;
+	uint32_t seq_min = 0;
+	uint32_t seq_max = 0;
+	size_t blocks_num = 0;
+	size_t i;
+
+	dh = opendir (db->dir);
+	if (dh == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("tsdb: opendir (%s) failed: %s", db->dir,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	while ((de = readdir (dh)) != NULL)
+	{
+		unsigned int seq;
+		char suffix[8];
+
+		if ((sscanf (de->d_name, "%10u.%7s", &seq, suffix) != 2)
+				|| (strcmp (suffix, "tsdb") != 0))
+			continue;
+
+		if (seqs_num >= seqs_size)
+		{
+			uint32_t *tmp;
+
+			seqs_size = (seqs_size == 0) ? 16 : (2 * seqs_size);
+			tmp = realloc (seqs, sizeof (*seqs) * seqs_size);
+			if (tmp == NULL)
+			{
+				closedir (dh);
+				sfree (seqs);
+				return (-1);
+			}
+			seqs = tmp;
+		}
+
+		if ((seqs_num == 0) || (seq < seq_min))
+			seq_min = (uint32_t) seq;
+		if ((seqs_num == 0) || (seq > seq_max))
+			seq_max = (uint32_t) seq;
+		seqs[seqs_num++] = (uint32_t) seq;
+	}
+	closedir (dh);
+
+	if (seqs_num == 0)
+	{
+		sfree (seqs);
+		return (0);
+	}
+
+	db->seq_last = seq_max;
+	if ((seq_max - seq_min) >= db->segments_max)
+		db->seq_first = seq_max - db->segments_max + 1;
+	else
+		db->seq_first = seq_min;
+
+	for (i = 0; i < seqs_num; i++)
+		if (seqs[i] < db->seq_first)
+			tsdb_segment_remove (db, seqs[i]);
+	sfree (seqs);
+
+	/* Blocks have to be added to their series oldest first. */
+	for (i = 0; i <= (size_t) (db->seq_last - db->seq_first); i++)
+	{
+		uint32_t seq = db->seq_first + (uint32_t) i;
+		char path[PATH_MAX];
+		tsdb_segment_t *seg;
+		uint32_t j;
+
+		tsdb_segment_path (db, seq, path, sizeof (path));
+		if (access (path, F_OK) != 0)
+			continue;
+
+		if (tsdb_segment_open (db, seq, /* create = */ 0) != 0)
+			continue;
+		seg = tsdb_segment_get (db, seq);
+
+		for (j = 0; j < seg->used; j++)
+		{
+			tsdb_block_t *b = (tsdb_block_t *) (seg->map
+					+ ((size_t) j) * TSDB_BLOCK_SIZE);
+			tsdb_series_t *s;
+
+			if (b->series >= db->series_next_id)
+				db->series_next_id = b->series + 1;
+
+			if ((b->count == 0) || (b->bits > TSDB_DATA_BITS)
+					|| (b->series >= db->series_size))
+				continue;
+			s = db->series[b->series];
+			if (s == NULL)
+				continue;
+
+			tsdb_series_push_block (s, TSDB_ADDR (seq, j));
+			s->last_time = (cdtime_t) b->last_time;
+			blocks_num++;
+		}
+	}
+
+	INFO ("tsdb: Found %u segment%s with %lu block%s in %s.",
+			(unsigned int) (db->seq_last - db->seq_first + 1),
+			(db->seq_last == db->seq_first) ? "" : "s",
+			(unsigned long) blocks_num, (blocks_num == 1) ? "" : "s",
+			db->dir);
+	return (0);
+} /* }}} int tsdb_scan */
+
+/*
+ * Public functions
+ */
+tsdb_t *tsdb_open (const char *dir, int max_segments) /* {{{ */
+{
+	tsdb_t *db;
+	char dir_slash[PATH_MAX];
+	long page_size;
+
+	/* check_create_dir treats the last component as a file unless the
+	 * path ends with a slash. */
+	ssnprintf (dir_slash, sizeof (dir_slash), "%s/", dir);
+	if (check_create_dir (dir_slash) != 0)
+		return (NULL);
+
+	db = calloc (1, sizeof (*db));
+	if (db == NULL)
+		return (NULL);
+
+	page_size = sysconf (_SC_PAGESIZE);
+	db->page_size = (page_size > 0) ? ((size_t) page_size) : 4096;
+
+	db->segments_max = (max_segments < 1) ? 1 : ((uint32_t) max_segments);
+	db->seq_first = 1;
+	db->seq_last = 0;
+
+	db->dir = strdup (dir);
+	db->segments = calloc (db->segments_max, sizeof (*db->segments));
+	if ((db->dir == NULL) || (db->segments == NULL)
+			|| (tsdb_index_read (db) != 0)
+			|| (tsdb_scan (db) != 0)
+			|| (tsdb_index_rewrite (db) != 0))
+	{
+		tsdb_close (db);
+		return (NULL);
+	}
+
+	return (db);
+} /* }}} tsdb_t *tsdb_open */
+
+void tsdb_close (tsdb_t *db) /* {{{ */
+{
+	uint32_t i;
+
+	if (db == NULL)
+		return;
+
+	tsdb_sync (db);
+
+	if (db->segments != NULL)
+	{
+		for (i = 0; i < db->segments_max; i++)
+			if (db->segments[i].map != NULL)
+				munmap (db->segments[i].map, TSDB_SEGMENT_SIZE);
+	}
+
+	for (i = 0; i < db->series_size; i++)
+		tsdb_series_free (db->series[i]);
+
+	if (db->index_fh != NULL)
+		fclose (db->index_fh);
+
+	sfree (db->series);
+	sfree (db->hash);
+	sfree (db->segments);
+	sfree (db->values_saved);
+	sfree (db->dir);
+	sfree (db);
+} /* }}} void tsdb_close */
+
+/* Encodes the sample into the open block of `s'. Returns non-zero, leaving
+ * the block unchanged, if it does not fit. */
+static int tsdb_encode (tsdb_t *db, tsdb_series_t *s, /* {{{ */
+		cdtime_t time, const value_t *values)
+{
+	tsdb_block_t *b = s->block;
+	size_t pos = b->bits;
+	cdtime_t delta = 0;
+	int status;
+	int i;
+
+	if (db->values_saved_num < s->ds_num)
+	{
+		tsdb_value_state_t *tmp;
+
+		tmp = realloc (db->values_saved, sizeof (*tmp) * s->ds_num);
+		if (tmp == NULL)
+			return (ENOMEM);
+		db->values_saved = tmp;
+		db->values_saved_num = s->ds_num;
+	}
+	memcpy (db->values_saved, s->values, sizeof (*s->values) * s->ds_num);
+
+	if (b->count == 0)
+	{
+		values_reset (s->values, s->ds_num);
+		status = bits_write (b->data, &pos, (uint64_t) time, 64);
+	}
+	else
+	{
+		delta = time - s->last_time;
+		status = encode_time (b->data, &pos,
+				(int64_t) (delta - s->last_delta));
+	}
+
+	for (i = 0; (status == 0) && (i < s->ds_num); i++)
+	{
+		uint64_t word = value_to_word (s->ds_types[i], values[i],
+				s->values + i);
+		status = encode_word (b->data, &pos, word, s->values + i);
+	}
+
+	if (status != 0)
+	{
+		memcpy (s->values, db->values_saved,
+				sizeof (*s->values) * s->ds_num);
+		return (status);
+	}
+
+	/* Update the header after the data. */
+	if (b->count == 0)
+		b->first_time = (uint64_t) time;
+	b->last_time = (uint64_t) time;
+	b->bits = (uint16_t) pos;
+	b->count++;
+
+	s->last_time = time;
+	s->last_delta = delta;
+
+	tsdb_block_touch (db, s->block_addr);
+	return (0);
+} /* }}} int tsdb_encode */
+
+int tsdb_append (tsdb_t *db, const identifier_t *ident, /* {{{ */
+		const data_set_t *ds, const value_list_t *vl)
+{
+	tsdb_series_t *s;
+	int status;
+	int i;
+
+	if ((db == NULL) || (ident == NULL) || (ds->ds_num != vl->values_len))
+		return (-1);
+
+	s = tsdb_series_lookup (db, ident);
+	if ((s != NULL) && !tsdb_series_matches (s, ds))
+	{
+		NOTICE ("tsdb: The data sources of %s have changed. "
+				"Starting a new series.", ident->name);
+		tsdb_series_unlink (db, s);
+		tsdb_series_free (s);
+		s = NULL;
+	}
+
+	if (s == NULL)
+	{
+		int ds_types[DATA_MAX_NAME_LEN];
+
+		if ((ds->ds_num >= DATA_MAX_NAME_LEN)
+				|| (TSDB_SAMPLE_BITS_MAX (ds->ds_num) > TSDB_DATA_BITS))
+		{
+			ERROR ("tsdb: Type `%s' has too many data sources.",
+					ds->type);
+			return (-1);
+		}
+
+		for (i = 0; i < ds->ds_num; i++)
+			ds_types[i] = ds->ds[i].type;
+
+		s = tsdb_series_create (db, ident, db->series_next_id,
+				ds_types, ds->ds_num);
+		if (s == NULL)
+			return (ENOMEM);
+
+		if ((db->index_fh != NULL)
+				&& ((tsdb_index_print (db->index_fh, s) != 0)
+					|| (fflush (db->index_fh) != 0)))
+		{
+			char errbuf[1024];
+			ERROR ("tsdb: Writing the index failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+		}
+	}
+
+	if ((s->blocks_num > 0) && (vl->time <= s->last_time))
+		return (EINVAL);
+
+	if ((s->block == NULL)
+			|| (tsdb_encode (db, s, vl->time, vl->values) != 0))
+	{
+		if (tsdb_block_new (db, s) == NULL)
+			return (-1);
+		status = tsdb_encode (db, s, vl->time, vl->values);
+		if (status != 0)
+			return (status);
+	}
+
+	return (0);
+} /* }}} int tsdb_append */
+
+/* Decodes all samples of `b', calling `add' with the ones in the range. */
+static int tsdb_decode (const tsdb_series_t *s, /* {{{ */
+		const tsdb_block_t *b, cdtime_t begin, cdtime_t end,
+		tsdb_value_state_t *state,
+		cdtime_t **times, value_t **values, size_t *num, size_t *size)
+{
+	size_t pos = 0;
+	cdtime_t time = 0;
+	cdtime_t delta = 0;
+	uint16_t n;
+	int i;
+
+	values_reset (state, s->ds_num);
+
+	for (n = 0; n < b->count; n++)
+	{
+		value_t *v;
+
+		if (n == 0)
+		{
+			time = (cdtime_t) bits_read (b->data, &pos, 64);
+		}
+		else
+		{
+			delta += (cdtime_t) decode_time (b->data, &pos);
+			time += delta;
+		}
+
+		if (time > end)
+			break;
+
+		if (*num >= *size)
+		{
+			size_t new_size = (*size == 0) ? 64 : (2 * *size);
+			cdtime_t *tmp_times;
+			value_t *tmp_values;
+
+			tmp_times = realloc (*times, sizeof (**times) * new_size);
+			if (tmp_times == NULL)
+				return (ENOMEM);
+			*times = tmp_times;
+
+			tmp_values = realloc (*values,
+					sizeof (**values) * new_size * s->ds_num);
+			if (tmp_values == NULL)
+				return (ENOMEM);
+			*values = tmp_values;
+
+			*size = new_size;
+		}
+
+		v = *values + (*num * s->ds_num);
+		for (i = 0; i < s->ds_num; i++)
+		{
+			uint64_t word = decode_word (b->data, &pos, state + i);
+			v[i] = word_to_value (s->ds_types[i], word, state + i);
+		}
+
+		if (pos > b->bits)
+			break;
+
+		if (time >= begin)
+		{
+			(*times)[*num] = time;
+			(*num)++;
+		}
+	}
+
+	return (0);
+} /* }}} int tsdb_decode */
+
+int tsdb_query (tsdb_t *db, const identifier_t *ident, /* {{{ */
+		const data_set_t *ds, cdtime_t begin, cdtime_t end,
+		cdtime_t **ret_times, value_t **ret_values, size_t *ret_num)
+{
+	tsdb_series_t *s;
+	tsdb_value_state_t *state;
+	cdtime_t *times = NULL;
+	value_t *values = NULL;
+	size_t num = 0;
+	size_t size = 0;
+	size_t lo, hi;
+	int status = 0;
+
+	if ((db == NULL) || (ident == NULL))
+		return (EINVAL);
+
+	s = tsdb_series_lookup (db, ident);
+	if (s == NULL)
+		return (ENOENT);
+	if (!tsdb_series_matches (s, ds))
+		return (EINVAL);
+
+	state = malloc (sizeof (*state) * s->ds_num);
+	if (state == NULL)
+		return (ENOMEM);
+
+	/* Find the first block which ends at or after `begin'. */
+	lo = 0;
+	hi = s->blocks_num;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		tsdb_block_t *b = tsdb_block_get (db,
+				s->blocks[s->blocks_first + mid]);
+
+		if ((b != NULL) && (b->last_time < begin))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; (status == 0) && (lo < s->blocks_num); lo++)
+	{
+		tsdb_block_t *b = tsdb_block_get (db,
+				s->blocks[s->blocks_first + lo]);
+
+		if ((b == NULL) || (b->count == 0))
+			continue;
+		if (b->first_time > end)
+			break;
+
+		status = tsdb_decode (s, b, begin, end, state,
+				&times, &values, &num, &size);
+	}
+
+	sfree (state);
+
+	if (status != 0)
+	{
+		sfree (times);
+		sfree (values);
+		return (status);
+	}
+
+	*ret_times = times;
+	*ret_values = values;
+	*ret_num = num;
+	return (0);
+} /* }}} int tsdb_query */
+
+int tsdb_sync (tsdb_t *db) /* {{{ */
+{
+	int status = 0;
+	uint32_t i;
+
+	if ((db == NULL) || (db->segments == NULL))
+		return (EINVAL);
+
+	for (i = 0; i < db->segments_max; i++)
+	{
+		tsdb_segment_t *seg = db->segments + i;
+		size_t offset;
+		size_t end;
+
+		if ((seg->map == NULL) || !seg->dirty)
+			continue;
+
+		offset = ((size_t) seg->dirty_min) * TSDB_BLOCK_SIZE;
+		offset -= offset % db->page_size;
+		end = ((size_t) seg->dirty_max + 1) * TSDB_BLOCK_SIZE;
+
+		if (msync (seg->map + offset, end - offset, MS_SYNC) != 0)
+		{
+			char errbuf[1024];
+			ERROR ("tsdb: msync failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			status = errno;
+			continue;
+		}
+
+		seg->dirty = 0;
+	}
+
+	return (status);
+} /* }}} int tsdb_sync */
@@ -0,0 +1,125 @@
+/**
+ * collectd - src/utils_tsdb.h
+ * Copyright (C) 2009  collectd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+#ifndef UTILS_TSDB_H
+#define UTILS_TSDB_H 1
+
+#include "plugin.h"
+#include "utils_ident.h"
+
+/*
+ * Time series store
+ *
+ * Stores the values of any number of series in a directory. The samples are
+ * kept in blocks of TSDB_BLOCK_SIZE bytes, each of which belongs to a single
+ * series. Blocks are appended to segment files of TSDB_SEGMENT_SIZE bytes,
+ * which are mapped into memory. Once the newest segment is full, a new one is
+ * started and, if there are more than `max_segments' segments, the oldest
+ * one is removed.
+ *
+ * Within a block the times are stored as the difference to the previous
+ * difference and the values as the XOR with the previous value, using as few
+ * bits as possible. For COUNTER data sources the difference to the previous
+ * value is XOR'ed instead, so a constant rate takes a single bit per value.
+ *
+ * The series are identified by interned identifiers (see utils_ident.h).
+ * Their names and data source types are kept in the file `index' in the
+ * directory.
+ *
+ * The files are in host byte order, so they cannot be copied to hosts of
+ * another architecture. The functions are not thread-safe, the caller has to
+ * serialize access to a store.
+ */
+#define TSDB_BLOCK_SIZE 512
+#define TSDB_SEGMENT_SIZE (16 * 1024 * 1024)
+
+struct tsdb_s;
+typedef struct tsdb_s tsdb_t;
+
+/*
+ * NAME
+ *   tsdb_open
+ *
+ * DESCRIPTION
+ *   Opens the store in `dir', creating the directory if necessary. Samples
+ *   written by a previous run are kept, but new samples are appended to new
+ *   blocks. If there are more than `max_segments' segments, the oldest ones
+ *   are removed.
+ *
+ * RETURN VALUE
+ *   The store or NULL on error.
+ */
+tsdb_t *tsdb_open (const char *dir, int max_segments);
+
+/*
+ * NAME
+ *   tsdb_close
+ *
+ * DESCRIPTION
+ *   Writes all samples to disk and closes the store.
+ */
+void tsdb_close (tsdb_t *db);
+
+/*
+ * NAME
+ *   tsdb_append
+ *
+ * DESCRIPTION
+ *   Appends the values of `vl' to the series `ident'. The series is created
+ *   if necessary. If the data sources of `ds' differ from the ones the series
+ *   was created with, a new series replaces the old one.
+ *
+ * RETURN VALUE
+ *   Zero on success, EINVAL if `vl->time' is not newer than the last sample
+ *   of the series or another error number on failure.
+ */
+int tsdb_append (tsdb_t *db, const identifier_t *ident,
+		const data_set_t *ds, const value_list_t *vl);
+
+/*
+ * NAME
+ *   tsdb_query
+ *
+ * DESCRIPTION
+ *   Returns the samples of the series `ident' with a time between `begin'
+ *   and `end', inclusively. `*ret_values' holds `ds->ds_num' values per
+ *   sample. The caller has to free `*ret_times' and `*ret_values'.
+ *
+ * RETURN VALUE
+ *   Zero on success, ENOENT if the series does not exist, EINVAL if it was
+ *   created with other data sources than `ds' or another error number on
+ *   failure.
+ */
+int tsdb_query (tsdb_t *db, const identifier_t *ident, const data_set_t *ds,
+		cdtime_t begin, cdtime_t end,
+		cdtime_t **ret_times, value_t **ret_values, size_t *ret_num);
+
+/*
+ * NAME
+ *   tsdb_sync
+ *
+ * DESCRIPTION
+ *   Writes the blocks changed since the last call to disk and waits for the
+ *   writes to complete.
+ *
+ * RETURN VALUE
+ *   Zero on success or an error number on failure.
+ */
+int tsdb_sync (tsdb_t *db);
+
+#endif /* UTILS_TSDB_H */